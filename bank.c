@@ -0,0 +1,351 @@
+//
+//  bank.c
+//  MC68HC11 Assembler
+//
+//  Switched memory banks (BANKWINDOW/BANK/ENDBANK).  Boards with more code than the 16-bit address space holds map one
+//  bank of external memory at a time into a window of it:
+//
+//              BANKWINDOW $8000,$BFFF
+//              BANK 3
+//      FILTER  LDAA ...
+//              ENDBANK
+//
+//  Code in a bank is assembled at logical addresses in the window, so symbols and instruction encoding stay 16-bit.
+//  Each bank keeps its own location counter (BANK resumes where the bank left off, ENDBANK returns to common memory) and
+//  is merged into an image of its own.  The S-records of a bank load at the 24-bit physical address
+//  (bank << 16) | logical address.
+//
+//  Only one bank is mapped at a time, so code in a bank may call, jump or branch to its own bank or to common memory,
+//  but reaches another bank only through a trampoline in common memory (which maps the bank before calling into it).
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utility.h"
+#include "bank.h"
+
+extern UINT8 g_memImage[MEM_IMAGE_SIZE];
+extern UINT8 g_memWritten[MEM_IMAGE_SIZE];
+extern void getStatementSpan(SOURCEFILE *pSourceFile, CHUNK *pChunk, STATEMENT *pStmt, char *pszSpan);
+extern void getParamValue(char *pszParamString, char *pszValue);
+
+SWITCHBANK g_switchBanks[MAX_SWITCH_BANKS];
+int        g_switchBankCount;       // Banks used by the source
+bool       g_fBankWindow;
+UINT16     g_bankWindowStart;
+UINT16     g_bankWindowEnd;
+UINT16     g_commonAddr;            // Common memory location counter while the walk is in a bank
+
+typedef struct _banklabel_
+{
+    char name[MAX_SYMBOL_NAME_LENGTH];
+    int  bank;
+} BANKLABEL;
+
+
+int compareBankLabels(const void *pLeft, const void *pRight)
+{
+    return strcmp(((const BANKLABEL *)pLeft)->name, ((const BANKLABEL *)pRight)->name);
+}
+
+
+// Forget the banks seen by a statement walk, so the statements can be walked again (the images are kept).
+//
+void resetBanks(void)
+{
+    for (int i=0 ; i<MAX_SWITCH_BANKS ; i++)
+    {
+        g_switchBanks[i].fUsed    = false;
+        g_switchBanks[i].nextAddr = 0;
+    }
+    g_switchBankCount = 0;
+    g_fBankWindow     = false;
+    g_commonAddr      = 0;
+}
+
+
+// BANKWINDOW - the logical addresses every bank is assembled at.
+//
+int setBankWindow(char *pszOperand, int nLineNumber)
+{
+    UINT16 nStart;
+    UINT16 nEnd;
+
+    parseAddressRange(pszOperand, &nStart, &nEnd);
+    if (g_fBankWindow && (nStart != g_bankWindowStart || nEnd != g_bankWindowEnd))
+    {
+        printf("ERROR: BANKWINDOW on line %d differs from the earlier one ($%04X-$%04X)\r\n", nLineNumber, g_bankWindowStart, g_bankWindowEnd);
+        return -1;
+    }
+
+    g_fBankWindow     = true;
+    g_bankWindowStart = nStart;
+    g_bankWindowEnd   = nEnd;
+
+    return 0;
+}
+
+
+// BANK or ENDBANK - save the location counter of the code being left and pick up the one of the code entered.
+//
+int switchBank(STATEMENT *pStmt, int *pnBank, UINT16 *pnAddr, int nLineNumber)
+{
+    if (pStmt->macroLine)
+    {
+        printf("ERROR: BANK and ENDBANK can\'t be used in a macro expansion (line %d)\r\n", nLineNumber);
+        return -1;
+    }
+
+    if (pStmt->kind == STMT_ENDBANK && *pnBank == BANK_COMMON)
+    {
+        printf("ERROR: ENDBANK on line %d doesn\'t follow a BANK\r\n", nLineNumber);
+        return -1;
+    }
+
+    if (pStmt->kind == STMT_BANK && !g_fBankWindow)
+    {
+        printf("ERROR: BANK on line %d needs a BANKWINDOW first\r\n", nLineNumber);
+        return -1;
+    }
+
+    if (*pnBank == BANK_COMMON)
+        g_commonAddr = *pnAddr;
+    else
+        g_switchBanks[*pnBank].nextAddr = *pnAddr;
+
+    if (pStmt->kind == STMT_ENDBANK)
+    {
+        *pnBank = BANK_COMMON;
+        *pnAddr = g_commonAddr;
+        return 0;
+    }
+
+    *pnBank = pStmt->value;
+    if (!g_switchBanks[*pnBank].fUsed)
+    {
+        g_switchBanks[*pnBank].fUsed    = true;
+        g_switchBanks[*pnBank].nextAddr = g_bankWindowStart;
+        g_switchBankCount++;
+    }
+    *pnAddr = g_switchBanks[*pnBank].nextAddr;
+
+    return 0;
+}
+
+
+// Banked code has to fit in the window, and common code has to stay out of it (the window shows whichever bank is
+// mapped).  Only statements that place bytes are checked.
+//
+int checkBankPlacement(STATEMENT *pStmt, int nBank, int nLineNumber)
+{
+    UINT32 nEnd = (UINT32)pStmt->addr + pStmt->size - 1;
+
+    if (!g_fBankWindow || 0 == pStmt->size || pStmt->kind == STMT_RMB)
+        return 0;
+
+    if (nBank != BANK_COMMON && (pStmt->addr < g_bankWindowStart || nEnd > g_bankWindowEnd))
+    {
+        printf("ERROR: Bank %d code on line %d is outside the bank window ($%04X-$%04X)\r\n", nBank, nLineNumber, g_bankWindowStart, g_bankWindowEnd);
+        return -1;
+    }
+
+    if (nBank == BANK_COMMON && g_switchBankCount && pStmt->addr <= g_bankWindowEnd && nEnd >= g_bankWindowStart)
+    {
+        printf("ERROR: Common code on line %d is inside the bank window ($%04X-$%04X)\r\n", nLineNumber, g_bankWindowStart, g_bankWindowEnd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Check that no call, jump or branch goes straight from one bank to another.  The labels in each bank are collected
+// first, then every transfer to one of them is checked against the bank it's made from.
+//
+int checkBankCalls(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks)
+{
+    char      szParam[MAX_LINE_LENGTH];
+    char      szValue[MAX_LINE_LENGTH];
+    BANKLABEL key;
+    BANKLABEL *pLabels    = NULL;
+    int       nLabels     = 0;
+    int       nAllocated  = 0;
+    int       nRetVal     = 0;
+
+    if (0 == g_switchBankCount)
+        return 0;
+
+    for (int nPass=0 ; nPass < 2 && !nRetVal ; nPass++)
+    {
+        int nBank     = BANK_COMMON;
+        int nLineBase = 0;
+
+        for (int nChunk=0 ; nChunk < nChunks && !nRetVal ; nChunk++)
+        {
+            CHUNK *pChunk = &pChunks[nChunk];
+
+            for (int nStmt=0 ; nStmt < pChunk->statementCount ; nStmt++)
+            {
+                STATEMENT *pStmt = &pChunk->pStatements[nStmt];
+                BANKLABEL *pTarget;
+                char      *pszMneumonic;
+
+                if (pStmt->kind == STMT_BANK || pStmt->kind == STMT_ENDBANK)
+                {
+                    nBank = (pStmt->kind == STMT_BANK ? (int)pStmt->value : BANK_COMMON);
+                    continue;
+                }
+
+                if (0 == nPass)
+                {
+                    if (pStmt->kind != STMT_LABEL || nBank == BANK_COMMON)
+                        continue;
+
+                    if (nLabels == nAllocated)
+                    {
+                        int       nNewCount = (nAllocated ? nAllocated * 2 : 64);
+                        BANKLABEL *pTemp;
+
+                        if (NULL == (pTemp = (BANKLABEL *)realloc(pLabels, (sizeof(BANKLABEL) * nNewCount))))
+                        {
+                            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(BANKLABEL) * nNewCount));
+                            nRetVal = -1;
+                            break;
+                        }
+                        pLabels    = pTemp;
+                        nAllocated = nNewCount;
+                    }
+                    copySymbolName(pLabels[nLabels].name, pStmt->symbolName);
+                    pLabels[nLabels++].bank = nBank;
+                    continue;
+                }
+
+                if (pStmt->kind != STMT_DEFERRED || NULL == pStmt->pInst || nBank == BANK_COMMON)
+                    continue;
+
+                pszMneumonic = pStmt->pInst->mnemonic;
+                if (strcmp(pszMneumonic, "JSR") && strcmp(pszMneumonic, "JMP") && pStmt->pInst->addrMode != REL)
+                    continue;
+
+                getStatementSpan(pSourceFile, pChunk, pStmt, szParam);
+                if ('#' == *szParam || NULL != strchr(szParam, ','))
+                    continue;
+                getParamValue(szParam, szValue);
+                copySymbolName(key.name, szValue);
+
+                if (NULL != (pTarget = (BANKLABEL *)bsearch(&key, pLabels, nLabels, sizeof(BANKLABEL), compareBankLabels)) &&
+                    pTarget->bank != nBank)
+                {
+                    printf("ERROR: %s from bank %d to \'%s\' in bank %d on line %d must go through a trampoline in common memory\r\n",
+                           pszMneumonic, nBank, key.name, pTarget->bank, nLineBase + pStmt->lineNumber);
+                    nRetVal = -1;
+                    break;
+                }
+            }
+
+            nLineBase += pChunk->lineCount;
+        }
+
+        if (0 == nPass && pLabels)
+            qsort(pLabels, nLabels, sizeof(BANKLABEL), compareBankLabels);
+    }
+
+    if (pLabels)
+        free(pLabels);
+
+    return nRetVal;
+}
+
+
+// Physical load address of a logical address in a bank (common memory loads at its logical address).
+//
+UINT32 getBankAddress(int nBank, UINT16 nAddr)
+{
+    return (nBank == BANK_COMMON ? nAddr : (((UINT32)nBank << 16) | nAddr));
+}
+
+
+// Get the memory image a bank is encoded into.
+//
+void getBankImage(int nBank, UINT8 **ppImage, UINT8 **ppWritten)
+{
+    if (nBank == BANK_COMMON)
+    {
+        *ppImage   = g_memImage;
+        *ppWritten = g_memWritten;
+        return;
+    }
+
+    *ppImage   = g_switchBanks[nBank].pImage;
+    *ppWritten = g_switchBanks[nBank].pWritten;
+}
+
+
+// Give every bank the walk used an empty image, ahead of the pass 2 workers.  The images are kept after the assembly
+// (like the common memory image) for the image files, and reused by the next one.  Returns the number of banks used.
+//
+int clearBankImages(void)
+{
+    for (int i=0 ; i<MAX_SWITCH_BANKS ; i++)
+    {
+        SWITCHBANK *pBank = &g_switchBanks[i];
+
+        if (!pBank->fUsed)
+            continue;
+
+        if (NULL == pBank->pImage &&
+            (NULL == (pBank->pImage = (UINT8 *)malloc(MEM_IMAGE_SIZE)) || NULL == (pBank->pWritten = (UINT8 *)malloc(MEM_IMAGE_SIZE))))
+        {
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", MEM_IMAGE_SIZE);
+            return -1;
+        }
+        memset(pBank->pImage, 0, MEM_IMAGE_SIZE);
+        memset(pBank->pWritten, 0, MEM_IMAGE_SIZE);
+    }
+
+    return g_switchBankCount;
+}
+
+
+void freeBanks(void)
+{
+    for (int i=0 ; i<MAX_SWITCH_BANKS ; i++)
+    {
+        if (g_switchBanks[i].pImage)
+            free(g_switchBanks[i].pImage);
+        if (g_switchBanks[i].pWritten)
+            free(g_switchBanks[i].pWritten);
+        g_switchBanks[i].pImage   = NULL;
+        g_switchBanks[i].pWritten = NULL;
+    }
+
+    resetBanks();
+}
+
+
+// Print the bytes assembled into each switched bank.
+//
+void reportBanks(void)
+{
+    if (0 == g_switchBankCount)
+        return;
+
+    printf("Switched banks: %d in window $%04X-$%04X\r\n", g_switchBankCount, g_bankWindowStart, g_bankWindowEnd);
+    for (int i=0 ; i<MAX_SWITCH_BANKS ; i++)
+    {
+        UINT32 nUsed = 0;
+
+        if (!g_switchBanks[i].fUsed || NULL == g_switchBanks[i].pWritten)
+            continue;
+
+        for (UINT32 nAddr=g_bankWindowStart ; nAddr <= g_bankWindowEnd ; nAddr++)
+            nUsed += g_switchBanks[i].pWritten[nAddr];
+        printf("    Bank %3d  $%06lX-$%06lX  %5d of %d bytes\r\n", i, (unsigned long)getBankAddress(i, g_bankWindowStart),
+               (unsigned long)getBankAddress(i, g_bankWindowEnd), (int)nUsed, (int)(g_bankWindowEnd - g_bankWindowStart + 1));
+    }
+    printf("\r\n");
+}
@@ -0,0 +1,17 @@
+//
+//  bank.h
+//  MC68HC11 Assembler
+//
+//  Switched memory banks (BANKWINDOW/BANK/ENDBANK).
+//
+
+void resetBanks(void);
+int setBankWindow(char *pszOperand, int nLineNumber);
+int switchBank(STATEMENT *pStmt, int *pnBank, UINT16 *pnAddr, int nLineNumber);
+int checkBankPlacement(STATEMENT *pStmt, int nBank, int nLineNumber);
+int checkBankCalls(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks);
+UINT32 getBankAddress(int nBank, UINT16 nAddr);
+void getBankImage(int nBank, UINT8 **ppImage, UINT8 **ppWritten);
+int clearBankImages(void);
+void freeBanks(void);
+void reportBanks(void);
@@ -17,18 +17,60 @@ typedef unsigned long  UINT32;
 #define S19_FILE_EXTENSION      "s19"
 #define SYM_FILE_EXTENSION      "sym"
 #define LST_FILE_EXTENSION      "lst"
+#define EQS_FILE_EXTENSION      "eqs"
+#define DIS_FILE_EXTENSION      "dis"
+#define MAP_FILE_EXTENSION      "map"
+#define STK_FILE_EXTENSION      "stk"
+#define DELTA_FILE_EXTENSION    "d19"
+#define PLAN_FILE_EXTENSION     "epl"
+#define BIN_FILE_EXTENSION      "bin"
+#define HEX_FILE_EXTENSION      "hex"
+#define EVEN_FILE_EXTENSION     "evn"
+#define ODD_FILE_EXTENSION      "odd"
+#define DEBUG_FILE_EXTENSION    "dbg"
+#define XREF_FILE_EXTENSION     "xrf"
+#define LINEMAP_FILE_EXTENSION  "lmp"
+#define DEPEND_FILE_EXTENSION   "d"
+
+#define STDIN_BASE_NAME         "stdin"     // Output file base name when the source is read from standard input.
 
 #define MAX_LINE_LENGTH         256
 #define MAX_SYMBOL_NAME_LENGTH  16
 #define MAX_SYMBOL_COUNT        2000
+#define MAX_SNAPSHOT_FILES      8
+#define MAX_DEFINES             32
+#define MAX_COND_DEPTH          32
+#define MAX_MACRO_DEPTH         8           // Deepest nesting of macro invocations and REPT/IRP blocks
+#define MAX_MACRO_ARGS          16          // Macro arguments (or IRP values) per invocation
+#define MAX_MACRO_ARG_LENGTH    32
+#define MAX_MEMORY_BANKS        8
 
 #define MAX_S19_CHARPAIRS       32
 #define MAX_S19_CHARS           (MAX_S19_CHARPAIRS * 2)
+#define MAX_SREC_COUNT          255         // Largest S-record count byte (address, data and checksum bytes).
+#define MAX_SREC_ADDRESS_BYTES  4
+#define MAX_SREC_DATA_BYTES     (MAX_SREC_COUNT - 2 - 1)
 #define NUM_SREC_TYPE_CHARS		2			// Number of S-record type characters.		
 #define NUM_CHARPAIR_CHARS		2			// Number of code/data character.
 #define NUM_LOADADDRESS_CHARS	4			// Number of load address characters.
 #define NUM_CHECKSUM_CHARS		2			// Number of checksum characters.
 
+#define MEM_IMAGE_SIZE          0x10000     // Size of the 16-bit target address space.
+#define MAX_SWITCH_BANKS        256         // Switched banks (BANK 0-255), each an image of its own
+#define BANK_COMMON             -1          // Code outside any switched bank
+#define PASS2_REGION_LINES      512         // Maximum number of source lines encoded by a single pass 2 worker.
+#define MAX_WORKER_THREADS      32          // Upper limit on the number of pass 1/pass 2 worker threads.
+#define SOURCE_READ_SIZE        0x10000     // Initial read buffer size; grown as input arrives.
+#define MAX_SOURCE_SIZE         0x4000000   // Largest source (or S-record) input accepted.
+#define PASS1_CHUNK_SIZE        0x8000      // Approximate number of source bytes parsed by a single pass 1 worker.
+#define DELTA_BRIDGE_BYTES      5           // Longest run of unchanged bytes sent to avoid starting a new delta S-record.
+#define EEPROM_WRITE_MS         10          // Time for one EEPROM erase or program cycle.
+#define MAX_PREFIX_PAGES        4           // Op-code pages: unprefixed plus one per instruction pre-byte ($18, $1A, $CD).
+#define WATCH_REGION_MIN_LINES  128         // Watch mode: fewest source lines in a region ahead of a content anchor.
+#define WATCH_REGION_ANCHOR     256         // Watch mode: one line text hash in this many starts a new region.
+#define WATCH_POLL_MS           250         // Watch mode: source modification time polling interval (no inotify).
+#define WATCH_SETTLE_MS         50          // Watch mode: quiet time after a change before re-assembling.
+
 // S-record type enumeration
 enum SREC_TYPES
 {
@@ -45,6 +87,17 @@ enum SREC_TYPES
 	S9						// Termination record for a block of S1 records.
 };
 
+// Image output formats written alongside the S-records (-f).
+#define OUTPUT_FORMAT_BINARY    0x01        // Raw binary image over an address window
+#define OUTPUT_FORMAT_INTEL_HEX 0x02        // Intel HEX
+#define OUTPUT_FORMAT_SPLIT     0x04        // Even and odd address images
+#define OUTPUT_FORMAT_BANKS     0x08        // One raw binary image per memory bank
+
+// Intel HEX record types
+#define INTEL_HEX_DATA          0x00
+#define INTEL_HEX_END_OF_FILE   0x01
+#define INTEL_HEX_START_SEGMENT 0x03
+
 typedef enum _symboltype_
 {
     SYMBOL_TYPE_NUMBER_8BIT,    // 8-bit symbol
@@ -66,6 +119,89 @@ typedef struct _symbol_
     SYMBOLVALUE u;
 } SYMBOL;
 
+// Symbol table snapshot file layout - a header, one record per symbol, then the string pool for string symbols.  Snapshots
+// are mapped directly into memory, so the layout is fixed-size and native byte order (checked via byteOrder).
+//
+#define SNAPSHOT_MAGIC          "HC11EQS"
+#define SNAPSHOT_VERSION        1
+#define SNAPSHOT_BYTE_ORDER     0x1234
+
+typedef struct _snapshotheader_
+{
+    char   magic[8];            // SNAPSHOT_MAGIC
+    UINT16 version;             // SNAPSHOT_VERSION
+    UINT16 byteOrder;           // SNAPSHOT_BYTE_ORDER as written by the host that created the snapshot
+    UINT16 headerSize;          // sizeof(SNAPSHOTHEADER)
+    UINT16 recordSize;          // sizeof(SNAPSHOTSYMBOL)
+    UINT16 symbolCount;         // Number of symbol records following the header
+    UINT16 reserved;
+    UINT32 stringPoolSize;      // Number of string pool bytes following the symbol records
+} SNAPSHOTHEADER;
+
+typedef struct _snapshotsymbol_
+{
+    char   symbolName[MAX_SYMBOL_NAME_LENGTH];
+    UINT16 symbolType;          // SYMBOLTYPE
+    UINT16 value;               // Numeric value, or offset of the string in the string pool
+} SNAPSHOTSYMBOL;
+
+// Debug symbol file layout - a header, the symbol records sorted by name, an index of the 16-bit symbol records sorted
+// by value, then the string pool.  Like snapshots, debug files are mapped directly into memory.
+//
+#define DEBUG_MAGIC             "HC11DBG"
+#define DEBUG_VERSION           1
+
+typedef struct _debugheader_
+{
+    char   magic[8];            // DEBUG_MAGIC
+    UINT16 version;             // DEBUG_VERSION
+    UINT16 byteOrder;           // SNAPSHOT_BYTE_ORDER as written by the host that created the file
+    UINT16 headerSize;          // sizeof(DEBUGHEADER)
+    UINT16 recordSize;          // sizeof(SNAPSHOTSYMBOL)
+    UINT16 symbolCount;         // Number of symbol records
+    UINT16 addressCount;        // Number of entries in the address index
+    UINT32 recordOffset;        // File offsets of each section
+    UINT32 addressIndexOffset;
+    UINT32 stringPoolOffset;
+    UINT32 stringPoolSize;
+} DEBUGHEADER;
+
+// Line map file layout - a header, the source file name table (NUL-terminated names), a block index, then the encoded
+// entries.  Each entry maps the bytes a source line encoded to the file and line, sorted by address.  Entries are
+// grouped in blocks of LINEMAP_BLOCK_ENTRIES: the block index gives the first entry of each block so a lookup binary
+// searches the index and then decodes at most one block.  Within a block each entry is stored as unsigned LEB128
+// values relative to the entry before it (the block index entry for the first one):
+//
+//   address delta, (zigzag line delta << 1) | file changed, [file index if changed], byte count
+//
+#define LINEMAP_MAGIC           "HC11LMP"
+#define LINEMAP_VERSION         1
+#define LINEMAP_BLOCK_ENTRIES   32
+
+typedef struct _linemapheader_
+{
+    char   magic[8];            // LINEMAP_MAGIC
+    UINT16 version;             // LINEMAP_VERSION
+    UINT16 byteOrder;           // SNAPSHOT_BYTE_ORDER as written by the host that created the file
+    UINT16 headerSize;          // sizeof(LINEMAPHEADER)
+    UINT16 fileCount;           // Number of names in the file name table
+    UINT32 entryCount;          // Number of entries
+    UINT32 blockCount;          // Number of block index entries
+    UINT32 fileTableOffset;     // File offsets of each section
+    UINT32 blockIndexOffset;
+    UINT32 dataOffset;
+    UINT32 dataSize;
+} LINEMAPHEADER;
+
+typedef struct _linemapblock_
+{
+    UINT16 addr;                // Address of the block's first entry
+    UINT16 fileIndex;           // File name table index of the block's first entry
+    UINT32 lineNumber;          // Line number of the block's first entry
+    UINT32 dataOffset;          // Offset of the block's encoded entries from dataOffset
+    UINT32 entryCount;          // Number of entries in the block
+} LINEMAPBLOCK;
+
 
 typedef enum _addrmode_
 {
@@ -79,6 +215,63 @@ typedef enum _addrmode_
     INVALID = -1
 } ADDRMODE;
 
+#define MAX_MNEUMONIC_LENGTH    5
+
+typedef struct _instruction_
+{
+    char     mnemonic[MAX_MNEUMONIC_LENGTH];    // Instruction mneumonic
+    ADDRMODE addrMode;                          // Instruction address mode
+    UINT8    preByte;                           // Pre-Byte value (optional)
+    UINT8    opCode;                            // Instruction op-code
+    UINT8    numBytes;                          // Number of encoding bytes for instruction
+    UINT8    numCycles;                         // Number of processor cycles for instruction
+} INSTRUCTION;
+
+extern INSTRUCTION instructions[];              // Instruction table (opcodes.h), terminated by an empty mneumonic
+
+// Conditional assembly.  Ahead of pass 1 the source is scanned for the IF/IFDEF/IFNDEF/ELSE/ENDIF keywords alone, and
+// the directive lines and the runs of lines they disable are recorded as spans in source order.  getNextFileLine()
+// steps over a disabled run in one move, so neither pass tokenizes the lines in it.  Macro definitions are recorded the
+// same way - listed but not assembled - and so are the bodies of REPT/IRP blocks, which are skipped.
+//
+typedef struct _condspan_
+{
+    int  startOffset;   // Source byte offset of the first line
+    int  endOffset;     // Source byte offset following the last line
+    int  lineCount;     // Number of line ends in the span
+    bool fDirective;    // Lines listed but not assembled (directives, macro definitions) rather than skipped
+} CONDSPAN;
+
+// Macro expansion.  The same pre-pass records each MACRO/ENDM definition and REPT/ENDR or IRP/ENDR block with its body
+// lines split once into text and parameter pieces.  A line that invokes one starts an expansion in the reader, and
+// getNextFileLine() then returns the substituted body lines ahead of the next source line.
+//
+typedef enum _macroscan_
+{
+    MACRO_SCAN_SOURCE,          // Line assembled as usual
+    MACRO_SCAN_LISTED,          // Line of a macro definition (listed but not assembled)
+    MACRO_SCAN_SKIPPED          // Line of a REPT/IRP body (assembled through the expansion instead)
+} MACROSCAN;
+
+typedef struct _macrolevel_
+{
+    int  block;                 // Macro or repeat block being expanded
+    int  nextLine;              // Next line of the block body
+    int  iteration;             // Current pass over the body (REPT/IRP)
+    int  iterationCount;
+    int  uniqueId;              // \@ number of the current pass
+    int  argCount;              // Macro arguments or IRP values
+    char args[MAX_MACRO_ARGS][MAX_MACRO_ARG_LENGTH];
+} MACROLEVEL;
+
+typedef struct _macrostate_
+{
+    MACROLEVEL levels[MAX_MACRO_DEPTH];
+    int  depth;                 // Expansions in progress (0 == reading the source)
+    int  lineCount;             // Lines returned since the outermost expansion started
+    int  uniqueCount;           // \@ numbers handed out since the outermost expansion started
+} MACROSTATE;
+
 typedef struct _sourcefile_
 {
     char *pFile;        // Pointer to file contents
@@ -87,4 +280,285 @@ typedef struct _sourcefile_
     int  byteOffset;    // Current file read byte offset
     bool fEOF;          // EOF flag
     int  lineNumber;    // Current file line number
+    int  lineOffset;    // Byte offset of the most recently read line
+    int  lineStart;     // Line number preceding the most recently read line
+    CONDSPAN *pCondSpans; // Conditional assembly spans (NULL == none)
+    int  condSpanCount;
+    int  nextCondSpan;  // First span not yet behind the read pointer (-1 == find it from the read pointer)
+    bool fCondLine;     // The most recently read line is listed but not assembled
+    MACROSTATE *pMacroState; // Macro expansion state (NULL == invocations aren't expanded through this reader)
+    int  macroLine;     // Index of the most recently read line in the expansion it came from (0 == source line)
+    int  macroOffset;   // Byte offset of the source line that started the expansion
 } SOURCEFILE;
+
+typedef struct _listbuffer_
+{
+    char *pBuffer;      // Pointer to buffer contents
+    int  bufferSize;    // Allocated buffer size
+    int  length;        // Number of characters in the buffer
+} LISTBUFFER;
+
+// A region is a run of source lines that pass 2 can encode independently of every other region.  Regions are
+// split at each ORG directive and every PASS2_REGION_LINES lines, with the starting address supplied by pass 1.  In
+// watch mode they're split at lines picked by their text instead, so an edit doesn't move the regions after it.
+//
+// Pass 2 records what it encoded for each source line, and the listing is rendered from the records afterwards (only
+// if one was requested).  The kind selects how the line is laid out in the listing.
+//
+typedef enum _linekind_
+{
+    LINE_PREFIX,        // Line number only - the next line continues the listing line (label-only lines)
+    LINE_SOURCE,        // Source text (comments, equates and directives that don't emit bytes)
+    LINE_DATA,          // Address and packed data bytes ahead of the source text (FCB, FDB lists)
+    LINE_STRING,        // Address and spaced data bytes ahead of the source text (FCC)
+    LINE_BINARY,        // Address and byte count ahead of the source text (INCBIN, FILL/BSZ/ZMB)
+    LINE_INSTRUCTION,   // Source text, then the address, bytes and mneumonic
+    LINE_REFERENCE      // Not listed - another symbol reference from the line before (FCB/FDB lists)
+} LINEKIND;
+
+typedef struct _linerecord_
+{
+    int      lineOffset;    // Source byte offset of the line
+    int      lineNumber;    // Source line number shown in the listing
+    UINT16   lineLength;    // Length of the source text
+    UINT16   tokenLength;   // Length of the source text up to the end of its first token (LINE_INSTRUCTION)
+    UINT16   addr;          // Address of the first byte encoded
+    UINT16   numBytes;      // Number of bytes encoded
+    int      byteOffset;    // Offset of the encoded bytes in the region's byte pool
+    int      textOffset;    // Offset of the expanded text in the region's text pool (-1 == the source text at lineOffset)
+    UINT8    cycles;        // Processor cycles (LINE_INSTRUCTION)
+    UINT8    refMode;       // How the operand uses refSymbol (REF_MODE_xxx)
+    int      refSymbol;     // Symbol table index of the symbol the operand refers to (-1 == none, only with -x)
+    LINEKIND kind;
+} LINERECORD;
+
+// Cross-reference modes - an instruction operand is recorded with its ADDRMODE, other references use these.
+//
+#define REF_MODE_DATA           (INDY + 1)      // FCB/FDB/FILL value
+#define REF_MODE_DROPPED        (INDY + 2)      // Operand of an instruction removed by the peephole optimizer
+
+typedef struct _region_
+{
+    int    startOffset; // Source byte offset of the first line in the region
+    int    endOffset;   // Source byte offset following the last line in the region
+    int    startLine;   // Source line number preceding the first line in the region
+    UINT16 startAddr;   // Address at the start of the region (computed by pass 1)
+    int    bank;        // Switched bank the region is encoded into (BANK_COMMON == the common memory image)
+    int    retVal;      // Pass 2 result for the region
+    LISTBUFFER listing; // Listing text for the region (rendered from the line records)
+    LINERECORD *pLines; // Line records, in source order
+    int    lineCount;
+    int    linesAllocated;
+    UINT8  *pLineBytes; // Bytes encoded by the lines (LINERECORD.byteOffset)
+    int    lineByteCount;
+    int    lineBytesAllocated;
+    char   *pLineText;  // Text of the lines expanded from a MACRO, REPT or IRP body (LINERECORD.textOffset)
+    int    lineTextLength;
+    int    lineTextAllocated;
+    bool   fReused;     // Line records carried over from the previous assembly instead of encoded (watch mode)
+} REGION;
+
+// Pass 1 parses each chunk of the source into a list of statements in parallel.  Statements only record what
+// affects the location counter and the symbol table, so the chunk lists can then be walked in order to assign
+// addresses without tokenizing the source again.
+//
+typedef enum _stmtkind_
+{
+    STMT_LABEL,         // Label bound to the current address
+    STMT_EQU,           // Label equated to a numeric constant (value)
+    STMT_EQU_STRING,    // Label equated to a string (span)
+    STMT_ORG,           // Address set to value
+    STMT_RMB,           // Address advanced by value (reserved bytes)
+    STMT_SIZED,         // Instruction or data of a known size (value bytes)
+    STMT_STRING,        // FCC string (value bytes, text span)
+    STMT_DEFERRED,      // Instruction whose size depends on a symbol value (pInst, operand span)
+    STMT_INCBIN,        // Binary file included by INCBIN (operand span, sized from the file by the statement walk)
+    STMT_STACK,         // Stack budget asserted by the STACK directive (value bytes)
+    STMT_POOL,          // Start of a pooled string section (value == STRPOOL_xxx terminator)
+    STMT_ENDPOOL,       // End of a pooled string section
+    STMT_DELAY,         // Delay sequence synthesized by DELAY (value bytes)
+    STMT_LOCALRAM,      // Area local variables are placed in (operand span)
+    STMT_LOCALS,        // Start of the local variables of the routine labelled on the line
+    STMT_ENDLOCALS,     // End of a routine's local variables
+    STMT_BANKWINDOW,    // Logical window the switched banks appear in (operand span)
+    STMT_BANK,          // Start of code in switched bank value
+    STMT_ENDBANK,       // Return to common memory
+    STMT_ERROR          // Line failed to parse (value == error code)
+} STMTKIND;
+
+typedef struct _statement_
+{
+    STMTKIND    kind;
+    int         lineNumber;     // Line number relative to the start of the chunk
+    int         lineOffset;     // Source byte offset of the line (or of the line that started its macro expansion)
+    int         lineStart;      // Line number preceding the line, relative to the start of the chunk
+    UINT16      value;          // Size, address or constant (depends on kind)
+    int         macroLine;      // Index of the line in the macro expansion it came from (0 == source line)
+    int         spanOffset;     // Source byte offset of the operand or string value (chunk macro text offset for macro lines)
+    int         spanLength;     // Length of the operand or string value
+    INSTRUCTION *pInst;         // First instruction table entry for the mneumonic (instructions only)
+    char        symbolName[MAX_SYMBOL_NAME_LENGTH];
+    UINT16      addr;           // Address assigned by the most recent statement walk
+    UINT16      size;           // Bytes assigned by the most recent statement walk (instructions, data and RMB)
+    bool        fShortJump;     // JMP encoded as BRA by the peephole optimizer
+    bool        fLongJump;      // JMP that went out of BRA range and must stay a JMP
+} STATEMENT;
+
+// Peephole optimizer rules (-O).  Each rule matches an instruction table mneumonic and is only applied when the rewrite
+// can't be observed - condition code bits the replacement treats differently must be dead (overwritten before they're
+// read on every path out of the instruction).
+//
+#define CCR_C                   0x01        // Carry
+#define CCR_H                   0x02        // Half carry
+
+#define CCR_READS_C             0x01        // Instruction reads C
+#define CCR_READS_H             0x02        // Instruction reads H
+#define CCR_WRITES_C            0x04        // Instruction sets C without reading it
+#define CCR_WRITES_H            0x08        // Instruction sets H without reading it
+#define CCR_FLOW                0x10        // Instruction leaves the straight-line path (flags are assumed live)
+
+#define IO_REGISTER_BASE        0x1000      // Default location of the on-chip register block (INIT reset value)
+#define IO_REGISTER_SIZE        0x40
+#define PEEPHOLE_LOOKAHEAD      32          // Maximum number of instructions examined when checking that a flag is dead
+
+// Stack depth analysis (-k and the STACK directive).
+//
+#define RETURN_ADDRESS_SIZE     2           // Bytes pushed by JSR/BSR
+#define INTERRUPT_FRAME_SIZE    9           // Bytes pushed on interrupt entry (CCR, B, A, X, Y, return address)
+
+#define STACK_FLAG_RECURSIVE    0x01        // A subroutine calls itself, directly or indirectly
+#define STACK_FLAG_INDIRECT     0x02        // Indexed call or jump, or a stack pointer loaded from a register
+#define STACK_FLAG_UNBALANCED   0x04        // Paths join (or return) with different stack offsets
+#define STACK_FLAG_UNDECODED    0x08        // A path ran into bytes that aren't a valid instruction
+
+typedef enum _peepholekind_
+{
+    PEEPHOLE_REPLACE,           // Immediate operand rewritten as an inherent instruction (LDAA #0 -> CLRA)
+    PEEPHOLE_SHORT_JUMP,        // JMP to a label within branch range rewritten as BRA
+    PEEPHOLE_DROP_LOAD          // Load of the location just stored from the same register removed
+} PEEPHOLEKIND;
+
+typedef struct _peepholerule_
+{
+    PEEPHOLEKIND kind;
+    char         *pszMatch;     // Mneumonic the rule applies to
+    UINT16       operand;       // Immediate operand value (PEEPHOLE_REPLACE)
+    char         *pszOther;     // Replacement mneumonic, or the store that must precede the load (PEEPHOLE_DROP_LOAD)
+    UINT8        deadFlags;     // Condition code bits that must be dead (CCR_C, CCR_H)
+    char         *pszDescription;
+    INSTRUCTION  *pMatch;       // First instruction table entry for pszMatch
+    INSTRUCTION  *pOther;       // First instruction table entry for pszOther
+    int          count;         // Number of rewrites (most recent statement walk)
+    int          bytesSaved;
+    int          cyclesSaved;
+} PEEPHOLERULE;
+
+typedef struct _lineref_
+{
+    int         lineOffset;     // Source byte offset of the line (or of the line that started its macro expansion)
+    int         macroLine;      // Index of the line in the macro expansion (0 == source line)
+} LINEREF;
+
+typedef struct _rewrite_
+{
+    int         lineOffset;     // Source byte offset of the rewritten line
+    int         rule;           // Index of the rule applied
+} REWRITE;
+
+// Pooled string sections (STRPOOL/ENDPOOL).  The statement walk lists every string in a section with the address it was
+// bound to, and pass 2 looks each FCC line up in the list to see whether it encodes anything.
+//
+#define STRPOOL_PLAIN           0           // Strings as written (only exact copies are shared)
+#define STRPOOL_NUL             1           // NUL appended to each string (STRPOOL Z)
+#define STRPOOL_HIGH_BIT        2           // High bit set on the last character of each string (STRPOOL H)
+
+typedef struct _poolstring_
+{
+    int         lineOffset;     // Source byte offset of the FCC line (or of the line that started its macro expansion)
+    int         macroLine;      // Index of the line in the macro expansion (0 == source line)
+    UINT8       terminator;     // STRPOOL_xxx
+    bool        fShared;        // Stored in another string's bytes (the line encodes nothing)
+    UINT16      addr;           // Address of the string's text
+} POOLSTRING;
+
+// Overlaid subroutine locals (LOCALS/ENDLOCALS).  The variables of every block are placed in the LOCALRAM area before
+// the statement walk, which binds each variable's label to its address from the list, and pass 2 looks each RMB line up
+// in the list so the variables don't take up space at the location counter.
+//
+typedef struct _localvar_
+{
+    int         lineOffset;     // Source byte offset of the RMB line (or of the line that started its macro expansion)
+    int         macroLine;      // Index of the line in the macro expansion (0 == source line)
+    int         lineNumber;
+    char        name[MAX_SYMBOL_NAME_LENGTH];       // Variable label ("" if unnamed)
+    char        routine[MAX_SYMBOL_NAME_LENGTH];    // Label of the routine that owns the block
+    UINT16      size;
+    int         references;     // Direct and extended references to the variable
+    UINT16      addr;           // Address the variable was placed at
+} LOCALVAR;
+
+// Cycle-exact delays (DELAY).  A delay is built from instructions that change nothing - NOPs, a BRN and balanced
+// push/pull or exchange pairs - plus, when the condition codes may change, one countdown loop on a register.  A loop on
+// a register that may not change is wrapped in a push and pull of it.
+//
+#define DELAY_CLOBBER_A         0x01        // Registers a DELAY may change (listed after the count)
+#define DELAY_CLOBBER_B         0x02
+#define DELAY_CLOBBER_X         0x04
+#define DELAY_CLOBBER_Y         0x08
+#define DELAY_CLOBBER_CCR       0x10        // Condition codes (needed for any loop)
+#define MAX_DELAY_BYTES         64          // Longest sequence a DELAY may emit
+#define DELAY_PAD_CYCLES        128         // Padding up to this many cycles is searched exhaustively
+#define DEFAULT_E_CLOCK_HZ      2000000     // E clock for DELAY times in microseconds (8 MHz crystal)
+
+// Switched banks (BANKWINDOW/BANK/ENDBANK).  Each bank is assembled at logical addresses in the window and encoded into
+// an image of its own, so pass 2 regions of different banks never share bytes.  A bank's S-records load at the 24-bit
+// physical address (bank << 16) | logical address.
+//
+typedef struct _switchbank_
+{
+    bool   fUsed;
+    UINT16 nextAddr;            // Bank's location counter while the walk is outside it
+    UINT8  *pImage;             // Bank's memory image (logical addresses), allocated for pass 2
+    UINT8  *pWritten;
+} SWITCHBANK;
+
+// Memory map (-m).  The map is collected from the final pass 1 statement walk and written once the image is assembled.
+//
+typedef struct _memorybank_
+{
+    char   name[MAX_SYMBOL_NAME_LENGTH];
+    UINT16 start;               // First address in the bank
+    UINT16 end;                 // Last address in the bank
+} MEMORYBANK;
+
+typedef struct _mapblock_
+{
+    UINT16 start;               // ORG address
+    UINT32 end;                 // Address following the last byte placed or reserved in the block
+    int    lineNumber;          // Line number of the ORG directive (0 if code precedes the first ORG)
+    int    bank;                // Switched bank (BANK_COMMON if none)
+} MAPBLOCK;
+
+typedef struct _maplabel_
+{
+    char   name[MAX_SYMBOL_NAME_LENGTH];
+    UINT16 addr;
+    int    lineNumber;
+    UINT32 codeBytes;           // Instruction bytes up to the next label or ORG
+    UINT32 dataBytes;           // FCB/FDB/FCC/FILL/INCBIN bytes up to the next label or ORG
+    UINT32 reservedBytes;       // RMB bytes up to the next label or ORG
+    bool   fReservation;        // Label names an RMB directive
+} MAPLABEL;
+
+typedef struct _chunk_
+{
+    int       startOffset;      // Source byte offset of the first line in the chunk
+    int       endOffset;        // Source byte offset following the last line in the chunk
+    int       lineCount;        // Number of line breaks in the chunk
+    int       retVal;           // Pass 1 parse result for the chunk
+    STATEMENT *pStatements;     // Parsed statements, in source order
+    int       statementCount;
+    int       statementsAllocated;
+    LISTBUFFER macroText;       // Operands of statements expanded from macros (they aren't in the source buffer)
+    bool      fParsed;          // Statements carried over from the previous assembly (watch mode)
+} CHUNK;
@@ -0,0 +1,586 @@
+//
+//  cond.c
+//  MC68HC11 Assembler
+//
+//  Conditional assembly (IF/IFDEF/IFNDEF/ELSE/ENDIF) and -D symbol definitions.  The source is scanned once before
+//  pass 1, looking at nothing but the first token of each line, and the disabled lines are recorded as spans that both
+//  passes step over without reading (see CONDSPAN).
+//
+//  Conditions are evaluated while scanning, ahead of pass 1, so an IF can only test the values of symbols defined ahead
+//  of the source - -D definitions and equate snapshots.  That keeps the chunks independent so pass 1 can still parse them
+//  in parallel.  IFDEF and IFNDEF only need to know whether a symbol exists, so they also see the labels and equates on
+//  the source lines scanned before them (not those made by macro expansions).  A symbol one of them found undefined
+//  can be defined inside the block it controls - the usual way to give a default - but not after the block, since the
+//  other branch would then have been the one assembled.
+//
+//  The lines the conditionals keep are passed on to the macro scanner (macro.c), so macro definitions and REPT/IRP
+//  bodies come out as spans as well.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utility.h"
+#include "cond.h"
+#include "macro.h"
+
+extern SYMBOL symbols[];
+extern int pushSymbol(char *pszName, SYMBOLTYPE Type, void *pValue);
+extern int findSymbolIndex(char *pszName);
+
+typedef struct _define_
+{
+    char   symbolName[MAX_SYMBOL_NAME_LENGTH];
+    UINT16 value;
+} DEFINE;
+
+typedef struct _condlevel_
+{
+    bool fActive;       // Lines at this level are assembled
+    bool fTaken;        // A branch at this level has been assembled (or the level is inside a disabled block)
+    bool fElse;         // ELSE seen
+    int  lineNumber;    // Line of the IF (for the unterminated block error)
+} CONDLEVEL;
+
+typedef struct _condname_
+{
+    char name[MAX_SYMBOL_NAME_LENGTH];
+    int  lineNumber;    // Line of the definition, or of the IFDEF/IFNDEF that found the name undefined
+    int  depth;         // Tested names: nesting depth of the block the IFDEF/IFNDEF controls (-1 once it has ended)
+} CONDNAME;
+
+typedef enum _condkeyword_
+{
+    COND_NONE,
+    COND_IF,
+    COND_IFDEF,
+    COND_IFNDEF,
+    COND_ELSE,
+    COND_ENDIF
+} CONDKEYWORD;
+
+DEFINE   g_defines[MAX_DEFINES];    // -D definitions, pushed into the symbol table ahead of the snapshots
+int      g_defineCount;
+CONDSPAN *g_condSpans;              // Spans recorded by the most recent scan
+int      g_condSpanCount;
+int      g_condSpansAllocated;
+CONDNAME *g_condDefined;            // Symbols defined by the source lines scanned so far
+int      g_condDefinedCount;
+int      g_condDefinedAllocated;
+CONDNAME *g_condTested;             // Symbols an IFDEF/IFNDEF found undefined
+int      g_condTestedCount;
+int      g_condTestedAllocated;
+
+
+// Add a -D definition: NAME (value 1) or NAME=<value>.
+//
+int addDefine(const char *pszDefinition)
+{
+    char   szName[MAX_LINE_LENGTH];
+    char   *pszValue;
+    UINT16 nValue = 1;
+
+    strncpy(szName, pszDefinition, MAX_LINE_LENGTH - 1);
+    szName[MAX_LINE_LENGTH - 1] = '\0';
+
+    if (NULL != (pszValue = strchr(szName, '=')))
+    {
+        *pszValue++ = '\0';
+        if (convertToNumber(pszValue, &nValue))
+        {
+            printf("ERROR: Invalid -D value \'%s\'\r\n", pszValue);
+            return -1;
+        }
+    }
+
+    if ('\0' == szName[0] || strlen(szName) >= MAX_SYMBOL_NAME_LENGTH || g_defineCount >= MAX_DEFINES)
+    {
+        printf("ERROR: Invalid -D symbol \'%s\' (at most %d symbols of %d characters)\r\n", szName, MAX_DEFINES,
+               MAX_SYMBOL_NAME_LENGTH - 1);
+        return -1;
+    }
+
+    strcpy(g_defines[g_defineCount].symbolName, szName);
+    g_defines[g_defineCount].value = nValue;
+    g_defineCount++;
+
+    return 0;
+}
+
+
+// Push the -D definitions into the symbol table.  They're sized the way EQU sizes a value.
+//
+int pushDefines(void)
+{
+    for (int i=0 ; i<g_defineCount ; i++)
+    {
+        if (pushSymbol(g_defines[i].symbolName, (g_defines[i].value < 256 ? SYMBOL_TYPE_NUMBER_8BIT : SYMBOL_TYPE_NUMBER_16BIT),
+                       &g_defines[i].value))
+            return -1;
+    }
+
+    return 0;
+}
+
+
+// Record a span.  Consecutive lines treated the same way are merged into one run.
+//
+int addCondSpan(int nStartOffset, int nEndOffset, int nLineCount, bool fDirective)
+{
+    CONDSPAN *pSpan;
+
+    if (g_condSpanCount && g_condSpans[g_condSpanCount - 1].fDirective == fDirective &&
+        g_condSpans[g_condSpanCount - 1].endOffset == nStartOffset)
+    {
+        g_condSpans[g_condSpanCount - 1].endOffset  = nEndOffset;
+        g_condSpans[g_condSpanCount - 1].lineCount += nLineCount;
+        return 0;
+    }
+
+    if (g_condSpanCount == g_condSpansAllocated)
+    {
+        int nNewCount = (g_condSpansAllocated ? g_condSpansAllocated * 2 : 64);
+
+        if (NULL == (pSpan = (CONDSPAN *)realloc(g_condSpans, (sizeof(CONDSPAN) * nNewCount))))
+        {
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(CONDSPAN) * nNewCount));
+            return -1;
+        }
+        g_condSpans          = pSpan;
+        g_condSpansAllocated = nNewCount;
+    }
+
+    pSpan = &g_condSpans[g_condSpanCount++];
+    pSpan->startOffset = nStartOffset;
+    pSpan->endOffset   = nEndOffset;
+    pSpan->lineCount   = nLineCount;
+    pSpan->fDirective  = fDirective;
+
+    return 0;
+}
+
+
+// Add a name to a list of source symbol names.
+//
+int addCondName(CONDNAME **ppNames, int *pnCount, int *pnAllocated, const char *pName, int nLength, int nLineNumber,
+                int nDepth)
+{
+    CONDNAME *pTemp;
+
+    if (*pnCount == *pnAllocated)
+    {
+        int nNewCount = (*pnAllocated ? *pnAllocated * 2 : 256);
+
+        if (NULL == (pTemp = (CONDNAME *)realloc(*ppNames, (sizeof(CONDNAME) * nNewCount))))
+        {
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(CONDNAME) * nNewCount));
+            return -1;
+        }
+        *ppNames     = pTemp;
+        *pnAllocated = nNewCount;
+    }
+
+    pTemp = &(*ppNames)[(*pnCount)++];
+    if (nLength > MAX_SYMBOL_NAME_LENGTH - 1)
+        nLength = MAX_SYMBOL_NAME_LENGTH - 1;
+    memcpy(pTemp->name, pName, nLength);
+    pTemp->name[nLength] = '\0';
+    pTemp->lineNumber = nLineNumber;
+    pTemp->depth      = nDepth;
+
+    return 0;
+}
+
+
+// Returns the index of a name in a list of source symbol names, or -1.  Only IFDEF/IFNDEF look names up (and the
+// list of names they found undefined is short), so a linear search is enough.
+//
+int findCondName(CONDNAME *pNames, int nCount, const char *pszName)
+{
+    for (int i=0 ; i<nCount ; i++)
+    {
+        if (!strcasecmp(pNames[i].name, pszName))
+            return i;
+    }
+
+    return -1;
+}
+
+
+// Note the symbol a kept source line defines (its first token, if it starts in the first column).  It's an error for
+// an IFDEF/IFNDEF whose block has ended to have found it undefined.
+//
+int addSourceSymbol(const char *pLine, const char *pEnd, int nLineNumber)
+{
+    CONDNAME *pName;
+    int      nLength;
+
+    if (pLine == pEnd || *pLine == ' ' || *pLine == '\t' || *pLine == '\r' || *pLine == ';' || *pLine == '*' ||
+        (*pLine == '/' && pLine + 1 < pEnd && pLine[1] == '/'))
+        return 0;
+
+    for (nLength=0 ; pLine + nLength < pEnd && pLine[nLength] != ' ' && pLine[nLength] != '\t' && pLine[nLength] != '\r' &&
+         pLine[nLength] != ':' ; nLength++)
+        ;
+    if (addCondName(&g_condDefined, &g_condDefinedCount, &g_condDefinedAllocated, pLine, nLength, nLineNumber, -1))
+        return -1;
+    pName = &g_condDefined[g_condDefinedCount - 1];
+
+    for (int i=0 ; i<g_condTestedCount ; i++)
+    {
+        if (g_condTested[i].depth < 0 && !strcasecmp(g_condTested[i].name, pName->name))
+        {
+            printf("ERROR: Symbol \'%s\' on line %d is defined after the IFDEF/IFNDEF on line %d that tested it\r\n",
+                   pName->name, nLineNumber, g_condTested[i].lineNumber);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Returns the conditional keyword that starts a line (labels can't be named after the keywords), leaving the read
+// pointer after it.  Only lines whose first token starts with an 'E' or 'I' get as far as a compare.
+//
+CONDKEYWORD getCondKeyword(const char **ppLine, const char *pEnd)
+{
+    const char *pToken = *ppLine;
+    const char *pTokenEnd;
+    int nLength;
+
+    while (pToken < pEnd && (*pToken == ' ' || *pToken == '\t'))
+        pToken++;
+
+    if (pToken == pEnd || (*pToken != 'I' && *pToken != 'i' && *pToken != 'E' && *pToken != 'e'))
+        return COND_NONE;
+
+    for (pTokenEnd = pToken ; pTokenEnd < pEnd && *pTokenEnd != ' ' && *pTokenEnd != '\t' && *pTokenEnd != '\r' ; pTokenEnd++)
+        ;
+    nLength = (int)(pTokenEnd - pToken);
+    *ppLine = pTokenEnd;
+
+    if (2 == nLength && !strncasecmp(pToken, "IF", 2))
+        return COND_IF;
+    if (5 == nLength && !strncasecmp(pToken, "IFDEF", 5))
+        return COND_IFDEF;
+    if (6 == nLength && !strncasecmp(pToken, "IFNDEF", 6))
+        return COND_IFNDEF;
+    if (4 == nLength && !strncasecmp(pToken, "ELSE", 4))
+        return COND_ELSE;
+    if (5 == nLength && !strncasecmp(pToken, "ENDIF", 5))
+        return COND_ENDIF;
+
+    return COND_NONE;
+}
+
+
+// Get the value of an IF operand - a number or a numeric symbol defined ahead of the source.
+//
+int getCondValue(char *pszOperand, int nLineNumber, UINT16 *pnValue)
+{
+    int nSymbol;
+
+    if (0 == convertToNumber(pszOperand, pnValue))
+        return 0;
+
+    if ((nSymbol = findSymbolIndex(pszOperand)) < 0 || symbols[nSymbol].symbolType == SYMBOL_TYPE_STRING)
+    {
+        printf("ERROR: IF operand \'%s\' on line %d isn\'t a number or a -D/snapshot symbol\r\n", pszOperand, nLineNumber);
+        return -1;
+    }
+
+    *pnValue = (symbols[nSymbol].symbolType == SYMBOL_TYPE_NUMBER_8BIT ? symbols[nSymbol].u.nsymbolValue8 :
+                symbols[nSymbol].u.nsymbolValue16);
+
+    return 0;
+}
+
+
+// Evaluate the operand of an IF/IFDEF/IFNDEF: IF takes <value> (true if non-zero) or <value><op><value> with one of
+// = == != <> < <= > >=, and IFDEF/IFNDEF take a symbol name.
+//
+int evaluateCondition(CONDKEYWORD keyword, const char *pText, const char *pEnd, int nLineNumber, int nDepth, bool *pfResult)
+{
+    char   szExpr[MAX_LINE_LENGTH];
+    char   *pszOp;
+    char   *pszRight;
+    char   szOp[3] = { 0, 0, 0 };
+    UINT16 nLeft;
+    UINT16 nRight;
+    int    nLength;
+
+    while (pText < pEnd && (*pText == ' ' || *pText == '\t'))
+        pText++;
+    for (nLength=0 ; pText + nLength < pEnd && nLength < MAX_LINE_LENGTH - 1 && pText[nLength] != ' ' &&
+         pText[nLength] != '\t' && pText[nLength] != '\r' ; nLength++)
+        szExpr[nLength] = pText[nLength];
+    szExpr[nLength] = '\0';
+
+    if (0 == nLength)
+    {
+        printf("ERROR: Missing condition on line %d\r\n", nLineNumber);
+        return -1;
+    }
+
+    if (keyword != COND_IF)
+    {
+        char szName[MAX_SYMBOL_NAME_LENGTH];
+        bool fDefined;
+
+        copySymbolName(szName, szExpr);
+        fDefined = (findSymbolIndex(szName) >= 0 || findCondName(g_condDefined, g_condDefinedCount, szName) >= 0);
+        if (!fDefined && addCondName(&g_condTested, &g_condTestedCount, &g_condTestedAllocated, szName, (int)strlen(szName),
+                                     nLineNumber, nDepth))
+            return -1;
+
+        *pfResult = (fDefined == (keyword == COND_IFDEF));
+        return 0;
+    }
+
+    // Split the expression at the operator, if there is one.
+    //
+    if (NULL == (pszOp = strpbrk(szExpr, "=!<>")))
+    {
+        if (getCondValue(szExpr, nLineNumber, &nLeft))
+            return -1;
+        *pfResult = (nLeft != 0);
+        return 0;
+    }
+
+    szOp[0]  = pszOp[0];
+    pszRight = pszOp + 1;
+    if (*pszRight == '=' || (szOp[0] == '<' && *pszRight == '>'))
+        szOp[1] = *pszRight++;
+    *pszOp = '\0';
+
+    if (getCondValue(szExpr, nLineNumber, &nLeft) || getCondValue(pszRight, nLineNumber, &nRight))
+        return -1;
+
+    if (!strcmp(szOp, "=") || !strcmp(szOp, "=="))
+        *pfResult = (nLeft == nRight);
+    else if (!strcmp(szOp, "!=") || !strcmp(szOp, "<>"))
+        *pfResult = (nLeft != nRight);
+    else if (!strcmp(szOp, "<"))
+        *pfResult = (nLeft < nRight);
+    else if (!strcmp(szOp, "<="))
+        *pfResult = (nLeft <= nRight);
+    else if (!strcmp(szOp, ">"))
+        *pfResult = (nLeft > nRight);
+    else if (!strcmp(szOp, ">="))
+        *pfResult = (nLeft >= nRight);
+    else
+    {
+        printf("ERROR: Invalid condition operator \'%s\' on line %d\r\n", szOp, nLineNumber);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Scan the source for conditional directives and record the spans pass 1 and pass 2 skip.  Inside a disabled block
+// only the nesting is followed - nothing in it is evaluated.  The macro definitions and REPT/IRP blocks are recorded
+// from the lines that are kept.
+//
+int scanConditionals(SOURCEFILE *pSourceFile)
+{
+    CONDLEVEL levels[MAX_COND_DEPTH];
+    int  nDepth      = 0;
+    int  nLineNumber = 0;
+    int  nOffset     = 0;
+
+    g_condSpanCount    = 0;
+    g_condDefinedCount = 0;
+    g_condTestedCount  = 0;
+    beginMacroScan();
+
+    while (nOffset < pSourceFile->fileSize)
+    {
+        const char  *pLine = pSourceFile->pFile + nOffset;
+        const char  *pEnd  = memchr(pLine, '\n', pSourceFile->fileSize - nOffset);
+        int         nNextOffset = (pEnd ? (int)(pEnd - pSourceFile->pFile) + 1 : pSourceFile->fileSize);
+        int         nLineEnds   = (pEnd ? 1 : 0);
+        bool        fParentActive = (0 == nDepth || levels[nDepth - 1].fActive);
+        bool        fActive;
+        CONDKEYWORD keyword;
+        MACROSCAN   scan;
+
+        ++nLineNumber;
+        if (NULL == pEnd)
+            pEnd = pSourceFile->pFile + pSourceFile->fileSize;
+
+        keyword = getCondKeyword(&pLine, pEnd);
+
+        // The ELSE and ENDIF of a block are controlled by the level the block is nested in.
+        //
+        if ((keyword == COND_ELSE || keyword == COND_ENDIF) && nDepth)
+            fParentActive = (1 == nDepth || levels[nDepth - 2].fActive);
+
+        switch (keyword)
+        {
+            case COND_IF:
+            case COND_IFDEF:
+            case COND_IFNDEF:
+                if (nDepth == MAX_COND_DEPTH)
+                {
+                    printf("ERROR: Conditionals nested more than %d deep on line %d\r\n", MAX_COND_DEPTH, nLineNumber);
+                    return -1;
+                }
+
+                fActive = false;
+                if (fParentActive && evaluateCondition(keyword, pLine, pEnd, nLineNumber, nDepth, &fActive))
+                    return -1;
+
+                levels[nDepth].fActive    = fActive;
+                levels[nDepth].fTaken     = (fActive || !fParentActive);
+                levels[nDepth].fElse      = false;
+                levels[nDepth].lineNumber = nLineNumber;
+                nDepth++;
+                break;
+
+            case COND_ELSE:
+                if (0 == nDepth || levels[nDepth - 1].fElse)
+                {
+                    printf("ERROR: ELSE without IF on line %d\r\n", nLineNumber);
+                    return -1;
+                }
+                levels[nDepth - 1].fActive = !levels[nDepth - 1].fTaken;
+                levels[nDepth - 1].fTaken  = true;
+                levels[nDepth - 1].fElse   = true;
+                break;
+
+            case COND_ENDIF:
+                if (0 == nDepth)
+                {
+                    printf("ERROR: ENDIF without IF on line %d\r\n", nLineNumber);
+                    return -1;
+                }
+                nDepth--;
+
+                // The names the block's IFDEF/IFNDEF tested can't be defined from here on.
+                //
+                for (int i=0 ; i<g_condTestedCount ; i++)
+                {
+                    if (g_condTested[i].depth >= nDepth)
+                        g_condTested[i].depth = -1;
+                }
+                break;
+
+            case COND_NONE:
+            default:
+                break;
+        }
+
+        // A directive is listed when the block it belongs to is (unless it's in a REPT/IRP body), and any other line is
+        // skipped when it's disabled.  The macro scanner decides about the rest.
+        //
+        if (keyword != COND_NONE || !fParentActive)
+            scan = (keyword != COND_NONE && fParentActive && getMacroScanBlock() != MACRO_SCAN_SKIPPED ? MACRO_SCAN_LISTED :
+                    MACRO_SCAN_SKIPPED);
+        else if (scanMacroLine(pSourceFile, nOffset, nNextOffset, nLineNumber, &scan))
+            return -1;
+
+        // The symbols on lines that are assembled (directly or through a REPT/IRP expansion) are defined for the
+        // IFDEF/IFNDEF lines below.
+        //
+        if (keyword == COND_NONE && fParentActive && scan != MACRO_SCAN_LISTED &&
+            addSourceSymbol(pSourceFile->pFile + nOffset, pEnd, nLineNumber))
+            return -1;
+
+        if (scan != MACRO_SCAN_SOURCE && addCondSpan(nOffset, nNextOffset, nLineEnds, (scan == MACRO_SCAN_LISTED)))
+            return -1;
+
+        nOffset = nNextOffset;
+    }
+
+    if (nDepth)
+    {
+        printf("ERROR: IF on line %d has no ENDIF\r\n", levels[nDepth - 1].lineNumber);
+        return -1;
+    }
+
+    if (endMacroScan())
+        return -1;
+
+    pSourceFile->pCondSpans    = (g_condSpanCount ? g_condSpans : NULL);
+    pSourceFile->condSpanCount = g_condSpanCount;
+    pSourceFile->nextCondSpan  = -1;
+
+    return 0;
+}
+
+
+// Find the first span that isn't wholly behind a source offset.
+//
+int findCondSpan(SOURCEFILE *pSourceFile, int nOffset)
+{
+    int nLow  = 0;
+    int nHigh = pSourceFile->condSpanCount;
+
+    while (nLow < nHigh)
+    {
+        int nMiddle = (nLow + nHigh) / 2;
+
+        if (pSourceFile->pCondSpans[nMiddle].endOffset <= nOffset)
+            nLow = nMiddle + 1;
+        else
+            nHigh = nMiddle;
+    }
+
+    return nLow;
+}
+
+
+// Called by getNextFileLine() at the start of each line - steps over any disabled run starting there and notes whether
+// the line is listed but not assembled.
+//
+void skipDisabledLines(SOURCEFILE *pSourceFile)
+{
+    if (pSourceFile->nextCondSpan < 0)
+        pSourceFile->nextCondSpan = findCondSpan(pSourceFile, pSourceFile->byteOffset);
+
+    pSourceFile->fCondLine = false;
+
+    while (pSourceFile->nextCondSpan < pSourceFile->condSpanCount &&
+           pSourceFile->pCondSpans[pSourceFile->nextCondSpan].startOffset <= pSourceFile->byteOffset)
+    {
+        CONDSPAN *pSpan = &pSourceFile->pCondSpans[pSourceFile->nextCondSpan];
+
+        // A listed span covers every line up to its end.
+        //
+        if (pSpan->endOffset <= pSourceFile->byteOffset)
+        {
+            pSourceFile->nextCondSpan++;
+            continue;
+        }
+
+        if (pSpan->fDirective)
+        {
+            pSourceFile->fCondLine = true;
+            break;
+        }
+
+        pSourceFile->nextCondSpan++;
+        pSourceFile->piterOffset += (pSpan->endOffset - pSourceFile->byteOffset);
+        pSourceFile->byteOffset   = pSpan->endOffset;
+        pSourceFile->lineNumber  += pSpan->lineCount;
+    }
+}
+
+
+// Returns the offset, or the end of the disabled run it's inside of (a run is only ever stepped over from its start).
+//
+int getEnabledOffset(SOURCEFILE *pSourceFile, int nOffset)
+{
+    int nSpan = findCondSpan(pSourceFile, nOffset);
+
+    if (nSpan < pSourceFile->condSpanCount && !pSourceFile->pCondSpans[nSpan].fDirective &&
+        pSourceFile->pCondSpans[nSpan].startOffset < nOffset)
+        return pSourceFile->pCondSpans[nSpan].endOffset;
+
+    return nOffset;
+}
@@ -0,0 +1,12 @@
+//
+//  cond.h
+//  MC68HC11 Assembler
+//
+//  Conditional assembly and -D symbol definitions.
+//
+
+int addDefine(const char *pszDefinition);
+int pushDefines(void);
+int scanConditionals(SOURCEFILE *pSourceFile);
+void skipDisabledLines(SOURCEFILE *pSourceFile);
+int getEnabledOffset(SOURCEFILE *pSourceFile, int nOffset);
@@ -0,0 +1,354 @@
+//
+//  delay.c
+//  MC68HC11 Assembler
+//
+//  Cycle-exact delays (DELAY).  The count is given in E clock cycles, or in microseconds with a US suffix (converted
+//  with the -e clock), and may be followed by the registers the delay is allowed to change:
+//
+//      DELAY 40            ; 40 cycles, nothing changed
+//      DELAY 250US,XC      ; 250us, X and the condition codes may change
+//
+//  The shortest sequence (in bytes) that takes exactly that many cycles is built from the cycle counts in the instruction
+//  table.  Padding comes from instructions that change nothing (NOP, BRN and balanced push/pull or exchange pairs), so a
+//  DELAY with no register list is straight-line code.  Longer delays need a countdown loop (LDX #n / DEX / BNE), which
+//  changes the condition codes, so C must be listed for one to be used; the loop register is pushed and pulled around it
+//  unless it's listed too.  A loop runs at most 65536 passes, so longer delays (past about 65536 * 7 cycles with Y) are
+//  rejected rather than built short.
+//
+//  Pass 1 sizes a DELAY and pass 2 encodes it by building the same sequence from the same operand.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "common.h"
+#include "utility.h"
+#include "delay.h"
+
+extern INSTRUCTION *lookUpMneumonic(char *pszMneumonic);
+extern INSTRUCTION *lookUpMatchingAddrMode(INSTRUCTION *pInst, ADDRMODE addrMode);
+extern UINT32 g_eClockHz;
+
+// Padding that changes nothing - one instruction, or a pair that undoes itself.
+//
+typedef struct _delaypiece_
+{
+    char     *pszFirst;
+    char     *pszSecond;        // NULL for a single instruction
+    ADDRMODE addrMode;
+} DELAYPIECE;
+
+// Countdown loops, one per register that can be loaded, decremented and tested.
+//
+typedef struct _delayloop_
+{
+    UINT8  clobber;             // DELAY_CLOBBER_xxx bit of the loop register
+    char   *pszLoad;            // Immediate load of the count
+    char   *pszCount;           // Decrement
+    char   *pszPush;            // Saves the register when it may not change
+    char   *pszPull;
+    UINT32 maxCount;            // Iterations for a count of zero
+} DELAYLOOP;
+
+// The last piece has the most cycles per byte, so long straight-line delays are mostly made of it.
+//
+DELAYPIECE g_delayPieces[] =
+{
+    { "NOP",  NULL,   INH },
+    { "BRN",  NULL,   REL },
+    { "XGDX", "XGDX", INH },
+    { "PSHA", "PULA", INH },
+    { "PSHX", "PULX", INH }
+};
+
+DELAYLOOP g_delayLoops[] =
+{
+    { DELAY_CLOBBER_A, "LDAA", "DECA", "PSHA", "PULA", 0x100 },
+    { DELAY_CLOBBER_B, "LDAB", "DECB", "PSHB", "PULB", 0x100 },
+    { DELAY_CLOBBER_X, "LDX",  "DEX",  "PSHX", "PULX", 0x10000 },
+    { DELAY_CLOBBER_Y, "LDY",  "DEY",  "PSHY", "PULY", 0x10000 }
+};
+
+#define NUM_DELAY_PIECES    (int)(sizeof(g_delayPieces) / sizeof(DELAYPIECE))
+#define NUM_DELAY_LOOPS     (int)(sizeof(g_delayLoops) / sizeof(DELAYLOOP))
+
+typedef struct _delayplan_
+{
+    int    padBytes[DELAY_PAD_CYCLES + 1];  // Fewest padding bytes for each cycle count (INT_MAX == none)
+    int    padPiece[DELAY_PAD_CYCLES + 1];  // Last piece of that padding
+    int    pieceCycles[NUM_DELAY_PIECES];
+    int    pieceBytes[NUM_DELAY_PIECES];
+} DELAYPLAN;
+
+
+// Read a DELAY count - decimal, $hex or @octal as convertToNumber() takes them, but 32 bits wide, so a long delay is
+// never wrapped into a short one.
+//
+int getDelayCount(char *pszToken, unsigned long long *pnCount)
+{
+    UINT16 nCheck;
+    int    nBase      = ('$' == *pszToken ? 16 : ('@' == *pszToken ? 8 : 10));
+    char   *pszDigits = pszToken + (nBase != 10 ? 1 : 0);
+
+    if ('\'' == *pszToken || '%' == *pszToken || convertToNumber(pszToken, &nCheck) || '\0' == *pszDigits ||
+        strlen(pszDigits) > 11)
+        return -1;
+
+    *pnCount = strtoull(pszDigits, NULL, nBase);
+    return (*pnCount > 0xFFFFFFFF ? -1 : 0);
+}
+
+
+// Parse a DELAY operand - the count (with an optional US suffix) and an optional list of registers it may change (A, B,
+// D, X, Y and C for the condition codes).
+//
+int parseDelay(char *pszOperand, UINT32 *pnCycles, UINT8 *pnClobber)
+{
+    char               szCount[MAX_LINE_LENGTH];
+    char               *pszList;
+    int                nLength;
+    bool               fMicroseconds = false;
+    unsigned long long nCount;
+
+    if (NULL == pszOperand)
+        return -1;
+
+    strncpy(szCount, pszOperand, MAX_LINE_LENGTH - 1);
+    szCount[MAX_LINE_LENGTH - 1] = '\0';
+    if (NULL != (pszList = strchr(szCount, ',')))
+        *pszList++ = '\0';
+
+    nLength = (int)strlen(szCount);
+    if (nLength > 2 && strcasecmp(szCount + nLength - 2, "US") == 0)
+    {
+        szCount[nLength - 2] = '\0';
+        fMicroseconds = true;
+    }
+
+    if (getDelayCount(szCount, &nCount))
+        return -1;
+    if (fMicroseconds)
+        nCount = ((nCount * g_eClockHz) + 500000) / 1000000;
+    if (nCount > 0xFFFFFFFF)
+        return -1;
+    *pnCycles = (UINT32)nCount;
+
+    *pnClobber = 0;
+    if (pszList)
+    {
+        if ('\0' == *pszList)
+            return -1;
+
+        for ( ; *pszList != '\0' ; pszList++)
+        {
+            switch (*pszList)
+            {
+                case 'A': case 'a':   *pnClobber |= DELAY_CLOBBER_A;                     break;
+                case 'B': case 'b':   *pnClobber |= DELAY_CLOBBER_B;                     break;
+                case 'D': case 'd':   *pnClobber |= (DELAY_CLOBBER_A | DELAY_CLOBBER_B); break;
+                case 'X': case 'x':   *pnClobber |= DELAY_CLOBBER_X;                     break;
+                case 'Y': case 'y':   *pnClobber |= DELAY_CLOBBER_Y;                     break;
+                case 'C': case 'c':   *pnClobber |= DELAY_CLOBBER_CCR;                   break;
+                default:
+                    return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+INSTRUCTION *findDelayInstruction(char *pszMneumonic, ADDRMODE addrMode)
+{
+    INSTRUCTION *pInst = lookUpMneumonic(pszMneumonic);
+
+    return (pInst ? lookUpMatchingAddrMode(pInst, addrMode) : NULL);
+}
+
+
+// Find the fewest padding bytes for every cycle count up to DELAY_PAD_CYCLES (an unbounded knapsack over the pieces).
+//
+void planDelayPadding(DELAYPLAN *pPlan)
+{
+    for (int i=0 ; i<NUM_DELAY_PIECES ; i++)
+    {
+        INSTRUCTION *pFirst  = findDelayInstruction(g_delayPieces[i].pszFirst, g_delayPieces[i].addrMode);
+        INSTRUCTION *pSecond = (g_delayPieces[i].pszSecond ? findDelayInstruction(g_delayPieces[i].pszSecond, g_delayPieces[i].addrMode) : NULL);
+
+        pPlan->pieceCycles[i] = pFirst->numCycles + (pSecond ? pSecond->numCycles : 0);
+        pPlan->pieceBytes[i]  = pFirst->numBytes + (pSecond ? pSecond->numBytes : 0);
+    }
+
+    pPlan->padBytes[0] = 0;
+    pPlan->padPiece[0] = -1;
+    for (int nCycles=1 ; nCycles <= DELAY_PAD_CYCLES ; nCycles++)
+    {
+        pPlan->padBytes[nCycles] = INT_MAX;
+        pPlan->padPiece[nCycles] = -1;
+
+        for (int i=0 ; i<NUM_DELAY_PIECES ; i++)
+        {
+            int nRest = nCycles - pPlan->pieceCycles[i];
+
+            if (nRest >= 0 && pPlan->padBytes[nRest] != INT_MAX && pPlan->padBytes[nRest] + pPlan->pieceBytes[i] < pPlan->padBytes[nCycles])
+            {
+                pPlan->padBytes[nCycles] = pPlan->padBytes[nRest] + pPlan->pieceBytes[i];
+                pPlan->padPiece[nCycles] = i;
+            }
+        }
+    }
+}
+
+
+// Returns the padding bytes for a cycle count, or INT_MAX if it can't be padded.  Counts past the table are brought into
+// it with the last piece.
+//
+int getDelayPadBytes(DELAYPLAN *pPlan, UINT32 nCycles)
+{
+    int    nLast  = NUM_DELAY_PIECES - 1;
+    UINT32 nExtra = 0;
+
+    if (nCycles > DELAY_PAD_CYCLES)
+        nExtra = (nCycles - DELAY_PAD_CYCLES + pPlan->pieceCycles[nLast] - 1) / pPlan->pieceCycles[nLast];
+    if (nExtra > MAX_DELAY_BYTES || pPlan->padBytes[nCycles - (nExtra * pPlan->pieceCycles[nLast])] == INT_MAX)
+        return INT_MAX;
+
+    return (int)(nExtra * pPlan->pieceBytes[nLast]) + pPlan->padBytes[nCycles - (nExtra * pPlan->pieceCycles[nLast])];
+}
+
+
+// Append an instruction to the sequence.
+//
+int emitDelayInstruction(UINT8 *pBytes, int nBytes, char *pszMneumonic, ADDRMODE addrMode, UINT16 nOperand, UINT32 *pnCycles)
+{
+    INSTRUCTION *pInst = findDelayInstruction(pszMneumonic, addrMode);
+    int nOperandBytes  = pInst->numBytes - (pInst->preByte ? 2 : 1);
+
+    if (pInst->preByte)
+        pBytes[nBytes++] = pInst->preByte;
+    pBytes[nBytes++] = pInst->opCode;
+    if (nOperandBytes == 2)
+        pBytes[nBytes++] = (UINT8)(nOperand >> 8);
+    if (nOperandBytes)
+        pBytes[nBytes++] = (UINT8)nOperand;
+
+    *pnCycles += pInst->numCycles;
+    return nBytes;
+}
+
+
+int emitDelayPadding(DELAYPLAN *pPlan, UINT8 *pBytes, int nBytes, UINT32 nCycles, UINT32 *pnCycles)
+{
+    while (nCycles)
+    {
+        int nPiece = (nCycles > DELAY_PAD_CYCLES ? NUM_DELAY_PIECES - 1 : pPlan->padPiece[nCycles]);
+
+        // A BRN to the next instruction is never taken, but its offset is still encoded.
+        //
+        nBytes = emitDelayInstruction(pBytes, nBytes, g_delayPieces[nPiece].pszFirst, g_delayPieces[nPiece].addrMode, 0, pnCycles);
+        if (g_delayPieces[nPiece].pszSecond)
+            nBytes = emitDelayInstruction(pBytes, nBytes, g_delayPieces[nPiece].pszSecond, g_delayPieces[nPiece].addrMode, 0, pnCycles);
+        nCycles -= pPlan->pieceCycles[nPiece];
+    }
+
+    return nBytes;
+}
+
+
+// Build the shortest sequence that takes exactly nCycles, changing only the registers in nClobber (DELAY_CLOBBER_xxx).
+// The bytes (at most MAX_DELAY_BYTES) go to pBytes; returns the number of bytes, or -1 if no sequence fits.
+//
+int synthesizeDelay(UINT32 nCycles, UINT8 nClobber, UINT8 *pBytes)
+{
+    DELAYPLAN plan;
+    int       nBest;
+    int       nBestLoop  = -1;
+    bool      fBestSave  = false;
+    UINT32    nBestCount = 0;
+    UINT32    nEmitted   = 0;
+    int       nBytes     = 0;
+
+    planDelayPadding(&plan);
+
+    // Straight-line padding changes nothing, so it's preferred when it's as short as a loop.
+    //
+    nBest = getDelayPadBytes(&plan, nCycles);
+
+    for (int i=0 ; i<NUM_DELAY_LOOPS && (nClobber & DELAY_CLOBBER_CCR) ; i++)
+    {
+        DELAYLOOP   *pLoop  = &g_delayLoops[i];
+        INSTRUCTION *pLoad  = findDelayInstruction(pLoop->pszLoad, IMM);
+        INSTRUCTION *pCount = findDelayInstruction(pLoop->pszCount, INH);
+        INSTRUCTION *pPush  = findDelayInstruction(pLoop->pszPush, INH);
+        INSTRUCTION *pPull  = findDelayInstruction(pLoop->pszPull, INH);
+        INSTRUCTION *pBranch = findDelayInstruction("BNE", REL);
+        UINT32      nPass   = pCount->numCycles + pBranch->numCycles;
+
+        for (int nSave=0 ; nSave<2 ; nSave++)
+        {
+            bool   fSave  = (nSave != 0);
+            UINT32 nSetup = pLoad->numCycles + (fSave ? pPush->numCycles + pPull->numCycles : 0);
+            int    nLoopBytes = pLoad->numBytes + pCount->numBytes + pBranch->numBytes + (fSave ? pPush->numBytes + pPull->numBytes : 0);
+            UINT32 nCount;
+
+            // A register that may change is never saved, and one that may not always is.
+            //
+            if (fSave == ((nClobber & pLoop->clobber) != 0) || nCycles < nSetup + nPass)
+                continue;
+
+            // The most passes leave the least padding, but a remainder that can't be padded (one cycle) needs a pass less.
+            //
+            nCount = (nCycles - nSetup) / nPass;
+            if (nCount > pLoop->maxCount)
+                nCount = pLoop->maxCount;
+
+            for (int nTry=0 ; nTry<4 && nCount > 0 ; nTry++, nCount--)
+            {
+                int nPadBytes = getDelayPadBytes(&plan, nCycles - nSetup - (nCount * nPass));
+
+                if (nPadBytes != INT_MAX && nLoopBytes + nPadBytes < nBest)
+                {
+                    nBest      = nLoopBytes + nPadBytes;
+                    nBestLoop  = i;
+                    fBestSave  = fSave;
+                    nBestCount = nCount;
+                }
+            }
+        }
+    }
+
+    if (nBest > MAX_DELAY_BYTES)
+        return -1;
+
+    if (nBestLoop < 0)
+        return emitDelayPadding(&plan, pBytes, 0, nCycles, &nEmitted);
+
+    // [push] load, decrement, branch back to the decrement, padding, [pull]
+    //
+    {
+        DELAYLOOP   *pLoop  = &g_delayLoops[nBestLoop];
+        INSTRUCTION *pCount = findDelayInstruction(pLoop->pszCount, INH);
+        INSTRUCTION *pBranch = findDelayInstruction("BNE", REL);
+        UINT32      nPass   = pCount->numCycles + pBranch->numCycles;
+        UINT32      nPull   = (fBestSave ? findDelayInstruction(pLoop->pszPull, INH)->numCycles : 0);
+
+        if (fBestSave)
+            nBytes = emitDelayInstruction(pBytes, nBytes, pLoop->pszPush, INH, 0, &nEmitted);
+        nBytes = emitDelayInstruction(pBytes, nBytes, pLoop->pszLoad, IMM, (UINT16)(nBestCount & (pLoop->maxCount - 1)), &nEmitted);
+        nBytes = emitDelayInstruction(pBytes, nBytes, pLoop->pszCount, INH, 0, &nEmitted);
+        nBytes = emitDelayInstruction(pBytes, nBytes, "BNE", REL, (UINT16)(0x100 - pCount->numBytes - pBranch->numBytes), &nEmitted);
+
+        // The loop body was counted once, so add the other passes.
+        //
+        nEmitted += (nBestCount - 1) * nPass;
+        nBytes = emitDelayPadding(&plan, pBytes, nBytes, nCycles - nEmitted - nPull, &nEmitted);
+        if (fBestSave)
+            nBytes = emitDelayInstruction(pBytes, nBytes, pLoop->pszPull, INH, 0, &nEmitted);
+    }
+
+    return (nEmitted == nCycles ? nBytes : -1);
+}
@@ -0,0 +1,9 @@
+//
+//  delay.h
+//  MC68HC11 Assembler
+//
+//  Cycle-exact delays (DELAY).
+//
+
+int parseDelay(char *pszOperand, UINT32 *pnCycles, UINT8 *pnClobber);
+int synthesizeDelay(UINT32 nCycles, UINT8 nClobber, UINT8 *pBytes);
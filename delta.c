@@ -0,0 +1,252 @@
+//
+//  delta.c
+//  MC68HC11 Assembler
+//
+//  Delta S-record output.  The assembled image is compared against a baseline (the image already on the target) and
+//  only the changed bytes are written, along with a byte-level write plan for the EEPROM banks.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "utility.h"
+#include "srecord.h"
+#include "mapfile.h"
+#include "depend.h"
+#include "delta.h"
+
+extern int writeToSRecord(int fpSRecord, UINT32 nAddr, UINT8 *pBytes, int NumBytes);
+extern int writeSRecordEnd(int fpSRecord, UINT16 nStartAddr);
+
+
+// Load the baseline image.  S-record files are loaded at their record addresses, anything else is treated as a raw
+// memory image starting at address 0.
+//
+int loadBaselineImage(const char *pszFileName, UINT8 *pImage, UINT8 *pWritten)
+{
+    int nRetVal = 0;
+    int fpBaseline;
+    struct stat fileStat;
+    char cFirst = '\0';
+
+    if ((fpBaseline = open(pszFileName, O_RDONLY)) < 0)
+    {
+        printf("ERROR: Baseline file open failed (%s)\r\n", pszFileName);
+        return -1;
+    }
+    if (addDependency(pszFileName))
+    {
+        close(fpBaseline);
+        return -1;
+    }
+
+    if (fstat(fpBaseline, &fileStat) < 0 || (fileStat.st_size && read(fpBaseline, &cFirst, 1) != 1))
+    {
+        printf("ERROR: Baseline file read failed (%s)\r\n", pszFileName);
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    if (cFirst == 'S')
+    {
+        close(fpBaseline);
+        return readSRecordFile(pszFileName, pImage, pWritten, NULL);
+    }
+
+    if (fileStat.st_size > MEM_IMAGE_SIZE)
+    {
+        printf("ERROR: Baseline image is larger than the 16-bit address space (%s)\r\n", pszFileName);
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    if (lseek(fpBaseline, 0, SEEK_SET) < 0 || read(fpBaseline, pImage, fileStat.st_size) != fileStat.st_size)
+    {
+        printf("ERROR: Baseline file read failed (%s)\r\n", pszFileName);
+        nRetVal = -1;
+        goto Exit;
+    }
+    memset(pWritten, 1, fileStat.st_size);
+
+Exit:
+
+    close(fpBaseline);
+
+    return nRetVal;
+}
+
+
+// Returns true if the address is in a bank named EEPROM (EEPROM, EEPROM2, ...).
+//
+bool isEepromAddress(MEMORYBANK *pBanks, int nBanks, UINT32 nAddr)
+{
+    for (int i=0 ; i<nBanks ; i++)
+    {
+        if (!strncasecmp(pBanks[i].name, "EEPROM", 6) && nAddr >= pBanks[i].start && nAddr <= pBanks[i].end)
+            return true;
+    }
+
+    return false;
+}
+
+
+// Write the EEPROM write plan - one line per changed byte.  68HC11 EEPROM programming can only clear bits, so a byte
+// needs an erase (to $FF) first whenever the new value sets a bit that is clear in the old one.
+//
+int writeEepromPlan(int fpPlan, UINT8 *pImage, UINT8 *pWritten, UINT8 *pBaseline, UINT8 *pBaseWritten, MEMORYBANK *pBanks, int nBanks)
+{
+    LISTBUFFER plan;
+    char szLine[MAX_LINE_LENGTH];
+    int  nErases = 0;
+    int  nPrograms = 0;
+    int  nBytes = 0;
+
+    memset(&plan, 0, sizeof(LISTBUFFER));
+
+    appendToBuffer(&plan, "  EEPROM WRITE   ADDR   OLD  NEW  ACTION\r\n");
+    appendToBuffer(&plan, "-----------------------------------------------\r\n");
+
+    for (UINT32 nAddr=0 ; nAddr < MEM_IMAGE_SIZE ; nAddr++)
+    {
+        bool fErase;
+        bool fProgram;
+        char szOld[4];
+
+        if (!pWritten[nAddr] || !isEepromAddress(pBanks, nBanks, nAddr) ||
+            (pBaseWritten[nAddr] && pBaseline[nAddr] == pImage[nAddr]))
+            continue;
+
+        // If the baseline doesn't cover the byte, its contents are unknown and it's erased first.
+        //
+        if (pBaseWritten[nAddr])
+            sprintf(szOld, "$%02X", pBaseline[nAddr]);
+        else
+            strcpy(szOld, " --");
+
+        fErase   = (!pBaseWritten[nAddr] || (pImage[nAddr] & ~pBaseline[nAddr]) != 0);
+        fProgram = (pImage[nAddr] != 0xFF);
+
+        sprintf(szLine, "%15s  $%04X  %s  $%02X  %s%s%s\r\n", "", (UINT16)nAddr, szOld, pImage[nAddr],
+                (fErase ? "ERASE" : ""), (fErase && fProgram ? ", " : ""), (fProgram ? "PROGRAM" : ""));
+        appendToBuffer(&plan, szLine);
+
+        nBytes++;
+        nErases   += (fErase ? 1 : 0);
+        nPrograms += (fProgram ? 1 : 0);
+    }
+
+    sprintf(szLine, "\r\n%15s  %d bytes changed, %d erase and %d program cycles (about %d ms)\r\n", "", nBytes, nErases,
+            nPrograms, (nErases + nPrograms) * EEPROM_WRITE_MS);
+    appendToBuffer(&plan, szLine);
+
+    if (plan.length)
+        write(fpPlan, plan.pBuffer, plan.length);
+    if (plan.pBuffer)
+        free(plan.pBuffer);
+
+    printf("EEPROM plan: %d bytes changed (%d erase, %d program cycles)\r\n\n", nBytes, nErases, nPrograms);
+
+    return 0;
+}
+
+
+// Write the S-records for the bytes that differ from the baseline.  Short runs of unchanged bytes between two changes
+// are sent anyway when that's cheaper than starting a new record, except in EEPROM where every byte written costs a
+// write cycle.
+//
+int writeDeltaSRecords(const char *pszBaseline, UINT8 *pImage, UINT8 *pWritten, UINT16 nStartAddr, int fpDelta, int fpPlan)
+{
+    int nRetVal = 0;
+    UINT8 *pBaseline    = NULL;
+    UINT8 *pBaseWritten = NULL;
+    UINT8 *pChanged     = NULL;
+    MEMORYBANK *pBanks;
+    int   nBanks;
+    int   nChanged  = 0;
+    int   nBridged  = 0;
+    int   nRemoved  = 0;
+    int   nImage    = 0;
+    UINT32 nAddr;
+
+    pBanks = getMemoryBanks(&nBanks);
+
+    if (NULL == (pBaseline = (UINT8 *)calloc(MEM_IMAGE_SIZE, 1)) || NULL == (pBaseWritten = (UINT8 *)calloc(MEM_IMAGE_SIZE, 1)) ||
+        NULL == (pChanged = (UINT8 *)calloc(MEM_IMAGE_SIZE, 1)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", MEM_IMAGE_SIZE);
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    if (0 != (nRetVal = loadBaselineImage(pszBaseline, pBaseline, pBaseWritten)))
+        goto Exit;
+
+    for (nAddr=0 ; nAddr < MEM_IMAGE_SIZE ; nAddr++)
+    {
+        pChanged[nAddr] = (pWritten[nAddr] && (!pBaseWritten[nAddr] || pBaseline[nAddr] != pImage[nAddr]));
+        nChanged += pChanged[nAddr];
+        nImage   += (pWritten[nAddr] ? 1 : 0);
+        nRemoved += (pBaseWritten[nAddr] && !pWritten[nAddr] ? 1 : 0);
+    }
+
+    // Bridge the short gaps.  A gap is only bridged if it lies between two changed bytes, every byte in it is part of
+    // the new image and none of it is EEPROM.
+    //
+    for (nAddr=0 ; nAddr < MEM_IMAGE_SIZE ; nAddr++)
+    {
+        UINT32 nGapEnd;
+        bool   fBridge;
+
+        if (!pChanged[nAddr] || nAddr + 1 >= MEM_IMAGE_SIZE || pChanged[nAddr + 1])
+            continue;
+
+        for (nGapEnd = nAddr + 1 ; nGapEnd < MEM_IMAGE_SIZE && nGapEnd <= nAddr + DELTA_BRIDGE_BYTES && !pChanged[nGapEnd] ; nGapEnd++)
+            ;
+        if (nGapEnd >= MEM_IMAGE_SIZE || !pChanged[nGapEnd])
+            continue;
+
+        fBridge = true;
+        for (UINT32 nGap = nAddr + 1 ; nGap < nGapEnd && fBridge ; nGap++)
+            fBridge = (pWritten[nGap] && !isEepromAddress(pBanks, nBanks, nGap));
+        if (!fBridge)
+            continue;
+
+        for (UINT32 nGap = nAddr + 1 ; nGap < nGapEnd ; nGap++)
+        {
+            pChanged[nGap] = 1;
+            nBridged++;
+        }
+    }
+
+    for (nAddr=0 ; nAddr < MEM_IMAGE_SIZE ; nAddr++)
+    {
+        if (pChanged[nAddr])
+            writeToSRecord(fpDelta, (UINT16)nAddr, &pImage[nAddr], 1);
+    }
+    writeToSRecord(fpDelta, 0, NULL, 0);
+    writeSRecordEnd(fpDelta, nStartAddr);
+
+    printf("Delta: %d of %d bytes changed (%d unchanged bytes sent to join records)\r\n\n", nChanged, nImage, nBridged);
+    if (nRemoved)
+        printf("WARNING: %d baseline bytes are no longer in the image and are left as they are on the target\r\n\n", nRemoved);
+
+    if (fpPlan)
+        nRetVal = writeEepromPlan(fpPlan, pImage, pWritten, pBaseline, pBaseWritten, pBanks, nBanks);
+
+Exit:
+
+    if (pBaseline)
+        free(pBaseline);
+    if (pBaseWritten)
+        free(pBaseWritten);
+    if (pChanged)
+        free(pChanged);
+
+    return nRetVal;
+}
@@ -0,0 +1,9 @@
+//
+//  delta.h
+//  MC68HC11 Assembler
+//
+//  Delta S-record output against a baseline image.
+//
+
+int loadBaselineImage(const char *pszFileName, UINT8 *pImage, UINT8 *pWritten);
+int writeDeltaSRecords(const char *pszBaseline, UINT8 *pImage, UINT8 *pWritten, UINT16 nStartAddr, int fpDelta, int fpPlan);
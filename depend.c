@@ -0,0 +1,117 @@
+//
+//  depend.c
+//  MC68HC11 Assembler
+//
+//  Dependency file output (-MD/-MF) - a make rule naming every file the assembler read while building its output, so
+//  make and ninja only re-run an assembly when one of them changes.  Each input also gets an empty rule of its own,
+//  so deleting or renaming one doesn't leave the build stuck on a missing prerequisite.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utility.h"
+#include "depend.h"
+
+char **g_pszDependencies;       // Files read, in the order they were first read
+int  g_dependencyCount;
+int  g_dependencyAllocated;
+
+
+// Note a file the assembler read.  A file read more than once (watch mode re-assemblies) is only listed once.
+//
+int addDependency(const char *pszFileName)
+{
+    char *pszCopy;
+
+    for (int i=0 ; i<g_dependencyCount ; i++)
+    {
+        if (!strcmp(g_pszDependencies[i], pszFileName))
+            return 0;
+    }
+
+    if (g_dependencyCount == g_dependencyAllocated)
+    {
+        int  nNewCount = (g_dependencyAllocated ? g_dependencyAllocated * 2 : 16);
+        char **pTemp   = (char **)realloc(g_pszDependencies, sizeof(char *) * nNewCount);
+
+        if (NULL == pTemp)
+        {
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(char *) * nNewCount));
+            return -1;
+        }
+        g_pszDependencies     = pTemp;
+        g_dependencyAllocated = nNewCount;
+    }
+
+    if (NULL == (pszCopy = strdup(pszFileName)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)strlen(pszFileName) + 1);
+        return -1;
+    }
+    g_pszDependencies[g_dependencyCount++] = pszCopy;
+
+    return 0;
+}
+
+
+// Append a file name the way make reads it: spaces and '#' are escaped with a backslash and '$' is doubled.
+//
+int appendMakeName(LISTBUFFER *pText, const char *pszFileName)
+{
+    char szName[(MAX_LINE_LENGTH * 2) + 1];
+    int  nLength = 0;
+
+    for (const char *pChar = pszFileName ; *pChar && nLength < (MAX_LINE_LENGTH * 2) - 1 ; pChar++)
+    {
+        if (*pChar == ' ' || *pChar == '\t' || *pChar == '#')
+            szName[nLength++] = '\\';
+        else if (*pChar == '$')
+            szName[nLength++] = '$';
+        szName[nLength++] = *pChar;
+    }
+    szName[nLength] = '\0';
+
+    return appendToBuffer(pText, szName);
+}
+
+
+// Write the dependency rule for the target, followed by an empty rule for each input.
+//
+int writeDependencyFile(int fpDepend, const char *pszTarget)
+{
+    LISTBUFFER text;
+    int nRetVal = 0;
+
+    memset(&text, 0, sizeof(LISTBUFFER));
+
+    appendMakeName(&text, pszTarget);
+    appendToBuffer(&text, ":");
+    for (int i=0 ; i<g_dependencyCount ; i++)
+    {
+        appendToBuffer(&text, " \\\n  ");
+        appendMakeName(&text, g_pszDependencies[i]);
+    }
+    appendToBuffer(&text, "\n");
+
+    for (int i=0 ; i<g_dependencyCount ; i++)
+    {
+        appendToBuffer(&text, "\n");
+        appendMakeName(&text, g_pszDependencies[i]);
+        appendToBuffer(&text, ":\n");
+    }
+
+    if (text.length && write(fpDepend, text.pBuffer, text.length) != text.length)
+    {
+        printf("ERROR: Dependency file write failed\r\n");
+        nRetVal = -1;
+    }
+
+    if (text.pBuffer)
+        free(text.pBuffer);
+
+    return nRetVal;
+}
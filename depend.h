@@ -0,0 +1,9 @@
+//
+//  depend.h
+//  MC68HC11 Assembler
+//
+//  Make-compatible dependency file output.
+//
+
+int addDependency(const char *pszFileName);
+int writeDependencyFile(int fpDepend, const char *pszTarget);
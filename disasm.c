@@ -0,0 +1,430 @@
+//
+//  disasm.c
+//  MC68HC11 Assembler
+//
+//  Table-driven disassembler.  The decode tables are built from the assembler's own instruction table so the two can
+//  never disagree about an encoding.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "utility.h"
+#include "symfile.h"
+#include "disasm.h"
+
+
+// Operand layouts, derived from the address mode and the number of operand bytes that follow the op-code.
+//
+typedef enum _operandformat_
+{
+    OPFMT_NONE,         // Inherent
+    OPFMT_IMM8,         // #$nn
+    OPFMT_IMM16,        // #$nnnn
+    OPFMT_DIR,          // $nn
+    OPFMT_EXT,          // $nnnn
+    OPFMT_IDX,          // $nn,X (or Y)
+    OPFMT_REL,          // Branch target
+    OPFMT_BIT_DIR,      // BSET/BCLR  $nn,#$mm
+    OPFMT_BIT_IDX,      // BSET/BCLR  $nn,X,#$mm
+    OPFMT_BRBIT_DIR,    // BRSET/BRCLR  $nn,#$mm,target
+    OPFMT_BRBIT_IDX     // BRSET/BRCLR  $nn,X,#$mm,target
+} OPERANDFORMAT;
+
+typedef struct _decodeentry_
+{
+    INSTRUCTION   *pInst;     // Instruction table entry (NULL if the op-code isn't valid on this page)
+    OPERANDFORMAT format;     // Operand layout
+} DECODEENTRY;
+
+DECODEENTRY g_decodeTable[MAX_PREFIX_PAGES][256];   // Direct-indexed by op-code, one table per prefix page
+UINT8       g_prefixPage[256];                      // Decode table page for each prefix byte (0 == not a prefix)
+bool        g_fDecodeTablesBuilt = false;
+
+char        *g_labelAt[MEM_IMAGE_SIZE];             // Symbol name for each address (loaded from a symbol file)
+char        *g_labelNames = NULL;                   // Storage for the symbol names referenced by g_labelAt
+
+
+// Build the decode tables from the instruction table.  Mneumonic aliases share an encoding (ASL/LSL, BCC/BHS, ...) so
+// the first entry in the instruction table wins.
+//
+int buildDecodeTables(void)
+{
+    int nPageCount = 1;
+
+    if (g_fDecodeTablesBuilt)
+        return 0;
+
+    memset(g_decodeTable, 0, sizeof(g_decodeTable));
+    memset(g_prefixPage, 0, sizeof(g_prefixPage));
+
+    for (INSTRUCTION *pInst = instructions ; pInst->mnemonic[0] != '\0' ; pInst++)
+    {
+        int nPage = 0;
+        int nOperandBytes;
+        OPERANDFORMAT format;
+
+        if (pInst->preByte)
+        {
+            if (0 == g_prefixPage[pInst->preByte])
+            {
+                if (nPageCount == MAX_PREFIX_PAGES)
+                {
+                    printf("ERROR: Too many instruction prefix bytes (0x%02x)\r\n", pInst->preByte);
+                    return -1;
+                }
+                g_prefixPage[pInst->preByte] = nPageCount++;
+            }
+            nPage = g_prefixPage[pInst->preByte];
+        }
+
+        nOperandBytes = pInst->numBytes - (pInst->preByte ? 2 : 1);
+        switch (pInst->addrMode)
+        {
+            case IMM:
+                format = (nOperandBytes == 2 ? OPFMT_IMM16 : OPFMT_IMM8);
+                break;
+            case DIR:
+                format = (nOperandBytes == 3 ? OPFMT_BRBIT_DIR : (nOperandBytes == 2 ? OPFMT_BIT_DIR : OPFMT_DIR));
+                break;
+            case INDX:
+            case INDY:
+                format = (nOperandBytes == 3 ? OPFMT_BRBIT_IDX : (nOperandBytes == 2 ? OPFMT_BIT_IDX : OPFMT_IDX));
+                break;
+            case EXT:
+                format = OPFMT_EXT;
+                break;
+            case REL:
+                format = OPFMT_REL;
+                break;
+            case INH:
+            default:
+                format = OPFMT_NONE;
+                break;
+        }
+
+        if (NULL == g_decodeTable[nPage][pInst->opCode].pInst)
+        {
+            g_decodeTable[nPage][pInst->opCode].pInst  = pInst;
+            g_decodeTable[nPage][pInst->opCode].format = format;
+        }
+    }
+
+    g_fDecodeTablesBuilt = true;
+
+    return 0;
+}
+
+
+// Load 16-bit symbols from a symbol file (text or binary debug symbols) written by processSourceFile() so addresses can
+// be shown by name.  When more than one symbol has the same value, the first one in the file is used.
+//
+int loadDisassemblySymbols(const char *pszFileName)
+{
+    int nRetVal = 0;
+    int fpSymbols;
+    struct stat fileStat;
+    char *pFile = NULL;
+    SOURCEFILE sourceFile;
+    char line[MAX_LINE_LENGTH];
+    int nNames = 0;
+
+    if ((fpSymbols = open(pszFileName, O_RDONLY)) < 0)
+    {
+        printf("ERROR: Symbol file open failed (%s)\r\n", pszFileName);
+        return -1;
+    }
+
+    if (fstat(fpSymbols, &fileStat) < 0 || NULL == (pFile = (char *)malloc(fileStat.st_size + 1)) ||
+        read(fpSymbols, pFile, fileStat.st_size) != fileStat.st_size)
+    {
+        printf("ERROR: Symbol file read failed (%s)\r\n", pszFileName);
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    // Each symbol line is at most MAX_SYMBOL_NAME_LENGTH characters of name, so this bounds the name storage.
+    //
+    if (g_labelNames)
+        free(g_labelNames);
+    memset(g_labelAt, 0, sizeof(g_labelAt));
+    if (NULL == (g_labelNames = (char *)malloc(((fileStat.st_size / 8) + 1) * MAX_SYMBOL_NAME_LENGTH)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(((fileStat.st_size / 8) + 1) * MAX_SYMBOL_NAME_LENGTH));
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    // The binary debug symbol file already has the address symbols indexed.
+    //
+    if (isValidDebugFile(pFile, (UINT32)fileStat.st_size))
+    {
+        DEBUGHEADER    *pHeader  = (DEBUGHEADER *)pFile;
+        SNAPSHOTSYMBOL *pRecords = (SNAPSHOTSYMBOL *)(pFile + pHeader->recordOffset);
+        UINT16         *pIndex   = (UINT16 *)(pFile + pHeader->addressIndexOffset);
+
+        for (int i=0 ; i<pHeader->addressCount ; i++)
+        {
+            SNAPSHOTSYMBOL *pRecord = &pRecords[pIndex[i]];
+            char *pszName;
+
+            if (g_labelAt[pRecord->value])
+                continue;
+
+            pszName = g_labelNames + (nNames++ * MAX_SYMBOL_NAME_LENGTH);
+            strncpy(pszName, pRecord->symbolName, MAX_SYMBOL_NAME_LENGTH);
+            pszName[MAX_SYMBOL_NAME_LENGTH - 1] = '\0';
+            g_labelAt[pRecord->value] = pszName;
+        }
+        goto Exit;
+    }
+
+    memset(&sourceFile, 0, sizeof(SOURCEFILE));
+    sourceFile.pFile       = pFile;
+    sourceFile.fileSize    = (int)fileStat.st_size;
+    sourceFile.piterOffset = pFile;
+    sourceFile.fEOF        = (fileStat.st_size == 0);
+
+    while (getNextFileLine(&sourceFile, line, MAX_LINE_LENGTH) == 0)
+    {
+        char szName[MAX_SYMBOL_NAME_LENGTH];
+        char szValue[8];
+        unsigned int nValue;
+        char *pszName;
+
+        // Only "NAME, 0xnnnn" lines are addresses - 8-bit equates and string symbols are skipped.
+        //
+        if (sscanf(line, " %15[^, ] , %7s", szName, szValue) != 2 || strlen(szValue) != 6 ||
+            sscanf(szValue, "0x%4x", &nValue) != 1)
+            continue;
+
+        if (g_labelAt[nValue])
+            continue;
+
+        pszName = g_labelNames + (nNames++ * MAX_SYMBOL_NAME_LENGTH);
+        strncpy(pszName, szName, MAX_SYMBOL_NAME_LENGTH);
+        pszName[MAX_SYMBOL_NAME_LENGTH - 1] = '\0';
+        g_labelAt[nValue] = pszName;
+    }
+
+Exit:
+
+    close(fpSymbols);
+    if (pFile)
+        free(pFile);
+
+    return nRetVal;
+}
+
+
+// Format an address operand, using the symbol name when one is known.
+//
+void formatAddress(char *pszOperand, UINT16 nAddr, bool fDirect)
+{
+    if (g_labelAt[nAddr])
+        strcpy(pszOperand, g_labelAt[nAddr]);
+    else if (fDirect)
+        sprintf(pszOperand, "$%02X", nAddr);
+    else
+        sprintf(pszOperand, "$%04X", nAddr);
+}
+
+
+// Look up the decode table entry for the instruction at nAddr (a single table lookup).  Returns NULL if the bytes don't
+// form a valid instruction or the instruction runs into memory that wasn't written.
+//
+DECODEENTRY *lookUpDecodeEntry(UINT8 *pImage, UINT8 *pWritten, UINT16 nAddr)
+{
+    DECODEENTRY *pEntry;
+
+    // A prefix byte selects the decode page for the following op-code - otherwise the byte is the op-code itself.
+    //
+    if (g_prefixPage[pImage[nAddr]] && nAddr < (MEM_IMAGE_SIZE - 1) && pWritten[nAddr + 1] &&
+        g_decodeTable[g_prefixPage[pImage[nAddr]]][pImage[nAddr + 1]].pInst)
+    {
+        pEntry = &g_decodeTable[g_prefixPage[pImage[nAddr]]][pImage[nAddr + 1]];
+    }
+    else
+    {
+        pEntry = &g_decodeTable[0][pImage[nAddr]];
+    }
+
+    if (NULL == pEntry->pInst || (UINT32)nAddr + pEntry->pInst->numBytes > MEM_IMAGE_SIZE)
+        return NULL;
+
+    for (int i=1 ; i<pEntry->pInst->numBytes ; i++)
+    {
+        if (!pWritten[nAddr + i])
+            return NULL;
+    }
+
+    return pEntry;
+}
+
+
+// Decode the instruction table entry for the instruction at nAddr (NULL if it isn't a valid instruction).
+//
+INSTRUCTION *decodeOpcode(UINT8 *pImage, UINT8 *pWritten, UINT16 nAddr)
+{
+    DECODEENTRY *pEntry;
+
+    if (!pWritten[nAddr] || NULL == (pEntry = lookUpDecodeEntry(pImage, pWritten, nAddr)))
+        return NULL;
+
+    return pEntry->pInst;
+}
+
+
+// Decode the instruction at nAddr.  Returns the instruction length, or 0 if the bytes don't form a valid instruction.
+//
+int decodeInstruction(UINT8 *pImage, UINT8 *pWritten, UINT16 nAddr, char *pszMneumonic, char *pszOperand)
+{
+    DECODEENTRY *pEntry;
+    UINT8  *pOperand;
+    UINT16 nTarget;
+    char   szAddr[MAX_SYMBOL_NAME_LENGTH + 8];
+    char   szIndex[3] = "";
+
+    if (NULL == (pEntry = lookUpDecodeEntry(pImage, pWritten, nAddr)))
+        return 0;
+
+    pOperand = &pImage[nAddr + (pEntry->pInst->preByte ? 2 : 1)];
+    nTarget  = (UINT16)(nAddr + pEntry->pInst->numBytes + (signed char)pImage[nAddr + pEntry->pInst->numBytes - 1]);
+
+    if (pEntry->pInst->addrMode == INDX)
+        strcpy(szIndex, ",X");
+    else if (pEntry->pInst->addrMode == INDY)
+        strcpy(szIndex, ",Y");
+
+    strcpy(pszMneumonic, pEntry->pInst->mnemonic);
+    switch (pEntry->format)
+    {
+        case OPFMT_IMM8:
+            sprintf(pszOperand, "#$%02X", pOperand[0]);
+            break;
+        case OPFMT_IMM16:
+            sprintf(pszOperand, "#$%04X", (pOperand[0] << 8) | pOperand[1]);
+            break;
+        case OPFMT_DIR:
+            formatAddress(pszOperand, pOperand[0], true);
+            break;
+        case OPFMT_EXT:
+            formatAddress(pszOperand, (UINT16)((pOperand[0] << 8) | pOperand[1]), false);
+            break;
+        case OPFMT_IDX:
+            sprintf(pszOperand, "$%02X%s", pOperand[0], szIndex);
+            break;
+        case OPFMT_REL:
+            formatAddress(pszOperand, nTarget, false);
+            break;
+        case OPFMT_BIT_DIR:
+            formatAddress(szAddr, pOperand[0], true);
+            sprintf(pszOperand, "%s,#$%02X", szAddr, pOperand[1]);
+            break;
+        case OPFMT_BIT_IDX:
+            sprintf(pszOperand, "$%02X%s,#$%02X", pOperand[0], szIndex, pOperand[1]);
+            break;
+        case OPFMT_BRBIT_DIR:
+            formatAddress(pszOperand, pOperand[0], true);
+            formatAddress(szAddr, nTarget, false);
+            sprintf(pszOperand + strlen(pszOperand), ",#$%02X,%s", pOperand[1], szAddr);
+            break;
+        case OPFMT_BRBIT_IDX:
+            formatAddress(szAddr, nTarget, false);
+            sprintf(pszOperand, "$%02X%s,#$%02X,%s", pOperand[0], szIndex, pOperand[1], szAddr);
+            break;
+        case OPFMT_NONE:
+        default:
+            *pszOperand = '\0';
+            break;
+    }
+
+    return pEntry->pInst->numBytes;
+}
+
+
+// Disassemble every written byte of the memory image in address order (a linear sweep).  Gaps in the image start a
+// new ORG and bytes that don't decode are emitted as FCB.
+//
+int disassembleImage(UINT8 *pImage, UINT8 *pWritten, UINT16 nStartAddr, int fpOutput)
+{
+    int nRetVal = 0;
+    UINT32 nAddr = 0;
+    bool fInBlock = false;
+    LISTBUFFER output;
+    char szLine[MAX_LINE_LENGTH];
+    char szMneumonic[MAX_MNEUMONIC_LENGTH + 1];
+    char szOperand[(MAX_SYMBOL_NAME_LENGTH * 2) + 16];
+    char szBytes[16];
+
+    if (buildDecodeTables() < 0)
+        return -1;
+
+    memset(&output, 0, sizeof(LISTBUFFER));
+
+    // The start address comes from the S9 record - the assembler has no END directive, so note it in a comment.
+    //
+    formatAddress(szOperand, nStartAddr, false);
+    sprintf(szLine, "; Start address: %s ($%04X)\r\n\r\n", szOperand, nStartAddr);
+    if ((nRetVal = appendToBuffer(&output, szLine)) < 0)
+        goto Exit;
+
+    while (nAddr < MEM_IMAGE_SIZE)
+    {
+        int nLength;
+
+        if (!pWritten[nAddr])
+        {
+            fInBlock = false;
+            nAddr++;
+            continue;
+        }
+
+        if (!fInBlock)
+        {
+            sprintf(szLine, "%-15s ORG    $%04X\r\n", "", (UINT16)nAddr);
+            if ((nRetVal = appendToBuffer(&output, szLine)) < 0)
+                goto Exit;
+            fInBlock = true;
+        }
+
+        if (0 == (nLength = decodeInstruction(pImage, pWritten, (UINT16)nAddr, szMneumonic, szOperand)))
+        {
+            strcpy(szMneumonic, "FCB");
+            sprintf(szOperand, "$%02X", pImage[nAddr]);
+            nLength = 1;
+        }
+
+        szBytes[0] = '\0';
+        for (int i=0 ; i<nLength ; i++)
+        {
+            sprintf(szBytes + (i * 3), "%02X ", pImage[nAddr + i]);
+        }
+
+        szBytes[(nLength * 3) - 1] = '\0';
+        sprintf(szLine, "%-15s %-6s %-24s ; %04X  %s\r\n", (g_labelAt[nAddr] ? g_labelAt[nAddr] : ""), szMneumonic, szOperand, (UINT16)nAddr, szBytes);
+        if ((nRetVal = appendToBuffer(&output, szLine)) < 0)
+            goto Exit;
+
+        nAddr += nLength;
+    }
+
+    if (output.length && write(fpOutput, output.pBuffer, output.length) != output.length)
+    {
+        printf("ERROR: Disassembly file write failed\r\n");
+        nRetVal = -1;
+    }
+
+Exit:
+
+    if (output.pBuffer)
+        free(output.pBuffer);
+
+    return nRetVal;
+}
@@ -0,0 +1,12 @@
+//
+//  disasm.h
+//  MC68HC11 Assembler
+//
+//  Table-driven disassembler.
+//
+
+int buildDecodeTables(void);
+int loadDisassemblySymbols(const char *pszFileName);
+INSTRUCTION *decodeOpcode(UINT8 *pImage, UINT8 *pWritten, UINT16 nAddr);
+int decodeInstruction(UINT8 *pImage, UINT8 *pWritten, UINT16 nAddr, char *pszMneumonic, char *pszOperand);
+int disassembleImage(UINT8 *pImage, UINT8 *pWritten, UINT16 nStartAddr, int fpOutput);
@@ -0,0 +1,298 @@
+//
+//  linemap.c
+//  MC68HC11 Assembler
+//
+//  Line map output - maps every address pass 2 encoded back to the source file and line, for trace tools and the
+//  simulator.  The entries are sorted by address and delta encoded in blocks behind a block index (see LINEMAPHEADER),
+//  so the file stays compact and can still be searched without decoding all of it.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utility.h"
+#include "linemap.h"
+
+// Largest encoding of one entry - four LEB128 values of at most 5 bytes each.
+//
+#define LINEMAP_MAX_ENTRY_BYTES     20
+
+typedef struct _linemapentry_
+{
+    UINT16 addr;
+    UINT16 numBytes;
+    UINT16 fileIndex;
+    int    lineNumber;
+} LINEMAPENTRY;
+
+
+// Address order, with the line order breaking ties (ORG blocks can overlap).
+//
+int compareLineMapEntries(const void *pLeft, const void *pRight)
+{
+    const LINEMAPENTRY *pLeftEntry  = (const LINEMAPENTRY *)pLeft;
+    const LINEMAPENTRY *pRightEntry = (const LINEMAPENTRY *)pRight;
+
+    if (pLeftEntry->addr != pRightEntry->addr)
+        return (pLeftEntry->addr < pRightEntry->addr ? -1 : 1);
+    if (pLeftEntry->fileIndex != pRightEntry->fileIndex)
+        return (pLeftEntry->fileIndex < pRightEntry->fileIndex ? -1 : 1);
+
+    return (pLeftEntry->lineNumber < pRightEntry->lineNumber ? -1 : (pLeftEntry->lineNumber > pRightEntry->lineNumber ? 1 : 0));
+}
+
+
+// Append an unsigned LEB128 value (7 bits per byte, high bit set on every byte but the last).
+//
+int encodeValue(UINT8 *pData, UINT32 nValue)
+{
+    int nBytes = 0;
+
+    while (nValue >= 0x80)
+    {
+        pData[nBytes++] = (UINT8)(nValue | 0x80);
+        nValue >>= 7;
+    }
+    pData[nBytes++] = (UINT8)nValue;
+
+    return nBytes;
+}
+
+
+// Read an unsigned LEB128 value, advancing the data pointer (which is never moved past pEnd).
+//
+UINT32 decodeValue(const UINT8 **ppData, const UINT8 *pEnd)
+{
+    UINT32 nValue = 0;
+    int    nShift = 0;
+
+    while (*ppData < pEnd && nShift < 32)
+    {
+        UINT8 nByte = *(*ppData)++;
+
+        nValue |= ((UINT32)(nByte & 0x7F) << nShift);
+        if (!(nByte & 0x80))
+            break;
+        nShift += 7;
+    }
+
+    return nValue;
+}
+
+
+// Write the line map for the lines recorded by pass 2.  Every line comes from the main source file (file index 0)
+// until there are include files to list after it.
+//
+int writeLineMap(int fpLineMap, REGION *pRegions, int nRegions, const char *pszSourceName)
+{
+    LINEMAPHEADER header;
+    LINEMAPENTRY  *pEntries = NULL;
+    LINEMAPBLOCK  *pBlocks  = NULL;
+    UINT8         *pData    = NULL;
+    UINT32        nEntries  = 0;
+    UINT32        nBlocks;
+    UINT32        nDataSize = 0;
+    UINT32        nNameSize = (UINT32)strlen(pszSourceName) + 1;
+    int           nRetVal   = 0;
+
+    for (int i=0 ; i<nRegions ; i++)
+    {
+        for (int j=0 ; j<pRegions[i].lineCount ; j++)
+            nEntries += (pRegions[i].pLines[j].numBytes ? 1 : 0);
+    }
+    nBlocks = (nEntries + LINEMAP_BLOCK_ENTRIES - 1) / LINEMAP_BLOCK_ENTRIES;
+
+    if (NULL == (pEntries = (LINEMAPENTRY *)malloc(sizeof(LINEMAPENTRY) * (nEntries ? nEntries : 1))) ||
+        NULL == (pBlocks = (LINEMAPBLOCK *)calloc((nBlocks ? nBlocks : 1), sizeof(LINEMAPBLOCK))) ||
+        NULL == (pData = (UINT8 *)malloc(LINEMAP_MAX_ENTRY_BYTES * (nEntries ? nEntries : 1))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(LINEMAP_MAX_ENTRY_BYTES * nEntries));
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    nEntries = 0;
+    for (int i=0 ; i<nRegions ; i++)
+    {
+        for (int j=0 ; j<pRegions[i].lineCount ; j++)
+        {
+            LINERECORD *pLine = &pRegions[i].pLines[j];
+
+            if (0 == pLine->numBytes)
+                continue;
+
+            pEntries[nEntries].addr       = pLine->addr;
+            pEntries[nEntries].numBytes   = pLine->numBytes;
+            pEntries[nEntries].fileIndex  = 0;
+            pEntries[nEntries].lineNumber = pLine->lineNumber;
+            nEntries++;
+        }
+    }
+    qsort(pEntries, nEntries, sizeof(LINEMAPENTRY), compareLineMapEntries);
+
+    for (UINT32 i=0 ; i<nEntries ; i++)
+    {
+        LINEMAPBLOCK *pBlock = &pBlocks[i / LINEMAP_BLOCK_ENTRIES];
+        LINEMAPENTRY *pPrev  = &pEntries[i];
+        int nLineDelta;
+        UINT32 nZigZag;
+
+        // The block index holds the first entry, so its deltas are all zero.
+        //
+        if (0 == (i % LINEMAP_BLOCK_ENTRIES))
+        {
+            pBlock->addr       = pEntries[i].addr;
+            pBlock->fileIndex  = pEntries[i].fileIndex;
+            pBlock->lineNumber = (UINT32)pEntries[i].lineNumber;
+            pBlock->dataOffset = nDataSize;
+        }
+        else
+            pPrev = &pEntries[i - 1];
+        pBlock->entryCount++;
+
+        nLineDelta = pEntries[i].lineNumber - pPrev->lineNumber;
+        nZigZag    = (nLineDelta < 0 ? (((UINT32)-nLineDelta << 1) - 1) : ((UINT32)nLineDelta << 1));
+
+        nDataSize += encodeValue(pData + nDataSize, (UINT32)(pEntries[i].addr - pPrev->addr));
+        nDataSize += encodeValue(pData + nDataSize, (nZigZag << 1) | (pEntries[i].fileIndex != pPrev->fileIndex ? 1 : 0));
+        if (pEntries[i].fileIndex != pPrev->fileIndex)
+            nDataSize += encodeValue(pData + nDataSize, pEntries[i].fileIndex);
+        nDataSize += encodeValue(pData + nDataSize, pEntries[i].numBytes);
+    }
+
+    memset(&header, 0, sizeof(LINEMAPHEADER));
+    strncpy(header.magic, LINEMAP_MAGIC, sizeof(header.magic));
+    header.version          = LINEMAP_VERSION;
+    header.byteOrder        = SNAPSHOT_BYTE_ORDER;
+    header.headerSize       = sizeof(LINEMAPHEADER);
+    header.fileCount        = 1;
+    header.entryCount       = nEntries;
+    header.blockCount       = nBlocks;
+    header.fileTableOffset  = sizeof(LINEMAPHEADER);
+    header.blockIndexOffset = header.fileTableOffset + ((nNameSize + 3) & ~3);
+    header.dataOffset       = header.blockIndexOffset + (sizeof(LINEMAPBLOCK) * nBlocks);
+    header.dataSize         = nDataSize;
+
+    // The file name table is padded so the block index stays aligned when the file is mapped.
+    //
+    {
+        UINT8 padding[4] = { 0, 0, 0, 0 };
+        int   nPadding   = (int)(header.blockIndexOffset - header.fileTableOffset - nNameSize);
+
+        if (write(fpLineMap, &header, sizeof(LINEMAPHEADER)) != sizeof(LINEMAPHEADER) ||
+            write(fpLineMap, pszSourceName, nNameSize) != (ssize_t)nNameSize ||
+            (nPadding && write(fpLineMap, padding, nPadding) != nPadding) ||
+            (nBlocks && write(fpLineMap, pBlocks, (sizeof(LINEMAPBLOCK) * nBlocks)) != (ssize_t)(sizeof(LINEMAPBLOCK) * nBlocks)) ||
+            (nDataSize && write(fpLineMap, pData, nDataSize) != (ssize_t)nDataSize))
+        {
+            printf("ERROR: Line map file write failed\r\n");
+            nRetVal = -1;
+        }
+    }
+
+Exit:
+
+    if (pEntries)
+        free(pEntries);
+    if (pBlocks)
+        free(pBlocks);
+    if (pData)
+        free(pData);
+
+    return nRetVal;
+}
+
+
+// Check that a mapped line map file was written by this version on a host with the same byte order, and that its
+// sections fit in the file.
+//
+bool isValidLineMap(const void *pFile, UINT32 nFileSize)
+{
+    const LINEMAPHEADER *pHeader = (const LINEMAPHEADER *)pFile;
+
+    return (nFileSize >= sizeof(LINEMAPHEADER) && !strncmp(pHeader->magic, LINEMAP_MAGIC, sizeof(pHeader->magic)) &&
+            pHeader->version == LINEMAP_VERSION && pHeader->byteOrder == SNAPSHOT_BYTE_ORDER &&
+            pHeader->headerSize == sizeof(LINEMAPHEADER) && pHeader->fileTableOffset <= pHeader->blockIndexOffset &&
+            pHeader->blockIndexOffset + ((UINT32)sizeof(LINEMAPBLOCK) * pHeader->blockCount) <= pHeader->dataOffset &&
+            pHeader->dataOffset + pHeader->dataSize <= nFileSize);
+}
+
+
+// Find the source file and line that encoded the byte at an address in a mapped line map file.  Returns false if no
+// line encoded it.
+//
+bool findLineByAddress(const void *pFile, UINT16 nAddr, const char **ppszFileName, int *pnLineNumber)
+{
+    const LINEMAPHEADER *pHeader = (const LINEMAPHEADER *)pFile;
+    const LINEMAPBLOCK  *pBlocks = (const LINEMAPBLOCK *)((const char *)pFile + pHeader->blockIndexOffset);
+    const UINT8         *pData;
+    const UINT8         *pEnd    = (const UINT8 *)pFile + pHeader->dataOffset + pHeader->dataSize;
+    const char          *pszName = (const char *)pFile + pHeader->fileTableOffset;
+    int    nLow   = 0;
+    int    nHigh  = (int)pHeader->blockCount - 1;
+    int    nBlock = -1;
+    UINT32 nEntryAddr;
+    UINT32 nFileIndex;
+    int    nLineNumber;
+    bool   fFound = false;
+
+    while (nLow <= nHigh)
+    {
+        int nMiddle = (nLow + nHigh) / 2;
+
+        if (pBlocks[nMiddle].addr <= nAddr)
+        {
+            nBlock = nMiddle;
+            nLow   = nMiddle + 1;
+        }
+        else
+            nHigh = nMiddle - 1;
+    }
+
+    if (nBlock < 0)
+        return false;
+
+    // Decode the block, keeping the last line whose bytes cover the address.
+    //
+    pData       = (const UINT8 *)pFile + pHeader->dataOffset + pBlocks[nBlock].dataOffset;
+    nEntryAddr  = pBlocks[nBlock].addr;
+    nFileIndex  = pBlocks[nBlock].fileIndex;
+    nLineNumber = (int)pBlocks[nBlock].lineNumber;
+
+    for (UINT32 i=0 ; i<pBlocks[nBlock].entryCount && pData < pEnd ; i++)
+    {
+        UINT32 nLineField;
+        UINT32 nZigZag;
+        UINT32 nBytes;
+
+        nEntryAddr += decodeValue(&pData, pEnd);
+        if (nEntryAddr > nAddr)
+            break;
+
+        nLineField   = decodeValue(&pData, pEnd);
+        nZigZag      = (nLineField >> 1);
+        nLineNumber += ((nZigZag & 1) ? -(int)((nZigZag + 1) >> 1) : (int)(nZigZag >> 1));
+        if (nLineField & 1)
+            nFileIndex = decodeValue(&pData, pEnd);
+        nBytes = decodeValue(&pData, pEnd);
+
+        if (nAddr < nEntryAddr + nBytes)
+        {
+            fFound        = true;
+            *pnLineNumber = nLineNumber;
+            if (ppszFileName)
+            {
+                const char *pszFile = pszName;
+
+                for (UINT32 nFile=0 ; nFile < nFileIndex && nFile < pHeader->fileCount ; nFile++)
+                    pszFile += strlen(pszFile) + 1;
+                *ppszFileName = pszFile;
+            }
+        }
+    }
+
+    return fFound;
+}
@@ -0,0 +1,10 @@
+//
+//  linemap.h
+//  MC68HC11 Assembler
+//
+//  Line-to-address map for trace tools and simulators.
+//
+
+int writeLineMap(int fpLineMap, REGION *pRegions, int nRegions, const char *pszSourceName);
+bool isValidLineMap(const void *pFile, UINT32 nFileSize);
+bool findLineByAddress(const void *pFile, UINT16 nAddr, const char **ppszFileName, int *pnLineNumber);
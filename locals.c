@@ -0,0 +1,940 @@
+//
+//  locals.c
+//  MC68HC11 Assembler
+//
+//  Overlaid subroutine locals (LOCALS/ENDLOCALS).  A routine's scratch variables are declared as RMBs in a block that
+//  follows its label, and are placed in the area given by LOCALRAM rather than at the location counter:
+//
+//              LOCALRAM $0000,$01FF
+//      ...
+//      SEND    LOCALS
+//      COUNT   RMB 1
+//      PTR     RMB 2
+//              ENDLOCALS
+//              LDAA COUNT
+//
+//  The blocks are overlaid by following the static call graph.  A routine's variables only have to stay clear of those of
+//  the routines that may be active underneath it, so routines that are never active at the same time share bytes.  The
+//  most referenced variables are placed in page zero while it has room, so those references can use direct addressing.
+//
+//  The graph is read from the statements before the walk.  A routine starts at a label that's called (JSR/BSR), owns a
+//  LOCALS block, is START, or has its address taken (FDB, or an immediate operand such as LDX #ISR).  Calls, jumps and
+//  branches to another routine's labels, and falling through into the next routine, are its edges.  A routine that's
+//  entered some other way - START, interrupt vectors, jump tables - is a root and may interrupt any other, so each root's
+//  call tree is overlaid in an area of its own, and a routine reached from more than one root isn't overlaid at all.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utility.h"
+#include "locals.h"
+
+extern LOCALVAR *g_localVars;
+extern int g_localVarCount;
+extern int g_localVarsAllocated;
+extern void getStatementSpan(SOURCEFILE *pSourceFile, CHUNK *pChunk, STATEMENT *pStmt, char *pszSpan);
+extern void getParamValue(char *pszParamString, char *pszValue);
+
+#define LOCAL_TIER_PAGE_ZERO    0           // Variables placed in page zero
+#define LOCAL_TIER_RAM          1           // Variables placed above it
+#define LOCAL_ARENA_NONE        -1          // Not reached from any root
+#define LOCAL_ARENA_SHARED      -2          // Reached from more than one root (not overlaid)
+
+#define LOCAL_ENTRY_CALLED      0x01        // Called by JSR/BSR or owns a LOCALS block
+#define LOCAL_ENTRY_ADDRESS     0x02        // Address taken (or START) - a root
+
+typedef struct _localname_
+{
+    char name[MAX_SYMBOL_NAME_LENGTH];
+    int  value;                 // Routine index (labels) or LOCAL_ENTRY_xxx flags (entry names)
+} LOCALNAME;
+
+typedef struct _localroutine_
+{
+    char name[MAX_SYMBOL_NAME_LENGTH];
+    int  lineNumber;
+    bool fRoot;
+    int  arena;                 // Root whose call tree holds the routine, or LOCAL_ARENA_xxx
+    int  size[2];               // Variable bytes in each tier
+    int  offset[2];             // Offset of the routine's variables in each tier
+} LOCALROUTINE;
+
+typedef struct _localedge_
+{
+    int from;
+    int to;
+} LOCALEDGE;
+
+typedef struct _localtransfer_
+{
+    int  routine;
+    char name[MAX_SYMBOL_NAME_LENGTH];
+    bool fCall;
+} LOCALTRANSFER;
+
+LOCALNAME     *g_localEntries;      // Names that start a routine, sorted
+int           g_localEntryCount;
+int           g_localEntriesAllocated;
+LOCALNAME     *g_localLabels;       // Labels and the routine each is in, sorted
+int           g_localLabelCount;
+int           g_localLabelsAllocated;
+LOCALROUTINE  *g_localRoutines;
+int           g_localRoutineCount;
+int           g_localRoutinesAllocated;
+LOCALEDGE     *g_localEdges;        // Sorted by the calling routine
+int           g_localEdgeCount;
+int           g_localEdgesAllocated;
+LOCALTRANSFER *g_localTransfers;    // Calls and jumps by name, resolved once every label is known
+int           g_localTransferCount;
+int           g_localTransfersAllocated;
+int           *g_pEdgeStart;        // First edge of each routine (routine count + 1 entries)
+int           *g_pVarRoutine;       // Routine of each variable
+bool          *g_pVarPageZero;      // Variable placed in page zero
+
+UINT16        g_localRamStart;
+UINT16        g_localRamEnd;
+bool          g_fLocalRam;
+int           g_localBytesUnshared; // Variable bytes before overlaying
+int           g_localBytesUsed;     // LOCALRAM bytes used
+int           g_localPageZeroCount;
+
+
+// Make room for one more element in an array, doubling its allocation when it's full.
+//
+void *growLocalArray(void *pArray, int nCount, int *pnAllocated, int nElementSize)
+{
+    void *pTemp;
+    int  nNewCount;
+
+    if (nCount < *pnAllocated)
+        return pArray;
+
+    nNewCount = (*pnAllocated ? *pnAllocated * 2 : 64);
+    if (NULL == (pTemp = realloc(pArray, (size_t)nElementSize * nNewCount)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", nElementSize * nNewCount);
+        return NULL;
+    }
+    *pnAllocated = nNewCount;
+
+    return pTemp;
+}
+
+
+int compareLocalNames(const void *pLeft, const void *pRight)
+{
+    return strcmp(((const LOCALNAME *)pLeft)->name, ((const LOCALNAME *)pRight)->name);
+}
+
+
+int compareLocalEdges(const void *pLeft, const void *pRight)
+{
+    const LOCALEDGE *pLeftEdge  = (const LOCALEDGE *)pLeft;
+    const LOCALEDGE *pRightEdge = (const LOCALEDGE *)pRight;
+
+    if (pLeftEdge->from != pRightEdge->from)
+        return (pLeftEdge->from < pRightEdge->from ? -1 : 1);
+
+    return (pLeftEdge->to < pRightEdge->to ? -1 : (pLeftEdge->to > pRightEdge->to ? 1 : 0));
+}
+
+
+// Returns the sorted name list entry for a name, or NULL.
+//
+LOCALNAME *findLocalName(LOCALNAME *pNames, int nCount, const char *pszName)
+{
+    LOCALNAME key;
+
+    copySymbolName(key.name, pszName);
+
+    return (LOCALNAME *)bsearch(&key, pNames, nCount, sizeof(LOCALNAME), compareLocalNames);
+}
+
+
+int addLocalEntry(const char *pszName, int nFlags)
+{
+    LOCALNAME *pTemp;
+
+    if (NULL == (pTemp = growLocalArray(g_localEntries, g_localEntryCount, &g_localEntriesAllocated, sizeof(LOCALNAME))))
+        return -1;
+    g_localEntries = pTemp;
+
+    copySymbolName(g_localEntries[g_localEntryCount].name, pszName);
+    g_localEntries[g_localEntryCount].value = nFlags;
+    g_localEntryCount++;
+
+    return 0;
+}
+
+
+int addLocalEdge(int nFrom, int nTo)
+{
+    LOCALEDGE *pTemp;
+
+    if (NULL == (pTemp = growLocalArray(g_localEdges, g_localEdgeCount, &g_localEdgesAllocated, sizeof(LOCALEDGE))))
+        return -1;
+    g_localEdges = pTemp;
+
+    g_localEdges[g_localEdgeCount].from = nFrom;
+    g_localEdges[g_localEdgeCount].to   = nTo;
+    g_localEdgeCount++;
+
+    return 0;
+}
+
+
+int addLocalRoutine(const char *pszName, int nLineNumber, bool fRoot)
+{
+    LOCALROUTINE *pTemp;
+
+    if (NULL == (pTemp = growLocalArray(g_localRoutines, g_localRoutineCount, &g_localRoutinesAllocated, sizeof(LOCALROUTINE))))
+        return -1;
+    g_localRoutines = pTemp;
+
+    memset(&g_localRoutines[g_localRoutineCount], 0, sizeof(LOCALROUTINE));
+    copySymbolName(g_localRoutines[g_localRoutineCount].name, pszName);
+    g_localRoutines[g_localRoutineCount].lineNumber = nLineNumber;
+    g_localRoutines[g_localRoutineCount].fRoot      = fRoot;
+    g_localRoutines[g_localRoutineCount].arena      = LOCAL_ARENA_NONE;
+
+    return g_localRoutineCount++;
+}
+
+
+// Returns true if a call or jump operand names its target directly (not an immediate or indexed operand).
+//
+bool isDirectOperand(char *pszOperand)
+{
+    return ('#' != *pszOperand && NULL == strchr(pszOperand, ','));
+}
+
+
+// First scan - the LOCALRAM area, the variables of each LOCALS block and the names that start a routine.
+//
+int collectLocalBlocks(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks)
+{
+    char szParam[MAX_LINE_LENGTH];
+    char szValue[MAX_SYMBOL_NAME_LENGTH];
+    int  nLineBase  = 0;
+    int  nBlockLine = 0;
+    STATEMENT *pOwner = NULL;
+
+    if (addLocalEntry(START_SYMBOL_NAME, LOCAL_ENTRY_ADDRESS))
+        return -1;
+
+    for (int nChunk=0 ; nChunk < nChunks ; nChunk++)
+    {
+        CHUNK *pChunk = &pChunks[nChunk];
+
+        for (int nStmt=0 ; nStmt < pChunk->statementCount ; nStmt++)
+        {
+            STATEMENT *pStmt = &pChunk->pStatements[nStmt];
+            STATEMENT *pPrev = (nStmt ? pStmt - 1 : NULL);
+            STATEMENT *pNext = (nStmt + 1 < pChunk->statementCount ? pStmt + 1 : NULL);
+            int       nLineNumber = nLineBase + pStmt->lineNumber;
+
+            switch (pStmt->kind)
+            {
+                // The walk reports parse errors, so the locals are left unplaced.
+                //
+                case STMT_ERROR:
+                    return 1;
+
+                case STMT_LOCALRAM:
+                    getStatementSpan(pSourceFile, pChunk, pStmt, szParam);
+                    parseAddressRange(szParam, &g_localRamStart, &g_localRamEnd);
+                    g_fLocalRam = true;
+                    continue;
+
+                // The parser only accepts LOCALS after a label.
+                //
+                case STMT_LOCALS:
+                    if (pOwner)
+                    {
+                        printf("ERROR: LOCALS on line %d is inside the LOCALS block of line %d\r\n", nLineNumber, nBlockLine);
+                        return -1;
+                    }
+                    pOwner     = pPrev;
+                    nBlockLine = nLineNumber;
+                    if (addLocalEntry(pOwner->symbolName, LOCAL_ENTRY_CALLED))
+                        return -1;
+                    continue;
+
+                case STMT_ENDLOCALS:
+                    if (NULL == pOwner)
+                    {
+                        printf("ERROR: ENDLOCALS on line %d doesn\'t follow a LOCALS\r\n", nLineNumber);
+                        return -1;
+                    }
+                    pOwner = NULL;
+                    continue;
+
+                default:
+                    break;
+            }
+
+            if (pOwner)
+            {
+                switch (pStmt->kind)
+                {
+                    case STMT_EQU:
+                    case STMT_EQU_STRING:
+                        break;
+
+                    case STMT_LABEL:
+                        if (NULL == pNext || pNext->kind != STMT_RMB || pNext->lineOffset != pStmt->lineOffset || pNext->macroLine != pStmt->macroLine)
+                        {
+                            printf("ERROR: Label on line %d doesn\'t name an RMB in the LOCALS block\r\n", nLineNumber);
+                            return -1;
+                        }
+                        break;
+
+                    case STMT_RMB:
+                    {
+                        LOCALVAR *pVar;
+
+                        if (NULL == (pVar = growLocalArray(g_localVars, g_localVarCount, &g_localVarsAllocated, sizeof(LOCALVAR))))
+                            return -1;
+                        g_localVars = pVar;
+
+                        pVar = &g_localVars[g_localVarCount++];
+                        memset(pVar, 0, sizeof(LOCALVAR));
+                        pVar->lineOffset = pStmt->lineOffset;
+                        pVar->macroLine  = pStmt->macroLine;
+                        pVar->lineNumber = nLineNumber;
+                        pVar->size       = pStmt->value;
+                        copySymbolName(pVar->routine, pOwner->symbolName);
+                        if (pPrev && pPrev->kind == STMT_LABEL && pPrev->lineOffset == pStmt->lineOffset && pPrev->macroLine == pStmt->macroLine)
+                            copySymbolName(pVar->name, pPrev->symbolName);
+                        break;
+                    }
+
+                    default:
+                        printf("ERROR: Only RMB variables can be placed in a LOCALS block (line %d)\r\n", nLineNumber);
+                        return -1;
+                }
+                continue;
+            }
+
+            // Called names start a routine, and so do names whose address is taken (they may be entered without a call).
+            //
+            if (pStmt->kind == STMT_DEFERRED && pStmt->pInst)
+            {
+                getStatementSpan(pSourceFile, pChunk, pStmt, szParam);
+                getParamValue(szParam, szValue);
+
+                if ('#' == *szParam)
+                {
+                    if (addLocalEntry(szValue, LOCAL_ENTRY_ADDRESS))
+                        return -1;
+                }
+                else if (isDirectOperand(szParam) && (!strcmp(pStmt->pInst->mnemonic, "JSR") || !strcmp(pStmt->pInst->mnemonic, "BSR")))
+                {
+                    if (addLocalEntry(szValue, LOCAL_ENTRY_CALLED))
+                        return -1;
+                }
+            }
+            else if (pStmt->kind == STMT_SIZED && NULL == pStmt->pInst && pStmt->spanLength)
+            {
+                char *pszContext;
+
+                // FDB values (vectors and jump tables).
+                //
+                getStatementSpan(pSourceFile, pChunk, pStmt, szParam);
+                for (char *pszValue = strtok_r(szParam, ",", &pszContext) ; pszValue ; pszValue = strtok_r(NULL, ",", &pszContext))
+                {
+                    if (isValidSymbolName(pszValue) && addLocalEntry(pszValue, LOCAL_ENTRY_ADDRESS))
+                        return -1;
+                }
+            }
+        }
+
+        nLineBase += pChunk->lineCount;
+    }
+
+    if (pOwner)
+    {
+        printf("ERROR: LOCALS on line %d has no ENDLOCALS\r\n", nBlockLine);
+        return -1;
+    }
+
+    // Sort the entry names, merging the flags of repeated names.
+    //
+    qsort(g_localEntries, g_localEntryCount, sizeof(LOCALNAME), compareLocalNames);
+    {
+        int nCount = 0;
+
+        for (int i=0 ; i<g_localEntryCount ; i++)
+        {
+            if (nCount && !strcmp(g_localEntries[nCount - 1].name, g_localEntries[i].name))
+                g_localEntries[nCount - 1].value |= g_localEntries[i].value;
+            else
+                g_localEntries[nCount++] = g_localEntries[i];
+        }
+        g_localEntryCount = nCount;
+    }
+
+    return 0;
+}
+
+
+// Second scan - split the code into routines, record the calls and jumps between them and count the direct references
+// to each variable.
+//
+int buildLocalCallGraph(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks)
+{
+    char szParam[MAX_LINE_LENGTH];
+    char szValue[MAX_SYMBOL_NAME_LENGTH];
+    LOCALNAME *pVarNames = NULL;
+    int  nVarNames  = 0;
+    int  nLineBase  = 0;
+    int  nCurrent;
+    int  nRetVal    = 0;
+    bool fInBlock   = false;
+    bool fTerminated = true;            // Last instruction doesn't fall through (or there's been none)
+
+    // Code ahead of the first routine is a routine of its own.
+    //
+    if ((nCurrent = addLocalRoutine("(top)", 0, true)) < 0 ||
+        NULL == (pVarNames = (LOCALNAME *)malloc(sizeof(LOCALNAME) * (g_localVarCount ? g_localVarCount : 1))))
+    {
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    for (int i=0 ; i<g_localVarCount ; i++)
+    {
+        if (g_localVars[i].name[0])
+        {
+            copySymbolName(pVarNames[nVarNames].name, g_localVars[i].name);
+            pVarNames[nVarNames++].value = i;
+        }
+    }
+    qsort(pVarNames, nVarNames, sizeof(LOCALNAME), compareLocalNames);
+
+    for (int nChunk=0 ; nChunk < nChunks ; nChunk++)
+    {
+        CHUNK *pChunk = &pChunks[nChunk];
+
+        for (int nStmt=0 ; nStmt < pChunk->statementCount ; nStmt++)
+        {
+            STATEMENT *pStmt = &pChunk->pStatements[nStmt];
+            LOCALNAME *pName;
+            char      *pszMneumonic;
+
+            if (pStmt->kind == STMT_LOCALS || pStmt->kind == STMT_ENDLOCALS)
+                fInBlock = (pStmt->kind == STMT_LOCALS);
+
+            if (fInBlock)
+                continue;
+
+            if (pStmt->kind == STMT_LABEL)
+            {
+                LOCALNAME *pTemp;
+
+                if (NULL != (pName = findLocalName(g_localEntries, g_localEntryCount, pStmt->symbolName)))
+                {
+                    int nRoutine = addLocalRoutine(pStmt->symbolName, nLineBase + pStmt->lineNumber, (pName->value & LOCAL_ENTRY_ADDRESS) != 0);
+
+                    if (nRoutine < 0 || (!fTerminated && addLocalEdge(nCurrent, nRoutine)))
+                    {
+                        nRetVal = -1;
+                        goto Exit;
+                    }
+                    nCurrent    = nRoutine;
+                    fTerminated = false;
+                }
+
+                if (NULL == (pTemp = growLocalArray(g_localLabels, g_localLabelCount, &g_localLabelsAllocated, sizeof(LOCALNAME))))
+                {
+                    nRetVal = -1;
+                    goto Exit;
+                }
+                g_localLabels = pTemp;
+                copySymbolName(g_localLabels[g_localLabelCount].name, pStmt->symbolName);
+                g_localLabels[g_localLabelCount++].value = nCurrent;
+                continue;
+            }
+
+            if ((pStmt->kind != STMT_SIZED && pStmt->kind != STMT_DEFERRED) || NULL == pStmt->pInst)
+                continue;
+
+            pszMneumonic = pStmt->pInst->mnemonic;
+            fTerminated  = (!strcmp(pszMneumonic, "RTS") || !strcmp(pszMneumonic, "RTI") || !strcmp(pszMneumonic, "JMP") ||
+                            !strcmp(pszMneumonic, "BRA"));
+
+            if (pStmt->kind != STMT_DEFERRED)
+                continue;
+
+            getStatementSpan(pSourceFile, pChunk, pStmt, szParam);
+            getParamValue(szParam, szValue);
+            if (!isDirectOperand(szParam))
+                continue;
+
+            if (NULL != (pName = findLocalName(pVarNames, nVarNames, szValue)))
+                g_localVars[pName->value].references++;
+
+            if (!strcmp(pszMneumonic, "JSR") || !strcmp(pszMneumonic, "JMP") || pStmt->pInst->addrMode == REL)
+            {
+                LOCALTRANSFER *pTemp;
+
+                if (NULL == (pTemp = growLocalArray(g_localTransfers, g_localTransferCount, &g_localTransfersAllocated, sizeof(LOCALTRANSFER))))
+                {
+                    nRetVal = -1;
+                    goto Exit;
+                }
+                g_localTransfers = pTemp;
+                g_localTransfers[g_localTransferCount].routine = nCurrent;
+                g_localTransfers[g_localTransferCount].fCall   = (!strcmp(pszMneumonic, "JSR") || !strcmp(pszMneumonic, "BSR"));
+                copySymbolName(g_localTransfers[g_localTransferCount].name, szValue);
+                g_localTransferCount++;
+            }
+        }
+
+        nLineBase += pChunk->lineCount;
+    }
+
+    // A jump to another routine's label (or a call to any label) is an edge.  Names that aren't labels are outside the
+    // source (ROM routines, equates).
+    //
+    qsort(g_localLabels, g_localLabelCount, sizeof(LOCALNAME), compareLocalNames);
+    for (int i=0 ; i<g_localTransferCount ; i++)
+    {
+        LOCALNAME *pLabel = findLocalName(g_localLabels, g_localLabelCount, g_localTransfers[i].name);
+
+        if (pLabel && (g_localTransfers[i].fCall || pLabel->value != g_localTransfers[i].routine) &&
+            addLocalEdge(g_localTransfers[i].routine, pLabel->value))
+        {
+            nRetVal = -1;
+            goto Exit;
+        }
+    }
+
+    qsort(g_localEdges, g_localEdgeCount, sizeof(LOCALEDGE), compareLocalEdges);
+    if (NULL == (g_pEdgeStart = (int *)calloc(g_localRoutineCount + 1, sizeof(int))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(int) * (g_localRoutineCount + 1)));
+        nRetVal = -1;
+        goto Exit;
+    }
+    for (int i=0, nEdge=0 ; i <= g_localRoutineCount ; i++)
+    {
+        while (nEdge < g_localEdgeCount && g_localEdges[nEdge].from < i)
+            nEdge++;
+        g_pEdgeStart[i] = nEdge;
+    }
+
+Exit:
+
+    if (pVarNames)
+        free(pVarNames);
+
+    return nRetVal;
+}
+
+
+// Walk the call graph from a routine, marking what it reaches.  Returns true if it reaches nTarget.
+//
+bool reachLocalRoutines(int nFrom, int nTarget, int *pStack, bool *pReached)
+{
+    int  nDepth = 0;
+    bool fFound = false;
+
+    memset(pReached, 0, sizeof(bool) * g_localRoutineCount);
+    pStack[nDepth++] = nFrom;
+
+    while (nDepth)
+    {
+        int nRoutine = pStack[--nDepth];
+
+        for (int i=g_pEdgeStart[nRoutine] ; i < g_pEdgeStart[nRoutine + 1] ; i++)
+        {
+            int nTo = g_localEdges[i].to;
+
+            if (nTo == nTarget)
+                fFound = true;
+            if (!pReached[nTo])
+            {
+                pReached[nTo]     = true;
+                pStack[nDepth++] = nTo;
+            }
+        }
+    }
+
+    return fFound;
+}
+
+
+// Place each routine in the call tree of the root that reaches it, and reject recursion through a routine with
+// variables (its variables would be overwritten by the call).
+//
+int assignLocalArenas(void)
+{
+    int  *pStack   = (int *)malloc(sizeof(int) * (g_localRoutineCount + 1));
+    bool *pReached = (bool *)malloc(sizeof(bool) * (g_localRoutineCount + 1));
+    int  nRetVal   = 0;
+
+    if (NULL == pStack || NULL == pReached)
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)((sizeof(int) + sizeof(bool)) * (g_localRoutineCount + 1)));
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    // A routine nothing calls can only be entered some other way.
+    //
+    for (int i=0 ; i<g_localEdgeCount ; i++)
+        g_localRoutines[g_localEdges[i].to].arena = 0;
+    for (int i=0 ; i<g_localRoutineCount ; i++)
+    {
+        if (g_localRoutines[i].arena == LOCAL_ARENA_NONE)
+            g_localRoutines[i].fRoot = true;
+        g_localRoutines[i].arena = LOCAL_ARENA_NONE;
+    }
+
+    for (int nRoot=0 ; nRoot < g_localRoutineCount ; nRoot++)
+    {
+        if (!g_localRoutines[nRoot].fRoot)
+            continue;
+
+        reachLocalRoutines(nRoot, -1, pStack, pReached);
+        pReached[nRoot] = true;
+
+        for (int i=0 ; i<g_localRoutineCount ; i++)
+        {
+            if (!pReached[i])
+                continue;
+            g_localRoutines[i].arena = (g_localRoutines[i].arena == LOCAL_ARENA_NONE ? nRoot : LOCAL_ARENA_SHARED);
+        }
+    }
+
+    for (int i=0 ; i<g_localRoutineCount ; i++)
+    {
+        if (g_localRoutines[i].arena == LOCAL_ARENA_NONE)
+            g_localRoutines[i].arena = LOCAL_ARENA_SHARED;
+
+        if ((g_localRoutines[i].size[LOCAL_TIER_PAGE_ZERO] + g_localRoutines[i].size[LOCAL_TIER_RAM]) &&
+            reachLocalRoutines(i, i, pStack, pReached))
+        {
+            printf("ERROR: Routine \'%s\' on line %d has LOCALS but can call itself\r\n", g_localRoutines[i].name, g_localRoutines[i].lineNumber);
+            nRetVal = -1;
+            goto Exit;
+        }
+    }
+
+Exit:
+
+    if (pStack)
+        free(pStack);
+    if (pReached)
+        free(pReached);
+
+    return nRetVal;
+}
+
+
+// Lay out one tier and return the bytes it needs.  Within a root's call tree each routine's variables follow those of
+// every routine that can call it (the longest path, which is well defined since only routines without variables can be
+// recursive); the trees then follow one another, and the routines reached from more than one root come last.
+//
+int layoutLocalTier(int nTier)
+{
+    int  nTotal = 0;
+    bool fChanged;
+
+    for (int i=0 ; i<g_localRoutineCount ; i++)
+        g_localRoutines[i].offset[nTier] = 0;
+
+    do
+    {
+        fChanged = false;
+        for (int i=0 ; i<g_localEdgeCount ; i++)
+        {
+            LOCALROUTINE *pFrom = &g_localRoutines[g_localEdges[i].from];
+            LOCALROUTINE *pTo   = &g_localRoutines[g_localEdges[i].to];
+
+            if (pFrom->arena >= 0 && pFrom->arena == pTo->arena && pFrom->offset[nTier] + pFrom->size[nTier] > pTo->offset[nTier])
+            {
+                pTo->offset[nTier] = pFrom->offset[nTier] + pFrom->size[nTier];
+                fChanged = true;
+            }
+        }
+    }
+    while (fChanged);
+
+    for (int nRoot=0 ; nRoot < g_localRoutineCount ; nRoot++)
+    {
+        int nExtent = 0;
+
+        if (g_localRoutines[nRoot].arena != nRoot)
+            continue;
+
+        for (int i=0 ; i<g_localRoutineCount ; i++)
+        {
+            if (g_localRoutines[i].arena != nRoot)
+                continue;
+            if (g_localRoutines[i].offset[nTier] + g_localRoutines[i].size[nTier] > nExtent)
+                nExtent = g_localRoutines[i].offset[nTier] + g_localRoutines[i].size[nTier];
+            g_localRoutines[i].offset[nTier] += nTotal;
+        }
+        nTotal += nExtent;
+    }
+
+    for (int i=0 ; i<g_localRoutineCount ; i++)
+    {
+        if (g_localRoutines[i].arena == LOCAL_ARENA_SHARED)
+        {
+            g_localRoutines[i].offset[nTier] = nTotal;
+            nTotal += g_localRoutines[i].size[nTier];
+        }
+    }
+
+    return nTotal;
+}
+
+
+// Most references first, then source order.
+//
+int compareLocalReferences(const void *pLeft, const void *pRight)
+{
+    int nLeft  = *(const int *)pLeft;
+    int nRight = *(const int *)pRight;
+
+    if (g_localVars[nLeft].references != g_localVars[nRight].references)
+        return (g_localVars[nLeft].references > g_localVars[nRight].references ? -1 : 1);
+
+    return (nLeft < nRight ? -1 : (nLeft > nRight ? 1 : 0));
+}
+
+
+void freeLocalGraph(void)
+{
+    if (g_localEntries)
+        free(g_localEntries);
+    if (g_localLabels)
+        free(g_localLabels);
+    if (g_localRoutines)
+        free(g_localRoutines);
+    if (g_localEdges)
+        free(g_localEdges);
+    if (g_localTransfers)
+        free(g_localTransfers);
+    if (g_pEdgeStart)
+        free(g_pEdgeStart);
+    if (g_pVarRoutine)
+        free(g_pVarRoutine);
+    if (g_pVarPageZero)
+        free(g_pVarPageZero);
+
+    g_localEntries   = NULL;
+    g_localLabels    = NULL;
+    g_localRoutines  = NULL;
+    g_localEdges     = NULL;
+    g_localTransfers = NULL;
+    g_pEdgeStart     = NULL;
+    g_pVarRoutine    = NULL;
+    g_pVarPageZero   = NULL;
+    g_localEntryCount   = g_localEntriesAllocated   = 0;
+    g_localLabelCount   = g_localLabelsAllocated    = 0;
+    g_localRoutineCount = g_localRoutinesAllocated  = 0;
+    g_localEdgeCount    = g_localEdgesAllocated     = 0;
+    g_localTransferCount = g_localTransfersAllocated = 0;
+}
+
+
+// Place the variables of every LOCALS block ahead of the statement walk, which binds their labels to the addresses in
+// the variable list.
+//
+int allocateLocals(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks)
+{
+    int    *pOrder   = NULL;
+    int    nRetVal   = 0;
+    int    nCapacity[2];
+    int    nNeeded[2];
+    UINT16 nTierBase[2];
+    bool   fLocals   = false;
+
+    // Most sources have no LOCALS blocks, so they're looked for before anything else.
+    //
+    for (int nChunk=0 ; nChunk < nChunks && !fLocals ; nChunk++)
+    {
+        for (int nStmt=0 ; nStmt < pChunks[nChunk].statementCount && !fLocals ; nStmt++)
+        {
+            STMTKIND kind = pChunks[nChunk].pStatements[nStmt].kind;
+
+            fLocals = (kind == STMT_LOCALS || kind == STMT_ENDLOCALS);
+        }
+    }
+    if (!fLocals)
+        return 0;
+
+    if (0 != (nRetVal = collectLocalBlocks(pSourceFile, pChunks, nChunks)))
+    {
+        nRetVal = (nRetVal > 0 ? 0 : nRetVal);
+        goto Exit;
+    }
+
+    if (!g_fLocalRam)
+    {
+        printf("ERROR: LOCALS blocks need a LOCALRAM area to be placed in\r\n");
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    if (0 != (nRetVal = buildLocalCallGraph(pSourceFile, pChunks, nChunks)))
+        goto Exit;
+
+    if (NULL == (g_pVarRoutine = (int *)malloc(sizeof(int) * (g_localVarCount + 1))) ||
+        NULL == (g_pVarPageZero = (bool *)calloc(g_localVarCount + 1, sizeof(bool))) ||
+        NULL == (pOrder = (int *)malloc(sizeof(int) * (g_localVarCount + 1))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(int) * (g_localVarCount + 1)));
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    // Every variable starts out above page zero.  A LOCALS label is a routine entry, so it's always found.
+    //
+    g_localBytesUnshared = 0;
+    for (int i=0 ; i<g_localVarCount ; i++)
+    {
+        LOCALNAME *pLabel = findLocalName(g_localLabels, g_localLabelCount, g_localVars[i].routine);
+
+        g_pVarRoutine[i] = (pLabel ? pLabel->value : 0);
+        g_localRoutines[g_pVarRoutine[i]].size[LOCAL_TIER_RAM] += g_localVars[i].size;
+        g_localBytesUnshared += g_localVars[i].size;
+        pOrder[i] = i;
+    }
+
+    if (0 != (nRetVal = assignLocalArenas()))
+        goto Exit;
+
+    nTierBase[LOCAL_TIER_PAGE_ZERO] = g_localRamStart;
+    nTierBase[LOCAL_TIER_RAM]       = (g_localRamStart > 0xFF ? g_localRamStart : 0x100);
+    nCapacity[LOCAL_TIER_PAGE_ZERO] = (g_localRamStart > 0xFF ? 0 : (g_localRamEnd > 0xFF ? 0xFF : g_localRamEnd) - g_localRamStart + 1);
+    nCapacity[LOCAL_TIER_RAM]       = (g_localRamEnd < 0x100 ? 0 : g_localRamEnd - nTierBase[LOCAL_TIER_RAM] + 1);
+
+    // Move the most referenced variables into page zero while the overlaid page zero tier still fits.
+    //
+    qsort(pOrder, g_localVarCount, sizeof(int), compareLocalReferences);
+    for (int i=0 ; i<g_localVarCount && nCapacity[LOCAL_TIER_PAGE_ZERO] ; i++)
+    {
+        LOCALROUTINE *pRoutine = &g_localRoutines[g_pVarRoutine[pOrder[i]]];
+        int          nSize     = g_localVars[pOrder[i]].size;
+
+        pRoutine->size[LOCAL_TIER_PAGE_ZERO] += nSize;
+        pRoutine->size[LOCAL_TIER_RAM]       -= nSize;
+        if (layoutLocalTier(LOCAL_TIER_PAGE_ZERO) <= nCapacity[LOCAL_TIER_PAGE_ZERO])
+        {
+            g_pVarPageZero[pOrder[i]] = true;
+            continue;
+        }
+        pRoutine->size[LOCAL_TIER_PAGE_ZERO] -= nSize;
+        pRoutine->size[LOCAL_TIER_RAM]       += nSize;
+    }
+
+    nNeeded[LOCAL_TIER_PAGE_ZERO] = layoutLocalTier(LOCAL_TIER_PAGE_ZERO);
+    nNeeded[LOCAL_TIER_RAM]       = layoutLocalTier(LOCAL_TIER_RAM);
+    if (nNeeded[LOCAL_TIER_RAM] > nCapacity[LOCAL_TIER_RAM])
+    {
+        printf("ERROR: Local variables need %d bytes outside page zero but LOCALRAM $%04X-$%04X only has %d\r\n", nNeeded[LOCAL_TIER_RAM],
+               g_localRamStart, g_localRamEnd, nCapacity[LOCAL_TIER_RAM]);
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    // Each routine's variables follow one another, in source order, from the routine's offset in their tier.
+    //
+    g_localPageZeroCount = 0;
+    for (int i=0 ; i<g_localVarCount ; i++)
+    {
+        int          nTier    = (g_pVarPageZero[i] ? LOCAL_TIER_PAGE_ZERO : LOCAL_TIER_RAM);
+        LOCALROUTINE *pRoutine = &g_localRoutines[g_pVarRoutine[i]];
+
+        g_localVars[i].addr = (UINT16)(nTierBase[nTier] + pRoutine->offset[nTier]);
+        pRoutine->offset[nTier] += g_localVars[i].size;
+        g_localPageZeroCount += (g_pVarPageZero[i] ? 1 : 0);
+    }
+    g_localBytesUsed = nNeeded[LOCAL_TIER_PAGE_ZERO] + nNeeded[LOCAL_TIER_RAM];
+
+Exit:
+
+    if (pOrder)
+        free(pOrder);
+    freeLocalGraph();
+
+    return nRetVal;
+}
+
+
+// Returns the variable list entry for an RMB line, or -1 if the line isn't in a LOCALS block (binary search).
+//
+int findLocalVariable(LOCALVAR *pVars, int nCount, int nLineOffset, int nMacroLine)
+{
+    int nLow  = 0;
+    int nHigh = nCount - 1;
+
+    while (nLow <= nHigh)
+    {
+        int nMid = (nLow + nHigh) / 2;
+
+        if (pVars[nMid].lineOffset == nLineOffset && pVars[nMid].macroLine == nMacroLine)
+            return nMid;
+
+        if (pVars[nMid].lineOffset < nLineOffset || (pVars[nMid].lineOffset == nLineOffset && pVars[nMid].macroLine < nMacroLine))
+            nLow = nMid + 1;
+        else
+            nHigh = nMid - 1;
+    }
+
+    return -1;
+}
+
+
+// Returns true if a source line, or any line of the macro expansion it starts, is a local variable.
+//
+bool isLocalLine(LOCALVAR *pVars, int nCount, int nLineOffset)
+{
+    int nLow  = 0;
+    int nHigh = nCount - 1;
+
+    while (nLow <= nHigh)
+    {
+        int nMid = (nLow + nHigh) / 2;
+
+        if (pVars[nMid].lineOffset == nLineOffset)
+            return true;
+
+        if (pVars[nMid].lineOffset < nLineOffset)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid - 1;
+    }
+
+    return false;
+}
+
+
+void freeLocals(void)
+{
+    if (g_localVars)
+        free(g_localVars);
+    g_localVars          = NULL;
+    g_localVarCount      = 0;
+    g_localVarsAllocated = 0;
+    g_fLocalRam          = false;
+}
+
+
+// Print the RAM saved by overlaying the local variables.
+//
+void reportLocals(void)
+{
+    printf("Locals: %d variables, %d bytes overlaid into %d at $%04X-$%04X (%d bytes saved), %d in page zero\r\n\n", g_localVarCount,
+           g_localBytesUnshared, g_localBytesUsed, g_localRamStart, g_localRamEnd, (g_localBytesUnshared - g_localBytesUsed),
+           g_localPageZeroCount);
+}
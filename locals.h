@@ -0,0 +1,12 @@
+//
+//  locals.h
+//  MC68HC11 Assembler
+//
+//  Overlaid subroutine locals (LOCALS/ENDLOCALS).
+//
+
+int allocateLocals(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks);
+int findLocalVariable(LOCALVAR *pVars, int nCount, int nLineOffset, int nMacroLine);
+bool isLocalLine(LOCALVAR *pVars, int nCount, int nLineOffset);
+void freeLocals(void);
+void reportLocals(void);
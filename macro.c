@@ -0,0 +1,759 @@
+//
+//  macro.c
+//  MC68HC11 Assembler
+//
+//  Macros (MACRO/ENDM) and repeat blocks (REPT/ENDR, IRP/ENDR).  The conditional assembly pre-pass hands every line it
+//  keeps to scanMacroLine(), which records the definitions and splits each body line into text and parameter pieces.
+//  An invocation only copies pieces from then on, so every pass 1 chunk and pass 2 region streams its expansions from
+//  the same read-only tables without looking at the definition text again.
+//
+//  In a body, \1 to \9 (or \NAME for a named parameter) is replaced by a macro argument, \NAME inside an IRP block by
+//  the current IRP value, and \@ by a suffix unique to each invocation and each pass over a REPT/IRP body (for local
+//  labels).  REPT counts are evaluated like IF operands - numbers or symbols defined ahead of the source.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+
+#include "common.h"
+#include "utility.h"
+#include "macro.h"
+
+extern SYMBOL symbols[];
+extern int findSymbolIndex(char *pszName);
+extern INSTRUCTION *lookUpMneumonic(char *pszMneumonic);
+
+typedef enum _macrokind_
+{
+    MACRO_KIND_MACRO,           // MACRO/ENDM definition
+    MACRO_KIND_REPT,            // REPT/ENDR block
+    MACRO_KIND_IRP              // IRP/ENDR block
+} MACROKIND;
+
+typedef enum _piecekind_
+{
+    PIECE_TEXT,                 // Body text copied as is
+    PIECE_PARAM,                // Parameter reference (\1 or \NAME) - the span is the name
+    PIECE_UNIQUE                // \@
+} PIECEKIND;
+
+typedef struct _macropiece_
+{
+    PIECEKIND kind;
+    int       offset;           // Source byte offset of the text or parameter name
+    int       length;
+} MACROPIECE;
+
+typedef struct _macroline_
+{
+    int block;                  // Block the line is in
+    int lineOffset;             // Source byte offset of the line
+    int firstPiece;
+    int pieceCount;
+} MACROLINE;
+
+typedef struct _macroblock_
+{
+    MACROKIND kind;
+    char      name[MAX_SYMBOL_NAME_LENGTH];                     // Macro name, or the IRP value name
+    char      params[MAX_MACRO_ARGS][MAX_SYMBOL_NAME_LENGTH];   // Macro parameter names
+    int       paramCount;
+    int       lineOffset;       // Source byte offset of the MACRO, REPT or IRP line
+    int       lineNumber;
+    int       firstLine;        // Body lines (contiguous once the scan is finished)
+    int       lineCount;
+} MACROBLOCK;
+
+MACROBLOCK *g_macroBlocks;          // Definitions and repeat blocks, in source order
+int        g_macroBlockCount;
+int        g_macroBlocksAllocated;
+MACROLINE  *g_macroLines;           // Body lines, grouped by block
+int        g_macroLineCount;
+int        g_macroLinesAllocated;
+MACROPIECE *g_macroPieces;          // Body line pieces
+int        g_macroPieceCount;
+int        g_macroPiecesAllocated;
+int        g_openBlocks[MAX_MACRO_DEPTH];  // Blocks the scan is inside of
+int        g_openDepth;
+
+
+// Make room for one more element in a macro table, doubling its allocation when it's full.
+//
+void *growMacroArray(void *pArray, int nCount, int *pnAllocated, int nElementSize)
+{
+    void *pTemp;
+    int  nNewCount;
+
+    if (nCount < *pnAllocated)
+        return pArray;
+
+    nNewCount = (*pnAllocated ? *pnAllocated * 2 : 256);
+    if (NULL == (pTemp = realloc(pArray, (size_t)nElementSize * nNewCount)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", nElementSize * nNewCount);
+        return NULL;
+    }
+    *pnAllocated = nNewCount;
+
+    return pTemp;
+}
+
+
+// Forget the definitions of the previous scan.
+//
+void beginMacroScan(void)
+{
+    g_macroBlockCount = 0;
+    g_macroLineCount  = 0;
+    g_macroPieceCount = 0;
+    g_openDepth       = 0;
+}
+
+
+// Returns how the lines of the block the scan is in are treated - a definition is listed, a REPT/IRP body skipped.
+//
+MACROSCAN getMacroScanBlock(void)
+{
+    if (0 == g_openDepth)
+        return MACRO_SCAN_SOURCE;
+
+    return (g_macroBlocks[g_openBlocks[0]].kind == MACRO_KIND_MACRO ? MACRO_SCAN_LISTED : MACRO_SCAN_SKIPPED);
+}
+
+
+// Returns the next whitespace delimited token at or after a pointer (zero length at the end of the line).
+//
+const char *getScanToken(const char *pText, const char *pEnd, int *pnLength)
+{
+    int nLength = 0;
+
+    while (pText < pEnd && (*pText == ' ' || *pText == '\t'))
+        pText++;
+    while (pText + nLength < pEnd && pText[nLength] != ' ' && pText[nLength] != '\t' && pText[nLength] != '\r' &&
+           pText[nLength] != '\n')
+        nLength++;
+
+    *pnLength = nLength;
+
+    return pText;
+}
+
+
+// Add a block the scan has just entered.
+//
+int addMacroBlock(MACROKIND kind, const char *pName, int nNameLength, int nLineOffset, int nLineNumber)
+{
+    MACROBLOCK *pBlock;
+
+    if (g_openDepth == MAX_MACRO_DEPTH)
+    {
+        printf("ERROR: REPT/IRP blocks nested more than %d deep on line %d\r\n", MAX_MACRO_DEPTH, nLineNumber);
+        return -1;
+    }
+
+    if (nNameLength >= MAX_SYMBOL_NAME_LENGTH)
+    {
+        printf("ERROR: Name \'%.*s\' on line %d is longer than %d characters\r\n", nNameLength, pName, nLineNumber,
+               MAX_SYMBOL_NAME_LENGTH - 1);
+        return -1;
+    }
+
+    if (NULL == (pBlock = (MACROBLOCK *)growMacroArray(g_macroBlocks, g_macroBlockCount, &g_macroBlocksAllocated, sizeof(MACROBLOCK))))
+        return -1;
+    g_macroBlocks = pBlock;
+
+    pBlock = &g_macroBlocks[g_macroBlockCount];
+    memset(pBlock, 0, sizeof(MACROBLOCK));
+    pBlock->kind       = kind;
+    pBlock->lineOffset = nLineOffset;
+    pBlock->lineNumber = nLineNumber;
+    memcpy(pBlock->name, pName, nNameLength);
+
+    g_openBlocks[g_openDepth++] = g_macroBlockCount++;
+
+    return 0;
+}
+
+
+// Add a piece to the body line being split.
+//
+int addMacroPiece(PIECEKIND kind, int nOffset, int nLength)
+{
+    MACROPIECE *pPiece;
+
+    if (NULL == (pPiece = (MACROPIECE *)growMacroArray(g_macroPieces, g_macroPieceCount, &g_macroPiecesAllocated, sizeof(MACROPIECE))))
+        return -1;
+    g_macroPieces = pPiece;
+
+    pPiece = &g_macroPieces[g_macroPieceCount++];
+    pPiece->kind   = kind;
+    pPiece->offset = nOffset;
+    pPiece->length = nLength;
+
+    return 0;
+}
+
+
+// Add a line to the body of the innermost open block, split into pieces at each parameter reference.
+//
+int addMacroLine(SOURCEFILE *pSourceFile, int nOffset, int nEndOffset)
+{
+    const char *pFile = pSourceFile->pFile;
+    MACROLINE  *pLine;
+    int        nTextOffset = nOffset;
+    int        nFirstPiece = g_macroPieceCount;
+
+    while (nEndOffset > nOffset && (pFile[nEndOffset - 1] == '\n' || pFile[nEndOffset - 1] == '\r'))
+        nEndOffset--;
+
+    for (int i=nOffset ; i < nEndOffset - 1 ; i++)
+    {
+        int nNameLength = 0;
+
+        if (pFile[i] != '\\')
+            continue;
+
+        if (pFile[i + 1] == '@')
+            nNameLength = 1;
+        else if (pFile[i + 1] >= '1' && pFile[i + 1] <= '9')
+            nNameLength = 1;
+        else
+        {
+            while (i + 1 + nNameLength < nEndOffset &&
+                   (isalnum((UINT8)pFile[i + 1 + nNameLength]) || pFile[i + 1 + nNameLength] == '_'))
+                nNameLength++;
+        }
+
+        if (0 == nNameLength)
+            continue;
+
+        if ((i > nTextOffset && addMacroPiece(PIECE_TEXT, nTextOffset, i - nTextOffset)) ||
+            addMacroPiece((pFile[i + 1] == '@' ? PIECE_UNIQUE : PIECE_PARAM), i + 1, nNameLength))
+            return -1;
+
+        nTextOffset = i + 1 + nNameLength;
+        i = nTextOffset - 1;
+    }
+
+    if (nEndOffset > nTextOffset && addMacroPiece(PIECE_TEXT, nTextOffset, nEndOffset - nTextOffset))
+        return -1;
+
+    if (NULL == (pLine = (MACROLINE *)growMacroArray(g_macroLines, g_macroLineCount, &g_macroLinesAllocated, sizeof(MACROLINE))))
+        return -1;
+    g_macroLines = pLine;
+
+    pLine = &g_macroLines[g_macroLineCount++];
+    pLine->block      = g_openBlocks[g_openDepth - 1];
+    pLine->lineOffset = nOffset;
+    pLine->firstPiece = nFirstPiece;
+    pLine->pieceCount = g_macroPieceCount - nFirstPiece;
+
+    g_macroBlocks[pLine->block].lineCount++;
+
+    return 0;
+}
+
+
+// Record the parameter names of a MACRO line (a comma separated list).
+//
+int addMacroParams(MACROBLOCK *pBlock, const char *pList, int nListLength, int nLineNumber)
+{
+    while (nListLength > 0 && *pList != ';' && *pList != '*')
+    {
+        const char *pComma  = memchr(pList, ',', nListLength);
+        int        nLength  = (pComma ? (int)(pComma - pList) : nListLength);
+
+        if (0 == nLength || nLength >= MAX_SYMBOL_NAME_LENGTH || pBlock->paramCount == MAX_MACRO_ARGS)
+        {
+            printf("ERROR: Invalid macro parameter list on line %d (at most %d names of %d characters)\r\n", nLineNumber,
+                   MAX_MACRO_ARGS, MAX_SYMBOL_NAME_LENGTH - 1);
+            return -1;
+        }
+
+        memcpy(pBlock->params[pBlock->paramCount++], pList, nLength);
+        if (NULL == pComma)
+            break;
+        nListLength -= nLength + 1;
+        pList       += nLength + 1;
+    }
+
+    return 0;
+}
+
+
+// Returns true if a scanned token is a keyword.
+//
+bool isScanKeyword(const char *pToken, int nLength, const char *pszKeyword)
+{
+    return (nLength == (int)strlen(pszKeyword) && !strncasecmp(pToken, pszKeyword, nLength));
+}
+
+
+// Scan a line the conditional pre-pass is keeping.  Definitions and REPT/IRP blocks are recorded along with their body
+// lines, and the line is classified: a definition (MACRO through ENDM) is listed, the body and ENDR of a REPT/IRP block
+// outside of a definition are skipped, and everything else (REPT and IRP lines included) is assembled.
+//
+int scanMacroLine(SOURCEFILE *pSourceFile, int nOffset, int nEndOffset, int nLineNumber, MACROSCAN *pScan)
+{
+    const char *pLine = pSourceFile->pFile + nOffset;
+    const char *pEnd  = pSourceFile->pFile + nEndOffset;
+    const char *pLabel;
+    const char *pToken;
+    const char *pOperand;
+    int  nLabelLength  = 0;
+    int  nLength;
+    int  nOperandLength;
+    bool fLabel;
+
+    *pScan = getMacroScanBlock();
+
+    // Comments go straight into the body of the block they're in.
+    //
+    if (pLine < pEnd && (*pLine == ';' || *pLine == '*' || (*pLine == '/' && pLine + 1 < pEnd && pLine[1] == '/')))
+        return (g_openDepth ? addMacroLine(pSourceFile, nOffset, nEndOffset) : 0);
+
+    fLabel = (pLine < pEnd && *pLine != ' ' && *pLine != '\t' && *pLine != '\r' && *pLine != '\n');
+    pLabel = pToken = getScanToken(pLine, pEnd, &nLength);
+    if (fLabel)
+    {
+        nLabelLength = (nLength && pLabel[nLength - 1] == ':' ? nLength - 1 : nLength);
+        pToken = getScanToken(pToken + nLength, pEnd, &nLength);
+    }
+    pOperand = getScanToken(pToken + nLength, pEnd, &nOperandLength);
+
+    // Most lines are ruled out by the first character of the keyword.
+    //
+    switch (toupper((UINT8)*pToken))
+    {
+        case 'M':
+            if (!fLabel || !isScanKeyword(pToken, nLength, "MACRO"))
+                break;
+
+            if (g_openDepth)
+            {
+                printf("ERROR: MACRO on line %d is inside another definition or a REPT/IRP block\r\n", nLineNumber);
+                return -1;
+            }
+
+            {
+                char szName[MAX_SYMBOL_NAME_LENGTH];
+
+                if (nLabelLength < MAX_SYMBOL_NAME_LENGTH)
+                {
+                    memcpy(szName, pLabel, nLabelLength);
+                    szName[nLabelLength] = '\0';
+                    if (lookUpMneumonic(szName) || lookUpMacro(szName) >= 0)
+                    {
+                        printf("ERROR: Macro \'%s\' on line %d is already an instruction or macro\r\n", szName, nLineNumber);
+                        return -1;
+                    }
+                }
+            }
+
+            if (addMacroBlock(MACRO_KIND_MACRO, pLabel, nLabelLength, nOffset, nLineNumber) ||
+                addMacroParams(&g_macroBlocks[g_macroBlockCount - 1], pOperand, nOperandLength, nLineNumber))
+                return -1;
+
+            *pScan = MACRO_SCAN_LISTED;
+            return 0;
+
+        case 'R':
+        case 'I':
+            if (!isScanKeyword(pToken, nLength, "REPT") && !isScanKeyword(pToken, nLength, "IRP"))
+                break;
+
+            // The REPT/IRP line is a body line of the block it's in (it starts the nested expansion).
+            //
+            if (g_openDepth && addMacroLine(pSourceFile, nOffset, nEndOffset))
+                return -1;
+
+            if (toupper((UINT8)*pToken) == 'I')
+            {
+                const char *pComma = memchr(pOperand, ',', nOperandLength);
+
+                if (NULL == pComma || pComma == pOperand)
+                {
+                    printf("ERROR: IRP on line %d needs a name and a list of values\r\n", nLineNumber);
+                    return -1;
+                }
+                return addMacroBlock(MACRO_KIND_IRP, pOperand, (int)(pComma - pOperand), nOffset, nLineNumber);
+            }
+            return addMacroBlock(MACRO_KIND_REPT, "", 0, nOffset, nLineNumber);
+
+        case 'E':
+            if (fLabel)
+                break;
+
+            if (isScanKeyword(pToken, nLength, "ENDM"))
+            {
+                if (0 == g_openDepth || g_macroBlocks[g_openBlocks[g_openDepth - 1]].kind != MACRO_KIND_MACRO)
+                {
+                    printf("ERROR: ENDM without MACRO on line %d\r\n", nLineNumber);
+                    return -1;
+                }
+                g_openDepth--;
+                return 0;
+            }
+
+            if (isScanKeyword(pToken, nLength, "ENDR"))
+            {
+                if (0 == g_openDepth || g_macroBlocks[g_openBlocks[g_openDepth - 1]].kind == MACRO_KIND_MACRO)
+                {
+                    printf("ERROR: ENDR without REPT or IRP on line %d\r\n", nLineNumber);
+                    return -1;
+                }
+                g_openDepth--;
+                return 0;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return (g_openDepth ? addMacroLine(pSourceFile, nOffset, nEndOffset) : 0);
+}
+
+
+// Finish the scan - check every block was closed and group the body lines by block.
+//
+int endMacroScan(void)
+{
+    MACROLINE *pLines;
+    int       nLine = 0;
+
+    if (g_openDepth)
+    {
+        MACROBLOCK *pBlock = &g_macroBlocks[g_openBlocks[g_openDepth - 1]];
+
+        printf("ERROR: %s on line %d has no %s\r\n", (pBlock->kind == MACRO_KIND_MACRO ? "MACRO" : "REPT/IRP"),
+               pBlock->lineNumber, (pBlock->kind == MACRO_KIND_MACRO ? "ENDM" : "ENDR"));
+        return -1;
+    }
+
+    if (0 == g_macroLineCount)
+        return 0;
+
+    // The lines of nested blocks are interleaved, so they're moved into one run per block (in source order).
+    //
+    if (NULL == (pLines = (MACROLINE *)malloc(sizeof(MACROLINE) * g_macroLineCount)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(MACROLINE) * g_macroLineCount));
+        return -1;
+    }
+
+    for (int i=0 ; i<g_macroBlockCount ; i++)
+    {
+        g_macroBlocks[i].firstLine = nLine;
+        nLine += g_macroBlocks[i].lineCount;
+        g_macroBlocks[i].lineCount = 0;
+    }
+
+    for (int i=0 ; i<g_macroLineCount ; i++)
+    {
+        MACROBLOCK *pBlock = &g_macroBlocks[g_macroLines[i].block];
+
+        pLines[pBlock->firstLine + pBlock->lineCount++] = g_macroLines[i];
+    }
+
+    free(g_macroLines);
+    g_macroLines          = pLines;
+    g_macroLinesAllocated = g_macroLineCount;
+
+    return 0;
+}
+
+
+// Returns the block index of a macro, or -1 if there's no macro by that name.
+//
+int lookUpMacro(char *pszName)
+{
+    for (int i=0 ; i<g_macroBlockCount ; i++)
+    {
+        if (g_macroBlocks[i].kind == MACRO_KIND_MACRO && !strcasecmp(g_macroBlocks[i].name, pszName))
+            return i;
+    }
+
+    return -1;
+}
+
+
+// Returns the block index of the REPT/IRP block started by a source line, or -1 (binary search).
+//
+int findRepeatBlock(int nLineOffset)
+{
+    int nLow  = 0;
+    int nHigh = g_macroBlockCount - 1;
+
+    while (nLow <= nHigh)
+    {
+        int nMiddle = (nLow + nHigh) / 2;
+
+        if (g_macroBlocks[nMiddle].lineOffset == nLineOffset)
+            return (g_macroBlocks[nMiddle].kind == MACRO_KIND_MACRO ? -1 : nMiddle);
+
+        if (g_macroBlocks[nMiddle].lineOffset < nLineOffset)
+            nLow = nMiddle + 1;
+        else
+            nHigh = nMiddle - 1;
+    }
+
+    return -1;
+}
+
+
+// Start expanding a block.  The lines of an expansion are identified by the source line that started the outermost
+// one and their index in it, which is the same in both passes.
+//
+MACROLEVEL *pushMacroLevel(SOURCEFILE *pSourceFile, int nBlock)
+{
+    MACROSTATE *pState = pSourceFile->pMacroState;
+    MACROLEVEL *pLevel;
+
+    if (NULL == pState || pState->depth == MAX_MACRO_DEPTH)
+        return NULL;
+
+    if (0 == pState->depth)
+    {
+        pSourceFile->macroOffset = pSourceFile->lineOffset;
+        pState->lineCount   = 0;
+        pState->uniqueCount = 0;
+    }
+
+    pLevel = &pState->levels[pState->depth++];
+    pLevel->block          = nBlock;
+    pLevel->nextLine       = 0;
+    pLevel->iteration      = 0;
+    pLevel->iterationCount = 1;
+    pLevel->uniqueId       = pState->uniqueCount++;
+    pLevel->argCount       = 0;
+
+    return pLevel;
+}
+
+
+// Split a comma separated argument (or IRP value) list into a level, skipping the first nSkip entries.
+//
+int splitMacroArgs(MACROLEVEL *pLevel, char *pszList, int nSkip)
+{
+    char *pszArg = pszList;
+
+    while (pszArg && *pszArg && !isCommentLine(pszArg))
+    {
+        char *pszComma = strchr(pszArg, ',');
+        int  nLength   = (pszComma ? (int)(pszComma - pszArg) : (int)strlen(pszArg));
+
+        if (nSkip)
+            nSkip--;
+        else
+        {
+            if (pLevel->argCount == MAX_MACRO_ARGS || nLength >= MAX_MACRO_ARG_LENGTH)
+                return -1;
+            memcpy(pLevel->args[pLevel->argCount], pszArg, nLength);
+            pLevel->args[pLevel->argCount++][nLength] = '\0';
+        }
+
+        pszArg = (pszComma ? pszComma + 1 : NULL);
+    }
+
+    return 0;
+}
+
+
+// Start expanding a macro invocation (the arguments are the operand of the invoking line, or NULL).
+//
+int beginMacroExpansion(SOURCEFILE *pSourceFile, int nBlock, char *pszArgs)
+{
+    MACROLEVEL *pLevel;
+
+    if (NULL == (pLevel = pushMacroLevel(pSourceFile, nBlock)))
+        return -1;
+
+    if (splitMacroArgs(pLevel, pszArgs, 0))
+    {
+        pSourceFile->pMacroState->depth--;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Start expanding the REPT/IRP block started by the line just read.
+//
+int beginRepeatExpansion(SOURCEFILE *pSourceFile, char *pszOperand)
+{
+    MACROLEVEL *pLevel;
+    int    nBlock;
+    int    nSymbol;
+    UINT16 nCount = 0;
+
+    if ((nBlock = findRepeatBlock(pSourceFile->lineOffset)) < 0 || NULL == pszOperand)
+        return -1;
+
+    // A REPT count has to be known while the chunks are parsed, ahead of the source's own symbols.
+    //
+    if (g_macroBlocks[nBlock].kind == MACRO_KIND_REPT && convertToNumber(pszOperand, &nCount))
+    {
+        if ((nSymbol = findSymbolIndex(pszOperand)) < 0 || symbols[nSymbol].symbolType == SYMBOL_TYPE_STRING)
+            return -1;
+        nCount = (symbols[nSymbol].symbolType == SYMBOL_TYPE_NUMBER_8BIT ? symbols[nSymbol].u.nsymbolValue8 :
+                  symbols[nSymbol].u.nsymbolValue16);
+    }
+
+    if (NULL == (pLevel = pushMacroLevel(pSourceFile, nBlock)))
+        return -1;
+
+    if (g_macroBlocks[nBlock].kind == MACRO_KIND_IRP)
+    {
+        if (splitMacroArgs(pLevel, pszOperand, 1))
+        {
+            pSourceFile->pMacroState->depth--;
+            return -1;
+        }
+        nCount = (UINT16)pLevel->argCount;
+    }
+
+    pLevel->iterationCount = nCount;
+    if (0 == nCount)
+        pSourceFile->pMacroState->depth--;
+
+    return 0;
+}
+
+
+// Returns the value of a parameter reference, or NULL if nothing in scope has that name (parameters of an outer macro
+// aren't visible inside a macro it invokes).
+//
+const char *findMacroParam(MACROSTATE *pState, const char *pName, int nLength)
+{
+    for (int i=pState->depth - 1 ; i >= 0 ; i--)
+    {
+        MACROLEVEL *pLevel = &pState->levels[i];
+        MACROBLOCK *pBlock = &g_macroBlocks[pLevel->block];
+
+        if (pBlock->kind == MACRO_KIND_IRP)
+        {
+            if ((int)strlen(pBlock->name) == nLength && !strncasecmp(pBlock->name, pName, nLength))
+                return pLevel->args[pLevel->iteration];
+            continue;
+        }
+
+        if (pBlock->kind == MACRO_KIND_REPT)
+            continue;
+
+        if (1 == nLength && *pName >= '1' && *pName <= '9')
+            return (*pName - '1' < pLevel->argCount ? pLevel->args[*pName - '1'] : "");
+
+        for (int j=0 ; j<pBlock->paramCount ; j++)
+        {
+            if ((int)strlen(pBlock->params[j]) == nLength && !strncasecmp(pBlock->params[j], pName, nLength))
+                return (j < pLevel->argCount ? pLevel->args[j] : "");
+        }
+
+        return NULL;
+    }
+
+    return NULL;
+}
+
+
+// Build an expanded body line in the caller's buffer.  Returns -1 if it doesn't fit.
+//
+int expandMacroLine(SOURCEFILE *pSourceFile, MACROLINE *pMacroLine, char *pLine, int nMaxLineLength)
+{
+    MACROSTATE *pState = pSourceFile->pMacroState;
+    char szUnique[24];
+    int  nLength = 0;
+
+    for (int i=0 ; i<pMacroLine->pieceCount ; i++)
+    {
+        MACROPIECE *pPiece = &g_macroPieces[pMacroLine->firstPiece + i];
+        const char *pText  = pSourceFile->pFile + pPiece->offset;
+        int        nTextLength = pPiece->length;
+
+        if (pPiece->kind == PIECE_PARAM)
+        {
+            const char *pszValue = findMacroParam(pState, pText, nTextLength);
+
+            // An unknown name is left as it was written.
+            //
+            if (pszValue)
+            {
+                pText       = pszValue;
+                nTextLength = (int)strlen(pszValue);
+            }
+            else
+            {
+                pText--;
+                nTextLength++;
+            }
+        }
+        else if (pPiece->kind == PIECE_UNIQUE)
+        {
+            // The source offset of the invoking line is unique to it, and the pass number tells apart the invocations
+            // and REPT/IRP passes within its expansion.
+            //
+            int nId = pState->levels[pState->depth - 1].uniqueId;
+
+            nTextLength = sprintf(szUnique, "_%X", pSourceFile->macroOffset);
+            if (nId)
+                nTextLength += sprintf(szUnique + nTextLength, "_%X", nId);
+            pText = szUnique;
+        }
+
+        if (nLength + nTextLength >= nMaxLineLength)
+            return -1;
+
+        memcpy(pLine + nLength, pText, nTextLength);
+        nLength += nTextLength;
+    }
+
+    pLine[nLength] = '\0';
+
+    return 0;
+}
+
+
+// Called by getNextFileLine() while an expansion is in progress.  Returns 0 with the next expanded line, 1 once every
+// expansion has finished (the next line comes from the source), or -2 if a line doesn't fit in the buffer.
+//
+int getNextMacroLine(SOURCEFILE *pSourceFile, char *pLine, int nMaxLineLength)
+{
+    MACROSTATE *pState = pSourceFile->pMacroState;
+
+    while (pState->depth)
+    {
+        MACROLEVEL *pLevel = &pState->levels[pState->depth - 1];
+        MACROBLOCK *pBlock = &g_macroBlocks[pLevel->block];
+
+        if (pLevel->nextLine < pBlock->lineCount)
+        {
+            MACROLINE *pMacroLine = &g_macroLines[pBlock->firstLine + pLevel->nextLine++];
+
+            if (expandMacroLine(pSourceFile, pMacroLine, pLine, nMaxLineLength))
+                return -2;
+
+            pSourceFile->lineOffset = pMacroLine->lineOffset;
+            pSourceFile->macroLine  = ++pState->lineCount;
+            pSourceFile->fCondLine  = false;
+            return 0;
+        }
+
+        // Start the next pass over a REPT/IRP body, or finish the block.
+        //
+        if (++pLevel->iteration < pLevel->iterationCount)
+        {
+            pLevel->nextLine = 0;
+            pLevel->uniqueId = pState->uniqueCount++;
+        }
+        else
+            pState->depth--;
+    }
+
+    return 1;
+}
+
@@ -0,0 +1,15 @@
+//
+//  macro.h
+//  MC68HC11 Assembler
+//
+//  Macros (MACRO/ENDM) and repeat blocks (REPT/ENDR, IRP/ENDR).
+//
+
+void beginMacroScan(void);
+MACROSCAN getMacroScanBlock(void);
+int scanMacroLine(SOURCEFILE *pSourceFile, int nOffset, int nEndOffset, int nLineNumber, MACROSCAN *pScan);
+int endMacroScan(void);
+int lookUpMacro(char *pszName);
+int beginMacroExpansion(SOURCEFILE *pSourceFile, int nBlock, char *pszArgs);
+int beginRepeatExpansion(SOURCEFILE *pSourceFile, char *pszOperand);
+int getNextMacroLine(SOURCEFILE *pSourceFile, char *pLine, int nMaxLineLength);
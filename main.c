@@ -15,16 +15,136 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "utility.h"
 #include "opcodes.h"
+#include "srecord.h"
+#include "disasm.h"
+#include "mapfile.h"
+#include "stack.h"
+#include "delta.h"
+#include "output.h"
+#include "symfile.h"
+#include "xref.h"
+#include "linemap.h"
+#include "watch.h"
+#include "depend.h"
+#include "cond.h"
+#include "macro.h"
+#include "strpool.h"
+#include "delay.h"
+#include "locals.h"
+#include "bank.h"
 
 
 UINT16 g_startAddress;
 UINT16 symbolCount;
 SYMBOL symbols[MAX_SYMBOL_COUNT];
 
+UINT8  g_memImage[MEM_IMAGE_SIZE];      // Target memory image produced by pass 2
+UINT8  g_memWritten[MEM_IMAGE_SIZE];    // Non-zero for each memory image byte written by pass 2
+REGION *g_regions;                      // Pass 2 regions, in source order
+int    g_regionCount;
+int    g_regionsAllocated;
+int    g_numThreads = 1;                // Number of pass 1/pass 2 worker threads
+const char *g_snapshotFiles[MAX_SNAPSHOT_FILES];    // Equate snapshots loaded ahead of the source file
+int    g_snapshotCount;
+int    g_defineSymbolCount;             // Symbols pushed from the -D definitions (first in the table)
+int    g_predefinedSymbolCount;         // Symbols pushed ahead of the source - the -D definitions, then the snapshots
+LINEREF *g_forwardRefs;                 // Lines sized as extended by pass 1 (forward references), ascending
+int    g_forwardRefCount;
+int    g_forwardRefsAllocated;
+bool   g_fOptimize;                     // Apply peephole optimizations (-O)
+bool   g_fMemoryMap;                    // Collect the memory map from pass 1 (-m)
+REWRITE *g_rewrites;                    // Lines rewritten by the peephole optimizer, ascending source offset
+int    g_rewriteCount;
+int    g_rewritesAllocated;
+POOLSTRING *g_poolStrings;              // FCC strings in pooled sections (STRPOOL), ascending source offset
+int    g_poolStringCount;
+int    g_poolStringsAllocated;
+LOCALVAR *g_localVars;                  // Variables in LOCALS blocks, ascending source offset
+int    g_localVarCount;
+int    g_localVarsAllocated;
+UINT8  *g_ccrEffects;                   // Condition code effects (CCR_xxx) of each instruction table entry
+bool   g_fStackReport;                  // Analyze stack depth and write the report (-k)
+int    g_stackBudget;                   // Stack budget asserted by the STACK directive (0 == none)
+UINT8  g_srecType = 1;                  // S-record data record type (S1, S2 or S3)
+int    g_srecDataBytes = MAX_S19_CHARPAIRS; // Data bytes per S-record (-r)
+const char *g_pszBaselineFile;          // Image already on the target, for delta S-records (-u)
+bool   g_fCrossReference;               // Record symbol references in pass 2 for the cross-reference (-x)
+const char *g_pszSourceName;            // Source file name as given on the command line (for the line map)
+bool   g_fWatch;                        // Re-assemble whenever the source changes (--watch)
+UINT32 g_eClockHz = DEFAULT_E_CLOCK_HZ; // E clock for DELAY times in microseconds (-e)
+
+typedef struct _workcontext_
+{
+    SOURCEFILE      *pSourceFile;       // Source file shared by all workers
+    CHUNK           *pChunks;           // Chunks to be parsed (pass 1)
+    int             itemCount;          // Number of chunks or regions to be processed
+    int             nextItem;           // Index of the next chunk or region to be claimed by a worker
+    pthread_mutex_t lock;               // Protects nextItem
+} WORKCONTEXT;
+
+// State kept from the previous assembly in watch mode, so that an edit only re-parses and re-encodes what it touched.
+//
+typedef struct _watchstate_
+{
+    char    *pSource;           // Source text of the previous assembly
+    int     sourceSize;
+    CHUNK   *pChunks;           // Pass 1 chunks (statements) of the previous assembly
+    int     chunkCount;
+    REGION  *pRegions;          // Pass 2 regions (line records) of the previous assembly
+    int     regionCount;
+    SYMBOL  *pSymbols;          // Symbol table of the previous assembly
+    UINT16  symbolCount;
+    LINEREF *pForwardRefs;      // Forward references and peephole rewrites of the previous assembly
+    int     forwardRefCount;
+    REWRITE *pRewrites;
+    int     rewriteCount;
+    POOLSTRING *pPoolStrings;   // Pooled strings of the previous assembly
+    int     poolStringCount;
+    LOCALVAR *pLocalVars;       // LOCALS variables of the previous assembly
+    int     localVarCount;
+    int     prefixLength;       // Source bytes unchanged since the previous assembly, at the start and the end
+    int     suffixLength;
+    int     sizeDelta;          // Change in the source size
+    int     parsedBytes;        // Source bytes parsed by the current assembly
+    int     reusedRegions;      // Regions of the current assembly taken from the previous one
+} WATCHSTATE;
+
+WATCHSTATE g_watch;
+
+typedef enum _parseerror_
+{
+    PARSE_ERROR_EQU,                    // Invalid EQU value
+    PARSE_ERROR_ORG,                    // Invalid ORG instruction
+    PARSE_ERROR_RMB,                    // Invalid RMB instruction
+    PARSE_ERROR_STACK,                  // Invalid STACK directive
+    PARSE_ERROR_FCC,                    // Invalid FCC instruction
+    PARSE_ERROR_MNEUMONIC,              // Unknown mneumonic (symbolName)
+    PARSE_ERROR_ADDRMODE,               // Invalid instruction parameters
+    PARSE_ERROR_NO_ADDRMODE,            // Instruction (pInst) doesn't offer the addressing mode
+    PARSE_ERROR_MACRO,                  // Invalid macro invocation or REPT/IRP block (symbolName)
+    PARSE_ERROR_FILL,                   // Invalid FILL, BSZ or ZMB count (symbolName)
+    PARSE_ERROR_LIST,                   // Empty value in an FCB or FDB list (symbolName)
+    PARSE_ERROR_STRPOOL,                // Invalid STRPOOL terminator
+    PARSE_ERROR_DELAY,                  // Invalid DELAY operand
+    PARSE_ERROR_DELAY_CYCLES,           // No DELAY sequence fits (symbolName == cycles)
+    PARSE_ERROR_LOCALRAM,               // Invalid LOCALRAM area
+    PARSE_ERROR_LOCALS,                 // LOCALS without a routine label
+    PARSE_ERROR_BANKWINDOW,             // Invalid BANKWINDOW range
+    PARSE_ERROR_BANK                    // Invalid BANK number
+} PARSEERROR;
+
+typedef struct _ccreffect_
+{
+    char  *pszMneumonic;
+    UINT8 effects;                      // CCR_READS_C, CCR_WRITES_C, ...
+} CCREFFECT;
+
 
 // NOTES:
 // * Start Address: If the symbols "START" is defined, this is used as the program's start address else the first ORG block is used.
@@ -62,24 +182,322 @@ int pushSymbol(char *pszName, SYMBOLTYPE Type, void *pValue)
 }
 
 
-bool findSymbol(char *pszName, SYMBOLTYPE *pType, SYMBOLVALUE **pValue)
+// Returns the symbol table index of the named symbol, or -1 if it isn't defined.
+//
+int findSymbolIndex(char *pszName)
 {
     UINT16 nCount;
     
-    for (nCount=0 ; nCount <= symbolCount ; nCount++)
+    for (nCount=0 ; nCount < symbolCount ; nCount++)
     {
         if (strcasecmp(symbols[nCount].symbolName, pszName) == 0)
+            return nCount;
+    }
+    
+    return -1;
+}
+
+
+// A source line can't define a symbol a -D definition or a snapshot already defines - lookups find the earlier symbol
+// first, so the source's value would be silently ignored.
+//
+int checkPredefinedSymbol(char *pszName, int nLineNumber)
+{
+    char szName[MAX_SYMBOL_NAME_LENGTH];
+    int  nIndex;
+    
+    copySymbolName(szName, pszName);
+    if ((nIndex = findSymbolIndex(szName)) < 0 || nIndex >= g_predefinedSymbolCount)
+        return 0;
+    
+    printf("ERROR: Symbol \'%s\' on line %d is already defined by %s\r\n", szName, nLineNumber,
+           (nIndex < g_defineSymbolCount ? "-D" : "a symbol snapshot"));
+    return -1;
+}
+
+
+bool findSymbol(char *pszName, SYMBOLTYPE *pType, SYMBOLVALUE **pValue)
+{
+    int nIndex;
+    
+    if ((nIndex = findSymbolIndex(pszName)) < 0)
+        return false;
+    
+    *pType  = symbols[nIndex].symbolType;
+    *pValue = &symbols[nIndex].u;
+    
+    return true;
+}
+
+
+// Write the current symbol table to a snapshot file that can later be loaded with loadSymbolSnapshot().
+//
+int writeSymbolSnapshot(int fpSnapshot)
+{
+    SNAPSHOTHEADER header;
+    SNAPSHOTSYMBOL *pRecords;
+    UINT32 nPoolSize = 0;
+    int    nRetVal   = 0;
+    
+    if (NULL == (pRecords = (SNAPSHOTSYMBOL *)calloc((symbolCount ? symbolCount : 1), sizeof(SNAPSHOTSYMBOL))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(SNAPSHOTSYMBOL) * symbolCount));
+        return -1;
+    }
+    
+    for (int i=0 ; i<symbolCount ; i++)
+    {
+        strncpy(pRecords[i].symbolName, symbols[i].symbolName, MAX_SYMBOL_NAME_LENGTH);
+        pRecords[i].symbolType = (UINT16)symbols[i].symbolType;
+        
+        switch(symbols[i].symbolType)
         {
-            *pType  = symbols[nCount].symbolType;
-            *pValue = &symbols[nCount].u;
-            break;
+            case SYMBOL_TYPE_NUMBER_8BIT:
+                pRecords[i].value = symbols[i].u.nsymbolValue8;
+                break;
+            case SYMBOL_TYPE_NUMBER_16BIT:
+                pRecords[i].value = symbols[i].u.nsymbolValue16;
+                break;
+            case SYMBOL_TYPE_STRING:
+                // Strings are appended to the pool in symbol order, so the offset is the running pool size.
+                if (nPoolSize > 0xFFFF)
+                {
+                    printf("ERROR: Snapshot string pool is too large (symbol \'%s\')\r\n", symbols[i].symbolName);
+                    free(pRecords);
+                    return -1;
+                }
+                pRecords[i].value = (UINT16)nPoolSize;
+                nPoolSize += strlen(symbols[i].u.symbolValueStr) + 1;
+                break;
+            default:
+                break;
+        }
+    }
+    
+    memset(&header, 0, sizeof(SNAPSHOTHEADER));
+    strncpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version        = SNAPSHOT_VERSION;
+    header.byteOrder      = SNAPSHOT_BYTE_ORDER;
+    header.headerSize     = sizeof(SNAPSHOTHEADER);
+    header.recordSize     = sizeof(SNAPSHOTSYMBOL);
+    header.symbolCount    = symbolCount;
+    header.stringPoolSize = nPoolSize;
+    
+    if (write(fpSnapshot, &header, sizeof(SNAPSHOTHEADER)) != sizeof(SNAPSHOTHEADER) ||
+        write(fpSnapshot, pRecords, (sizeof(SNAPSHOTSYMBOL) * symbolCount)) != (ssize_t)(sizeof(SNAPSHOTSYMBOL) * symbolCount))
+    {
+        nRetVal = -1;
+    }
+    
+    for (int i=0 ; i<symbolCount && !nRetVal ; i++)
+    {
+        if (symbols[i].symbolType == SYMBOL_TYPE_STRING)
+        {
+            size_t nLength = strlen(symbols[i].u.symbolValueStr) + 1;
+            
+            if (write(fpSnapshot, symbols[i].u.symbolValueStr, nLength) != (ssize_t)nLength)
+                nRetVal = -1;
         }
     }
     
-    if (nCount <= symbolCount)
-        return true;
+    if (nRetVal)
+    {
+        printf("ERROR: Symbol snapshot write failed\r\n");
+    }
+    
+    free(pRecords);
+    return nRetVal;
+}
+
+
+// Map a symbol snapshot file into memory and push its symbols into the symbol table.
+//
+int loadSymbolSnapshot(const char *pszFileName)
+{
+    int nRetVal = 0;
+    int fpSnapshot;
+    struct stat fileStat;
+    char *pSnapshot;
+    SNAPSHOTHEADER *pHeader;
+    SNAPSHOTSYMBOL *pRecords;
+    char *pStringPool;
+    
+    if ((fpSnapshot = open(pszFileName, O_RDONLY)) < 0)
+    {
+        printf("ERROR: Symbol snapshot open failed (%s)\r\n", pszFileName);
+        return -1;
+    }
+    
+    if (addDependency(pszFileName))
+    {
+        close(fpSnapshot);
+        return -1;
+    }
+    
+    if (fstat(fpSnapshot, &fileStat) < 0 || fileStat.st_size < (off_t)sizeof(SNAPSHOTHEADER))
+    {
+        printf("ERROR: Invalid symbol snapshot (%s)\r\n", pszFileName);
+        close(fpSnapshot);
+        return -1;
+    }
+    
+    pSnapshot = (char *)mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fpSnapshot, 0);
+    close(fpSnapshot);
+    if (MAP_FAILED == pSnapshot)
+    {
+        printf("ERROR: Symbol snapshot mapping failed (%s)\r\n", pszFileName);
+        return -1;
+    }
+    
+    // Validate the header before trusting any of the sizes in it.
+    //
+    pHeader     = (SNAPSHOTHEADER *)pSnapshot;
+    pRecords    = (SNAPSHOTSYMBOL *)(pSnapshot + sizeof(SNAPSHOTHEADER));
+    pStringPool = (char *)(pRecords + pHeader->symbolCount);
+    
+    if (memcmp(pHeader->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) ||
+        pHeader->byteOrder  != SNAPSHOT_BYTE_ORDER ||
+        pHeader->headerSize != sizeof(SNAPSHOTHEADER) ||
+        pHeader->recordSize != sizeof(SNAPSHOTSYMBOL) ||
+        fileStat.st_size < (off_t)(sizeof(SNAPSHOTHEADER) + (sizeof(SNAPSHOTSYMBOL) * pHeader->symbolCount) + pHeader->stringPoolSize))
+    {
+        printf("ERROR: Invalid symbol snapshot (%s)\r\n", pszFileName);
+        nRetVal = -1;
+        goto Exit;
+    }
+    
+    if (pHeader->version != SNAPSHOT_VERSION)
+    {
+        printf("ERROR: Symbol snapshot version %d isn\'t supported - recompile it (%s)\r\n", (int)pHeader->version, pszFileName);
+        nRetVal = -1;
+        goto Exit;
+    }
+    
+    for (int i=0 ; i<pHeader->symbolCount && !nRetVal ; i++)
+    {
+        char szName[MAX_SYMBOL_NAME_LENGTH];
         
-    return false;
+        // The record's name isn't trusted to be terminated - keep it to what the symbol table holds.
+        //
+        copySymbolName(szName, pRecords[i].symbolName);
+        
+        switch((SYMBOLTYPE)pRecords[i].symbolType)
+        {
+            case SYMBOL_TYPE_NUMBER_8BIT:
+            {
+                UINT8 nValue8 = (UINT8)(pRecords[i].value & 0xFF);
+                nRetVal = pushSymbol(szName, SYMBOL_TYPE_NUMBER_8BIT, &nValue8);
+                break;
+            }
+            case SYMBOL_TYPE_NUMBER_16BIT:
+                nRetVal = pushSymbol(szName, SYMBOL_TYPE_NUMBER_16BIT, &pRecords[i].value);
+                break;
+            case SYMBOL_TYPE_STRING:
+                if (pRecords[i].value >= pHeader->stringPoolSize ||
+                    NULL == memchr((pStringPool + pRecords[i].value), '\0', (pHeader->stringPoolSize - pRecords[i].value)))
+                {
+                    printf("ERROR: Invalid symbol snapshot (%s)\r\n", pszFileName);
+                    nRetVal = -1;
+                    break;
+                }
+                nRetVal = pushSymbol(szName, SYMBOL_TYPE_STRING, (pStringPool + pRecords[i].value));
+                break;
+            default:
+                break;
+        }
+    }
+    
+Exit:
+    
+    munmap(pSnapshot, fileStat.st_size);
+    return nRetVal;
+}
+
+
+// Parse an INCBIN operand - the file name (quoted if it holds blanks or commas), then an optional byte offset and an
+// optional length separated by commas - and check the range against the file.  The contents aren't read, so pass 1 can
+// size the directive from this alone.  Returns the number of bytes included, or -1.
+//
+int parseIncludeBinary(char *pszOperand, char *pszFileName, UINT16 *pnOffset, int nLineNumber)
+{
+    struct stat fileStat;
+    char   *pszNext;
+    char   *pszToken;
+    char   *pszContext;
+    int    nNameLength = 0;
+    UINT16 nLength = 0;
+    bool   fLength = false;
+    
+    *pnOffset = 0;
+    
+    if (pszOperand)
+    {
+        pszOperand += strspn(pszOperand, " \t");
+        if ('\"' == *pszOperand)
+        {
+            nNameLength = (int)strcspn(++pszOperand, "\"\r\n");
+            pszNext     = pszOperand + nNameLength + ('\"' == pszOperand[nNameLength] ? 1 : 0);
+            if ('\"' != pszOperand[nNameLength])
+                nNameLength = 0;
+        }
+        else
+        {
+            nNameLength = (int)strcspn(pszOperand, ", \t\r\n");
+            pszNext     = pszOperand + nNameLength;
+        }
+    }
+    
+    if (0 == nNameLength || nNameLength >= MAX_LINE_LENGTH)
+    {
+        printf("ERROR: Invalid INCBIN directive on line %d\r\n", nLineNumber);
+        return -1;
+    }
+    memcpy(pszFileName, pszOperand, nNameLength);
+    pszFileName[nNameLength] = '\0';
+    
+    // The offset and length run up to the first blank (anything after it is a comment).
+    //
+    pszNext[strcspn(pszNext, " \t\r\n")] = '\0';
+    if (',' == *pszNext)
+    {
+        if (NULL == (pszToken = strtok_r (pszNext, ",", &pszContext)) || convertToNumber(pszToken, pnOffset) ||
+            (NULL != (pszToken = strtok_r (NULL, ",", &pszContext)) && (convertToNumber(pszToken, &nLength) ||
+                                                                        NULL != strtok_r (NULL, ",", &pszContext))))
+        {
+            printf("ERROR: Invalid INCBIN offset or length on line %d\r\n", nLineNumber);
+            return -1;
+        }
+        fLength = (NULL != pszToken);
+    }
+    else if (*pszNext)
+    {
+        printf("ERROR: Invalid INCBIN directive on line %d\r\n", nLineNumber);
+        return -1;
+    }
+    
+    if (stat(pszFileName, &fileStat) < 0)
+    {
+        printf("ERROR: INCBIN file not found (%s) on line %d\r\n", pszFileName, nLineNumber);
+        return -1;
+    }
+    
+    if (!fLength && fileStat.st_size >= *pnOffset)
+    {
+        if (fileStat.st_size - *pnOffset >= MEM_IMAGE_SIZE)
+        {
+            printf("ERROR: INCBIN file is larger than the address space (%s) on line %d\r\n", pszFileName, nLineNumber);
+            return -1;
+        }
+        nLength = (UINT16)(fileStat.st_size - *pnOffset);
+    }
+    
+    if ((off_t)*pnOffset + nLength > fileStat.st_size)
+    {
+        printf("ERROR: INCBIN offset or length is past the end of the file (%s) on line %d\r\n", pszFileName, nLineNumber);
+        return -1;
+    }
+    
+    return nLength;
 }
 
 
@@ -230,7 +648,9 @@ int computeAddrMode(UINT16 nCurrentAddr, INSTRUCTION *pInst, char *pszParamStrin
             {
                 int nTemp;
                 convertToNumber(szValue, pnParamValue);
-                if (*pnParamValue <= 255)
+                
+                // Page zero addresses use direct mode, unless the instruction doesn't offer it (CLR, INC, JMP, ...).
+                if (*pnParamValue <= 255 && lookUpMatchingAddrMode(pInst, DIR))
                 {
                     *paddrMode = DIR;
                 }
@@ -264,7 +684,7 @@ int computeAddrMode(UINT16 nCurrentAddr, INSTRUCTION *pInst, char *pszParamStrin
                 {
                     int nTemp;
                     
-                    if (tempSymbolValue->nsymbolValue16 <= 255)
+                    if (tempSymbolValue->nsymbolValue16 <= 255 && lookUpMatchingAddrMode(pInst, DIR))
                     {
                         *paddrMode = DIR;
                         *pnParamValue = (UINT8)(tempSymbolValue->nsymbolValue16 & 0xFF);
@@ -299,6 +719,88 @@ int computeAddrMode(UINT16 nCurrentAddr, INSTRUCTION *pInst, char *pszParamStrin
     return iRet;
 }
 
+// Extract the value from an instruction parameter the same way computeAddrMode() does (working on a copy since
+// isIndirectParams() modifies it).
+//
+void getParamValue(char *pszParamString, char *pszValue)
+{
+    char szParam[MAX_LINE_LENGTH];
+    ADDRMODE addrMode;
+
+    strncpy(szParam, pszParamString, MAX_LINE_LENGTH - 1);
+    szParam[MAX_LINE_LENGTH - 1] = '\0';
+
+    if (*szParam == '#')
+    {
+        strncpy(pszValue, (szParam + 1), MAX_SYMBOL_NAME_LENGTH);
+    }
+    else if (!isIndirectParams(szParam, pszValue, &addrMode))
+    {
+        strncpy(pszValue, szParam, MAX_SYMBOL_NAME_LENGTH);
+    }
+    pszValue[MAX_SYMBOL_NAME_LENGTH - 1] = '\0';
+
+    trimTrailingWhitespace(pszValue);
+}
+
+
+// Returns true if the instruction parameter refers to a symbol rather than a numeric constant.  The addressing mode (and
+// therefore the instruction size) of such a parameter can't be determined until the symbol's value is known.
+//
+bool isSymbolicParam(char *pszParamString)
+{
+    char szValue[MAX_SYMBOL_NAME_LENGTH];
+
+    getParamValue(pszParamString, szValue);
+
+    return !isValidNumber(szValue);
+}
+
+
+// Returns the symbol table index of the symbol an instruction parameter refers to, or -1 for a numeric constant.
+//
+int findParamSymbol(char *pszParamString)
+{
+    char szValue[MAX_SYMBOL_NAME_LENGTH];
+
+    getParamValue(pszParamString, szValue);
+
+    return (isValidNumber(szValue) ? -1 : findSymbolIndex(szValue));
+}
+
+
+// Convert one FCB/FDB/FILL value - a number, or a symbol of the matching size.  The symbol table index of a symbol is
+// returned through pnSymbol when references are being recorded (-1 otherwise).
+//
+int getDataValue(char *pszToken, SYMBOLTYPE expectedType, const char *pszDirective, UINT16 *pnValue, int *pnSymbol)
+{
+    SYMBOLVALUE *symbolValue;
+    SYMBOLTYPE  symbolType = expectedType;
+    
+    *pnSymbol = -1;
+    
+    if (convertToNumber(pszToken, pnValue))
+    {
+        if (!findSymbol(pszToken, &symbolType, &symbolValue) || symbolType != expectedType)
+        {
+            printf("ERROR: %s symbol \'%s\' type doesn't match expected (type=%d)\r\n", pszDirective, pszToken, (int)symbolType);
+            return -1;
+        }
+        *pnValue = (expectedType == SYMBOL_TYPE_NUMBER_8BIT ? symbolValue->nsymbolValue8 : symbolValue->nsymbolValue16);
+        if (g_fCrossReference || g_fWatch)
+            *pnSymbol = findSymbolIndex(pszToken);
+    }
+    
+    if (expectedType == SYMBOL_TYPE_NUMBER_8BIT && *pnValue > 255)
+    {
+        printf("ERROR: %s symbol value is larger than allowed (value=0x%04x)\r\n", pszDirective, (int)*pnValue);
+        return -1;
+    }
+    
+    return 0;
+}
+
+
 char convertToChar(UINT8 nNumber)
 {
     if (nNumber >= 0 && nNumber <= 9)
@@ -310,40 +812,58 @@ char convertToChar(UINT8 nNumber)
     return '0';
 }
 
-int writeSRecordLine(int fpSRecord, UINT16 nAddr, char *pDataChars, UINT16 nNumDataChars, UINT16 nChecksum)
+// Number of address bytes carried by an S-record type (S1/S9 == 2, S2/S8 == 3, S3/S7 == 4).
+//
+int getSRecordAddressBytes(UINT8 nType)
+{
+    switch (nType)
+    {
+        case 2: case 8: return 3;
+        case 3: case 7: return 4;
+        default:        return 2;
+    }
+}
+
+// SRecord Line: SnLLAAAAddddddddCC  (n == record type, LL == number of char pairs to follow, AAAA == 2, 3 or 4 address
+// bytes, dddddd == data char pairs, CC == checksum)
+int writeSRecordLine(int fpSRecord, UINT8 nType, UINT32 nAddr, char *pDataChars, UINT16 nNumDataChars, UINT32 nChecksum)
 {
-    char szTemp[NUM_SREC_TYPE_CHARS + NUM_CHARPAIR_CHARS + NUM_LOADADDRESS_CHARS + 1];
-    UINT16 nCharPairs = ((NUM_LOADADDRESS_CHARS + nNumDataChars + NUM_CHECKSUM_CHARS) >> 1);
-    UINT16 nSRecChecksum = nChecksum;
+    char szTemp[NUM_SREC_TYPE_CHARS + NUM_CHARPAIR_CHARS + (MAX_SREC_ADDRESS_BYTES * 2) + 1];
+    int nAddrBytes = getSRecordAddressBytes(nType);
+    UINT16 nCharPairs = (UINT16)(nAddrBytes + ((nNumDataChars + NUM_CHECKSUM_CHARS) >> 1));
+    UINT32 nSRecChecksum = nChecksum;
     
-    sprintf(szTemp, "S1%02X%04X", nCharPairs, nAddr);
+    sprintf(szTemp, "S%d%02X%0*lX", nType, nCharPairs, nAddrBytes * 2, nAddr);
     write(fpSRecord, szTemp, strlen(szTemp));
-    write(fpSRecord, pDataChars, nNumDataChars);
-    nSRecChecksum += (UINT8)((nAddr & 0xFF00) >> 8);
-    nSRecChecksum += (UINT8)(nAddr & 0xFF);
+    if (nNumDataChars)
+        write(fpSRecord, pDataChars, nNumDataChars);
+    for (int i=0 ; i<nAddrBytes ; i++)
+        nSRecChecksum += (UINT8)(nAddr >> (i * 8));
     nSRecChecksum += nCharPairs;
-    nSRecChecksum = (0xffff - (nSRecChecksum & 0xff));
+    nSRecChecksum = (0xff - (nSRecChecksum & 0xff));
     sprintf(szTemp, "%02X\r\n", (UINT8)nSRecChecksum);
     write(fpSRecord, szTemp, strlen(szTemp));
     
     return 0;
 }
 
-// SRecord Line: S1LLNNNNddddddddCC  (LL == number of char pairs to follow, NNNN == address, dddddd == data char pairs, CC == checksum)
-int writeToSRecord(int fpSRecord, UINT16 nAddr, UINT8 *pBytes, int NumBytes)
+// Buffer bytes into data records of g_srecDataBytes bytes, starting a new record whenever the address isn't contiguous.
+// A call with no data at address 0 flushes the buffer.
+//
+int writeToSRecord(int fpSRecord, UINT32 nAddr, UINT8 *pBytes, int NumBytes)
 {
     static int    SRecLineChars  = 0;
-    static UINT16 nSRecCurrAddr  = 0;
-    static UINT16 nSRecStartAddr = 0;
-    static UINT16 nSRecChecksum  = 0;
-    static char   szSRecLine[MAX_S19_CHARS];
+    static UINT32 nSRecCurrAddr  = 0;
+    static UINT32 nSRecStartAddr = 0;
+    static UINT32 nSRecChecksum  = 0;
+    static char   szSRecLine[MAX_SREC_DATA_BYTES * 2];
 
     if ((nSRecCurrAddr != nAddr) || (0 == nAddr && NULL == pBytes && 0 == NumBytes))
     {
         // If there are characters in the write buffer, flush it here.
         if (SRecLineChars)
         {
-            writeSRecordLine(fpSRecord, nSRecStartAddr, szSRecLine, SRecLineChars, nSRecChecksum);
+            writeSRecordLine(fpSRecord, g_srecType, nSRecStartAddr, szSRecLine, SRecLineChars, nSRecChecksum);
             
             SRecLineChars = 0;
             nSRecChecksum = 0;
@@ -360,9 +880,9 @@ int writeToSRecord(int fpSRecord, UINT16 nAddr, UINT8 *pBytes, int NumBytes)
         nSRecCurrAddr++;
         pBytes++;
                 
-        if (SRecLineChars >= MAX_S19_CHARS)
+        if (SRecLineChars >= (g_srecDataBytes * 2))
         {
-            writeSRecordLine(fpSRecord, nSRecStartAddr, szSRecLine, SRecLineChars, nSRecChecksum);
+            writeSRecordLine(fpSRecord, g_srecType, nSRecStartAddr, szSRecLine, SRecLineChars, nSRecChecksum);
             
             SRecLineChars  = 0;
             nSRecChecksum  = 0;
@@ -374,427 +894,781 @@ int writeToSRecord(int fpSRecord, UINT16 nAddr, UINT8 *pBytes, int NumBytes)
 }
 
 
-int assembleSource(SOURCEFILE *pSourceFile, int fpSRecord, int fpListing)
+// Termination record carrying the start address: S9 after S1 data records, S8 after S2 and S7 after S3.
+//
+int writeSRecordEnd(int fpSRecord, UINT16 nStartAddr)
 {
-    char line[MAX_LINE_LENGTH];
-    char saveLine[MAX_LINE_LENGTH];
+    return writeSRecordLine(fpSRecord, (UINT8)(10 - g_srecType), nStartAddr, NULL, 0, 0);
+}
 
-    char symbolName[MAX_SYMBOL_NAME_LENGTH];
-    char *pszToken;
-    INSTRUCTION *pInst;
-    UINT16 nParam = 0;
-    char mneumonic[MAX_MNEUMONIC_LENGTH + 1];
-    ADDRMODE addrMode;
-    int  nLocalLineNum = pSourceFile->lineNumber;
-    UINT16 nAddr = 0;
-    char szTempString[MAX_LINE_LENGTH];
-    
-    // Read each source file line until we encounter EOF or an error.
-    //
-    while(getNextFileLine(pSourceFile, line, MAX_LINE_LENGTH) == 0)
-    {   
-        // Make a copy of the line since we're going to modify it during parsing...
-        //
-        strncpy(saveLine, line, MAX_LINE_LENGTH);
+
+// Record a line whose parameter was a forward reference sized as extended by pass 1.  Lines are added in source order
+// (the lines of a macro expansion share the offset of the line that invoked it, in expansion order).
+//
+int addForwardReference(int nLineOffset, int nMacroLine)
+{
+    if (g_forwardRefCount == g_forwardRefsAllocated)
+    {
+        int nNewCount = (g_forwardRefsAllocated ? g_forwardRefsAllocated * 2 : 256);
+        LINEREF *pTemp;
         
-        // Output the current source line to a listing file.
-        //
-        if (fpListing)
+        if (NULL == (pTemp = (LINEREF *)realloc(g_forwardRefs, (sizeof(LINEREF) * nNewCount))))
         {
-            sprintf(szTempString, "%04d ", pSourceFile->lineNumber);
-            write(fpListing, szTempString, strlen(szTempString));
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(LINEREF) * nNewCount));
+            return -1;
         }
+        g_forwardRefs          = pTemp;
+        g_forwardRefsAllocated = nNewCount;
+    }
+    
+    g_forwardRefs[g_forwardRefCount].lineOffset = nLineOffset;
+    g_forwardRefs[g_forwardRefCount].macroLine  = nMacroLine;
+    g_forwardRefCount++;
+    
+    return 0;
+}
+
+
+// Returns true if the line is in a list of forward reference lines (binary search).
+//
+bool findForwardReference(LINEREF *pForwardRefs, int nCount, int nLineOffset, int nMacroLine)
+{
+    int nLow  = 0;
+    int nHigh = nCount - 1;
+    
+    while (nLow <= nHigh)
+    {
+        int nMid = (nLow + nHigh) / 2;
         
-        // Increment the local line number (used because the source file line number is used recursively).
-        //
-        ++nLocalLineNum;
+        if (pForwardRefs[nMid].lineOffset == nLineOffset && pForwardRefs[nMid].macroLine == nMacroLine)
+            return true;
         
-        // Skip comments or blank lines.
-        //
-        if (isCommentLine(line) || isBlankLine(line))
-        {
-            if (fpListing)
-            {
-                sprintf(szTempString, "%s\r\n", saveLine);
-                write(fpListing, szTempString, strlen(szTempString));
-            }
-            continue;
-        }
-        
-        // If the line contains a symbol definition, read the value or compute the address it
-        // refers to and push the information into the symbol table for later use.
-        //
-        if (isSymbolLine(line))
+        if (pForwardRefs[nMid].lineOffset < nLineOffset ||
+            (pForwardRefs[nMid].lineOffset == nLineOffset && pForwardRefs[nMid].macroLine < nMacroLine))
+            nLow = nMid + 1;
+        else
+            nHigh = nMid - 1;
+    }
+    
+    return false;
+}
+
+
+// Returns true if pass 1 sized the line as an extended mode forward reference.
+//
+bool isForwardReference(int nLineOffset, int nMacroLine)
+{
+    return findForwardReference(g_forwardRefs, g_forwardRefCount, nLineOffset, nMacroLine);
+}
+
+
+// Peephole optimizer rules, applied in table order (the first matching rule wins).  Every rewrite produces the same
+// registers, memory and N/Z/V bits as the original instruction - the C and H bits listed must be dead for the rewrite.
+// The instruction table entries are looked up by buildPeepholeTables() and the counts are kept by the statement walks.
+//
+PEEPHOLERULE g_peepholeRules[] =
+{
+    { PEEPHOLE_REPLACE,    "LDAA", 0, "CLRA", CCR_C,         "LDAA #0 -> CLRA", NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_REPLACE,    "LDAB", 0, "CLRB", CCR_C,         "LDAB #0 -> CLRB", NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_REPLACE,    "ADDA", 1, "INCA", CCR_C | CCR_H, "ADDA #1 -> INCA", NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_REPLACE,    "ADDB", 1, "INCB", CCR_C | CCR_H, "ADDB #1 -> INCB", NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_REPLACE,    "SUBA", 1, "DECA", CCR_C,         "SUBA #1 -> DECA", NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_REPLACE,    "SUBB", 1, "DECB", CCR_C,         "SUBB #1 -> DECB", NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_SHORT_JUMP, "JMP",  0, "BRA",  0,             "JMP -> BRA",      NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_DROP_LOAD,  "LDAA", 0, "STAA", 0,             "STAA x / LDAA x", NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_DROP_LOAD,  "LDAB", 0, "STAB", 0,             "STAB x / LDAB x", NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_DROP_LOAD,  "LDD",  0, "STD",  0,             "STD x / LDD x",   NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_DROP_LOAD,  "LDX",  0, "STX",  0,             "STX x / LDX x",   NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_DROP_LOAD,  "LDY",  0, "STY",  0,             "STY x / LDY x",   NULL, NULL, 0, 0, 0 },
+    { PEEPHOLE_DROP_LOAD,  "LDS",  0, "STS",  0,             "STS x / LDS x",   NULL, NULL, 0, 0, 0 },
+    { 0,                   NULL,   0, NULL,   0,             NULL,              NULL, NULL, 0, 0, 0 }
+};
+
+// Condition code effects of every instruction that reads C or H, sets them without reading them, or transfers control.
+// Anything not listed here leaves C and H alone.
+//
+CCREFFECT g_ccrEffectTable[] =
+{
+    { "ABA",   CCR_WRITES_C | CCR_WRITES_H },
+    { "ADCA",  CCR_READS_C | CCR_WRITES_C | CCR_WRITES_H },
+    { "ADCB",  CCR_READS_C | CCR_WRITES_C | CCR_WRITES_H },
+    { "ADDA",  CCR_WRITES_C | CCR_WRITES_H },
+    { "ADDB",  CCR_WRITES_C | CCR_WRITES_H },
+    { "ADDD",  CCR_WRITES_C },
+    { "ASL",   CCR_WRITES_C },
+    { "ASLA",  CCR_WRITES_C },
+    { "ASLB",  CCR_WRITES_C },
+    { "ASLD",  CCR_WRITES_C },
+    { "ASR",   CCR_WRITES_C },
+    { "ASRA",  CCR_WRITES_C },
+    { "ASRB",  CCR_WRITES_C },
+    { "BCC",   CCR_FLOW },
+    { "BCS",   CCR_FLOW },
+    { "BEQ",   CCR_FLOW },
+    { "BGE",   CCR_FLOW },
+    { "BGT",   CCR_FLOW },
+    { "BHI",   CCR_FLOW },
+    { "BHS",   CCR_FLOW },
+    { "BLE",   CCR_FLOW },
+    { "BLO",   CCR_FLOW },
+    { "BLS",   CCR_FLOW },
+    { "BLT",   CCR_FLOW },
+    { "BMI",   CCR_FLOW },
+    { "BNE",   CCR_FLOW },
+    { "BPL",   CCR_FLOW },
+    { "BRA",   CCR_FLOW },
+    { "BRCLR", CCR_FLOW },
+    { "BRN",   CCR_FLOW },
+    { "BRSET", CCR_FLOW },
+    { "BSR",   CCR_FLOW },
+    { "BVC",   CCR_FLOW },
+    { "BVS",   CCR_FLOW },
+    { "CBA",   CCR_WRITES_C },
+    { "CLC",   CCR_WRITES_C },
+    { "CLR",   CCR_WRITES_C },
+    { "CLRA",  CCR_WRITES_C },
+    { "CLRB",  CCR_WRITES_C },
+    { "CMPA",  CCR_WRITES_C },
+    { "CMPB",  CCR_WRITES_C },
+    { "COM",   CCR_WRITES_C },
+    { "COMA",  CCR_WRITES_C },
+    { "COMB",  CCR_WRITES_C },
+    { "CPD",   CCR_WRITES_C },
+    { "CPX",   CCR_WRITES_C },
+    { "CPY",   CCR_WRITES_C },
+    { "DAA",   CCR_READS_C | CCR_READS_H | CCR_WRITES_C },
+    { "FDIV",  CCR_WRITES_C },
+    { "IDIV",  CCR_WRITES_C },
+    { "JMP",   CCR_FLOW },
+    { "JSR",   CCR_FLOW },
+    { "LSL",   CCR_WRITES_C },
+    { "LSLA",  CCR_WRITES_C },
+    { "LSLB",  CCR_WRITES_C },
+    { "LSLD",  CCR_WRITES_C },
+    { "LSR",   CCR_WRITES_C },
+    { "LSRA",  CCR_WRITES_C },
+    { "LSRB",  CCR_WRITES_C },
+    { "LSRD",  CCR_WRITES_C },
+    { "MUL",   CCR_WRITES_C },
+    { "NEG",   CCR_WRITES_C },
+    { "NEGA",  CCR_WRITES_C },
+    { "NEGB",  CCR_WRITES_C },
+    { "ROL",   CCR_READS_C | CCR_WRITES_C },
+    { "ROLA",  CCR_READS_C | CCR_WRITES_C },
+    { "ROLB",  CCR_READS_C | CCR_WRITES_C },
+    { "ROR",   CCR_READS_C | CCR_WRITES_C },
+    { "RORA",  CCR_READS_C | CCR_WRITES_C },
+    { "RORB",  CCR_READS_C | CCR_WRITES_C },
+    { "RTI",   CCR_FLOW },
+    { "RTS",   CCR_FLOW },
+    { "SBA",   CCR_WRITES_C },
+    { "SBCA",  CCR_READS_C | CCR_WRITES_C },
+    { "SBCB",  CCR_READS_C | CCR_WRITES_C },
+    { "SEC",   CCR_WRITES_C },
+    { "STOP",  CCR_FLOW },
+    { "SUBA",  CCR_WRITES_C },
+    { "SUBB",  CCR_WRITES_C },
+    { "SUBD",  CCR_WRITES_C },
+    { "SWI",   CCR_FLOW },
+    { "TAP",   CCR_WRITES_C | CCR_WRITES_H },
+    { "TEST",  CCR_FLOW },
+    { "TPA",   CCR_READS_C | CCR_READS_H },
+    { "TST",   CCR_WRITES_C },
+    { "TSTA",  CCR_WRITES_C },
+    { "TSTB",  CCR_WRITES_C },
+    { "WAI",   CCR_FLOW },
+    { NULL,    0 }
+};
+
+
+// Resolve the peephole rule mneumonics and build the condition code effects for each instruction table entry.
+//
+int buildPeepholeTables(void)
+{
+    int nInstructions = 0;
+    
+    if (g_ccrEffects)
+        return 0;
+    
+    for (PEEPHOLERULE *pRule = g_peepholeRules ; pRule->pszMatch ; pRule++)
+    {
+        if (NULL == (pRule->pMatch = lookUpMneumonic(pRule->pszMatch)) || NULL == (pRule->pOther = lookUpMneumonic(pRule->pszOther)))
         {
-            // Get the first token - this should be the symbol name (may end with a ':' character).
-            //
-            if (NULL != (pszToken = strtok (line, ": \t\r\n")))
-            {
-                strncpy(symbolName, pszToken, MAX_SYMBOL_NAME_LENGTH);
-                if (NULL != (pszToken = strtok (NULL, " \t\r\n")))
-                {                
-                    // *** EQU ***
-                    if (strcasecmp(pszToken, "EQU") == 0)
-                    {
-                        if (fpListing)
-                        {
-                            sprintf(szTempString, "%s\r\n", saveLine);
-                            write(fpListing, szTempString, strlen(szTempString));
-                        }
-                        continue;
-                    }
-                }
-                else
-                {
-                    continue;
-                }
-            }
+            printf("ERROR: Invalid peephole rule (%s)\r\n", pRule->pszDescription);
+            return -1;
         }
-        else
+    }
+    
+    while (instructions[nInstructions].mnemonic[0] != '\0')
+        nInstructions++;
+    
+    if (NULL == (g_ccrEffects = (UINT8 *)calloc(nInstructions, sizeof(UINT8))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", nInstructions);
+        return -1;
+    }
+    
+    for (int i=0 ; i<nInstructions ; i++)
+    {
+        for (CCREFFECT *pEffect = g_ccrEffectTable ; pEffect->pszMneumonic ; pEffect++)
         {
-            if (NULL == (pszToken = strtok (line, " \t\r\n")))
+            if (!strcmp(pEffect->pszMneumonic, instructions[i].mnemonic))
             {
-                continue;
+                g_ccrEffects[i] = pEffect->effects;
+                break;
             }
-            
         }
+    }
+    
+    return 0;
+}
+
+
+// Record a line rewritten by the peephole optimizer.  Lines are added in source order.
+//
+int addRewrite(int nLineOffset, int nRule)
+{
+    if (g_rewriteCount == g_rewritesAllocated)
+    {
+        int nNewCount = (g_rewritesAllocated ? g_rewritesAllocated * 2 : 256);
+        REWRITE *pTemp;
         
-        // If there is no more data to process on this line, continue to the next.
-        //
-        if (isCommentLine(pszToken) || isBlankLine(pszToken))
+        if (NULL == (pTemp = (REWRITE *)realloc(g_rewrites, (sizeof(REWRITE) * nNewCount))))
         {
-            continue;
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(REWRITE) * nNewCount));
+            return -1;
         }
+        g_rewrites          = pTemp;
+        g_rewritesAllocated = nNewCount;
+    }
+    
+    g_rewrites[g_rewriteCount].lineOffset = nLineOffset;
+    g_rewrites[g_rewriteCount].rule       = nRule;
+    g_rewriteCount++;
+    
+    return 0;
+}
+
+
+// Returns the rule a list of rewrites applies to the line, or -1 if the line isn't in the list (binary search).
+//
+int findRewriteRule(REWRITE *pRewrites, int nCount, int nLineOffset)
+{
+    int nLow  = 0;
+    int nHigh = nCount - 1;
+    
+    while (nLow <= nHigh)
+    {
+        int nMid = (nLow + nHigh) / 2;
         
-        // At this point we should have a valid instruction, start processing known instructions.
-        //
+        if (pRewrites[nMid].lineOffset == nLineOffset)
+            return pRewrites[nMid].rule;
         
-        // *** ORG ***
-        if (strcasecmp(pszToken, "ORG") == 0)
+        if (pRewrites[nMid].lineOffset < nLineOffset)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid - 1;
+    }
+    
+    return -1;
+}
+
+
+// Returns the peephole rule pass 1 applied to the line, or -1 if the line is encoded as written.
+//
+int findRewrite(int nLineOffset)
+{
+    return findRewriteRule(g_rewrites, g_rewriteCount, nLineOffset);
+}
+
+
+// Returns true if the condition code bits are overwritten before anything can read them, following the straight-line
+// code after the statement.  Anything that leaves the straight-line path (branches, calls, data, ORG) counts as a read.
+//
+bool isFlagDead(CHUNK *pChunks, int nChunks, int nChunk, int nStmt, UINT8 nFlags)
+{
+    int nLookAhead = 0;
+    
+    while (nFlags && nLookAhead++ < PEEPHOLE_LOOKAHEAD)
+    {
+        STATEMENT *pStmt;
+        UINT8     nEffects;
+        
+        while (++nStmt >= pChunks[nChunk].statementCount)
         {
-            if (NULL == (pszToken = strtok (NULL, " \t\r\n")) || convertToNumber(pszToken, &nAddr))
-            {
-                printf("ERROR: Invalid ORG instruction\r\n");
-                return -1;
-            }
-            
-            // If we haven't already found the start address ("START" symbol), use the first ORG section found...
-            if (!g_startAddress)
-            {
-                g_startAddress = nAddr;
-            }
-            
-            if (fpListing)
-            {
-                sprintf(szTempString, "%s\r\n", saveLine);
-                write(fpListing, szTempString, strlen(szTempString));
-            }
-            continue;
+            if (++nChunk >= nChunks)
+                return false;
+            nStmt = -1;
         }
+        pStmt = &pChunks[nChunk].pStatements[nStmt];
         
-        // *** RMB ***
-        if (strcasecmp(pszToken, "RMB") == 0)
-        {
-            if (fpListing)
-            {
-                sprintf(szTempString, "%s\r\n", saveLine);
-                write(fpListing, szTempString, strlen(szTempString));
-            }
+        // Labels, equates and the stack budget don't generate code.
+        //
+        if (pStmt->kind == STMT_LABEL || pStmt->kind == STMT_EQU || pStmt->kind == STMT_EQU_STRING || pStmt->kind == STMT_STACK)
             continue;
-        }
         
-        // *** FCB ***
-        if (strcasecmp(pszToken, "FCB") == 0)
-        {
-            if (NULL != (pszToken = strtok (NULL, " \t\r\n")))
-            {
-                UINT16 nValue = 0;
-                if (convertToNumber(pszToken, &nValue))
-                {
-                    SYMBOLVALUE *symbolValue;
-                    SYMBOLTYPE  symbolType;
-                    if (!findSymbol(pszToken, &symbolType, &symbolValue) || symbolType != SYMBOL_TYPE_NUMBER_8BIT)
-                    {
-                        printf("ERROR: FCB symbol \'%s\' type doesn't match expected (type=%d)\r\n", pszToken, (int)symbolType);
-                        return -1;
-                    }
-                    nValue = symbolValue->nsymbolValue8;
-                }
-                if (nValue > 255)
-                {
-                    printf("ERROR: FCB symbol value is larger than allowed (value=0x%04x)\r\n", (int)nValue);
-                    return -1;
-                }
-                
-                writeToSRecord(fpSRecord, nAddr, (UINT8 *)&nValue, 1);
+        if ((pStmt->kind != STMT_SIZED && pStmt->kind != STMT_DEFERRED) || NULL == pStmt->pInst)
+            return false;
+        
+        nEffects = g_ccrEffects[pStmt->pInst - instructions];
+        if ((nEffects & CCR_FLOW) || ((nFlags & CCR_C) && (nEffects & CCR_READS_C)) || ((nFlags & CCR_H) && (nEffects & CCR_READS_H)))
+            return false;
+        
+        if (nEffects & CCR_WRITES_C)
+            nFlags &= ~CCR_C;
+        if (nEffects & CCR_WRITES_H)
+            nFlags &= ~CCR_H;
+    }
+    
+    return (0 == nFlags);
+}
 
-                if (fpListing)
-                {
-                    sprintf(szTempString, "%04x %02x", nAddr, (nValue & 0xff));
-                    write(fpListing, szTempString, strlen(szTempString));
-                    sprintf(szTempString, "%s\r\n", saveLine);
-                    write(fpListing, szTempString, strlen(szTempString));
-                }
-            }
-                    
-            nAddr += 1; // One byte
+
+// Apply the first peephole rule that matches an instruction statement, returning the number of bytes the statement now
+// occupies (or -1 on failure).  pPrevInst is the instruction statement immediately before it, if nothing else intervenes.
+//
+int optimizeStatement(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks, int nChunk, int nStmt, STATEMENT *pPrevInst, int nSize)
+{
+    STATEMENT *pStmt = &pChunks[nChunk].pStatements[nStmt];
+    char szParam[MAX_LINE_LENGTH];
+    ADDRMODE addrMode = INVALID;
+    UINT16 nParam = 0;
+    bool fParamKnown = false;
+    bool fParamParsed = false;
+    
+    // Rewrites are recorded by source line, which the lines of a macro expansion share, so those are left as written.
+    //
+    if (pStmt->macroLine)
+        return nSize;
+    
+    for (int nRule=0 ; g_peepholeRules[nRule].pszMatch ; nRule++)
+    {
+        PEEPHOLERULE *pRule = &g_peepholeRules[nRule];
+        INSTRUCTION  *pInst;
+        int          nNewSize;
+        
+        if (pRule->pMatch != pStmt->pInst || 0 == pStmt->spanLength)
             continue;
-        }
         
-        // *** FDB ***
-        if (strcasecmp(pszToken, "FDB") == 0)
+        // Only evaluate the parameter once some rule needs it (symbols defined later in the file aren't known yet).
+        //
+        if (!fParamParsed)
         {
-            if (NULL != (pszToken = strtok (NULL, " \t\r\n")))
-            {
-                UINT16 nValue = 0;
-                UINT8 nTemp;
-                if (convertToNumber(pszToken, &nValue))
-                {
-                    SYMBOLVALUE *symbolValue;
-                    SYMBOLTYPE  symbolType;
-                    if (!findSymbol(pszToken, &symbolType, &symbolValue) || symbolType != SYMBOL_TYPE_NUMBER_16BIT)
-                    {
-                        printf("ERROR: FCB symbol \'%s\' type doesn't match expected (type=%d)\r\n", pszToken, (int)symbolType);
-                        return -1;
-                    }
-                    nValue = symbolValue->nsymbolValue16;
-                }
-                
-                nTemp = ((nValue & 0xff00) >> 8);
-                writeToSRecord(fpSRecord, nAddr, &nTemp, 1);
-                nTemp = (nValue & 0xff);
-                writeToSRecord(fpSRecord, (nAddr + 1), &nTemp, 1);
-                
-                if (fpListing)
-                {
-                    sprintf(szTempString, "%04x %04x", nAddr, nValue);
-                    write(fpListing, szTempString, strlen(szTempString));
-                    sprintf(szTempString, "%s\r\n", saveLine);
-                    write(fpListing, szTempString, strlen(szTempString));
-                }
-            }
-            
-            nAddr += 2; // Two bytes
-            continue;
+            memcpy(szParam, (pSourceFile->pFile + pStmt->spanOffset), pStmt->spanLength);
+            szParam[pStmt->spanLength] = '\0';
+            fParamKnown  = (0 == computeAddrMode(pStmt->addr, pStmt->pInst, szParam, &addrMode, &nParam));
+            fParamParsed = true;
         }
         
-        // *** FCC ***
-        if (strcasecmp(pszToken, "FCC") == 0)
+        switch (pRule->kind)
         {
-            if (NULL == (pszToken = strtok (NULL, "\"\r\n")))
-            {
-                printf("ERROR: Invalid FCC instruction\r\n");
-                return -1;
-            }
-            else
-            {
-                writeToSRecord(fpSRecord, nAddr, (UINT8 *)pszToken, (int)strlen(pszToken));
+            case PEEPHOLE_REPLACE:
+                if (!fParamKnown || addrMode != IMM || nParam != pRule->operand || !isFlagDead(pChunks, nChunks, nChunk, nStmt, pRule->deadFlags))
+                    continue;
+                pInst    = lookUpMatchingAddrMode(pStmt->pInst, IMM);
+                nNewSize = pRule->pOther->numBytes;
+                break;
                 
-                if (fpListing)
-                {
-                    sprintf(szTempString, "%04x ", nAddr);
-                    write(fpListing, szTempString, (int)strlen(szTempString));
-        
-                    for (char *pTemp = pszToken ; *pTemp != '\0' ; pTemp++)
-                    {
-                        sprintf(szTempString, "%02x ", *pTemp);
-                        write(fpListing, szTempString, (int)strlen(szTempString));
-                    }
-                    sprintf(szTempString, "%s\r\n", saveLine);
-                    write(fpListing, szTempString, (int)strlen(szTempString));
-                }
+            case PEEPHOLE_SHORT_JUMP:
+                if (!pStmt->fShortJump)
+                    continue;
+                pInst    = lookUpMatchingAddrMode(pStmt->pInst, EXT);
+                nNewSize = pRule->pOther->numBytes;
+                break;
                 
-            }
-            
-            // TODO - how to handle leading spaces?
-            
-            nAddr += strlen(pszToken);
-            continue;
+            case PEEPHOLE_DROP_LOAD:
+                // The load is only redundant if it reads back the location just stored, from memory rather than an I/O register.
+                //
+                if (!fParamKnown || (addrMode != DIR && addrMode != EXT) || NULL == pPrevInst || pPrevInst->pInst != pRule->pOther ||
+                    pPrevInst->spanLength != pStmt->spanLength ||
+                    memcmp((pSourceFile->pFile + pPrevInst->spanOffset), szParam, pStmt->spanLength) ||
+                    (nParam >= IO_REGISTER_BASE && nParam < (IO_REGISTER_BASE + IO_REGISTER_SIZE)))
+                    continue;
+                pInst    = lookUpMatchingAddrMode(pStmt->pInst, addrMode);
+                nNewSize = 0;
+                break;
+                
+            default:
+                continue;
         }
         
-        if (fpListing)
-        {
-            sprintf(szTempString, "%s\r\n", saveLine);
-            write(fpListing, szTempString, strlen(szTempString));
-        }
-
-        // For all other commands, look for the instruction mneumonic in the command list.
-        //
-        if (NULL == (pInst = lookUpMneumonic(pszToken)))
-        {
-            printf("ERROR: Invalid mneumonic \'%s\' on line %d\r\n", pszToken, nLocalLineNum);
+        if (addRewrite(pStmt->lineOffset, nRule))
             return -1;
-        }
-        strncpy(mneumonic, pszToken, MAX_MNEUMONIC_LENGTH);
         
-        // Now, try to find an exact instruction match based on addressing mode.  If this command takes no parameters, we can continue to the next.
-        //
-        // TODO - need a better way to determine that this command only supports inherent addressing.
-        if (NULL == (pszToken = strtok (NULL, " \t\r\n")) || isCommentLine(pszToken) || isBlankLine(pszToken))
+        pRule->count++;
+        pRule->bytesSaved  += (nSize - nNewSize);
+        pRule->cyclesSaved += (pInst ? pInst->numCycles : 0) - (nNewSize ? pRule->pOther->numCycles : 0);
+        
+        return nNewSize;
+    }
+    
+    return nSize;
+}
+
+
+// Decide which JMPs can be encoded as BRA using the addresses from the statement walk that just finished.  A JMP whose
+// target is in range becomes a BRA - rewrites only remove bytes, so the target stays in range unless an ORG block sits in
+// between, in which case the JMP is put back for good.  Returns the number of JMPs changed (the walk is repeated until
+// there are none).
+//
+int relaxJumps(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks)
+{
+    int nChanges = 0;
+    char szParam[MAX_LINE_LENGTH];
+    ADDRMODE addrMode;
+    UINT16 nParam;
+    PEEPHOLERULE *pRule;
+    
+    for (pRule = g_peepholeRules ; pRule->pszMatch && pRule->kind != PEEPHOLE_SHORT_JUMP ; pRule++)
+        ;
+    if (NULL == pRule->pszMatch)
+        return 0;
+    
+    for (int nChunk=0 ; nChunk < nChunks ; nChunk++)
+    {
+        for (int nStmt=0 ; nStmt < pChunks[nChunk].statementCount ; nStmt++)
         {
-            if (pInst->preByte)
+            STATEMENT *pStmt = &pChunks[nChunk].pStatements[nStmt];
+            int       nOffset;
+            
+            if ((pStmt->kind != STMT_SIZED && pStmt->kind != STMT_DEFERRED) || pStmt->pInst != pRule->pMatch ||
+                0 == pStmt->spanLength || pStmt->fLongJump || pStmt->macroLine)
+                continue;
+            
+            memcpy(szParam, (pSourceFile->pFile + pStmt->spanOffset), pStmt->spanLength);
+            szParam[pStmt->spanLength] = '\0';
+            if (computeAddrMode(pStmt->addr, pStmt->pInst, szParam, &addrMode, &nParam) || (addrMode != DIR && addrMode != EXT))
+                continue;
+            
+            nOffset = (int)nParam - (int)(pStmt->addr + (pStmt->fShortJump ? pRule->pOther->numBytes : pStmt->pInst->numBytes));
+            if (pStmt->fShortJump && (nOffset < -128 || nOffset > 127))
             {
-                writeToSRecord(fpSRecord, nAddr,   &pInst->preByte, 1);
-                writeToSRecord(fpSRecord, nAddr+1, &pInst->opCode, 1);
+                pStmt->fShortJump = false;
+                pStmt->fLongJump  = true;
+                nChanges++;
             }
-            else
-                writeToSRecord(fpSRecord, nAddr, &pInst->opCode, 1);
-
-            if (fpListing)
+            else if (!pStmt->fShortJump && nOffset >= -128 && nOffset <= 127)
             {
-                sprintf(szTempString, "%04x ", nAddr);
-                write(fpListing, szTempString, strlen(szTempString));
-                if (pInst->preByte)
-                {
-                    sprintf(szTempString, "%02x %02x %s\r\n", pInst->preByte, pInst->opCode, line);
-                    write(fpListing, szTempString, strlen(szTempString));
-                }
-                else
-                {
-                    sprintf(szTempString, "%02x %s\r\n", pInst->opCode, line);
-                    write(fpListing, szTempString, strlen(szTempString));
-                }
+                pStmt->fShortJump = true;
+                nChanges++;
             }
+        }
+    }
+    
+    return nChanges;
+}
 
-            nAddr += pInst->numBytes;
+
+// Print the bytes and cycles saved by each peephole rule.
+//
+void reportOptimizations(void)
+{
+    int nCount  = 0;
+    int nBytes  = 0;
+    int nCycles = 0;
+    
+    printf("Peephole optimizations:\r\n");
+    for (PEEPHOLERULE *pRule = g_peepholeRules ; pRule->pszMatch ; pRule++)
+    {
+        if (0 == pRule->count)
             continue;
-        }
-        
-        // Compute the addressing mode from the insruction parameters.  At this point all the symbols will be in the symbol table so if we can't
-        // find the addressing mode now, it's an error.
-        //
-        if (computeAddrMode(nAddr, pInst, pszToken, &addrMode, &nParam))
-        {
-            printf("ERROR: Invalid address mode on line %d\r\n", nLocalLineNum);
-            return -1;            
-        }
         
-        // Now that we know the instruction addressing mode, look up the exact match in the instruction table.
-        //
-        if (NULL == (pInst = lookUpMatchingAddrMode(pInst, addrMode)))
-        {
-            printf("ERROR: Instruction \'%s\' doesn\'t offer addressing mode %d\r\n", mneumonic, (int)addrMode);
-            return -1;
-        }
+        printf("    %-20s %5d rewrites, %5d bytes, %5d cycles saved\r\n", pRule->pszDescription, pRule->count, pRule->bytesSaved, pRule->cyclesSaved);
+        nCount  += pRule->count;
+        nBytes  += pRule->bytesSaved;
+        nCycles += pRule->cyclesSaved;
+    }
+    printf("    %-20s %5d rewrites, %5d bytes, %5d cycles saved\r\n\n", "Total", nCount, nBytes, nCycles);
+}
+
+
+// Keep the bytes encoded by the current line with its record (beginLineRecord() reserved the room).  Regions are
+// encoded in parallel, so nothing touches the memory image here - mergeRegion() copies the bytes in once every region is
+// encoded, in source order, so overlapping ORG blocks resolve the same way whatever order the workers ran in.
+//
+void writeToImage(REGION *pRegion, UINT16 nAddr, UINT8 *pBytes, int NumBytes)
+{
+    LINERECORD *pLine = &pRegion->pLines[pRegion->lineCount - 1];
+    
+    if (0 == pLine->numBytes)
+        pLine->addr = nAddr;
+    memcpy((pRegion->pLineBytes + pRegion->lineByteCount), pBytes, NumBytes);
+    pRegion->lineByteCount += NumBytes;
+    pLine->numBytes        += NumBytes;
+}
+
+
+// Make sure the region's byte pool has room for another nBytes bytes.
+//
+int reserveLineBytes(REGION *pRegion, int nBytes)
+{
+    int   nNewSize = (pRegion->lineBytesAllocated ? pRegion->lineBytesAllocated : (MAX_LINE_LENGTH * 16));
+    UINT8 *pTemp;
+    
+    if (pRegion->lineByteCount + nBytes <= pRegion->lineBytesAllocated)
+        return 0;
+    
+    while (pRegion->lineByteCount + nBytes > nNewSize)
+        nNewSize *= 2;
+    
+    if (NULL == (pTemp = (UINT8 *)realloc(pRegion->pLineBytes, nNewSize)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", nNewSize);
+        return -1;
+    }
+    pRegion->pLineBytes         = pTemp;
+    pRegion->lineBytesAllocated = nNewSize;
+    
+    return 0;
+}
+
+
+// Start the record for the source line just read.  Room is reserved in the byte pool for everything a single line can
+// encode, so writeToImage() never has to grow it (INCBIN reserves the room for its file itself).
+//
+LINERECORD *beginLineRecord(REGION *pRegion, SOURCEFILE *pSourceFile, char *pszLine)
+{
+    LINERECORD *pLine;
+    
+    if (pRegion->lineCount == pRegion->linesAllocated)
+    {
+        int nNewCount = (pRegion->linesAllocated ? pRegion->linesAllocated * 2 : 256);
         
-        // TODO - clean-up
-        if (fpSRecord)
+        if (NULL == (pLine = (LINERECORD *)realloc(pRegion->pLines, (sizeof(LINERECORD) * nNewCount))))
         {
-            UINT16 nLocalAddr = nAddr;
-            UINT8  nTemp;
-
-            if (pInst->preByte)
-            {
-                writeToSRecord(fpSRecord, nLocalAddr++, &pInst->preByte, 1);
-            }
-            
-            writeToSRecord(fpSRecord, nLocalAddr++, &pInst->opCode, 1);
-            
-            if (nParam > 255)
-            {
-                nTemp = ((nParam & 0xff00)>>8);
-                writeToSRecord(fpSRecord, nLocalAddr++, &nTemp, 1);
-                nTemp = (nParam & 0xff);
-                writeToSRecord(fpSRecord, nLocalAddr++, &nTemp, 1);
-            }
-            else
-            {
-                // TODO - clean up.
-                if (pInst->numBytes == 4 || (pInst->preByte == 0 && pInst->numBytes == 3))
-                {
-                    // Case where value can fit in one byte but instruction is expecting two bytes.
-                    nTemp = 0;
-                    writeToSRecord(fpSRecord, nLocalAddr++, &nTemp, 1);                
-                }
-                nTemp = (nParam & 0xff);
-                writeToSRecord(fpSRecord, nLocalAddr++, &nTemp, 1);                
-            }
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(LINERECORD) * nNewCount));
+            return NULL;
         }
-      
-        // Dump source line's corresponding byte code.
-        //
-        // TODO - clean up.
-        if (fpListing)
+        pRegion->pLines         = pLine;
+        pRegion->linesAllocated = nNewCount;
+    }
+    
+    if (reserveLineBytes(pRegion, MAX_LINE_LENGTH))
+        return NULL;
+    
+    pLine = &pRegion->pLines[pRegion->lineCount++];
+    memset(pLine, 0, sizeof(LINERECORD));
+    pLine->lineOffset = pSourceFile->lineOffset;
+    pLine->lineNumber = pSourceFile->lineNumber;
+    pLine->lineLength = (UINT16)strlen(pszLine);
+    pLine->byteOffset = pRegion->lineByteCount;
+    pLine->textOffset = -1;
+    pLine->kind       = LINE_PREFIX;
+    pLine->refSymbol  = -1;
+    
+    // A line expanded from a MACRO, REPT or IRP body lists the text that was assembled (arguments and \@ substituted),
+    // which only exists in the line buffer, so it's kept in the region's text pool.
+    //
+    if (pSourceFile->macroLine)
+    {
+        if (pRegion->lineTextLength + pLine->lineLength > pRegion->lineTextAllocated)
         {
-            sprintf(szTempString, "%04x ", nAddr);
-            write(fpListing, szTempString, strlen(szTempString));
-            if (pInst->preByte)
-            {
-                sprintf(szTempString, "%02x ", pInst->preByte);
-                write(fpListing, szTempString, strlen(szTempString));
-            }
-
-            sprintf(szTempString, "%02x ", pInst->opCode);
-            write(fpListing, szTempString, strlen(szTempString));
-                
-            if (nParam > 255)
-            {
-                sprintf(szTempString, "%02x %02x %s\r\n", ((nParam & 0xff00)>>8), (nParam & 0xff), line);
-                write(fpListing, szTempString, strlen(szTempString));
-            }
-            else
+            int  nNewSize = (pRegion->lineTextAllocated ? pRegion->lineTextAllocated * 2 : (MAX_LINE_LENGTH * 16));
+            char *pTemp;
+            
+            while (pRegion->lineTextLength + pLine->lineLength > nNewSize)
+                nNewSize *= 2;
+            
+            if (NULL == (pTemp = (char *)realloc(pRegion->pLineText, nNewSize)))
             {
-                // TODO - clean up.
-                if (pInst->numBytes == 4 || (pInst->preByte == 0 && pInst->numBytes == 3))
-                {
-                    sprintf(szTempString, "00 ");
-                    write(fpListing, szTempString, strlen(szTempString));
-                }
-                sprintf(szTempString, "%02x %s\r\n",(nParam & 0xff), line);
-                write(fpListing, szTempString, strlen(szTempString));
+                printf("ERROR: Memory allocation failed (%d bytes)\r\n", nNewSize);
+                return NULL;
             }
+            pRegion->pLineText         = pTemp;
+            pRegion->lineTextAllocated = nNewSize;
         }
         
-        // Increment the address counter by the number of bytes required for the instruction.
-        //
-        nAddr += pInst->numBytes;
+        memcpy((pRegion->pLineText + pRegion->lineTextLength), pszLine, pLine->lineLength);
+        pLine->textOffset        = pRegion->lineTextLength;
+        pRegion->lineTextLength += pLine->lineLength;
     }
     
-    // Special SRecord write - flushes remaining contents to file.
-    //
-    writeToSRecord(fpSRecord, 0, NULL, 0);
+    return pLine;
+}
+
+
+// Record another symbol reference for the line just encoded (a line record only holds one).  The record lists nothing,
+// and it comes after the line's own record since the encoded bytes always go to the most recent record.
+//
+int addLineReference(REGION *pRegion, SOURCEFILE *pSourceFile, char *pszLine, UINT16 nAddr, int nSymbol, UINT8 nMode)
+{
+    LINERECORD *pLine;
     
-    // Add a final S9 SRecord line.
+    if (NULL == (pLine = beginLineRecord(pRegion, pSourceFile, pszLine)))
+        return -1;
+    
+    pLine->kind      = LINE_REFERENCE;
+    pLine->addr      = nAddr;
+    pLine->refSymbol = nSymbol;
+    pLine->refMode   = nMode;
+    
+    return 0;
+}
+
+
+// Map a binary file into memory and keep a range of it as the current line's bytes.
+//
+int includeBinary(REGION *pRegion, UINT16 nAddr, const char *pszFileName, UINT16 nOffset, UINT16 nLength)
+{
+    struct stat fileStat;
+    int   fpBinary;
+    UINT8 *pBinary;
+    
+    if (0 == nLength)
+        return 0;
+    
+    if ((fpBinary = open(pszFileName, O_RDONLY)) < 0)
+    {
+        printf("ERROR: INCBIN file open failed (%s)\r\n", pszFileName);
+        return -1;
+    }
+    
+    // The file is checked again in case it shrank since pass 1 sized it (reading past the end of a mapping faults).
     //
-    // TODO - compute real checksum
+    if (fstat(fpBinary, &fileStat) < 0 || fileStat.st_size < (off_t)nOffset + nLength)
+    {
+        printf("ERROR: INCBIN file changed during assembly (%s)\r\n", pszFileName);
+        close(fpBinary);
+        return -1;
+    }
+    
+    pBinary = (UINT8 *)mmap(NULL, (size_t)nOffset + nLength, PROT_READ, MAP_PRIVATE, fpBinary, 0);
+    close(fpBinary);
+    if (MAP_FAILED == pBinary)
+    {
+        printf("ERROR: INCBIN file mapping failed (%s)\r\n", pszFileName);
+        return -1;
+    }
     
-    UINT16 nSRecChecksum = (UINT8)((g_startAddress & 0xFF00) >> 8);
-    nSRecChecksum += (UINT8)(g_startAddress & 0xFF);
-    nSRecChecksum += 03;
-    nSRecChecksum = (0xffff - (nSRecChecksum & 0xff));
+    if (reserveLineBytes(pRegion, nLength))
+    {
+        munmap(pBinary, (size_t)nOffset + nLength);
+        return -1;
+    }
+    writeToImage(pRegion, nAddr, (pBinary + nOffset), nLength);
+    
+    munmap(pBinary, (size_t)nOffset + nLength);
+    return 0;
+}
+
+
+// Render a region's listing from its line records.
+//
+int formatListing(SOURCEFILE *pSourceFile, REGION *pRegion)
+{
+    char szTempString[MAX_LINE_LENGTH * 4];
     
-    sprintf(szTempString, "S903%04X%02X\r\n", g_startAddress, (UINT8)nSRecChecksum);
-    write(fpSRecord, szTempString, strlen(szTempString));
+    for (int i=0 ; i<pRegion->lineCount ; i++)
+    {
+        LINERECORD *pLine  = &pRegion->pLines[i];
+        char       *pszSource = (pLine->textOffset >= 0 ? pRegion->pLineText + pLine->textOffset : pSourceFile->pFile + pLine->lineOffset);
+        UINT8      *pBytes = pRegion->pLineBytes + pLine->byteOffset;
+        int        nChars;
+        
+        if (pLine->kind == LINE_REFERENCE)
+            continue;
+        
+        sprintf(szTempString, "%04d ", pLine->lineNumber);
+        if (appendToBuffer(&pRegion->listing, szTempString))
+            return -1;
+        
+        switch (pLine->kind)
+        {
+            case LINE_SOURCE:
+                sprintf(szTempString, "%.*s\r\n", pLine->lineLength, pszSource);
+                break;
+            case LINE_DATA:
+                nChars = sprintf(szTempString, "%04x ", pLine->addr);
+                for (int j=0 ; j<pLine->numBytes ; j++)
+                    nChars += sprintf(szTempString + nChars, "%02x", pBytes[j]);
+                sprintf(szTempString + nChars, "%.*s\r\n", pLine->lineLength, pszSource);
+                break;
+            case LINE_STRING:
+                nChars = sprintf(szTempString, "%04x ", pLine->addr);
+                if (appendToBuffer(&pRegion->listing, szTempString))
+                    return -1;
+                for (int j=0 ; j<pLine->numBytes ; j++)
+                {
+                    sprintf(szTempString, "%02x ", pBytes[j]);
+                    if (appendToBuffer(&pRegion->listing, szTempString))
+                        return -1;
+                }
+                sprintf(szTempString, "%.*s\r\n", pLine->lineLength, pszSource);
+                break;
+            case LINE_BINARY:
+                sprintf(szTempString, "%04x (%d bytes) %.*s\r\n", pLine->addr, pLine->numBytes, pLine->lineLength, pszSource);
+                break;
+            case LINE_INSTRUCTION:
+                nChars = sprintf(szTempString, "%.*s\r\n", pLine->lineLength, pszSource);
+                if (pLine->numBytes)
+                {
+                    nChars += sprintf(szTempString + nChars, "%04x ", pLine->addr);
+                    for (int j=0 ; j<pLine->numBytes ; j++)
+                        nChars += sprintf(szTempString + nChars, "%02x ", pBytes[j]);
+                    sprintf(szTempString + nChars, "%.*s\r\n", pLine->tokenLength, pszSource);
+                }
+                break;
+            case LINE_PREFIX:
+            default:
+                szTempString[0] = '\0';
+                break;
+        }
+        
+        if (szTempString[0] && appendToBuffer(&pRegion->listing, szTempString))
+            return -1;
+    }
     
     return 0;
 }
 
 
-// this function is called recursively.
-int buildSymbolTable(SOURCEFILE *pSourceFile, UINT16 nAddr)
+int assembleSource(SOURCEFILE *pSourceFile, REGION *pRegion)
 {
-    int  nRetVal = 0;
     char line[MAX_LINE_LENGTH];
+    char saveLine[MAX_LINE_LENGTH];
+
     char symbolName[MAX_SYMBOL_NAME_LENGTH];
     char *pszToken;
+    char *pszContext;
+    char *pszValueContext;
     INSTRUCTION *pInst;
     UINT16 nParam = 0;
     char mneumonic[MAX_MNEUMONIC_LENGTH + 1];
     ADDRMODE addrMode;
-    int  nLocalLineNum = pSourceFile->lineNumber;
+    int  nLocalLineNum;
+    int  nRule;
+    int  nMacro;
+    int  nPool;
+    int  nLength;
+    UINT16 nOffset;
+    char szFileName[MAX_LINE_LENGTH];
+    UINT16 nAddr = pRegion->startAddr;
+    LINERECORD *pLine;
     
     // Read each source file line until we encounter EOF or an error.
     //
     while(getNextFileLine(pSourceFile, line, MAX_LINE_LENGTH) == 0)
-    {       
-        // Increment the local line number (used because the source file line number is used recursively).
+    {   
+        // Make a copy of the line since we're going to modify it during parsing...
+        //
+        strncpy(saveLine, line, MAX_LINE_LENGTH);
+        
+        // Record the line - what it encodes is filled in below.
+        //
+        if (NULL == (pLine = beginLineRecord(pRegion, pSourceFile, saveLine)))
+            return -1;
+        
+        // Take the local line number from the source file (lines disabled by conditional assembly are stepped over).
         //
-        ++nLocalLineNum;
+        nLocalLineNum = pSourceFile->lineStart + 1;
         
-        // Skip comments or blank lines.
+        // Skip comments, blank lines and conditional directives.
         //
-        if (isCommentLine(line) || isBlankLine(line))
+        if (isCommentLine(line) || isBlankLine(line) || pSourceFile->fCondLine)
+        {
+            pLine->kind = LINE_SOURCE;
             continue;
+        }
         
         // If the line contains a symbol definition, read the value or compute the address it
         // refers to and push the information into the symbol table for later use.
@@ -803,62 +1677,27 @@ int buildSymbolTable(SOURCEFILE *pSourceFile, UINT16 nAddr)
         {
             // Get the first token - this should be the symbol name (may end with a ':' character).
             //
-            if (NULL != (pszToken = strtok (line, ": \t\r\n")))
+            if (NULL != (pszToken = strtok_r (line, ": \t\r\n", &pszContext)))
             {
                 strncpy(symbolName, pszToken, MAX_SYMBOL_NAME_LENGTH);
-                if (NULL != (pszToken = strtok (NULL, " \t\r\n")))
+                if (NULL != (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)))
                 {                
                     // *** EQU ***
                     if (strcasecmp(pszToken, "EQU") == 0)
                     {
-                        if (NULL != (pszToken = strtok (NULL, " \t\r\n")))
-                        {
-                            if ('\'' == *pszToken)
-                            {
-                                // Symbol equates to an ASCII string
-                                // TODO - also ends with a ' ?
-                                pushSymbol(symbolName, SYMBOL_TYPE_STRING, (pszToken + 1));
-                            }
-                            else if ('*' == *pszToken)
-                            {
-                                // Special Case: symbol refers to an address (FOO    EQU    *).
-                                //
-                                pushSymbol(symbolName, SYMBOL_TYPE_NUMBER_16BIT, &nAddr);
-                            }
-                            else
-                            {
-                                // Symbol equates to a number
-                                if (convertToNumber(pszToken, &nParam))
-                                    return -1;
-                                pushSymbol(symbolName, (nParam < 256 ? SYMBOL_TYPE_NUMBER_8BIT : SYMBOL_TYPE_NUMBER_16BIT), &nParam);
-                            }
-                        }
+                        pLine->kind = LINE_SOURCE;
                         continue;
                     }
-                    // *** RMB ***
-                    else if (strcasecmp(pszToken, "RMB") == 0)
-                    {  
-                        // Handle special below.
-                    }
-                    else
-                    {
-                        // Symbol refers to an address - note that valid instructions may follow on this same line.
-                        //
-                        pushSymbol(symbolName, SYMBOL_TYPE_NUMBER_16BIT, &nAddr);
-                    }
                 }
                 else
                 {
-                    // Symbol refers to an address - no other instructions follow so we can move to the next line.
-                    //
-                    pushSymbol(symbolName, SYMBOL_TYPE_NUMBER_16BIT, &nAddr);
                     continue;
                 }
             }
         }
         else
         {
-            if (NULL == (pszToken = strtok (line, " \t\r\n")))
+            if (NULL == (pszToken = strtok_r (line, " \t\r\n", &pszContext)))
             {
                 continue;
             }
@@ -878,188 +1717,2132 @@ int buildSymbolTable(SOURCEFILE *pSourceFile, UINT16 nAddr)
         // *** ORG ***
         if (strcasecmp(pszToken, "ORG") == 0)
         {
-            if (NULL == (pszToken = strtok (NULL, " \t\r\n")) || convertToNumber(pszToken, &nAddr))
+            if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) || convertToNumber(pszToken, &nAddr))
             {
                 printf("ERROR: Invalid ORG instruction\r\n");
                 return -1;
             }
             
+            pLine->kind = LINE_SOURCE;
+            continue;
+        }
+        
+        // *** STACK ***
+        if (strcasecmp(pszToken, "STACK") == 0)
+        {
+            // The budget is checked once the image is assembled.
+            //
+            pLine->kind = LINE_SOURCE;
             continue;
         }
         
         // *** RMB ***
         if (strcasecmp(pszToken, "RMB") == 0)
         {
-            // Symbol refers to an reserved address.
+            // Skip over the reserved bytes so the following lines are encoded at the same addresses pass 1 assigned.  LOCALS
+            // variables were placed in the LOCALRAM area instead.
             //
-            pushSymbol(symbolName, SYMBOL_TYPE_NUMBER_16BIT, &nAddr);
-            if (NULL == (pszToken = strtok (NULL, " \t\r\n")) || convertToNumber(pszToken, &nParam))
+            if (NULL != (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) && !convertToNumber(pszToken, &nParam) &&
+                (0 == g_localVarCount ||
+                 findLocalVariable(g_localVars, g_localVarCount, (pSourceFile->macroLine ? pSourceFile->macroOffset : pSourceFile->lineOffset),
+                                   pSourceFile->macroLine) < 0))
             {
-                printf("ERROR: Invalid RMB instruction\r\n");
-                return -1;
+                nAddr += nParam;
             }
-            nAddr += nParam;
+            
+            pLine->kind = LINE_SOURCE;
             continue;
         }
         
-        // *** FCB ***
-        if (strcasecmp(pszToken, "FCB") == 0)
+        // *** FCB / FDB *** - a comma-separated list of values, encoded as one block.
+        if (strcasecmp(pszToken, "FCB") == 0 || strcasecmp(pszToken, "FDB") == 0)
         {
-            nAddr += 1; // One byte
+            SYMBOLTYPE valueType = (strcasecmp(pszToken, "FCB") == 0 ? SYMBOL_TYPE_NUMBER_8BIT : SYMBOL_TYPE_NUMBER_16BIT);
+            char  *pszDirective  = (valueType == SYMBOL_TYPE_NUMBER_8BIT ? "FCB" : "FDB");
+            int   nValueSize     = (valueType == SYMBOL_TYPE_NUMBER_8BIT ? 1 : 2);
+            UINT8 bytes[MAX_LINE_LENGTH];
+            int   symbols[MAX_LINE_LENGTH / 2];
+            int   nBytes = 0;
+            
+            if (NULL != (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)))
+            {
+                if (countListValues(pszToken) < 0)
+                {
+                    printf("ERROR: Invalid %s list on line %d (empty value)\r\n", pszDirective, nLocalLineNum);
+                    return -1;
+                }
+                
+                for (pszToken = strtok_r (pszToken, ",", &pszValueContext) ; pszToken ; pszToken = strtok_r (NULL, ",", &pszValueContext))
+                {
+                    UINT16 nValue = 0;
+                    
+                    if (getDataValue(pszToken, valueType, pszDirective, &nValue, &symbols[nBytes / nValueSize]))
+                        return -1;
+                    
+                    if (nValueSize == 2)
+                        bytes[nBytes++] = (UINT8)((nValue & 0xff00) >> 8);
+                    bytes[nBytes++] = (UINT8)(nValue & 0xff);
+                }
+            }
+            
+            if (0 == nBytes)
+            {
+                nAddr += nValueSize;
+                continue;
+            }
+            
+            writeToImage(pRegion, nAddr, bytes, nBytes);
+            pLine->kind = LINE_DATA;
+            
+            // The first symbol goes in the line's own record and any others get records of their own.
+            //
+            for (int i=0 ; i < nBytes / nValueSize ; i++)
+            {
+                if (symbols[i] < 0)
+                    continue;
+                
+                if (pLine)
+                {
+                    pLine->refSymbol = symbols[i];
+                    pLine->refMode   = REF_MODE_DATA;
+                    pLine            = NULL;
+                }
+                else if (addLineReference(pRegion, pSourceFile, saveLine, (UINT16)(nAddr + (i * nValueSize)), symbols[i], REF_MODE_DATA))
+                    return -1;
+            }
+            
+            nAddr += nBytes;
             continue;
         }
-
-        // *** FDB ***
-        if (strcasecmp(pszToken, "FDB") == 0)
+        
+        // *** FILL / BSZ / ZMB *** - a run of one value (zero for BSZ and ZMB), encoded in blocks.
+        if (strcasecmp(pszToken, "FILL") == 0 || strcasecmp(pszToken, "BSZ") == 0 || strcasecmp(pszToken, "ZMB") == 0)
         {
-            nAddr += 2; // Two bytes
+            char   *pszDirective = pszToken;
+            char   *pszCount;
+            UINT8  bytes[MAX_LINE_LENGTH];
+            UINT16 nValue = 0;
+            UINT16 nCount = 0;
+            int    nSymbol = -1;
+            
+            if (NULL != (pszCount = strtok_r (NULL, " \t\r\n", &pszContext)) && strcasecmp(pszDirective, "FILL") == 0)
+            {
+                pszToken = pszCount;
+                if (NULL != (pszCount = strchr(pszToken, ',')))
+                {
+                    *pszCount++ = '\0';
+                    if (getDataValue(pszToken, SYMBOL_TYPE_NUMBER_8BIT, "FILL", &nValue, &nSymbol))
+                        return -1;
+                }
+            }
+            
+            if (NULL == pszCount || convertToNumber(pszCount, &nCount))
+            {
+                printf("ERROR: Invalid %s directive on line %d\r\n", pszDirective, nLocalLineNum);
+                return -1;
+            }
+            
+            if (nCount && reserveLineBytes(pRegion, nCount))
+                return -1;
+            
+            memset(bytes, (int)nValue, sizeof(bytes));
+            for (int nDone=0 ; nDone < nCount ; nDone += (int)sizeof(bytes))
+                writeToImage(pRegion, (UINT16)(nAddr + nDone), bytes, (nCount - nDone < (int)sizeof(bytes) ? nCount - nDone : (int)sizeof(bytes)));
+            
+            pLine->kind      = (nCount ? LINE_BINARY : LINE_SOURCE);
+            pLine->refSymbol = nSymbol;
+            pLine->refMode   = REF_MODE_DATA;
+            nAddr += nCount;
             continue;
         }
-
+        
         // *** FCC ***
         if (strcasecmp(pszToken, "FCC") == 0)
         {
-            if (NULL == (pszToken = strtok (NULL, "\"\r\n")))
+            if (NULL == (pszToken = strtok_r (NULL, "\"\r\n", &pszContext)))
             {
                 printf("ERROR: Invalid FCC instruction\r\n");
                 return -1;
             }
+            
+            // A pooled string shared with another one encodes nothing, and the rest get their terminator.
+            //
+            if (g_poolStringCount &&
+                (nPool = findPoolString(g_poolStrings, g_poolStringCount, (pSourceFile->macroLine ? pSourceFile->macroOffset : pSourceFile->lineOffset),
+                                        pSourceFile->macroLine)) >= 0)
+            {
+                UINT8 bytes[MAX_LINE_LENGTH + 1];
+                int   nBytes = (int)strlen(pszToken);
+                
+                if (g_poolStrings[nPool].fShared)
+                {
+                    pLine->kind = LINE_SOURCE;
+                    continue;
+                }
                 
+                memcpy(bytes, pszToken, nBytes);
+                if (g_poolStrings[nPool].terminator == STRPOOL_NUL)
+                    bytes[nBytes++] = '\0';
+                else if (g_poolStrings[nPool].terminator == STRPOOL_HIGH_BIT)
+                    bytes[nBytes - 1] |= 0x80;
+                
+                writeToImage(pRegion, nAddr, bytes, nBytes);
+                pLine->kind = LINE_STRING;
+                nAddr += nBytes;
+                continue;
+            }
+            
+            writeToImage(pRegion, nAddr, (UINT8 *)pszToken, (int)strlen(pszToken));
+            pLine->kind = LINE_STRING;
+            
             // TODO - how to handle leading spaces?
             
             nAddr += strlen(pszToken);
             continue;
         }
-
-        // For all other commands, look for the instruction mneumonic in the command list.
-        //
-        if (NULL == (pInst = lookUpMneumonic(pszToken)))
+        
+        // *** STRPOOL / ENDPOOL *** - pass 1 already bound the strings in between.
+        if (strcasecmp(pszToken, "STRPOOL") == 0 || strcasecmp(pszToken, "ENDPOOL") == 0)
         {
-            printf("ERROR: Invalid mneumonic \'%s\' on line %d\r\n", pszToken, nLocalLineNum);
-            return -1;
+            pLine->kind = LINE_SOURCE;
+            continue;
         }
-        strncpy(mneumonic, pszToken, MAX_MNEUMONIC_LENGTH);
         
-        // Now, try to find an exact instruction match based on addressing mode.  If this command takes no parameters, we can continue to the next.
-        //
+        // *** LOCALRAM / LOCALS / ENDLOCALS *** - pass 1 already placed the variables.
+        if (strcasecmp(pszToken, "LOCALRAM") == 0 || strcasecmp(pszToken, "LOCALS") == 0 || strcasecmp(pszToken, "ENDLOCALS") == 0)
+        {
+            pLine->kind = LINE_SOURCE;
+            continue;
+        }
+        
+        // *** BANKWINDOW / BANK / ENDBANK *** - BANK and ENDBANK start a region, which pass 1 gave the bank and address.
+        if (strcasecmp(pszToken, "BANKWINDOW") == 0 || strcasecmp(pszToken, "BANK") == 0 || strcasecmp(pszToken, "ENDBANK") == 0)
+        {
+            pLine->kind = LINE_SOURCE;
+            continue;
+        }
+        
+        // *** INCBIN ***
+        if (strcasecmp(pszToken, "INCBIN") == 0)
+        {
+            if ((nLength = parseIncludeBinary(strtok_r (NULL, "\r\n", &pszContext), szFileName, &nOffset, nLocalLineNum)) < 0 ||
+                includeBinary(pRegion, nAddr, szFileName, nOffset, (UINT16)nLength))
+                return -1;
+            
+            pLine->kind = (nLength ? LINE_BINARY : LINE_SOURCE);
+            nAddr += nLength;
+            continue;
+        }
+        
+        // *** REPT / IRP ***
+        if (strcasecmp(pszToken, "REPT") == 0 || strcasecmp(pszToken, "IRP") == 0)
+        {
+            // The reader returns the body lines next.
+            //
+            if (beginRepeatExpansion(pSourceFile, strtok_r (NULL, " \t\r\n", &pszContext)))
+            {
+                printf("ERROR: Invalid %s block on line %d\r\n", pszToken, nLocalLineNum);
+                return -1;
+            }
+            
+            pLine->kind = LINE_SOURCE;
+            continue;
+        }
+        
+        // Instructions list the source text, then the encoding along with the line up to the end of the mneumonic.
+        //
+        pLine->kind        = LINE_INSTRUCTION;
+        pLine->tokenLength = (UINT16)strlen(line);
+        pLine->addr        = nAddr;
+
+        // *** DELAY *** - listed like an instruction.
+        if (strcasecmp(pszToken, "DELAY") == 0)
+        {
+            UINT8  bytes[MAX_DELAY_BYTES];
+            UINT32 nCycles;
+            UINT8  nClobber;
+            int    nBytes;
+
+            if (parseDelay(strtok_r (NULL, " \t\r\n", &pszContext), &nCycles, &nClobber) ||
+                (nBytes = synthesizeDelay(nCycles, nClobber, bytes)) < 0)
+            {
+                printf("ERROR: Invalid DELAY on line %d\r\n", nLocalLineNum);
+                return -1;
+            }
+
+            if (nBytes)
+                writeToImage(pRegion, nAddr, bytes, nBytes);
+            nAddr += nBytes;
+            continue;
+        }
+
+        // For all other commands, look for the instruction mneumonic in the command list.
+        //
+        if (NULL == (pInst = lookUpMneumonic(pszToken)))
+        {
+            // *** Macro invocation *** - the reader returns the expanded lines next.
+            //
+            if ((nMacro = lookUpMacro(pszToken)) >= 0)
+            {
+                if (beginMacroExpansion(pSourceFile, nMacro, strtok_r (NULL, " \t\r\n", &pszContext)))
+                {
+                    printf("ERROR: Invalid invocation of macro \'%s\' on line %d\r\n", pszToken, nLocalLineNum);
+                    return -1;
+                }
+                
+                pLine->kind = LINE_SOURCE;
+                continue;
+            }
+            
+            printf("ERROR: Invalid mneumonic \'%s\' on line %d\r\n", pszToken, nLocalLineNum);
+            return -1;
+        }
+        strncpy(mneumonic, pszToken, MAX_MNEUMONIC_LENGTH);
+        
+        // Lines rewritten by the peephole optimizer are encoded the way pass 1 sized them.
+        //
+        if (g_rewriteCount && !pSourceFile->macroLine && (nRule = findRewrite(pSourceFile->lineOffset)) >= 0)
+        {
+            PEEPHOLERULE *pRule = &g_peepholeRules[nRule];
+            UINT8 bytes[3];
+            int   nBytes = 0;
+            int   nOffset;
+            
+            pszToken = strtok_r (NULL, " \t\r\n", &pszContext);
+            if ((g_fCrossReference || g_fWatch) && pszToken)
+            {
+                pLine->refSymbol = findParamSymbol(pszToken);
+                pLine->refMode   = (pRule->kind == PEEPHOLE_SHORT_JUMP ? REL : (pRule->kind == PEEPHOLE_REPLACE ? INH : REF_MODE_DROPPED));
+            }
+            
+            switch (pRule->kind)
+            {
+                case PEEPHOLE_REPLACE:
+                    if (pRule->pOther->preByte)
+                        bytes[nBytes++] = pRule->pOther->preByte;
+                    bytes[nBytes++] = pRule->pOther->opCode;
+                    break;
+                case PEEPHOLE_SHORT_JUMP:
+                    if (NULL == pszToken || computeAddrMode(nAddr, pInst, pszToken, &addrMode, &nParam) ||
+                        (nOffset = ((int)nParam - (int)(nAddr + pRule->pOther->numBytes))) < -128 || nOffset > 127)
+                    {
+                        printf("ERROR: Branch target out of range on line %d\r\n", nLocalLineNum);
+                        return -1;
+                    }
+                    bytes[nBytes++] = pRule->pOther->opCode;
+                    bytes[nBytes++] = (UINT8)nOffset;
+                    break;
+                case PEEPHOLE_DROP_LOAD:
+                default:
+                    break;
+            }
+            
+            if (nBytes)
+            {
+                writeToImage(pRegion, nAddr, bytes, nBytes);
+                pLine->cycles = pRule->pOther->numCycles;
+            }
+            
+            nAddr += nBytes;
+            continue;
+        }
+        
+        // Now, try to find an exact instruction match based on addressing mode.  If this command takes no parameters, we can continue to the next.
+        //
         // TODO - need a better way to determine that this command only supports inherent addressing.
-        if (NULL == (pszToken = strtok (NULL, " \t\r\n")) || isCommentLine(pszToken) || isBlankLine(pszToken))
+        if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) || isCommentLine(pszToken) || isBlankLine(pszToken))
         {
+            if (pInst->preByte)
+            {
+                writeToImage(pRegion, nAddr,   &pInst->preByte, 1);
+                writeToImage(pRegion, nAddr+1, &pInst->opCode, 1);
+            }
+            else
+                writeToImage(pRegion, nAddr, &pInst->opCode, 1);
+            pLine->cycles = pInst->numCycles;
+
             nAddr += pInst->numBytes;
             continue;
         }
+        
+        // Compute the addressing mode from the insruction parameters.  At this point all the symbols will be in the symbol table so if we can't
+        // find the addressing mode now, it's an error.
+        //
+        if (g_fCrossReference || g_fWatch)
+        {
+            pLine->refSymbol = findParamSymbol(pszToken);
+        }
+        
+        if (computeAddrMode(nAddr, pInst, pszToken, &addrMode, &nParam))
+        {
+            printf("ERROR: Invalid address mode on line %d\r\n", nLocalLineNum);
+            return -1;            
+        }
+        
+        // A forward reference was given room for an extended address in pass 1, so keep that size even if it could be direct.
+        //
+        if (addrMode == DIR && isForwardReference((pSourceFile->macroLine ? pSourceFile->macroOffset : pSourceFile->lineOffset),
+                                                  pSourceFile->macroLine))
+        {
+            addrMode = EXT;
+        }
+        
+        // Now that we know the instruction addressing mode, look up the exact match in the instruction table.
+        //
+        if (NULL == (pInst = lookUpMatchingAddrMode(pInst, addrMode)))
+        {
+            printf("ERROR: Instruction \'%s\' doesn\'t offer addressing mode %d\r\n", mneumonic, (int)addrMode);
+            return -1;
+        }
+        pLine->refMode = (UINT8)addrMode;
+        
+        // TODO - clean-up
+        {
+            UINT16 nLocalAddr = nAddr;
+            UINT8  nTemp;
+
+            if (pInst->preByte)
+            {
+                writeToImage(pRegion, nLocalAddr++, &pInst->preByte, 1);
+            }
+            
+            writeToImage(pRegion, nLocalAddr++, &pInst->opCode, 1);
+            
+            if (nParam > 255)
+            {
+                nTemp = ((nParam & 0xff00)>>8);
+                writeToImage(pRegion, nLocalAddr++, &nTemp, 1);
+                nTemp = (nParam & 0xff);
+                writeToImage(pRegion, nLocalAddr++, &nTemp, 1);
+            }
+            else
+            {
+                // TODO - clean up.
+                if (pInst->numBytes == 4 || (pInst->preByte == 0 && pInst->numBytes == 3))
+                {
+                    // Case where value can fit in one byte but instruction is expecting two bytes.
+                    nTemp = 0;
+                    writeToImage(pRegion, nLocalAddr++, &nTemp, 1);                
+                }
+                nTemp = (nParam & 0xff);
+                writeToImage(pRegion, nLocalAddr++, &nTemp, 1);                
+            }
+        }
+        pLine->cycles = pInst->numCycles;
+        
+        // Increment the address counter by the number of bytes required for the instruction.
+        //
+        nAddr += pInst->numBytes;
+    }
+    
+    return 0;
+}
+
+
+// Claim the next unprocessed chunk or region, returning -1 once all of them have been handed out.
+//
+int claimWorkItem(WORKCONTEXT *pWork)
+{
+    int nItem;
+    
+    pthread_mutex_lock(&pWork->lock);
+    nItem = pWork->nextItem++;
+    pthread_mutex_unlock(&pWork->lock);
+    
+    return (nItem < pWork->itemCount ? nItem : -1);
+}
+
+
+// Run a worker function on up to g_numThreads threads (the calling thread acts as one of them) and wait for all of them
+// to finish.  Workers claim their own work items, so if a thread can't be created the remaining workers simply pick up
+// its share.
+//
+void runWorkers(void *(*pfnWorker)(void *), WORKCONTEXT *pWork)
+{
+    pthread_t threads[MAX_WORKER_THREADS];
+    int nThreads;
+    int nCount;
+    
+    pWork->nextItem = 0;
+    pthread_mutex_init(&pWork->lock, NULL);
+    
+    nThreads = (g_numThreads < pWork->itemCount ? g_numThreads : pWork->itemCount);
+    if (nThreads > MAX_WORKER_THREADS)
+        nThreads = MAX_WORKER_THREADS;
+    
+    for (nCount=1 ; nCount < nThreads ; nCount++)
+    {
+        if (pthread_create(&threads[nCount], NULL, pfnWorker, pWork))
+            break;
+    }
+    nThreads = (nCount > 1 ? nCount : 1);
+    
+    pfnWorker(pWork);
+    
+    for (nCount=1 ; nCount < nThreads ; nCount++)
+    {
+        pthread_join(threads[nCount], NULL);
+    }
+    pthread_mutex_destroy(&pWork->lock);
+}
+
+
+// Pass 2 worker thread - repeatedly claims the next unencoded region and encodes its line records.
+//
+void *assembleRegionWorker(void *pContext)
+{
+    WORKCONTEXT *pWork = (WORKCONTEXT *)pContext;
+    int nRegion;
+    
+    while ((nRegion = claimWorkItem(pWork)) >= 0)
+    {
+        // Each region reads through its own view of the shared source buffer, bounded by the start of the next region.
+        //
+        REGION     *pRegion    = &g_regions[nRegion];
+        SOURCEFILE regionFile  = *pWork->pSourceFile;
+        MACROSTATE macroState;
+        
+        if (pRegion->fReused)
+            continue;
+        
+        regionFile.fileSize    = pRegion->endOffset;
+        regionFile.piterOffset = regionFile.pFile + pRegion->startOffset;
+        regionFile.byteOffset  = pRegion->startOffset;
+        regionFile.lineNumber  = pRegion->startLine;
+        regionFile.fEOF        = (pRegion->startOffset >= pRegion->endOffset);
+        regionFile.nextCondSpan = -1;
+        regionFile.pMacroState  = &macroState;
+        macroState.depth        = 0;
+        
+        pRegion->retVal = assembleSource(&regionFile, pRegion);
+    }
+    
+    return NULL;
+}
+
+
+// Listing worker thread - renders the listing text of each region from the line records pass 2 left behind.
+//
+void *formatRegionWorker(void *pContext)
+{
+    WORKCONTEXT *pWork = (WORKCONTEXT *)pContext;
+    int nRegion;
+    
+    while ((nRegion = claimWorkItem(pWork)) >= 0)
+    {
+        REGION *pRegion = &g_regions[nRegion];
+        int    nRetVal  = formatListing(pWork->pSourceFile, pRegion);
+        
+        if (0 == pRegion->retVal)
+            pRegion->retVal = nRetVal;
+    }
+    
+    return NULL;
+}
+
+
+// Record the start of a new pass 2 region at the given source line.
+//
+int beginRegion(SOURCEFILE *pSourceFile, int nLineOffset, int nLineStart, UINT16 nAddr, int nBank)
+{
+    REGION *pRegion;
+    
+    // If the current region hasn't consumed any lines yet, simply restart it here.
+    //
+    if (g_regionCount && g_regions[g_regionCount - 1].startOffset == nLineOffset)
+    {
+        g_regions[g_regionCount - 1].startAddr = nAddr;
+        g_regions[g_regionCount - 1].bank      = nBank;
+        return 0;
+    }
+    
+    if (g_regionCount == g_regionsAllocated)
+    {
+        int nNewCount = (g_regionsAllocated ? g_regionsAllocated * 2 : 64);
+        
+        if (NULL == (pRegion = (REGION *)realloc(g_regions, (sizeof(REGION) * nNewCount))))
+        {
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(REGION) * nNewCount));
+            return -1;
+        }
+        g_regions          = pRegion;
+        g_regionsAllocated = nNewCount;
+    }
+    
+    if (g_regionCount)
+    {
+        g_regions[g_regionCount - 1].endOffset = nLineOffset;
+    }
+    
+    pRegion = &g_regions[g_regionCount++];
+    memset(pRegion, 0, sizeof(REGION));
+    pRegion->startOffset = nLineOffset;
+    pRegion->endOffset   = pSourceFile->fileSize;
+    pRegion->startLine   = nLineStart;
+    pRegion->startAddr   = nAddr;
+    pRegion->bank        = nBank;
+    
+    return 0;
+}
+
+
+// Append a statement for the line most recently read from the chunk.
+//
+STATEMENT *addStatement(CHUNK *pChunk, SOURCEFILE *pChunkFile, STMTKIND kind, int nLocalLineNum)
+{
+    STATEMENT *pStmt;
+
+    if (pChunk->statementCount == pChunk->statementsAllocated)
+    {
+        int nNewCount = (pChunk->statementsAllocated ? pChunk->statementsAllocated * 2 : 1024);
+
+        if (NULL == (pStmt = (STATEMENT *)realloc(pChunk->pStatements, (sizeof(STATEMENT) * nNewCount))))
+        {
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(STATEMENT) * nNewCount));
+            return NULL;
+        }
+        pChunk->pStatements         = pStmt;
+        pChunk->statementsAllocated = nNewCount;
+    }
+
+    pStmt = &pChunk->pStatements[pChunk->statementCount++];
+    memset(pStmt, 0, sizeof(STATEMENT));
+    pStmt->kind       = kind;
+    pStmt->lineNumber = nLocalLineNum;
+    pStmt->lineOffset = (pChunkFile->macroLine ? pChunkFile->macroOffset : pChunkFile->lineOffset);
+    pStmt->lineStart  = pChunkFile->lineStart;
+    pStmt->macroLine  = pChunkFile->macroLine;
+
+    return pStmt;
+}
+
+
+// Returns the span offset of an operand of the line just read.  The text of an expanded line isn't in the source
+// buffer, so its operand is copied to the chunk's macro text instead.
+//
+int getSpanOffset(CHUNK *pChunk, SOURCEFILE *pChunkFile, char *pszLine, char *pszSpan)
+{
+    int nOffset = pChunk->macroText.length;
+
+    if (0 == pChunkFile->macroLine)
+        return pChunkFile->lineOffset + (int)(pszSpan - pszLine);
+
+    if (appendToBuffer(&pChunk->macroText, pszSpan))
+        return -1;
+
+    return nOffset;
+}
+
+
+// Copy the operand or string value of a statement.
+//
+void getStatementSpan(SOURCEFILE *pSourceFile, CHUNK *pChunk, STATEMENT *pStmt, char *pszSpan)
+{
+    memcpy(pszSpan, ((pStmt->macroLine ? pChunk->macroText.pBuffer : pSourceFile->pFile) + pStmt->spanOffset), pStmt->spanLength);
+    pszSpan[pStmt->spanLength] = '\0';
+}
+
+
+// Record a parse error - it's reported when the statement walk reaches it so errors come out in source order.
+//
+int addParseError(CHUNK *pChunk, SOURCEFILE *pChunkFile, int nLocalLineNum, PARSEERROR error, INSTRUCTION *pInst, char *pszToken)
+{
+    STATEMENT *pStmt;
+
+    if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_ERROR, nLocalLineNum)))
+        return -1;
+
+    pStmt->value = (UINT16)error;
+    pStmt->pInst = pInst;
+    if (pszToken)
+        strncpy(pStmt->symbolName, pszToken, MAX_SYMBOL_NAME_LENGTH - 1);
+
+    return -1;
+}
+
+
+// Pass 1 (parallel part) - parse the lines of a chunk into statements.  Nothing here depends on lines outside the chunk:
+// addresses are assigned later by resolveStatements() and parameters that refer to symbols are left for it to size.
+//
+int parseStatements(SOURCEFILE *pChunkFile, CHUNK *pChunk)
+{
+    char line[MAX_LINE_LENGTH];
+    char symbolName[MAX_SYMBOL_NAME_LENGTH];
+    char *pszToken;
+    char *pszContext;
+    INSTRUCTION *pInst;
+    UINT16 nParam = 0;
+    ADDRMODE addrMode;
+    STATEMENT *pStmt;
+    bool fLabel;
+    int  nLocalLineNum = 0;
+    int  nMacro;
+    int  nSpanOffset;
+    int  nSpanLength;
+
+    // Read each source file line until we encounter the end of the chunk or an error.
+    //
+    while(getNextFileLine(pChunkFile, line, MAX_LINE_LENGTH) == 0)
+    {
+        // Lines disabled by conditional assembly are stepped over, so the line number comes from the source file.
+        //
+        nLocalLineNum = pChunkFile->lineStart + 1;
+        fLabel = false;
+
+        // Skip comments, blank lines and conditional directives (already handled by scanConditionals()).
+        //
+        if (isCommentLine(line) || isBlankLine(line) || pChunkFile->fCondLine)
+            continue;
+
+        // If the line contains a symbol definition, record the value or the address it refers to.
+        //
+        if (isSymbolLine(line))
+        {
+            // Get the first token - this should be the symbol name (may end with a ':' character).
+            //
+            if (NULL != (pszToken = strtok_r (line, ": \t\r\n", &pszContext)))
+            {
+                strncpy(symbolName, pszToken, MAX_SYMBOL_NAME_LENGTH);
+                fLabel = true;
+
+                if (NULL != (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)))
+                {
+                    // *** EQU ***
+                    if (strcasecmp(pszToken, "EQU") == 0)
+                    {
+                        if (NULL != (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)))
+                        {
+                            if ('\'' == *pszToken)
+                            {
+                                // Symbol equates to an ASCII string
+                                // TODO - also ends with a ' ?
+                                if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_EQU_STRING, nLocalLineNum)) ||
+                                    (pStmt->spanOffset = getSpanOffset(pChunk, pChunkFile, line, (pszToken + 1))) < 0)
+                                    return -1;
+                                pStmt->spanLength = (int)strlen(pszToken + 1);
+                            }
+                            else if ('*' == *pszToken)
+                            {
+                                // Special Case: symbol refers to an address (FOO    EQU    *).
+                                //
+                                if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_LABEL, nLocalLineNum)))
+                                    return -1;
+                            }
+                            else
+                            {
+                                // Symbol equates to a number
+                                if (convertToNumber(pszToken, &nParam))
+                                    return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_EQU, NULL, pszToken);
+                                if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_EQU, nLocalLineNum)))
+                                    return -1;
+                                pStmt->value = nParam;
+                            }
+                            strncpy(pStmt->symbolName, symbolName, MAX_SYMBOL_NAME_LENGTH);
+                        }
+                        continue;
+                    }
+                    // *** RMB ***
+                    else if (strcasecmp(pszToken, "RMB") == 0)
+                    {
+                        // Handle special below.
+                    }
+                    else
+                    {
+                        // Symbol refers to an address - note that valid instructions may follow on this same line.
+                        //
+                        if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_LABEL, nLocalLineNum)))
+                            return -1;
+                        strncpy(pStmt->symbolName, symbolName, MAX_SYMBOL_NAME_LENGTH);
+                    }
+                }
+                else
+                {
+                    // Symbol refers to an address - no other instructions follow so we can move to the next line.
+                    //
+                    if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_LABEL, nLocalLineNum)))
+                        return -1;
+                    strncpy(pStmt->symbolName, symbolName, MAX_SYMBOL_NAME_LENGTH);
+                    continue;
+                }
+            }
+        }
+        else
+        {
+            if (NULL == (pszToken = strtok_r (line, " \t\r\n", &pszContext)))
+            {
+                continue;
+            }
+
+        }
+
+        // If there is no more data to process on this line, continue to the next.
+        //
+        if (isCommentLine(pszToken) || isBlankLine(pszToken))
+        {
+            continue;
+        }
+
+        // At this point we should have a valid instruction, start processing known instructions.
+        //
+
+        // *** ORG ***
+        if (strcasecmp(pszToken, "ORG") == 0)
+        {
+            if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) || convertToNumber(pszToken, &nParam))
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_ORG, NULL, NULL);
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_ORG, nLocalLineNum)))
+                return -1;
+            pStmt->value = nParam;
+            continue;
+        }
+
+        // *** RMB ***
+        if (strcasecmp(pszToken, "RMB") == 0)
+        {
+            // Symbol refers to an reserved address.
+            //
+            if (fLabel)
+            {
+                if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_LABEL, nLocalLineNum)))
+                    return -1;
+                strncpy(pStmt->symbolName, symbolName, MAX_SYMBOL_NAME_LENGTH);
+            }
+
+            if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) || convertToNumber(pszToken, &nParam))
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_RMB, NULL, NULL);
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_RMB, nLocalLineNum)))
+                return -1;
+            pStmt->value = nParam;
+            continue;
+        }
+
+        // *** STACK ***
+        if (strcasecmp(pszToken, "STACK") == 0)
+        {
+            if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) || convertToNumber(pszToken, &nParam) || nParam == 0)
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_STACK, NULL, NULL);
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_STACK, nLocalLineNum)))
+                return -1;
+            pStmt->value = nParam;
+            continue;
+        }
+
+        // *** FCB / FDB *** - one or two bytes per value in the list.
+        if (strcasecmp(pszToken, "FCB") == 0 || strcasecmp(pszToken, "FDB") == 0)
+        {
+            int nValueSize = (strcasecmp(pszToken, "FCB") == 0 ? 1 : 2);
+            int nValues;
+
+            if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)))
+                nValues = 1;
+            else if ((nValues = countListValues(pszToken)) < 0)
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_LIST, NULL, (nValueSize == 1 ? "FCB" : "FDB"));
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_SIZED, nLocalLineNum)))
+                return -1;
+            pStmt->value = (UINT16)(nValues * nValueSize);
+
+            // FDB values may be routine addresses (vectors, jump tables), which the LOCALS call graph needs.
+            //
+            if (nValueSize == 2 && pszToken && !isCommentLine(pszToken))
+            {
+                if ((pStmt->spanOffset = getSpanOffset(pChunk, pChunkFile, line, pszToken)) < 0)
+                    return -1;
+                pStmt->spanLength = (int)strlen(pszToken);
+            }
+            continue;
+        }
+
+        // *** FILL / BSZ / ZMB *** - FILL takes the value and then the count, BSZ and ZMB just the count.
+        if (strcasecmp(pszToken, "FILL") == 0 || strcasecmp(pszToken, "BSZ") == 0 || strcasecmp(pszToken, "ZMB") == 0)
+        {
+            char *pszDirective = pszToken;
+            char *pszCount;
+
+            if (NULL != (pszCount = strtok_r (NULL, " \t\r\n", &pszContext)) && strcasecmp(pszDirective, "FILL") == 0)
+                pszCount = (NULL != (pszCount = strchr(pszCount, ',')) ? pszCount + 1 : NULL);
+
+            if (NULL == pszCount || convertToNumber(pszCount, &nParam))
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_FILL, NULL, pszDirective);
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_SIZED, nLocalLineNum)))
+                return -1;
+            pStmt->value = nParam;
+            continue;
+        }
+
+        // *** FCC ***
+        if (strcasecmp(pszToken, "FCC") == 0)
+        {
+            if (NULL == (pszToken = strtok_r (NULL, "\"\r\n", &pszContext)))
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_FCC, NULL, NULL);
+
+            // TODO - how to handle leading spaces?
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_STRING, nLocalLineNum)))
+                return -1;
+            pStmt->value = (UINT16)strlen(pszToken);
+            if ((pStmt->spanOffset = getSpanOffset(pChunk, pChunkFile, line, pszToken)) < 0)
+                return -1;
+            pStmt->spanLength = (int)strlen(pszToken);
+            continue;
+        }
+
+        // *** STRPOOL / ENDPOOL *** - STRPOOL takes an optional terminator (Z == NUL, H == high bit on the last character).
+        if (strcasecmp(pszToken, "STRPOOL") == 0)
+        {
+            UINT16 nTerminator = STRPOOL_PLAIN;
+
+            if (NULL != (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) && !isCommentLine(pszToken))
+            {
+                if (strcasecmp(pszToken, "Z") == 0)
+                    nTerminator = STRPOOL_NUL;
+                else if (strcasecmp(pszToken, "H") == 0)
+                    nTerminator = STRPOOL_HIGH_BIT;
+                else
+                    return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_STRPOOL, NULL, NULL);
+            }
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_POOL, nLocalLineNum)))
+                return -1;
+            pStmt->value = nTerminator;
+            continue;
+        }
+
+        if (strcasecmp(pszToken, "ENDPOOL") == 0)
+        {
+            if (NULL == addStatement(pChunk, pChunkFile, STMT_ENDPOOL, nLocalLineNum))
+                return -1;
+            continue;
+        }
+
+        // *** LOCALRAM / LOCALS / ENDLOCALS *** - LOCALS follows the label of the routine that owns the variables.
+        if (strcasecmp(pszToken, "LOCALRAM") == 0)
+        {
+            UINT16 nStart;
+            UINT16 nEnd;
+
+            if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) || parseAddressRange(pszToken, &nStart, &nEnd))
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_LOCALRAM, NULL, NULL);
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_LOCALRAM, nLocalLineNum)))
+                return -1;
+            if ((pStmt->spanOffset = getSpanOffset(pChunk, pChunkFile, line, pszToken)) < 0)
+                return -1;
+            pStmt->spanLength = (int)strlen(pszToken);
+            continue;
+        }
+
+        if (strcasecmp(pszToken, "LOCALS") == 0)
+        {
+            if (!fLabel)
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_LOCALS, NULL, NULL);
+
+            if (NULL == addStatement(pChunk, pChunkFile, STMT_LOCALS, nLocalLineNum))
+                return -1;
+            continue;
+        }
+
+        if (strcasecmp(pszToken, "ENDLOCALS") == 0)
+        {
+            if (NULL == addStatement(pChunk, pChunkFile, STMT_ENDLOCALS, nLocalLineNum))
+                return -1;
+            continue;
+        }
+
+        // *** BANKWINDOW / BANK / ENDBANK *** - the statement walk switches location counters at BANK and ENDBANK.
+        if (strcasecmp(pszToken, "BANKWINDOW") == 0)
+        {
+            UINT16 nStart;
+            UINT16 nEnd;
+
+            if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) || parseAddressRange(pszToken, &nStart, &nEnd))
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_BANKWINDOW, NULL, NULL);
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_BANKWINDOW, nLocalLineNum)))
+                return -1;
+            if ((pStmt->spanOffset = getSpanOffset(pChunk, pChunkFile, line, pszToken)) < 0)
+                return -1;
+            pStmt->spanLength = (int)strlen(pszToken);
+            continue;
+        }
+
+        if (strcasecmp(pszToken, "BANK") == 0)
+        {
+            if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) || convertToNumber(pszToken, &nParam) || nParam >= MAX_SWITCH_BANKS)
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_BANK, NULL, NULL);
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_BANK, nLocalLineNum)))
+                return -1;
+            pStmt->value = nParam;
+            continue;
+        }
+
+        if (strcasecmp(pszToken, "ENDBANK") == 0)
+        {
+            if (NULL == addStatement(pChunk, pChunkFile, STMT_ENDBANK, nLocalLineNum))
+                return -1;
+            continue;
+        }
+
+        // *** DELAY *** - the sequence only depends on the operand, so it's built now to size it.
+        if (strcasecmp(pszToken, "DELAY") == 0)
+        {
+            UINT8  bytes[MAX_DELAY_BYTES];
+            UINT32 nCycles;
+            UINT8  nClobber;
+            int    nBytes;
+
+            if (parseDelay(strtok_r (NULL, " \t\r\n", &pszContext), &nCycles, &nClobber))
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_DELAY, NULL, NULL);
+
+            if ((nBytes = synthesizeDelay(nCycles, nClobber, bytes)) < 0)
+            {
+                char szCycles[MAX_SYMBOL_NAME_LENGTH];
+
+                snprintf(szCycles, sizeof(szCycles), "%lu", (unsigned long)nCycles);
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_DELAY_CYCLES, NULL, szCycles);
+            }
+
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_DELAY, nLocalLineNum)))
+                return -1;
+            pStmt->value = (UINT16)nBytes;
+            continue;
+        }
+
+        // *** INCBIN *** - the file is sized by the statement walk, which also lists it as a dependency.
+        if (strcasecmp(pszToken, "INCBIN") == 0)
+        {
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_INCBIN, nLocalLineNum)))
+                return -1;
+            if (NULL != (pszToken = strtok_r (NULL, "\r\n", &pszContext)))
+            {
+                if ((pStmt->spanOffset = getSpanOffset(pChunk, pChunkFile, line, pszToken)) < 0)
+                    return -1;
+                pStmt->spanLength = (int)strlen(pszToken);
+            }
+            continue;
+        }
+
+        // *** REPT / IRP ***
+        if (strcasecmp(pszToken, "REPT") == 0 || strcasecmp(pszToken, "IRP") == 0)
+        {
+            // The reader returns the body lines next.
+            //
+            if (beginRepeatExpansion(pChunkFile, strtok_r (NULL, " \t\r\n", &pszContext)))
+                return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_MACRO, NULL, pszToken);
+            continue;
+        }
+
+        // For all other commands, look for the instruction mneumonic in the command list.
+        //
+        if (NULL == (pInst = lookUpMneumonic(pszToken)))
+        {
+            // *** Macro invocation *** - the reader returns the expanded lines next.
+            //
+            if ((nMacro = lookUpMacro(pszToken)) >= 0)
+            {
+                if (beginMacroExpansion(pChunkFile, nMacro, strtok_r (NULL, " \t\r\n", &pszContext)))
+                    return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_MACRO, NULL, pszToken);
+                continue;
+            }
+
+            return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_MNEUMONIC, NULL, pszToken);
+        }
+
+        // Now, try to find an exact instruction match based on addressing mode.  If this command takes no parameters, we can continue to the next.
+        //
+        // TODO - need a better way to determine that this command only supports inherent addressing.
+        if (NULL == (pszToken = strtok_r (NULL, " \t\r\n", &pszContext)) || isCommentLine(pszToken) || isBlankLine(pszToken))
+        {
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_SIZED, nLocalLineNum)))
+                return -1;
+            pStmt->value = pInst->numBytes;
+            pStmt->pInst = pInst;
+            continue;
+        }
+
+        // Parameters that refer to symbols are sized once the symbol table is available.
+        //
+        if (isSymbolicParam(pszToken))
+        {
+            if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_DEFERRED, nLocalLineNum)))
+                return -1;
+            pStmt->pInst      = pInst;
+            if ((pStmt->spanOffset = getSpanOffset(pChunk, pChunkFile, line, pszToken)) < 0)
+                return -1;
+            pStmt->spanLength = (int)strlen(pszToken);
+            continue;
+        }
+
+        // Numeric parameters don't depend on anything else so the size can be computed now (a relative branch is the
+        // same size wherever it ends up, so the current address isn't needed).  The parameter span is saved first since
+        // computeAddrMode() splits indexed parameters in place.
+        //
+        if ((nSpanOffset = getSpanOffset(pChunk, pChunkFile, line, pszToken)) < 0)
+            return -1;
+        nSpanLength = (int)strlen(pszToken);
+        if (computeAddrMode(0, pInst, pszToken, &addrMode, &nParam))
+            return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_ADDRMODE, NULL, NULL);
+
+        if (NULL == lookUpMatchingAddrMode(pInst, addrMode))
+            return addParseError(pChunk, pChunkFile, nLocalLineNum, PARSE_ERROR_NO_ADDRMODE, pInst, NULL);
+
+        if (NULL == (pStmt = addStatement(pChunk, pChunkFile, STMT_SIZED, nLocalLineNum)))
+            return -1;
+        pStmt->value      = lookUpMatchingAddrMode(pInst, addrMode)->numBytes;
+        pStmt->pInst      = pInst;
+        pStmt->spanOffset = nSpanOffset;
+        pStmt->spanLength = nSpanLength;
+    }
+
+    return 0;
+}
+
+
+// Pass 1 worker thread - repeatedly claims the next unparsed chunk and parses it into statements.
+//
+void *parseChunkWorker(void *pContext)
+{
+    WORKCONTEXT *pWork = (WORKCONTEXT *)pContext;
+    int nChunk;
+
+    while ((nChunk = claimWorkItem(pWork)) >= 0)
+    {
+        CHUNK      *pChunk    = &pWork->pChunks[nChunk];
+        SOURCEFILE chunkFile  = *pWork->pSourceFile;
+        MACROSTATE macroState;
+
+        if (pChunk->fParsed)
+            continue;
+
+        // Line numbers are relative to the start of the chunk since the number of lines before it isn't known yet.
+        //
+        chunkFile.fileSize    = pChunk->endOffset;
+        chunkFile.piterOffset = chunkFile.pFile + pChunk->startOffset;
+        chunkFile.byteOffset  = pChunk->startOffset;
+        chunkFile.lineNumber  = 0;
+        chunkFile.fEOF        = (pChunk->startOffset >= pChunk->endOffset);
+        chunkFile.nextCondSpan = -1;
+        chunkFile.pMacroState  = &macroState;
+        macroState.depth       = 0;
+
+        pChunk->retVal    = parseStatements(&chunkFile, pChunk);
+        pChunk->lineCount = chunkFile.lineNumber;
+    }
+
+    return NULL;
+}
+
+
+// In watch mode, regions start at lines picked by a hash of their text, so the regions after an edit keep their lines
+// (and can be reused) even when lines are added or removed ahead of them.
+//
+bool isRegionAnchor(SOURCEFILE *pSourceFile, int nLineOffset)
+{
+    UINT32 nHash = 2166136261UL;
+
+    for (int i=nLineOffset ; i < pSourceFile->fileSize && pSourceFile->pFile[i] != '\n' ; i++)
+        nHash = ((nHash ^ (UINT8)pSourceFile->pFile[i]) * 16777619UL) & 0xFFFFFFFF;
+
+    return (0 == (nHash % WATCH_REGION_ANCHOR));
+}
+
+
+// Pass 1 (sequential part) - walk the statements of every chunk in source order, assigning addresses and pushing symbols
+// into the symbol table.  Each chunk starts at the address and line number where the previous one finished.
+//
+int resolveStatements(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks)
+{
+    char szParam[MAX_LINE_LENGTH];
+    char szFileName[MAX_LINE_LENGTH];
+    INSTRUCTION *pInst;
+    UINT16 nParam = 0;
+    ADDRMODE addrMode;
+    UINT16 nAddr = 0;
+    int  nLineBase = 0;
+    int  nRetVal;
+    int  nSize;
+    int  nRegionLines;
+    int  nNextPool = -1;
+    int  nNextLocal = 0;
+    int  nBank = BANK_COMMON;
+    bool fInLocals = false;
+    STATEMENT *pPrevInst = NULL;
+
+    for (int nChunk=0 ; nChunk < nChunks ; nChunk++)
+    {
+        CHUNK *pChunk = &pChunks[nChunk];
+
+        for (int nStmt=0 ; nStmt < pChunk->statementCount ; nStmt++)
+        {
+            STATEMENT *pStmt        = &pChunk->pStatements[nStmt];
+            int       nLocalLineNum = nLineBase + pStmt->lineNumber;
+
+            // Start a new pass 2 region once the current one covers enough lines (or at an ORG block, below).  The
+            // address is known at this point so pass 2 can encode the region without looking at any of the lines before it.
+            // A region can't start inside a macro expansion, since pass 2 only ever starts reading at a source line.
+            //
+            // BANK and ENDBANK switch location counters first, so the region starting at them is in the bank entered.
+            //
+            if ((pStmt->kind == STMT_BANK || pStmt->kind == STMT_ENDBANK) && switchBank(pStmt, &nBank, &nAddr, nLocalLineNum))
+                return -1;
+
+            nRegionLines = nLineBase + pStmt->lineStart - g_regions[g_regionCount - 1].startLine;
+            if (0 == pStmt->macroLine &&
+                (pStmt->kind == STMT_ORG || pStmt->kind == STMT_BANK || pStmt->kind == STMT_ENDBANK ||
+                 (g_fWatch ? ((nRegionLines >= WATCH_REGION_MIN_LINES && isRegionAnchor(pSourceFile, pStmt->lineOffset)) ||
+                              nRegionLines >= (PASS2_REGION_LINES * 4))
+                           : nRegionLines >= PASS2_REGION_LINES)))
+            {
+                if (beginRegion(pSourceFile, pStmt->lineOffset, (nLineBase + pStmt->lineStart), nAddr, nBank))
+                    return -1;
+            }
+
+            pStmt->addr = nAddr;
+
+            if ((pStmt->kind == STMT_LABEL || pStmt->kind == STMT_EQU || pStmt->kind == STMT_EQU_STRING) &&
+                checkPredefinedSymbol(pStmt->symbolName, nLocalLineNum))
+                return -1;
+
+            switch (pStmt->kind)
+            {
+                case STMT_LABEL:
+                    // A label in a string pool is bound to the string on its line, wherever the pool stored it.
+                    //
+                    if (nNextPool >= 0 && nNextPool < g_poolStringCount)
+                        pStmt->addr = g_poolStrings[nNextPool].addr;
+
+                    // A label in a LOCALS block is bound to the variable on its line, wherever allocateLocals() placed it.
+                    //
+                    if (fInLocals && nNextLocal < g_localVarCount)
+                        pStmt->addr = g_localVars[nNextLocal].addr;
+                    pushSymbol(pStmt->symbolName, SYMBOL_TYPE_NUMBER_16BIT, &pStmt->addr);
+                    break;
+
+                case STMT_EQU:
+                    pushSymbol(pStmt->symbolName, (pStmt->value < 256 ? SYMBOL_TYPE_NUMBER_8BIT : SYMBOL_TYPE_NUMBER_16BIT), &pStmt->value);
+                    break;
+
+                case STMT_EQU_STRING:
+                    getStatementSpan(pSourceFile, pChunk, pStmt, szParam);
+                    pushSymbol(pStmt->symbolName, SYMBOL_TYPE_STRING, szParam);
+                    break;
+
+                case STMT_ORG:
+                    nAddr = pStmt->value;
+
+                    // If we haven't already found the start address ("START" symbol), use the first ORG section found...
+                    if (!g_startAddress)
+                    {
+                        g_startAddress = nAddr;
+                    }
+                    break;
+
+                case STMT_RMB:
+                    if (fInLocals && nNextLocal < g_localVarCount)
+                    {
+                        pStmt->addr = g_localVars[nNextLocal++].addr;
+                        pStmt->size = 0;
+                        break;
+                    }
+                    pStmt->size = pStmt->value;
+                    nAddr += pStmt->value;
+                    break;
+
+                case STMT_LOCALS:
+                case STMT_ENDLOCALS:
+                    fInLocals = (pStmt->kind == STMT_LOCALS);
+                    break;
+
+                case STMT_LOCALRAM:
+                case STMT_BANK:
+                case STMT_ENDBANK:
+                    break;
+
+                case STMT_BANKWINDOW:
+                    getStatementSpan(pSourceFile, pChunk, pStmt, szParam);
+                    if (setBankWindow(szParam, nLocalLineNum))
+                        return -1;
+                    break;
+
+                case STMT_STACK:
+                    g_stackBudget = pStmt->value;
+                    break;
+
+                case STMT_SIZED:
+                    nSize = pStmt->value;
+                    if (g_fOptimize && pStmt->pInst && (nSize = optimizeStatement(pSourceFile, pChunks, nChunks, nChunk, nStmt, pPrevInst, nSize)) < 0)
+                        return -1;
+                    pStmt->size = (UINT16)nSize;
+                    nAddr += nSize;
+                    break;
+
+                case STMT_STRING:
+                    pStmt->size = pStmt->value;
+                    if (nNextPool >= 0 && nNextPool < g_poolStringCount)
+                    {
+                        if (g_poolStrings[nNextPool].fShared)
+                            pStmt->size = 0;
+                        else if (g_poolStrings[nNextPool].terminator == STRPOOL_NUL)
+                            pStmt->size++;
+                        nNextPool++;
+                    }
+                    nAddr += pStmt->size;
+                    break;
+
+                case STMT_POOL:
+                    if (nNextPool >= 0)
+                    {
+                        printf("ERROR: STRPOOL on line %d is inside another string pool\r\n", nLocalLineNum);
+                        return -1;
+                    }
+                    nNextPool = g_poolStringCount;
+                    if (layoutStringPool(pSourceFile, pChunks, nChunks, nChunk, nStmt, nLineBase, nAddr))
+                        return -1;
+                    break;
+
+                case STMT_ENDPOOL:
+                    if (nNextPool < 0)
+                    {
+                        printf("ERROR: ENDPOOL on line %d doesn\'t follow a STRPOOL\r\n", nLocalLineNum);
+                        return -1;
+                    }
+                    nNextPool = -1;
+                    break;
+
+                case STMT_DELAY:
+                    pStmt->size = pStmt->value;
+                    nAddr += pStmt->value;
+                    break;
+
+                case STMT_INCBIN:
+                    getStatementSpan(pSourceFile, pChunk, pStmt, szParam);
+                    if ((nSize = parseIncludeBinary(szParam, szFileName, &nParam, nLocalLineNum)) < 0 || addDependency(szFileName))
+                        return -1;
+                    pStmt->size = (UINT16)nSize;
+                    nAddr += nSize;
+                    break;
+
+                case STMT_DEFERRED:
+                    pInst = pStmt->pInst;
+                    getStatementSpan(pSourceFile, pChunk, pStmt, szParam);
+
+                    // If the referenced symbol isn't defined yet (a forward reference), the addressing mode can only be direct,
+                    // extended, or relative (immediate and indirect require a predefined constant value).  In our case, direct
+                    // isn't supported because we have no need to access bytes 0-255 (internal RAM).  This only leaves extended
+                    // and relative and the latter is only used in a few limited cases (ex: branching instructions).  Based on
+                    // this premise, the size of the instruction is computed as follows:
+                    //
+                    // 1. Look up the instruction in the table - if it only supports a single relative addressing mode, assume the
+                    //      mode is relative and compute the number of bytes for the next instruction based on this.  If later the
+                    //      address is outside the relative address range then we need to flag it as an error and stop further processing.
+                    //
+                    // 2. If the addressing mode isn't relative, assume it's extended and look up the corresponding number of
+                    //      instruction bytes for the extended addressing mode.
+                    //
+                    // NOTE: In the future if we want to support direct addressing, likely any symbols in that range (0-255 bytes)
+                    //         will already be defined before the code that accesses it so the code may be relativley simple.
+                    //
+                    // Immediate parameters keep their size whatever the value turns out to be.  Lines sized as extended are
+                    // recorded so pass 2 encodes them as extended even if the symbol ends up in the direct page - otherwise
+                    // the code would no longer match the addresses assigned here.
+                    //
+                    if (-2 == (nRetVal = computeAddrMode(nAddr, pInst, szParam, &addrMode, &nParam)))
+                    {
+                        if (pInst->addrMode == REL)
+                        {
+                            nSize = pInst->numBytes;
+                        }
+                        else
+                        {
+                            INSTRUCTION *pTemp = pInst;
+                            ADDRMODE    sizeMode = (*szParam == '#' ? IMM : EXT);
+                            
+                            if (NULL == (pTemp = lookUpMatchingAddrMode(pTemp, sizeMode)))
+                            {
+                                printf("ERROR: Instruction \'%s\' doesn\'t offer addressing mode %d\r\n", pInst->mnemonic, (int)sizeMode);
+                                return -1;
+                            }
+                            if (sizeMode == EXT && addForwardReference(pStmt->lineOffset, pStmt->macroLine))
+                                return -1;
+                            
+                            nSize = pTemp->numBytes;
+                        }
+                    }
+                    else
+                    {
+                        if (nRetVal)
+                        {
+                            printf("ERROR: Invalid address mode on line %d\r\n", nLocalLineNum);
+                            return -1;
+                        }
+
+                        // Now that we know the instruction addressing mode, look up the exact match in the instruction table.
+                        //
+                        if (NULL == (pInst = lookUpMatchingAddrMode(pInst, addrMode)))
+                        {
+                            printf("ERROR: Instruction \'%s\' doesn\'t offer addressing mode %d\r\n", pStmt->pInst->mnemonic, (int)addrMode);
+                            return -1;
+                        }
+                        nSize = pInst->numBytes;
+                    }
+
+                    // Increment the address counter by the number of bytes required for the instruction (after any peephole rewrite).
+                    //
+                    if (g_fOptimize && (nSize = optimizeStatement(pSourceFile, pChunks, nChunks, nChunk, nStmt, pPrevInst, nSize)) < 0)
+                        return -1;
+                    pStmt->size = (UINT16)nSize;
+                    nAddr += nSize;
+                    break;
+
+                case STMT_ERROR:
+                default:
+                    switch ((PARSEERROR)pStmt->value)
+                    {
+                        case PARSE_ERROR_EQU:
+                            printf("ERROR: Invalid EQU value \'%s\' on line %d\r\n", pStmt->symbolName, nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_ORG:
+                            printf("ERROR: Invalid ORG instruction\r\n");
+                            break;
+                        case PARSE_ERROR_RMB:
+                            printf("ERROR: Invalid RMB instruction\r\n");
+                            break;
+                        case PARSE_ERROR_STACK:
+                            printf("ERROR: Invalid STACK directive on line %d\r\n", nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_FCC:
+                            printf("ERROR: Invalid FCC instruction\r\n");
+                            break;
+                        case PARSE_ERROR_MNEUMONIC:
+                            printf("ERROR: Invalid mneumonic \'%s\' on line %d\r\n", pStmt->symbolName, nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_NO_ADDRMODE:
+                            printf("ERROR: Instruction \'%s\' doesn\'t offer the requested addressing mode on line %d\r\n", pStmt->pInst->mnemonic, nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_MACRO:
+                            printf("ERROR: Invalid %s on line %d (arguments, nesting deeper than %d or REPT count)\r\n", pStmt->symbolName,
+                                   nLocalLineNum, MAX_MACRO_DEPTH);
+                            break;
+                        case PARSE_ERROR_STRPOOL:
+                            printf("ERROR: Invalid STRPOOL terminator on line %d (Z or H)\r\n", nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_FILL:
+                            printf("ERROR: Invalid %s directive on line %d\r\n", pStmt->symbolName, nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_LIST:
+                            printf("ERROR: Invalid %s list on line %d (empty value)\r\n", pStmt->symbolName, nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_DELAY:
+                            printf("ERROR: Invalid DELAY on line %d (cycles or <n>US, then optionally a list of A, B, D, X, Y and C)\r\n", nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_DELAY_CYCLES:
+                            printf("ERROR: DELAY of %s cycles on line %d can\'t be built in %d bytes (one cycle is too short, and a loop needs C and runs at most 65536 passes)\r\n",
+                                   pStmt->symbolName, nLocalLineNum, MAX_DELAY_BYTES);
+                            break;
+                        case PARSE_ERROR_LOCALRAM:
+                            printf("ERROR: Invalid LOCALRAM on line %d (first and last address)\r\n", nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_LOCALS:
+                            printf("ERROR: LOCALS on line %d needs the label of the routine it belongs to\r\n", nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_BANKWINDOW:
+                            printf("ERROR: Invalid BANKWINDOW on line %d (first and last address)\r\n", nLocalLineNum);
+                            break;
+                        case PARSE_ERROR_BANK:
+                            printf("ERROR: Invalid BANK on line %d (0 to %d)\r\n", nLocalLineNum, MAX_SWITCH_BANKS - 1);
+                            break;
+                        case PARSE_ERROR_ADDRMODE:
+                        default:
+                            printf("ERROR: Invalid address mode on line %d\r\n", nLocalLineNum);
+                            break;
+                    }
+                    return -1;
+            }
+
+            if (checkBankPlacement(pStmt, nBank, nLocalLineNum))
+                return -1;
+
+            // Keep track of the instruction just walked so a following load can be matched against it.
+            //
+            pPrevInst = ((pStmt->kind == STMT_SIZED || pStmt->kind == STMT_DEFERRED) && pStmt->pInst && !pStmt->macroLine ? pStmt : NULL);
+        }
+
+        // A chunk that stopped early (out of memory) is missing statements, so nothing after it can be trusted.
+        //
+        if (pChunk->retVal)
+            return -1;
+
+        nLineBase += pChunk->lineCount;
+    }
+
+    return 0;
+}
+
+
+// Split the source between two line starts into roughly equal chunks of about PASS1_CHUNK_SIZE bytes, moving each split
+// point forward to the start of the next line.  Returns the number of chunks.
+//
+int splitChunks(SOURCEFILE *pSourceFile, int nStartOffset, int nEndOffset, CHUNK *pChunks)
+{
+    int nChunks = ((nEndOffset - nStartOffset) / PASS1_CHUNK_SIZE) + 1;
+    int nCount  = 0;
+    int nOffset = nStartOffset;
+
+    for (int i=1 ; i <= nChunks ; i++)
+    {
+        int nSplitOffset = nStartOffset + (int)(((long)(nEndOffset - nStartOffset) * i) / nChunks);
+
+        while (nSplitOffset < nEndOffset && pSourceFile->pFile[nSplitOffset - 1] != '\n')
+            nSplitOffset++;
+        
+        // A run of disabled lines is only stepped over from its start, so it can't be split.
+        //
+        if (pSourceFile->condSpanCount && (nSplitOffset = getEnabledOffset(pSourceFile, nSplitOffset)) > nEndOffset)
+            nSplitOffset = nEndOffset;
+
+        if (nSplitOffset > nOffset)
+        {
+            pChunks[nCount].startOffset = nOffset;
+            pChunks[nCount].endOffset   = nSplitOffset;
+            nCount++;
+            nOffset = nSplitOffset;
+        }
+    }
+
+    return nCount;
+}
+
+
+// Carry a chunk over from the previous assembly, moving its statements by the change in the source size ahead of it.
+// The jump relaxation flags start over since the addresses around the chunk may have moved.
+//
+void moveWatchChunk(CHUNK *pChunk, CHUNK *pPrevChunk, int nShift)
+{
+    *pChunk = *pPrevChunk;
+    pChunk->startOffset += nShift;
+    pChunk->endOffset   += nShift;
+    pChunk->fParsed      = true;
+
+    for (int i=0 ; i<pChunk->statementCount ; i++)
+    {
+        pChunk->pStatements[i].lineOffset += nShift;
+        pChunk->pStatements[i].spanOffset += nShift;
+        pChunk->pStatements[i].fShortJump  = false;
+        pChunk->pStatements[i].fLongJump   = false;
+    }
+}
+
+
+// Watch mode - build the chunk list from the previous assembly's chunks.  The source is compared with the previous
+// text to find the unchanged bytes at the start and end.  Chunks that lie wholly in either keep their statements, and
+// the text between them is split into new chunks, which are the only ones pass 1 parses.
+//
+int reuseWatchChunks(SOURCEFILE *pSourceFile, CHUNK **ppChunks, int *pnCount)
+{
+    char  *pPrev      = g_watch.pSource;
+    int   nPrevSize   = g_watch.sourceSize;
+    int   nSize       = pSourceFile->fileSize;
+    int   nCommon     = (nPrevSize < nSize ? nPrevSize : nSize);
+    int   nPrefix     = 0;
+    int   nSuffix     = 0;
+    int   nHead       = 0;
+    int   nTail       = g_watch.chunkCount;
+    int   nStartOffset;
+    int   nEndOffset;
+    int   nCount      = 0;
+    CHUNK *pChunks;
+
+    while (nPrefix < nCommon && pPrev[nPrefix] == pSourceFile->pFile[nPrefix])
+        nPrefix++;
+    while (nSuffix < nCommon - nPrefix && pPrev[nPrevSize - 1 - nSuffix] == pSourceFile->pFile[nSize - 1 - nSuffix])
+        nSuffix++;
+
+    g_watch.prefixLength = nPrefix;
+    g_watch.suffixLength = nSuffix;
+    g_watch.sizeDelta    = nSize - nPrevSize;
+
+    // A leading chunk is kept if its last line ends (with the line break) in the unchanged start, and a trailing chunk
+    // if the line break ahead of it is in the unchanged end.
+    //
+    while (nHead < nTail && g_watch.pChunks[nHead].endOffset <= nPrefix &&
+           (pPrev[g_watch.pChunks[nHead].endOffset - 1] == '\n' || (nPrefix == nPrevSize && nPrefix == nSize)))
+        nHead++;
+    while (nTail > nHead && g_watch.pChunks[nTail - 1].startOffset > 0 &&
+           g_watch.pChunks[nTail - 1].startOffset - 1 >= nPrevSize - nSuffix)
+        nTail--;
+
+    nStartOffset = (nHead ? g_watch.pChunks[nHead - 1].endOffset : 0);
+    nEndOffset   = (nTail < g_watch.chunkCount ? g_watch.pChunks[nTail].startOffset + g_watch.sizeDelta : nSize);
+
+    if (NULL == (pChunks = (CHUNK *)calloc(nHead + ((nEndOffset - nStartOffset) / PASS1_CHUNK_SIZE) + 1 + (g_watch.chunkCount - nTail), sizeof(CHUNK))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(CHUNK) * g_watch.chunkCount));
+        return -1;
+    }
+
+    for (int i=0 ; i<nHead ; i++)
+        moveWatchChunk(&pChunks[nCount++], &g_watch.pChunks[i], 0);
+
+    nCount += splitChunks(pSourceFile, nStartOffset, nEndOffset, &pChunks[nCount]);
+
+    for (int i=nTail ; i<g_watch.chunkCount ; i++)
+        moveWatchChunk(&pChunks[nCount++], &g_watch.pChunks[i], g_watch.sizeDelta);
+
+    // The statements of the chunks in between are parsed again.
+    //
+    for (int i=nHead ; i<nTail ; i++)
+    {
+        if (g_watch.pChunks[i].pStatements)
+            free(g_watch.pChunks[i].pStatements);
+        if (g_watch.pChunks[i].macroText.pBuffer)
+            free(g_watch.pChunks[i].macroText.pBuffer);
+    }
+    free(g_watch.pChunks);
+    g_watch.pChunks    = NULL;
+    g_watch.chunkCount = 0;
+
+    g_watch.parsedBytes = nEndOffset - nStartOffset;
+
+    *ppChunks = pChunks;
+    *pnCount  = nCount;
+
+    return 0;
+}
+
+
+// Undo the effects of a statement walk - symbols pushed, regions, forward references, peephole rewrites, pooled
+// strings and switched banks - so the statements can be walked again.  The LOCALS variables were placed ahead of the walks and are kept.
+//
+void resetStatementWalk(SOURCEFILE *pSourceFile, UINT16 nBaseSymbols, UINT16 nStartAddress)
+{
+    memset(&symbols[nBaseSymbols], 0, (sizeof(SYMBOL) * (MAX_SYMBOL_COUNT - nBaseSymbols)));
+    symbolCount    = nBaseSymbols;
+    g_startAddress = nStartAddress;
+    
+    g_regionCount = 0;
+    beginRegion(pSourceFile, 0, 0, 0, BANK_COMMON);
+    
+    g_forwardRefCount = 0;
+    g_rewriteCount    = 0;
+    resetStringPools();
+    resetBanks();
+    for (PEEPHOLERULE *pRule = g_peepholeRules ; pRule->pszMatch ; pRule++)
+    {
+        pRule->count       = 0;
+        pRule->bytesSaved  = 0;
+        pRule->cyclesSaved = 0;
+    }
+}
+
+
+// Pass 1 - build the symbol table.  The source is split at line boundaries into chunks which are parsed in parallel, then
+// the statements are walked in order to assign addresses (each chunk's addresses follow on from the previous chunk's).
+//
+int buildSymbolTable(SOURCEFILE *pSourceFile)
+{
+    int nRetVal = 0;
+    int nChunks = (pSourceFile->fileSize / PASS1_CHUNK_SIZE) + 1;
+    int nCount  = 0;
+    CHUNK *pChunks;
+    WORKCONTEXT work;
+    UINT16 nBaseSymbols;
+    UINT16 nStartAddress;
+
+    // In watch mode only the text an edit touched is parsed again.
+    //
+    if (g_fWatch && g_watch.pChunks)
+    {
+        if (0 != (nRetVal = reuseWatchChunks(pSourceFile, &pChunks, &nCount)))
+            return nRetVal;
+    }
+    else
+    {
+        if (NULL == (pChunks = (CHUNK *)calloc(nChunks, sizeof(CHUNK))))
+        {
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(CHUNK) * nChunks));
+            return -1;
+        }
+        nCount = splitChunks(pSourceFile, 0, pSourceFile->fileSize, pChunks);
+        g_watch.parsedBytes = pSourceFile->fileSize;
+    }
+
+    memset(&work, 0, sizeof(WORKCONTEXT));
+    work.pSourceFile = pSourceFile;
+    work.pChunks     = pChunks;
+    work.itemCount   = nCount;
+
+    runWorkers(parseChunkWorker, &work);
+
+    // The LOCALS variables are placed once, ahead of the walks - their addresses don't depend on the location counter.
+    //
+    nRetVal = allocateLocals(pSourceFile, pChunks, nCount);
+
+    // With peephole optimization on, the walk is repeated until the set of JMPs encoded as BRA settles.  Each walk starts
+    // from the symbols and state that were in place before the first one.
+    //
+    nBaseSymbols  = symbolCount;
+    nStartAddress = g_startAddress;
+    while (0 == nRetVal)
+    {
+        resetStatementWalk(pSourceFile, nBaseSymbols, nStartAddress);
+        
+        if (0 != (nRetVal = resolveStatements(pSourceFile, pChunks, nCount)) || !g_fOptimize || !relaxJumps(pSourceFile, pChunks, nCount))
+            break;
+    }
+    
+    if (0 == nRetVal)
+        nRetVal = checkBankCalls(pSourceFile, pChunks, nCount);
+    
+    if (0 == nRetVal && g_fMemoryMap)
+        nRetVal = buildMemoryMap(pChunks, nCount);
+
+    // Watch mode keeps the statements for the next assembly.
+    //
+    if (0 == nRetVal && g_fWatch)
+    {
+        g_watch.pChunks    = pChunks;
+        g_watch.chunkCount = nCount;
+        return 0;
+    }
+
+    for (int i=0 ; i < nCount ; i++)
+    {
+        if (pChunks[i].pStatements)
+            free(pChunks[i].pStatements);
+        if (pChunks[i].macroText.pBuffer)
+            free(pChunks[i].macroText.pBuffer);
+    }
+    free(pChunks);
+
+    return nRetVal;
+}
+
+
+// Returns a map from the previous assembly's symbols to the current ones (-1 where the symbol is gone or its value or
+// type changed).
+//
+int *mapWatchSymbols(void)
+{
+    int *pSymbolMap;
+
+    if (NULL == (pSymbolMap = (int *)malloc(sizeof(int) * (g_watch.symbolCount ? g_watch.symbolCount : 1))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(int) * g_watch.symbolCount));
+        return NULL;
+    }
+
+    for (int i=0 ; i<g_watch.symbolCount ; i++)
+    {
+        SYMBOL *pPrev = &g_watch.pSymbols[i];
+        int    nIndex = findSymbolIndex(pPrev->symbolName);
+
+        if (nIndex >= 0 && symbols[nIndex].symbolType != pPrev->symbolType)
+            nIndex = -1;
+        else if (nIndex >= 0)
+        {
+            switch (pPrev->symbolType)
+            {
+                case SYMBOL_TYPE_NUMBER_8BIT:
+                    nIndex = (symbols[nIndex].u.nsymbolValue8 == pPrev->u.nsymbolValue8 ? nIndex : -1);
+                    break;
+                case SYMBOL_TYPE_NUMBER_16BIT:
+                    nIndex = (symbols[nIndex].u.nsymbolValue16 == pPrev->u.nsymbolValue16 ? nIndex : -1);
+                    break;
+                case SYMBOL_TYPE_STRING:
+                default:
+                    nIndex = (!strcmp(symbols[nIndex].u.symbolValueStr, pPrev->u.symbolValueStr) ? nIndex : -1);
+                    break;
+            }
+        }
+        pSymbolMap[i] = nIndex;
+    }
+
+    return pSymbolMap;
+}
+
+
+// Returns true if a region from the previous assembly encodes exactly as it did then when moved to the given offset -
+// every line must be sized and rewritten the same way by pass 1 and refer only to symbols whose values didn't change.
+// Regions that include a binary file are always encoded again, since the file may have changed without the source, and
+// so are pooled strings, which depend on every other string in the pool, and LOCALS variables, which depend on the whole
+// call graph.
+// Expanded lines are always encoded again too, since their text depends on the body they came from and the offset
+// of the invocation.
+//
+bool isReusableRegion(REGION *pPrevRegion, int nShift, int *pSymbolMap)
+{
+    for (int i=0 ; i<pPrevRegion->lineCount ; i++)
+    {
+        LINERECORD *pLine = &pPrevRegion->pLines[i];
+
+        if (pLine->textOffset >= 0 || pLine->kind == LINE_BINARY || (pLine->refSymbol >= 0 && pSymbolMap[pLine->refSymbol] < 0) ||
+            isPooledLine(g_watch.pPoolStrings, g_watch.poolStringCount, pLine->lineOffset) ||
+            isPooledLine(g_poolStrings, g_poolStringCount, pLine->lineOffset + nShift) ||
+            isLocalLine(g_watch.pLocalVars, g_watch.localVarCount, pLine->lineOffset) ||
+            isLocalLine(g_localVars, g_localVarCount, pLine->lineOffset + nShift) ||
+            findForwardReference(g_watch.pForwardRefs, g_watch.forwardRefCount, pLine->lineOffset, 0) != isForwardReference(pLine->lineOffset + nShift, 0) ||
+            findRewriteRule(g_watch.pRewrites, g_watch.rewriteCount, pLine->lineOffset) != findRewrite(pLine->lineOffset + nShift))
+            return false;
+    }
+
+    return true;
+}
+
+
+// Watch mode - take over the line records of each region the edit didn't affect: the same text (in the unchanged start
+// or end of the source) starting at the same address, with nothing it depends on changed.  Pass 2 skips them, and their
+// bytes are merged into the memory image with the others.
+//
+int reuseWatchRegions(SOURCEFILE *pSourceFile)
+{
+    int *pSymbolMap;
+
+    g_watch.reusedRegions = 0;
+
+    if (NULL == (pSymbolMap = mapWatchSymbols()))
+        return -1;
+
+    for (int i=0 ; i<g_regionCount ; i++)
+    {
+        REGION *pRegion = &g_regions[i];
+        REGION *pPrevRegion = NULL;
+        int    nShift;
+        int    nLow  = 0;
+        int    nHigh = g_watch.regionCount - 1;
+
+        if (pRegion->endOffset <= g_watch.prefixLength)
+            nShift = 0;
+        else if (pRegion->startOffset > 0 && pRegion->startOffset - 1 >= pSourceFile->fileSize - g_watch.suffixLength)
+            nShift = g_watch.sizeDelta;
+        else
+            continue;
+
+        while (nLow <= nHigh)
+        {
+            int nMid = (nLow + nHigh) / 2;
+
+            if (g_watch.pRegions[nMid].startOffset == pRegion->startOffset - nShift)
+            {
+                pPrevRegion = &g_watch.pRegions[nMid];
+                break;
+            }
+            if (g_watch.pRegions[nMid].startOffset < pRegion->startOffset - nShift)
+                nLow = nMid + 1;
+            else
+                nHigh = nMid - 1;
+        }
+
+        if (NULL == pPrevRegion || pPrevRegion->endOffset != pRegion->endOffset - nShift || pPrevRegion->startAddr != pRegion->startAddr ||
+            pPrevRegion->bank != pRegion->bank || NULL == pPrevRegion->pLines || !isReusableRegion(pPrevRegion, nShift, pSymbolMap))
+            continue;
+
+        pRegion->pLines             = pPrevRegion->pLines;
+        pRegion->lineCount          = pPrevRegion->lineCount;
+        pRegion->linesAllocated     = pPrevRegion->linesAllocated;
+        pRegion->pLineBytes         = pPrevRegion->pLineBytes;
+        pRegion->lineByteCount      = pPrevRegion->lineByteCount;
+        pRegion->lineBytesAllocated = pPrevRegion->lineBytesAllocated;
+        pRegion->pLineText          = pPrevRegion->pLineText;
+        pRegion->lineTextLength     = pPrevRegion->lineTextLength;
+        pRegion->lineTextAllocated  = pPrevRegion->lineTextAllocated;
+        pRegion->fReused            = true;
+        pPrevRegion->pLines         = NULL;
+        pPrevRegion->pLineBytes     = NULL;
+        pPrevRegion->pLineText      = NULL;
+
+        for (int j=0 ; j<pRegion->lineCount ; j++)
+        {
+            LINERECORD *pLine = &pRegion->pLines[j];
+
+            pLine->lineOffset += nShift;
+            pLine->lineNumber += pRegion->startLine - pPrevRegion->startLine;
+            if (pLine->refSymbol >= 0)
+                pLine->refSymbol = pSymbolMap[pLine->refSymbol];
+        }
+
+        g_watch.reusedRegions++;
+    }
+
+    free(pSymbolMap);
+
+    return 0;
+}
+
+
+// Free the regions, pass 1 line lists and symbols kept from the previous assembly.
+//
+void freeWatchAssembly(void)
+{
+    for (int i=0 ; i<g_watch.regionCount ; i++)
+    {
+        if (g_watch.pRegions[i].listing.pBuffer)
+            free(g_watch.pRegions[i].listing.pBuffer);
+        if (g_watch.pRegions[i].pLines)
+            free(g_watch.pRegions[i].pLines);
+        if (g_watch.pRegions[i].pLineBytes)
+            free(g_watch.pRegions[i].pLineBytes);
+        if (g_watch.pRegions[i].pLineText)
+            free(g_watch.pRegions[i].pLineText);
+    }
+    if (g_watch.pRegions)
+        free(g_watch.pRegions);
+    if (g_watch.pForwardRefs)
+        free(g_watch.pForwardRefs);
+    if (g_watch.pRewrites)
+        free(g_watch.pRewrites);
+    if (g_watch.pPoolStrings)
+        free(g_watch.pPoolStrings);
+    if (g_watch.pLocalVars)
+        free(g_watch.pLocalVars);
+    if (g_watch.pSymbols)
+        free(g_watch.pSymbols);
+    
+    g_watch.pRegions     = NULL;
+    g_watch.regionCount  = 0;
+    g_watch.pForwardRefs = NULL;
+    g_watch.pRewrites    = NULL;
+    g_watch.pPoolStrings = NULL;
+    g_watch.pLocalVars   = NULL;
+    g_watch.pSymbols     = NULL;
+}
+
+
+// Drop everything kept from the previous assembly, so the next one starts from scratch.
+//
+void freeWatchState(void)
+{
+    for (int i=0 ; i<g_watch.chunkCount ; i++)
+    {
+        if (g_watch.pChunks[i].pStatements)
+            free(g_watch.pChunks[i].pStatements);
+        if (g_watch.pChunks[i].macroText.pBuffer)
+            free(g_watch.pChunks[i].macroText.pBuffer);
+    }
+    if (g_watch.pChunks)
+        free(g_watch.pChunks);
+    
+    freeWatchAssembly();
+    memset(&g_watch, 0, sizeof(WATCHSTATE));
+}
+
+
+// Keep what the next assembly in watch mode can reuse (buildSymbolTable() already kept the chunks).  The regions, forward
+// references, rewrites, pooled strings and LOCALS variables are taken over from the globals, so the usual clean-up leaves them alone.
+//
+int keepWatchState(SOURCEFILE *pSourceFile)
+{
+    freeWatchAssembly();
+    
+    if (NULL == (g_watch.pSymbols = (SYMBOL *)malloc(sizeof(SYMBOL) * (symbolCount ? symbolCount : 1))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(SYMBOL) * symbolCount));
+        freeWatchState();
+        return -1;
+    }
+    memcpy(g_watch.pSymbols, symbols, (sizeof(SYMBOL) * symbolCount));
+    g_watch.symbolCount = symbolCount;
+    
+    g_watch.pSource         = pSourceFile->pFile;
+    g_watch.sourceSize      = pSourceFile->fileSize;
+    g_watch.pRegions        = g_regions;
+    g_watch.regionCount     = g_regionCount;
+    g_watch.pForwardRefs    = g_forwardRefs;
+    g_watch.forwardRefCount = g_forwardRefCount;
+    g_watch.pRewrites       = g_rewrites;
+    g_watch.rewriteCount    = g_rewriteCount;
+    g_watch.pPoolStrings    = g_poolStrings;
+    g_watch.poolStringCount = g_poolStringCount;
+    g_watch.pLocalVars      = g_localVars;
+    g_watch.localVarCount   = g_localVarCount;
+    
+    g_regions     = NULL;
+    g_regionCount = 0;
+    g_forwardRefs = NULL;
+    g_rewrites    = NULL;
+    g_poolStrings = NULL;
+    g_localVars   = NULL;
+    
+    return 0;
+}
 
-        // Try to compute the addressing mode from the insruction parameters.  If we can't find the referenced symbol in the symbol table, recursively
-        // call this function so we can find it, then continue.
-        //
-        if (-2 == (nRetVal = computeAddrMode(nAddr, pInst, pszToken, &addrMode, &nParam)))
+
+// Copy the bytes a region encoded into the memory image (common memory or its switched bank) and write their S-records.
+// Regions are merged in source order, so where ORG blocks overlap the last one wins, as it would assembling serially.  A
+// line's bytes are split where they run past the top of the address space and wrap around; a switched bank's bytes load
+// at their physical address.
+//
+void mergeRegion(REGION *pRegion, int fpSRecord)
+{
+    UINT8 *pImage;
+    UINT8 *pWritten;
+    
+    getBankImage(pRegion->bank, &pImage, &pWritten);
+    for (int i=0 ; i<pRegion->lineCount ; i++)
+    {
+        LINERECORD *pLine   = &pRegion->pLines[i];
+        UINT8      *pBytes  = pRegion->pLineBytes + pLine->byteOffset;
+        UINT16     nAddr    = pLine->addr;
+        int        NumBytes = pLine->numBytes;
+        
+        while (NumBytes > 0)
         {
-            // If we get to this point, the addressing mode can only be direct, extended, or relative (immediate and indirect require a predefined
-            // constant value).  In our case, direct isn't supported because we have no need to access bytes 0-255 (internal RAM).  This only leaves
-            // extended and relative and the latter is only used in a few limited cases (ex: branching instructions).  Based on this premise, the 
-            // algorithm to compute the symbol address will go as follows:
-            //
-            // 1. Look up the instruction in the table - if it only supports a single relative addressing mode, assume the mode is relative and
-            //      compute the number of bytes for the next instruction based on this.  If later the address is outside the relative address range
-            //      then we need to flag it as an error and stop further processing.
-            //
-            // 2. If the addressing mode isn't relative, assume it's extended and look up the corresponding number of instruction bytes for the 
-            //      extended addressing mode then proceed to compute the symbols address.
-            //
-            // NOTE: In the future if we want to support direct addressing, likely any symbols in that range (0-255 bytes) will already be defined
-            //         before the code that accesses it so the code may be relativley simple.
-            //
-            UINT16 nNextLineAddr;
-            
-            if (pInst->addrMode == REL)
-                nNextLineAddr = nAddr + pInst->numBytes;
-            else
-            {
-                INSTRUCTION *pTemp = pInst;
-                if (NULL == (pTemp = lookUpMatchingAddrMode(pTemp, EXT)))
-                {
-                    printf("ERROR: Instruction \'%s\' doesn\'t offer addressing mode %d\r\n", mneumonic, (int)EXT);
-                    return -1;
-                }
-                nNextLineAddr = nAddr + pTemp->numBytes;
-            }
-            
-            if (buildSymbolTable(pSourceFile, nNextLineAddr))
-                return -1;
+            int nBlock = ((UINT32)nAddr + NumBytes > MEM_IMAGE_SIZE ? (int)(MEM_IMAGE_SIZE - nAddr) : NumBytes);
             
-            nRetVal = computeAddrMode(nAddr, pInst, pszToken, &addrMode, &nParam);
-        }
-                
-        if (nRetVal)
-        {
-            printf("ERROR: Invalid address mode on line %d\r\n", nLocalLineNum);
-            return -1;            
+            memcpy(&pImage[nAddr], pBytes, nBlock);
+            memset(&pWritten[nAddr], 1, nBlock);
+            writeToSRecord(fpSRecord, getBankAddress(pRegion->bank, nAddr), pBytes, nBlock);
+            nAddr    += nBlock;
+            pBytes   += nBlock;
+            NumBytes -= nBlock;
         }
+    }
+}
+
+
+// Encode every pass 2 region, then merge them into the memory image and write the S-records and listing in source order.
+//
+int assembleRegions(SOURCEFILE *pSourceFile, int fpSRecord, int fpListing)
+{
+    int nRetVal = 0;
+    int nCount;
+    int nBanks;
+    WORKCONTEXT work;
+    
+    memset(g_memImage, 0, sizeof(g_memImage));
+    memset(g_memWritten, 0, sizeof(g_memWritten));
+    
+    // Banked code loads at 24-bit physical addresses, so it needs S2 records at least.
+    //
+    if ((nBanks = clearBankImages()) < 0)
+        return -1;
+    if (nBanks && g_srecType < 2)
+    {
+        g_srecType = 2;
+        if (g_srecDataBytes > (MAX_SREC_COUNT - getSRecordAddressBytes(g_srecType) - 1))
+            g_srecDataBytes = (MAX_SREC_COUNT - getSRecordAddressBytes(g_srecType) - 1);
+    }
+    
+    memset(&work, 0, sizeof(WORKCONTEXT));
+    work.pSourceFile = pSourceFile;
+    work.itemCount   = g_regionCount;
+    
+    if (g_fWatch && g_watch.pRegions && reuseWatchRegions(pSourceFile))
+        return -1;
+    
+    runWorkers(assembleRegionWorker, &work);
+    
+    // The listing is only rendered if it was asked for.
+    //
+    if (fpListing)
+        runWorkers(formatRegionWorker, &work);
+    
+    // Stitch the listing fragments and S-records back together in source order, stopping at the first region that failed.
+    //
+    for (nCount=0 ; nCount < g_regionCount ; nCount++)
+    {
+        REGION *pRegion = &g_regions[nCount];
         
-        // Now that we know the instruction addressing mode, look up the exact match in the instruction table.
-        //
-        if (NULL == (pInst = lookUpMatchingAddrMode(pInst, addrMode)))
+        if (fpListing && pRegion->listing.length)
         {
-            printf("ERROR: Instruction \'%s\' doesn\'t offer addressing mode %d\r\n", mneumonic, (int)addrMode);
-            return -1;
+            write(fpListing, pRegion->listing.pBuffer, pRegion->listing.length);
         }
-            
-        // Increment the address counter by the number of bytes required for the instruction.
-        //
-        nAddr += pInst->numBytes;
+        
+        if (0 != (nRetVal = pRegion->retVal))
+            break;
+        
+        mergeRegion(pRegion, fpSRecord);
+    }
+    
+    // The S-record buffer outlives a failed assembly, so in watch mode it's emptied here rather than carried into the
+    // next one.
+    //
+    if (nRetVal)
+    {
+        if (g_fWatch)
+            writeToSRecord(fpSRecord, 0, NULL, 0);
+        return nRetVal;
     }
     
+    // Special SRecord write - flushes remaining contents to file.
+    //
+    writeToSRecord(fpSRecord, 0, NULL, 0);
+    
+    // Add a final S9 SRecord line.
+    //
+    writeSRecordEnd(fpSRecord, g_startAddress);
+    
     return 0;
 }
 
 
-int processSourceFile(SOURCEFILE sourceFile, int fpSRecord, int fpSymbols, int fpListing)
+int processSourceFile(SOURCEFILE sourceFile, int fpSRecord, int fpSymbols, int fpListing, int fpSnapshot, int fpDebug, int fpMap, int fpStack, int fpDelta, int fpPlan, int fpXref, int fpLineMap)
 {
     int nRetVal = 0;
-    char szTempString[MAX_LINE_LENGTH];
+    bool fIncremental;
     
     // Clear the symbol table and reset count.
     //
+    g_startAddress = 0;
     symbolCount = 0;
     memset(symbols, 0, (sizeof(SYMBOL) * MAX_SYMBOL_COUNT));
     
+    // Pre-populate the symbol table from the -D definitions and any equate snapshots - these symbols are defined ahead
+    // of the first source line (a -D definition wins over a snapshot symbol of the same name).
+    //
+    if (0 != (nRetVal = pushDefines()))
+        goto Exit;
+    g_defineSymbolCount = symbolCount;
+    
+    for (int i=0 ; i<g_snapshotCount ; i++)
+    {
+        if (0 != (nRetVal = loadSymbolSnapshot(g_snapshotFiles[i])))
+            goto Exit;
+    }
+    g_predefinedSymbolCount = symbolCount;
+    
+    // Find the lines conditional assembly leaves out.  Which lines those are can change with an edit anywhere, so watch
+    // mode only reuses the previous assembly when there are no conditionals.
+    //
+    if (0 != (nRetVal = scanConditionals(&sourceFile)))
+        goto Exit;
+    
+    if (g_fWatch && sourceFile.condSpanCount)
+        freeWatchState();
+    fIncremental = (g_fWatch && NULL != g_watch.pChunks);
+    
+    if (g_fOptimize && 0 != (nRetVal = buildPeepholeTables()))
+        goto Exit;
+    
+    // The first pass 2 region starts at the top of the file.
+    //
+    g_regionCount = 0;
+    if (0 != (nRetVal = beginRegion(&sourceFile, 0, 0, 0, BANK_COMMON)))
+        goto Exit;
+    
     // Scan source file contents and build up the symbol table.
     //
-    if (0 != (nRetVal = buildSymbolTable(&sourceFile, 0)))
+    if (0 != (nRetVal = buildSymbolTable(&sourceFile)))
         goto Exit;
     
-    if (fpSymbols)
+    if (fpSymbols && 0 != (nRetVal = writeSymbolFile(fpSymbols)))
+        goto Exit;
+    
+    // When precompiling equates, the symbol table is all we need.
+    //
+    if (fpSnapshot)
     {
-        int i;
-        
-        sprintf(szTempString, "  SYMBOL NAME    VALUE            [Total=%d]\r\n", (symbolCount));
-        write(fpSymbols, szTempString, strlen(szTempString));
-        sprintf(szTempString, "-----------------------------------------------\r\n");
-        write(fpSymbols, szTempString, strlen(szTempString));
-
-        for (i=0 ; i<symbolCount ; i++)
-        {
-            switch(symbols[i].symbolType)
-            {
-                case SYMBOL_TYPE_STRING:
-                    sprintf(szTempString, "%15s, %30s\r\n", symbols[i].symbolName, symbols[i].u.symbolValueStr);
-                    write(fpSymbols, szTempString, strlen(szTempString));
-                    break;
-                case SYMBOL_TYPE_NUMBER_8BIT:
-                    sprintf(szTempString, "%15s, 0x%02x\r\n", symbols[i].symbolName, symbols[i].u.nsymbolValue8);
-                    write(fpSymbols, szTempString, strlen(szTempString));
-                    break;
-                case SYMBOL_TYPE_NUMBER_16BIT:
-                    sprintf(szTempString, "%15s, 0x%04x\r\n", symbols[i].symbolName, symbols[i].u.nsymbolValue16);
-                    write(fpSymbols, szTempString, strlen(szTempString));
-                    break;
-                default:
-                    break;
-            }
-
-        }
+        nRetVal = writeSymbolSnapshot(fpSnapshot);
+        goto Exit;
     }
     
+    if (fpDebug && 0 != (nRetVal = writeDebugSymbols(fpDebug)))
+        goto Exit;
+    
     // Check for a symbole called "START" and use it as the start address (otherwise we'll use the first ORG block found during assembly
     //
     SYMBOLTYPE   symbolType;
@@ -1076,15 +3859,98 @@ int processSourceFile(SOURCEFILE sourceFile, int fpSRecord, int fpSymbols, int f
     sourceFile.byteOffset  = 0;
     sourceFile.lineNumber  = 0;
     sourceFile.fEOF        = false;
+    sourceFile.nextCondSpan = -1;
     
-    nRetVal = assembleSource(&sourceFile, fpSRecord, fpListing);
+    nRetVal = assembleRegions(&sourceFile, fpSRecord, fpListing);
+    
+    if (0 == nRetVal && fIncremental)
+        printf("Watch: parsed %d of %d source bytes, encoded %d of %d regions\r\n\n", g_watch.parsedBytes, sourceFile.fileSize,
+               (g_regionCount - g_watch.reusedRegions), g_regionCount);
+    
+    if (0 == nRetVal && g_fOptimize)
+        reportOptimizations();
+    
+    if (0 == nRetVal && g_poolStringCount)
+        reportStringPools();
+    
+    if (0 == nRetVal && g_localVarCount)
+        reportLocals();
+    
+    if (0 == nRetVal)
+        reportBanks();
+    
+    if (0 == nRetVal && fpMap)
+        nRetVal = writeMapFile(fpMap, g_memWritten);
+    
+    if (0 == nRetVal && fpXref)
+        nRetVal = writeCrossReference(fpXref, g_regions, g_regionCount);
+    
+    if (0 == nRetVal && fpLineMap)
+        nRetVal = writeLineMap(fpLineMap, g_regions, g_regionCount, g_pszSourceName);
+    
+    if (0 == nRetVal && (fpStack || g_stackBudget))
+        nRetVal = analyzeStackDepth(g_memImage, g_memWritten, g_startAddress, g_stackBudget, fpListing, fpStack);
+    
+    if (0 == nRetVal && fpDelta)
+        nRetVal = writeDeltaSRecords(g_pszBaselineFile, g_memImage, g_memWritten, g_startAddress, fpDelta, fpPlan);
 
 Exit:
     
+    // In watch mode the statements, line records and symbols are kept for the next assembly.  A failed assembly may
+    // have left them half built, so they're dropped instead.
+    //
+    if (g_fWatch && 0 == nRetVal && !fpSnapshot && 0 == sourceFile.condSpanCount)
+        nRetVal = keepWatchState(&sourceFile);
+    else if (g_fWatch)
+        freeWatchState();
+    
+    for (int i=0 ; i<g_regionCount ; i++)
+    {
+        if (g_regions[i].listing.pBuffer)
+            free(g_regions[i].listing.pBuffer);
+        if (g_regions[i].pLines)
+            free(g_regions[i].pLines);
+        if (g_regions[i].pLineBytes)
+            free(g_regions[i].pLineBytes);
+        if (g_regions[i].pLineText)
+            free(g_regions[i].pLineText);
+    }
+    if (g_regions)
+        free(g_regions);
+    g_regions          = NULL;
+    g_regionCount      = 0;
+    g_regionsAllocated = 0;
+    
+    if (g_forwardRefs)
+        free(g_forwardRefs);
+    g_forwardRefs          = NULL;
+    g_forwardRefCount      = 0;
+    g_forwardRefsAllocated = 0;
+    
+    if (g_rewrites)
+        free(g_rewrites);
+    g_rewrites          = NULL;
+    g_rewriteCount      = 0;
+    g_rewritesAllocated = 0;
+    
+    freeStringPools();
+    freeLocals();
+    freeMemoryMap();
+    g_stackBudget = 0;
+    
     return nRetVal;
 }
 
 
+// The banner is printed once the output files are open, so it goes to standard error when standard output carries a file.
+//
+void printBanner(void)
+{
+    printf("\n6811ASM for Mac Version 0.3\n");
+	printf("Copyright (c) 2012, Jeff Glaum.  All rights reserved.\n\n");
+}
+
+
 int main (int argc, const char * argv[])
 {
     int nRetVal     = 0;
@@ -1096,19 +3962,41 @@ int main (int argc, const char * argv[])
     int fpSymbols   = 0;
     bool fDumpListing = false;
     int fpListing   = 0;
-    struct stat fileStat;
+    bool fSnapshot  = false;
+    int fpSnapshot  = 0;
+    bool fDebugSymbols = false;
+    int fpDebug     = 0;
+    bool fDisassemble = false;
+    const char *pszLabelFile = NULL;
+    int fpDisassembly = 0;
+    int fpMap       = 0;
+    int fpStack     = 0;
+    int fpDelta     = 0;
+    int fpPlan      = 0;
+    int fpXref      = 0;
+    bool fLineMap   = false;
+    int fpLineMap   = 0;
+    bool fDependencies = false;
+    int fpDepend    = 0;
+    char szTarget[MAX_LINE_LENGTH];
     char *pSource   = NULL;
+    int nSourceSize = 0;
+    bool fStdin     = false;
+    const char *pszOutputPath  = NULL;
+    const char *pszListingPath = NULL;
+    const char *pszSymbolsPath = NULL;
+    const char *pszDependPath  = NULL;
+    const char *pszBaseName    = NULL;
     SOURCEFILE sourceFile;
     
-
-    // Print banner.
-	//
-    printf("\n6811ASM for Mac Version 0.3\n");
-	printf("Copyright (c) 2012, Jeff Glaum.  All rights reserved.\n\n");
+    // Default to one pass 2 worker per processor.
+    //
+    if ((g_numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        g_numThreads = 1;
 
     // Validate command line parameters.
     //
-	if (argc < 2 || argc > 4)
+	if (argc < 2)
 		goto UsageMsg;
     
     // Check command line parameters.
@@ -1119,10 +4007,96 @@ int main (int argc, const char * argv[])
             fDumpListing = true;
         else if (!strcmp(argv[1+nCount], "-s"))
             fDumpSymbols = true;
+        else if (!strncmp(argv[1+nCount], "-j", 2) && atoi(argv[1+nCount] + 2) > 0)
+            g_numThreads = atoi(argv[1+nCount] + 2);
+        else if (!strcmp(argv[1+nCount], "-p"))
+            fSnapshot = true;
+        else if (!strncmp(argv[1+nCount], "-i", 2) && argv[1+nCount][2] != '\0' && g_snapshotCount < MAX_SNAPSHOT_FILES)
+            g_snapshotFiles[g_snapshotCount++] = argv[1+nCount] + 2;
+        else if (!strcmp(argv[1+nCount], "-O"))
+            g_fOptimize = true;
+        else if (!strncmp(argv[1+nCount], "-e", 2) && atoi(argv[1+nCount] + 2) > 0)
+            g_eClockHz = (UINT32)atoi(argv[1+nCount] + 2);
+        else if (!strcmp(argv[1+nCount], "-m"))
+            g_fMemoryMap = true;
+        else if (!strcmp(argv[1+nCount], "-k"))
+            g_fStackReport = true;
+        else if (!strcmp(argv[1+nCount], "-g"))
+            fDebugSymbols = true;
+        else if (!strcmp(argv[1+nCount], "-x"))
+            g_fCrossReference = true;
+        else if (!strcmp(argv[1+nCount], "-t"))
+            fLineMap = true;
+        else if (!strcmp(argv[1+nCount], "--watch"))
+            g_fWatch = true;
+        else if (!strncmp(argv[1+nCount], "-D", 2) && argv[1+nCount][2] != '\0')
+        {
+            if (addDefine(argv[1+nCount] + 2))
+                goto UsageMsg;
+        }
+        else if (!strcmp(argv[1+nCount], "-MD"))
+            fDependencies = true;
+        else if (!strncmp(argv[1+nCount], "-MF", 3) && argv[1+nCount][3] != '\0')
+        {
+            pszDependPath = argv[1+nCount] + 3;
+            fDependencies = true;
+        }
+        else if (!strncmp(argv[1+nCount], "-r", 2) && atoi(argv[1+nCount] + 2) > 0)
+            g_srecDataBytes = atoi(argv[1+nCount] + 2);
+        else if (!strcmp(argv[1+nCount], "-S1") || !strcmp(argv[1+nCount], "-S2") || !strcmp(argv[1+nCount], "-S3"))
+            g_srecType = (UINT8)(argv[1+nCount][2] - '0');
+        else if (!strncmp(argv[1+nCount], "-f", 2))
+        {
+            if (addOutputFormat(argv[1+nCount] + 2))
+                goto UsageMsg;
+        }
+        else if (!strncmp(argv[1+nCount], "-F", 2))
+        {
+            if (setFillByte(argv[1+nCount] + 2))
+                goto UsageMsg;
+        }
+        else if (!strncmp(argv[1+nCount], "-w", 2))
+        {
+            if (setImageWindow(argv[1+nCount] + 2))
+                goto UsageMsg;
+        }
+        else if (!strncmp(argv[1+nCount], "-u", 2) && argv[1+nCount][2] != '\0')
+            g_pszBaselineFile = argv[1+nCount] + 2;
+        else if (!strncmp(argv[1+nCount], "-b", 2))
+        {
+            if (addMemoryBank(argv[1+nCount] + 2))
+                goto UsageMsg;
+        }
+        else if (!strncmp(argv[1+nCount], "-o", 2) && argv[1+nCount][2] != '\0')
+            pszOutputPath = argv[1+nCount] + 2;
+        else if (!strncmp(argv[1+nCount], "--output=", 9) && argv[1+nCount][9] != '\0')
+            pszOutputPath = argv[1+nCount] + 9;
+        else if (!strncmp(argv[1+nCount], "--listing=", 10) && argv[1+nCount][10] != '\0')
+        {
+            pszListingPath = argv[1+nCount] + 10;
+            fDumpListing   = true;
+        }
+        else if (!strncmp(argv[1+nCount], "--symbols=", 10) && argv[1+nCount][10] != '\0')
+        {
+            pszSymbolsPath = argv[1+nCount] + 10;
+            fDumpSymbols   = true;
+        }
+        else if (!strcmp(argv[1+nCount], "-d"))
+            fDisassemble = true;
+        else if (!strncmp(argv[1+nCount], "-y", 2) && argv[1+nCount][2] != '\0')
+            pszLabelFile = argv[1+nCount] + 2;
         else goto UsageMsg;
     }
             
-	// Copy filename into buffer.
+    // A record's count byte covers the address, data and checksum bytes, so it limits the data bytes per record.
+    //
+    if (g_srecDataBytes > (MAX_SREC_COUNT - getSRecordAddressBytes(g_srecType) - 1))
+    {
+        printf("ERROR: S%d records carry at most %d data bytes\r\n", g_srecType, (MAX_SREC_COUNT - getSRecordAddressBytes(g_srecType) - 1));
+        goto UsageMsg;
+    }
+    
+	// Copy filename into buffer ("-" reads the source from standard input).
     //
 	nLength   = (int)strlen(argv[argc-1]);
 	nLength  += (int)strlen(ASM_FILE_EXTENSION) + 1;
@@ -1134,42 +4108,102 @@ int main (int argc, const char * argv[])
         goto Exit;
     }
     strcpy(pFileName, argv[argc-1]);
+    fStdin = !strcmp(pFileName, "-");
+    
+    if (g_fWatch && (fStdin || fDisassemble))
+    {
+        printf("ERROR: --watch needs an ASM source file (not standard input)\r\n");
+        nRetVal = -1;
+        goto Exit;
+    }
     
 	// If filename doesn't have extension, add one.
     //
-	if (!strchr(pFileName, '.'))
-		strcat(pFileName, ASM_FILE_EXTENSION);
+	if (!fStdin && !strchr(pFileName, '.'))
+		strcat(pFileName, (fDisassemble ? S19_FILE_EXTENSION : ASM_FILE_EXTENSION));
     
-	// Open source file for reading.
+    // Files without an explicit path are named after the -o file, or the source file when that's written to standard
+    // output or a file descriptor.
     //
-	fpSource = open(pFileName, O_RDONLY);
-	if (fpSource < 0)
+    if (pszOutputPath && strcmp(pszOutputPath, "-") && strncmp(pszOutputPath, "fd:", 3))
+        pszBaseName = pszOutputPath;
+    else
+        pszBaseName = (fStdin ? STDIN_BASE_NAME : pFileName);
+    
+    // Disassemble an existing S-record file instead of assembling.
+    //
+    if (fDisassemble)
     {
-        printf("ERROR: Source file open failed (%s)\r\n", pFileName);
-        nRetVal = -1;
+        UINT16 nStartAddr = 0;
+        
+        if ((fpDisassembly = openDerivedFile(pszOutputPath, pszBaseName, DIS_FILE_EXTENSION, "Disassembly file")) < 0)
+        {
+            nRetVal = -1;
+            goto Exit;
+        }
+        
+        printBanner();
+        printf("Disassembling: %s ...\r\n\n", pFileName);
+        
+        if (readSRecordFile(pFileName, g_memImage, g_memWritten, &nStartAddr) < 0 ||
+            (pszLabelFile && loadDisassemblySymbols(pszLabelFile) < 0))
+        {
+            nRetVal = -1;
+            goto Exit;
+        }
+        
+        if (disassembleImage(g_memImage, g_memWritten, nStartAddr, fpDisassembly) < 0)
+        {
+            printf("ERROR: Disassembly failed\r\n");
+            nRetVal = -1;
+        }
         goto Exit;
     }
-
-    // Get source file size.
+    
+    // Open SRecord (or symbol snapshot), Symbol, and Listing files for writing if needed.  These are opened ahead of
+    // reading the source so status messages are already going to standard error if the S-records go to standard output.
     //
-    if (fstat(fpSource, &fileStat) < 0)
+    if (fSnapshot)
+    {
+        if ((fpSnapshot = openDerivedFile(pszOutputPath, pszBaseName, EQS_FILE_EXTENSION, "Symbol snapshot file")) < 0)
+        {
+            nRetVal = -1;
+            goto Exit;
+        }
+    }
+    else if ((fpSRecord = openDerivedFile(pszOutputPath, pszBaseName, S19_FILE_EXTENSION, "S-Record file")) < 0)
+    {
+        nRetVal = -1;
+        goto Exit;
+    }
+    if ((fDumpSymbols && (fpSymbols = openDerivedFile(pszSymbolsPath, pszBaseName, SYM_FILE_EXTENSION, "Symbol file")) < 0) ||
+        (fDebugSymbols && !fSnapshot && (fpDebug = openDerivedFile(NULL, pszBaseName, DEBUG_FILE_EXTENSION, "Debug symbol file")) < 0) ||
+        (g_fMemoryMap && !fSnapshot && (fpMap = openDerivedFile(NULL, pszBaseName, MAP_FILE_EXTENSION, "Map file")) < 0) ||
+        (g_pszBaselineFile && !fSnapshot && (fpDelta = openDerivedFile(NULL, pszBaseName, DELTA_FILE_EXTENSION, "Delta S-Record file")) < 0) ||
+        (g_pszBaselineFile && !fSnapshot && (fpPlan = openDerivedFile(NULL, pszBaseName, PLAN_FILE_EXTENSION, "EEPROM plan file")) < 0) ||
+        (g_fCrossReference && !fSnapshot && (fpXref = openDerivedFile(NULL, pszBaseName, XREF_FILE_EXTENSION, "Cross-reference file")) < 0) ||
+        (fLineMap && !fSnapshot && (fpLineMap = openDerivedFile(NULL, pszBaseName, LINEMAP_FILE_EXTENSION, "Line map file")) < 0) ||
+        (fDependencies && (fpDepend = openDerivedFile(pszDependPath, pszBaseName, DEPEND_FILE_EXTENSION, "Dependency file")) < 0) ||
+        (g_fStackReport && !fSnapshot && (fpStack = openDerivedFile(NULL, pszBaseName, STK_FILE_EXTENSION, "Stack report file")) < 0) ||
+        (fDumpListing && (fpListing = openDerivedFile(pszListingPath, pszBaseName, LST_FILE_EXTENSION, "Listing file")) < 0))
     {
-        printf("ERROR: Failed to obtain source file statistics (%s)\r\n", pFileName);
         nRetVal = -1;
         goto Exit;
     }
     
-    // Allocate and read the file into memory.
+    printBanner();
+    
+	// Open the source file and read it into memory - standard input is read as it arrives.
     //
-    pSource = (char *)malloc(fileStat.st_size);
-    if (!pSource)
+	fpSource = (fStdin ? STDIN_FILENO : open(pFileName, O_RDONLY));
+	if (fpSource < 0)
     {
-        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)fileStat.st_size);
+        printf("ERROR: Source file open failed (%s)\r\n", pFileName);
         nRetVal = -1;
         goto Exit;
     }
 
-    if (read(fpSource, pSource, fileStat.st_size) != fileStat.st_size)
+    if (readFileContents(fpSource, &pSource, &nSourceSize, MAX_SOURCE_SIZE) < 0 || (!fStdin && addDependency(pFileName)))
     {
         printf("ERROR: Source file read failed (%s)\r\n", pFileName);
         nRetVal = -1;
@@ -1178,74 +4212,135 @@ int main (int argc, const char * argv[])
 
     // Update user message.
     //
-    printf("Assembling: %s ...\r\n\n", pFileName);
+    printf("Assembling: %s ...\r\n\n", (fStdin ? "(standard input)" : pFileName));
+    g_pszSourceName = (fStdin ? "-" : pFileName);
+
+    // Process file contents.
+    //
+    memset(&sourceFile, 0, sizeof(SOURCEFILE));
+    
+    sourceFile.pFile       = pSource;
+    sourceFile.fileSize    = nSourceSize;
+    sourceFile.piterOffset = pSource;
+    sourceFile.fEOF        = (nSourceSize == 0);
 
-    // Open SRecord, Symbol, and Listing files for writing if needed.
+    // In watch mode a broken source only means waiting for the next save.
     //
-    // NOTE: (filename + 1) is used to skip a leading "./foo.asm" char
-    memcpy((strchr(pFileName+1, '.') + 1), S19_FILE_EXTENSION, strlen(S19_FILE_EXTENSION));
-	fpSRecord = open(pFileName, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-	if (fpSRecord < 0)
+    if (processSourceFile(sourceFile, fpSRecord, fpSymbols, fpListing, fpSnapshot, fpDebug, fpMap, fpStack, fpDelta, fpPlan, fpXref, fpLineMap) < 0)
     {
-        printf("ERROR: S-Record file open failed (%s)\r\n", pFileName);
+        printf("ERROR: Source file processing failed\r\n");
         nRetVal = -1;
-        goto Exit;
-    }
-    if (fDumpSymbols)
-    {
-        memcpy((strchr(pFileName+1, '.') + 1), SYM_FILE_EXTENSION, strlen(SYM_FILE_EXTENSION));
-        fpSymbols = open(pFileName, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-        if (fpSymbols < 0)
-        {
-            printf("ERROR: Symbol file open failed (%s)\r\n", pFileName);
-            nRetVal = -1;
+        if (!g_fWatch)
             goto Exit;
-        }
     }
-    if (fDumpListing)
+    
+    if (!fSnapshot && 0 == nRetVal && writeImageFiles(pszBaseName, g_memImage, g_memWritten, g_startAddress, g_srecDataBytes) < 0)
     {
-        memcpy((strchr(pFileName+1, '.') + 1), LST_FILE_EXTENSION, strlen(LST_FILE_EXTENSION));
-        fpListing = open(pFileName, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-        if (fpListing < 0)
-        {
-            printf("ERROR: Listing file open failed (%s)\r\n", pFileName);
-            nRetVal = -1;
-            goto Exit;
-        }
+        nRetVal = -1;
+        goto Exit;
     }
-            
-    // Process file contents.
+    
+    // The dependency rule's target is the S-record file (or the snapshot), by the name the build knows it by.
     //
-    memset(&sourceFile, 0, sizeof(SOURCEFILE));
+    if (pszOutputPath && strcmp(pszOutputPath, "-") && strncmp(pszOutputPath, "fd:", 3))
+        strncpy(szTarget, pszOutputPath, MAX_LINE_LENGTH - 1);
+    else
+        makeOutputFileName(szTarget, MAX_LINE_LENGTH, pszBaseName, "", (fSnapshot ? EQS_FILE_EXTENSION : S19_FILE_EXTENSION));
+    szTarget[MAX_LINE_LENGTH - 1] = '\0';
     
-    sourceFile.pFile       = pSource;
-    sourceFile.fileSize    = (int)fileStat.st_size;
-    sourceFile.piterOffset = pSource;
-    sourceFile.fEOF        = false;
-
-    if (processSourceFile(sourceFile, fpSRecord, fpSymbols, fpListing) < 0)
+    if (fpDepend && 0 == nRetVal && writeDependencyFile(fpDepend, szTarget) < 0)
+    {
+        nRetVal = -1;
+        goto Exit;
+    }
+    
+    // Watch mode - re-assemble into the same output files each time the source changes.  The previous source stays in
+    // memory until the next assembly has compared against it.
+    //
+    if (g_fWatch && beginWatch(pFileName) < 0)
     {
-        printf("ERROR: Source file processing failed\r\n");
         nRetVal = -1;
         goto Exit;
     }
+    
+    while (g_fWatch && 0 == waitForSourceChange())
+    {
+        int  fpUpdated;
+        char *pUpdated  = NULL;
+        int  nUpdatedSize = 0;
+        int  fpOutputs[] = { fpSRecord, fpSymbols, fpListing, fpSnapshot, fpDebug, fpMap, fpStack, fpDelta, fpPlan, fpXref, fpLineMap, fpDepend };
+        
+        if ((fpUpdated = open(pFileName, O_RDONLY)) < 0 || readFileContents(fpUpdated, &pUpdated, &nUpdatedSize, MAX_SOURCE_SIZE) < 0)
+        {
+            printf("ERROR: Source file read failed (%s)\r\n", pFileName);
+            if (fpUpdated >= 0)
+                close(fpUpdated);
+            continue;
+        }
+        close(fpUpdated);
+        
+        for (int i=0 ; i < (int)(sizeof(fpOutputs) / sizeof(fpOutputs[0])) ; i++)
+            rewindOutputFile(fpOutputs[i]);
+        
+        printf("Re-assembling: %s ...\r\n\n", pFileName);
+        
+        memset(&sourceFile, 0, sizeof(SOURCEFILE));
+        sourceFile.pFile       = pUpdated;
+        sourceFile.fileSize    = nUpdatedSize;
+        sourceFile.piterOffset = pUpdated;
+        sourceFile.fEOF        = (nUpdatedSize == 0);
+        
+        nRetVal = 0;
+        if (processSourceFile(sourceFile, fpSRecord, fpSymbols, fpListing, fpSnapshot, fpDebug, fpMap, fpStack, fpDelta, fpPlan, fpXref, fpLineMap) < 0)
+        {
+            printf("ERROR: Source file processing failed\r\n\n");
+            nRetVal = -1;
+        }
+        else if ((!fSnapshot && writeImageFiles(pszBaseName, g_memImage, g_memWritten, g_startAddress, g_srecDataBytes) < 0) ||
+                 (fpDepend && writeDependencyFile(fpDepend, szTarget) < 0))
+            nRetVal = -1;
+        
+        free(pSource);
+        pSource = pUpdated;
+    }
 
 Exit:
     
     // Clean up.
     //
-	if (fpSource)
+	if (fpSource > 0)
 		close(fpSource);
     if (fpSRecord)
 		close(fpSRecord);
     if (fpSymbols)
 		close(fpSymbols);
+    if (fpSnapshot)
+		close(fpSnapshot);
+    if (fpDebug)
+		close(fpDebug);
     if (fpListing)
 		close(fpListing);
+    if (fpDisassembly)
+		close(fpDisassembly);
+    if (fpMap)
+		close(fpMap);
+    if (fpStack)
+		close(fpStack);
+    if (fpDelta)
+		close(fpDelta);
+    if (fpPlan)
+		close(fpPlan);
+    if (fpXref)
+		close(fpXref);
+    if (fpLineMap)
+		close(fpLineMap);
+    if (fpDepend)
+		close(fpDepend);
 	if (pSource)
 		free (pSource);
 	if (pFileName)
 		free (pFileName);
+    freeBanks();
     
 	return nRetVal;
     
@@ -1253,9 +4348,43 @@ UsageMsg:
     
     // Display usage message.
     //
-	printf("USAGE: %s [-l | -s] [<ASM file]\r\n\n", argv[0]);
-    printf("    -l  Generate assembly listing file\r\n");
-    printf("    -s  Generate symbol file\r\n\n");
+    printBanner();
+	printf("USAGE: %s [options] <ASM file | ->\r\n", argv[0]);
+	printf("       %s -d [-y<SYM file>] [-o<DIS file>] <S19 file | ->\r\n\n", argv[0]);
+    printf("    -      Read the source (or S-records) from standard input\r\n");
+    printf("    -o<f>  Write the S-records (snapshot with -p, disassembly with -d) to <f>; other files are named after it\r\n");
+    printf("           <f> may be - for standard output or fd:<n> for an open file descriptor (as for the options below)\r\n");
+    printf("    --listing=<f>  Write the listing to <f>\r\n");
+    printf("    --symbols=<f>  Write the symbol file to <f>\r\n");
+    printf("    -l     Generate assembly listing file\r\n");
+    printf("    -s     Generate symbol file (sorted by name)\r\n");
+    printf("    -g     Generate binary debug symbol file indexed by name and address (.%s)\r\n", DEBUG_FILE_EXTENSION);
+    printf("    -m     Generate memory map file (.%s)\r\n", MAP_FILE_EXTENSION);
+    printf("    -x     Generate symbol cross-reference and unreferenced symbol file (.%s)\r\n", XREF_FILE_EXTENSION);
+    printf("    -t     Generate address to source line map for trace tools and simulators (.%s)\r\n", LINEMAP_FILE_EXTENSION);
+    printf("    -MD    Generate make dependency file listing every file read (.%s)\r\n", DEPEND_FILE_EXTENSION);
+    printf("    -MF<f> Write the dependency file to <f> (implies -MD)\r\n");
+    printf("    -b<b>  Memory bank for the map as <name>,<start>,<end> (may be repeated, default: 68HC11E9 layout)\r\n");
+    printf("    -r<n>  Write <n> data bytes per S-record or Intel HEX record (default: %d)\r\n", MAX_S19_CHARPAIRS);
+    printf("    -S<n>  Write S<n> data records with 16, 24 or 32-bit addresses (default: S1)\r\n");
+    printf("    -f<f>  Also write image format <f>: bin, hex, split (.%s/.%s) or banks (may be repeated)\r\n",
+           EVEN_FILE_EXTENSION, ODD_FILE_EXTENSION);
+    printf("    -F<n>  Fill unassembled bytes in binary images with <n> (default: $FF)\r\n");
+    printf("    -w<w>  Binary image window as <start>,<end> (default: lowest to highest assembled address)\r\n");
+    printf("    -u<f>  Write only the S-records that changed against baseline image <f> (.%s) and an EEPROM plan (.%s)\r\n",
+           DELTA_FILE_EXTENSION, PLAN_FILE_EXTENSION);
+    printf("    -k     Analyze worst case stack depth into a report file (.%s) and the listing\r\n", STK_FILE_EXTENSION);
+    printf("    -j<n>  Assemble using <n> threads (default: one per processor)\r\n");
+    printf("    --watch  Stay running and re-assemble whenever the source file changes\r\n");
+    printf("    -O     Apply peephole optimizations and report the bytes and cycles saved\r\n");
+    printf("    -p     Precompile equates into a symbol snapshot (.%s) instead of assembling\r\n", EQS_FILE_EXTENSION);
+    printf("    -i<f>  Load symbol snapshot <f> before assembling (may be repeated)\r\n");
+    printf("    -e<n>  E clock in Hz for DELAY times given in microseconds (default: %d)\r\n", DEFAULT_E_CLOCK_HZ);
+    printf("    -D<s>  Define symbol <s> as 1, or as <s>=<n>, for IF/IFDEF/IFNDEF (may be repeated; the source can\'t\r\n");
+    printf("           redefine <s>, so give a default under IFNDEF)\r\n");
+    printf("    -d     Disassemble an S-record file into a .%s file\r\n", DIS_FILE_EXTENSION);
+    printf("    -y<f>  Label disassembled addresses using symbol file <f> (.%s or .%s)\r\n\n", SYM_FILE_EXTENSION,
+           DEBUG_FILE_EXTENSION);
     
     return 0;
 }
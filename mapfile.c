@@ -0,0 +1,437 @@
+//
+//  mapfile.c
+//  MC68HC11 Assembler
+//
+//  Memory map and footprint report.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdarg.h>
+
+#include "common.h"
+#include "utility.h"
+#include "mapfile.h"
+#include "bank.h"
+
+
+// Default memory banks (MC68HC11E9 single-chip layout) - replaced by any banks given on the command line.
+//
+MEMORYBANK g_defaultBanks[] =
+{
+    { "RAM",       0x0000, 0x01FF },
+    { "REGISTERS", 0x1000, 0x103F },
+    { "EEPROM",    0xB600, 0xB7FF },
+    { "ROM",       0xD000, 0xFFFF }
+};
+
+MEMORYBANK g_memBanks[MAX_MEMORY_BANKS];
+int        g_memBankCount;
+
+MAPBLOCK   *g_mapBlocks;            // ORG blocks, in source order
+int        g_mapBlockCount;
+int        g_mapBlocksAllocated;
+MAPLABEL   *g_mapLabels;            // Address labels, in source order
+int        g_mapLabelCount;
+int        g_mapLabelsAllocated;
+
+extern LOCALVAR *g_localVars;
+extern int g_localVarCount;
+extern SWITCHBANK g_switchBanks[MAX_SWITCH_BANKS];
+extern int g_switchBankCount;
+extern UINT16 g_bankWindowStart;
+extern UINT16 g_bankWindowEnd;
+
+
+// Add a memory bank from a "<name>,<start>,<end>" command line specification (numbers use assembler syntax).
+//
+int addMemoryBank(const char *pszSpec)
+{
+    char szSpec[MAX_LINE_LENGTH];
+    char *pszName;
+    char *pszStart;
+    char *pszEnd;
+    char *pszContext;
+    MEMORYBANK *pBank;
+
+    strncpy(szSpec, pszSpec, MAX_LINE_LENGTH - 1);
+    szSpec[MAX_LINE_LENGTH - 1] = '\0';
+
+    if (g_memBankCount == MAX_MEMORY_BANKS)
+    {
+        printf("ERROR: Maximum memory bank count exceeded (%d)\r\n", MAX_MEMORY_BANKS);
+        return -1;
+    }
+    pBank = &g_memBanks[g_memBankCount];
+
+    if (NULL == (pszName = strtok_r(szSpec, ",", &pszContext)) || NULL == (pszStart = strtok_r(NULL, ",", &pszContext)) ||
+        NULL == (pszEnd = strtok_r(NULL, ",", &pszContext)) || convertToNumber(pszStart, &pBank->start) ||
+        convertToNumber(pszEnd, &pBank->end) || pBank->end < pBank->start)
+    {
+        printf("ERROR: Invalid memory bank \'%s\' (expected <name>,<start>,<end>)\r\n", pszSpec);
+        return -1;
+    }
+
+    copySymbolName(pBank->name, pszName);
+    g_memBankCount++;
+
+    return 0;
+}
+
+
+// Returns the memory banks given on the command line, or the 68HC11E9 layout if there weren't any.
+//
+MEMORYBANK *getMemoryBanks(int *pnBanks)
+{
+    *pnBanks = (g_memBankCount ? g_memBankCount : (int)(sizeof(g_defaultBanks) / sizeof(MEMORYBANK)));
+
+    return (g_memBankCount ? g_memBanks : g_defaultBanks);
+}
+
+
+// Make room for one more element in a map array, doubling its allocation when it's full.
+//
+void *growMapArray(void *pArray, int nCount, int *pnAllocated, int nElementSize)
+{
+    void *pTemp;
+    int  nNewCount;
+
+    if (nCount < *pnAllocated)
+        return pArray;
+
+    nNewCount = (*pnAllocated ? *pnAllocated * 2 : 64);
+    if (NULL == (pTemp = realloc(pArray, (size_t)nElementSize * nNewCount)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", nElementSize * nNewCount);
+        return NULL;
+    }
+    *pnAllocated = nNewCount;
+
+    return pTemp;
+}
+
+
+void freeMemoryMap(void)
+{
+    if (g_mapBlocks)
+        free(g_mapBlocks);
+    if (g_mapLabels)
+        free(g_mapLabels);
+
+    g_mapBlocks          = NULL;
+    g_mapBlockCount      = 0;
+    g_mapBlocksAllocated = 0;
+    g_mapLabels          = NULL;
+    g_mapLabelCount      = 0;
+    g_mapLabelsAllocated = 0;
+}
+
+
+// Collect the ORG blocks and per-label footprint from the statements, using the addresses and sizes assigned by the
+// final statement walk.
+//
+int buildMemoryMap(CHUNK *pChunks, int nChunks)
+{
+    MAPBLOCK *pBlock = NULL;
+    MAPLABEL *pLabel = NULL;
+    void *pTemp;
+    int  nLineBase    = 0;
+    int  nBank        = BANK_COMMON;
+    bool fInLocals    = false;
+    bool fSwitchBlock = false;      // Current block was started by BANK or ENDBANK
+
+    freeMemoryMap();
+
+    for (int nChunk=0 ; nChunk < nChunks ; nChunk++)
+    {
+        CHUNK *pChunk = &pChunks[nChunk];
+
+        for (int nStmt=0 ; nStmt < pChunk->statementCount ; nStmt++)
+        {
+            STATEMENT *pStmt = &pChunk->pStatements[nStmt];
+
+            // LOCALS variables are listed on their own, since they don't take up space where they're declared.
+            //
+            if (pStmt->kind == STMT_LOCALS || pStmt->kind == STMT_ENDLOCALS)
+                fInLocals = (pStmt->kind == STMT_LOCALS);
+            if (fInLocals && (pStmt->kind == STMT_LABEL || pStmt->kind == STMT_RMB))
+                continue;
+
+            // Each ORG starts a new block, and so does switching banks (as does anything placed before the first ORG).
+            //
+            if (pStmt->kind == STMT_BANK || pStmt->kind == STMT_ENDBANK)
+                nBank = (pStmt->kind == STMT_BANK ? (int)pStmt->value : BANK_COMMON);
+
+            if (pStmt->kind == STMT_ORG || pStmt->kind == STMT_BANK || pStmt->kind == STMT_ENDBANK || (NULL == pBlock && (pStmt->kind == STMT_LABEL || pStmt->kind == STMT_RMB ||
+                                                               pStmt->kind == STMT_SIZED || pStmt->kind == STMT_DEFERRED ||
+                                                               pStmt->kind == STMT_STRING || pStmt->kind == STMT_INCBIN ||
+                                                               pStmt->kind == STMT_DELAY)))
+            {
+                // A bank switch with nothing placed before the next one doesn't leave an empty block behind.
+                //
+                if (pBlock && fSwitchBlock && pBlock->end == pBlock->start)
+                    g_mapBlockCount--;
+
+                if (NULL == (pTemp = growMapArray(g_mapBlocks, g_mapBlockCount, &g_mapBlocksAllocated, sizeof(MAPBLOCK))))
+                    return -1;
+                g_mapBlocks = (MAPBLOCK *)pTemp;
+
+                pBlock       = &g_mapBlocks[g_mapBlockCount++];
+                fSwitchBlock = (pStmt->kind == STMT_BANK || pStmt->kind == STMT_ENDBANK);
+                pBlock->start      = (pStmt->kind == STMT_ORG ? pStmt->value : pStmt->addr);
+                pBlock->end        = pBlock->start;
+                pBlock->lineNumber = (pStmt->kind == STMT_ORG || pStmt->kind == STMT_BANK || pStmt->kind == STMT_ENDBANK ? nLineBase + pStmt->lineNumber : 0);
+                pBlock->bank       = nBank;
+                pLabel             = NULL;
+
+                if (pStmt->kind == STMT_ORG || pStmt->kind == STMT_BANK || pStmt->kind == STMT_ENDBANK)
+                    continue;
+            }
+
+            switch (pStmt->kind)
+            {
+                case STMT_LABEL:
+                    if (NULL == (pTemp = growMapArray(g_mapLabels, g_mapLabelCount, &g_mapLabelsAllocated, sizeof(MAPLABEL))))
+                        return -1;
+                    g_mapLabels = (MAPLABEL *)pTemp;
+
+                    pLabel = &g_mapLabels[g_mapLabelCount++];
+                    memset(pLabel, 0, sizeof(MAPLABEL));
+                    copySymbolName(pLabel->name, pStmt->symbolName);
+                    pLabel->addr       = pStmt->addr;
+                    pLabel->lineNumber = nLineBase + pStmt->lineNumber;
+
+                    // A label on an RMB line names the reservation.
+                    //
+                    if (nStmt + 1 < pChunk->statementCount && pChunk->pStatements[nStmt + 1].kind == STMT_RMB &&
+                        pChunk->pStatements[nStmt + 1].lineOffset == pStmt->lineOffset &&
+                        pChunk->pStatements[nStmt + 1].macroLine == pStmt->macroLine)
+                        pLabel->fReservation = true;
+                    break;
+
+                case STMT_RMB:
+                case STMT_SIZED:
+                case STMT_DEFERRED:
+                case STMT_STRING:
+                case STMT_INCBIN:
+                case STMT_DELAY:
+                    if (pLabel)
+                    {
+                        if (pStmt->kind == STMT_RMB)
+                            pLabel->reservedBytes += pStmt->size;
+                        else if (pStmt->pInst || pStmt->kind == STMT_DELAY)
+                            pLabel->codeBytes += pStmt->size;
+                        else
+                            pLabel->dataBytes += pStmt->size;
+                    }
+
+                    if ((UINT32)pStmt->addr + pStmt->size > pBlock->end)
+                        pBlock->end = (UINT32)pStmt->addr + pStmt->size;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        nLineBase += pChunk->lineCount;
+    }
+
+    if (pBlock && fSwitchBlock && pBlock->end == pBlock->start)
+        g_mapBlockCount--;
+
+    return 0;
+}
+
+
+// Append one formatted line to the map text.
+//
+int appendMapLine(LISTBUFFER *pMap, char *pszFormat, ...)
+{
+    char szLine[MAX_LINE_LENGTH];
+    va_list args;
+
+    va_start(args, pszFormat);
+    vsnprintf(szLine, sizeof(szLine), pszFormat, args);
+    va_end(args);
+
+    return appendToBuffer(pMap, szLine);
+}
+
+
+// Write the memory map: ORG blocks, RMB reservations, LOCALS variables, per-label footprint, unused gaps, bank
+// utilization and switched banks.  The address space is marked from the common memory ORG blocks (placed and reserved
+// bytes) and the LOCALS variables so overlapping blocks are only counted once.
+//
+int writeMapFile(int fpMap, UINT8 *pWritten)
+{
+    int nRetVal = 0;
+    LISTBUFFER map;
+    UINT8 *pUsed = NULL;
+    int nBanks;
+    MEMORYBANK *pBanks = getMemoryBanks(&nBanks);
+    UINT32 nTotalCode = 0;
+    UINT32 nTotalData = 0;
+    UINT32 nTotalReserved = 0;
+
+    memset(&map, 0, sizeof(LISTBUFFER));
+
+    if (NULL == (pUsed = (UINT8 *)calloc(MEM_IMAGE_SIZE, sizeof(UINT8))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", MEM_IMAGE_SIZE);
+        return -1;
+    }
+
+    for (int i=0 ; i<g_mapBlockCount ; i++)
+    {
+        if (g_mapBlocks[i].bank != BANK_COMMON)
+            continue;
+        for (UINT32 nAddr=g_mapBlocks[i].start ; nAddr < g_mapBlocks[i].end && nAddr < MEM_IMAGE_SIZE ; nAddr++)
+            pUsed[nAddr] = 1;
+    }
+    for (int i=0 ; i<g_localVarCount ; i++)
+    {
+        for (UINT32 nAddr=g_localVars[i].addr ; nAddr < (UINT32)g_localVars[i].addr + g_localVars[i].size && nAddr < MEM_IMAGE_SIZE ; nAddr++)
+            pUsed[nAddr] = 1;
+    }
+
+    // ORG blocks.
+    //
+    appendMapLine(&map, "  ORG BLOCKS     START  END    SIZE    LINE     [Total=%d]\r\n", g_mapBlockCount);
+    appendMapLine(&map, "-----------------------------------------------\r\n");
+    for (int i=0 ; i<g_mapBlockCount ; i++)
+    {
+        MAPBLOCK *pBlock = &g_mapBlocks[i];
+        char     szBank[MAX_SYMBOL_NAME_LENGTH];
+
+        szBank[0] = '\0';
+        if (pBlock->bank != BANK_COMMON)
+            sprintf(szBank, "BANK %d", pBlock->bank);
+
+        if (pBlock->end == pBlock->start)
+            appendMapLine(&map, "%15s  $%04X  -      %5d   %5d\r\n", szBank, pBlock->start, 0, pBlock->lineNumber);
+        else
+            appendMapLine(&map, "%15s  $%04X  $%04X  %5d   %5d\r\n", szBank, pBlock->start, (UINT16)(pBlock->end - 1),
+                          (int)(pBlock->end - pBlock->start), pBlock->lineNumber);
+    }
+
+    // RMB reservations.
+    //
+    appendMapLine(&map, "\r\n  RESERVATION    START  END    SIZE    LINE\r\n");
+    appendMapLine(&map, "-----------------------------------------------\r\n");
+    for (int i=0 ; i<g_mapLabelCount ; i++)
+    {
+        MAPLABEL *pLabel = &g_mapLabels[i];
+
+        if (pLabel->fReservation && pLabel->reservedBytes)
+            appendMapLine(&map, "%15s  $%04X  $%04X  %5d   %5d\r\n", pLabel->name, pLabel->addr,
+                          (UINT16)(pLabel->addr + pLabel->reservedBytes - 1), (int)pLabel->reservedBytes, pLabel->lineNumber);
+    }
+
+    // LOCALS variables, overlaid along the call graph.
+    //
+    if (g_localVarCount)
+    {
+        appendMapLine(&map, "\r\n  LOCAL VARIABLE ROUTINE          ADDR   SIZE   REFS    LINE     [Total=%d]\r\n", g_localVarCount);
+        appendMapLine(&map, "-----------------------------------------------\r\n");
+        for (int i=0 ; i<g_localVarCount ; i++)
+        {
+            LOCALVAR *pVar = &g_localVars[i];
+
+            appendMapLine(&map, "%15s  %-15s  $%04X  %5d  %5d   %5d\r\n", (pVar->name[0] ? pVar->name : "(unnamed)"), pVar->routine,
+                          pVar->addr, (int)pVar->size, pVar->references, pVar->lineNumber);
+        }
+    }
+
+    // Per-label footprint (everything placed between the label and the next label or ORG).
+    //
+    appendMapLine(&map, "\r\n  LABEL          ADDR    CODE   DATA    RMB    LINE     [Total=%d]\r\n", g_mapLabelCount);
+    appendMapLine(&map, "-----------------------------------------------\r\n");
+    for (int i=0 ; i<g_mapLabelCount ; i++)
+    {
+        MAPLABEL *pLabel = &g_mapLabels[i];
+
+        appendMapLine(&map, "%15s  $%04X  %5d  %5d  %5d   %5d\r\n", pLabel->name, pLabel->addr, (int)pLabel->codeBytes,
+                      (int)pLabel->dataBytes, (int)pLabel->reservedBytes, pLabel->lineNumber);
+        nTotalCode     += pLabel->codeBytes;
+        nTotalData     += pLabel->dataBytes;
+        nTotalReserved += pLabel->reservedBytes;
+    }
+    appendMapLine(&map, "%15s         %5d  %5d  %5d\r\n", "(labelled)", (int)nTotalCode, (int)nTotalData, (int)nTotalReserved);
+
+    // Bank utilization and the free gaps in each bank.
+    //
+    appendMapLine(&map, "\r\n  BANK           START  END    SIZE    USED  IMAGE   FREE\r\n");
+    appendMapLine(&map, "-----------------------------------------------\r\n");
+    for (int i=0 ; i<nBanks ; i++)
+    {
+        MEMORYBANK *pBank = &pBanks[i];
+        UINT32 nSize  = (UINT32)pBank->end - pBank->start + 1;
+        UINT32 nUsed  = 0;
+        UINT32 nImage = 0;
+
+        for (UINT32 nAddr=pBank->start ; nAddr <= pBank->end ; nAddr++)
+        {
+            nUsed  += pUsed[nAddr];
+            nImage += (pWritten[nAddr] ? 1 : 0);
+        }
+
+        appendMapLine(&map, "%15s  $%04X  $%04X  %5d  %5d  %5d  %5d  (%d%% used)\r\n", pBank->name, pBank->start, pBank->end,
+                      (int)nSize, (int)nUsed, (int)nImage, (int)(nSize - nUsed), (int)((nUsed * 100) / nSize));
+    }
+
+    appendMapLine(&map, "\r\n  FREE GAP       START  END    SIZE    BANK\r\n");
+    appendMapLine(&map, "-----------------------------------------------\r\n");
+    for (int i=0 ; i<nBanks ; i++)
+    {
+        MEMORYBANK *pBank = &pBanks[i];
+        UINT32 nGapStart = pBank->start;
+
+        for (UINT32 nAddr=pBank->start ; nAddr <= (UINT32)pBank->end + 1 ; nAddr++)
+        {
+            if (nAddr <= pBank->end && !pUsed[nAddr])
+                continue;
+
+            if (nAddr > nGapStart)
+                appendMapLine(&map, "%15s  $%04X  $%04X  %5d   %s\r\n", "", (UINT16)nGapStart, (UINT16)(nAddr - 1),
+                              (int)(nAddr - nGapStart), pBank->name);
+            nGapStart = nAddr + 1;
+        }
+    }
+
+    // Switched banks, by physical address.
+    //
+    if (g_switchBankCount)
+    {
+        appendMapLine(&map, "\r\n  SWITCHED BANK  START    END      SIZE    USED   FREE     [Total=%d]\r\n", g_switchBankCount);
+        appendMapLine(&map, "-----------------------------------------------\r\n");
+        for (int i=0 ; i<MAX_SWITCH_BANKS ; i++)
+        {
+            UINT32 nSize = (UINT32)g_bankWindowEnd - g_bankWindowStart + 1;
+            UINT32 nUsed = 0;
+
+            if (!g_switchBanks[i].fUsed || NULL == g_switchBanks[i].pWritten)
+                continue;
+
+            for (UINT32 nAddr=g_bankWindowStart ; nAddr <= g_bankWindowEnd ; nAddr++)
+                nUsed += (g_switchBanks[i].pWritten[nAddr] ? 1 : 0);
+
+            appendMapLine(&map, "%15d  $%06lX  $%06lX  %5d  %5d  %5d  (%d%% used)\r\n", i, (unsigned long)getBankAddress(i, g_bankWindowStart),
+                          (unsigned long)getBankAddress(i, g_bankWindowEnd), (int)nSize, (int)nUsed, (int)(nSize - nUsed), (int)((nUsed * 100) / nSize));
+        }
+    }
+
+    if (map.length && write(fpMap, map.pBuffer, map.length) != map.length)
+    {
+        printf("ERROR: Map file write failed\r\n");
+        nRetVal = -1;
+    }
+
+    if (map.pBuffer)
+        free(map.pBuffer);
+    free(pUsed);
+
+    return nRetVal;
+}
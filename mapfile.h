@@ -0,0 +1,12 @@
+//
+//  mapfile.h
+//  MC68HC11 Assembler
+//
+//  Memory map and footprint report.
+//
+
+int addMemoryBank(const char *pszSpec);
+MEMORYBANK *getMemoryBanks(int *pnBanks);
+int buildMemoryMap(CHUNK *pChunks, int nChunks);
+int writeMapFile(int fpMap, UINT8 *pWritten);
+void freeMemoryMap(void);
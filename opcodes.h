@@ -6,18 +6,6 @@
 //  Copyright 2011 __MyCompanyName__. All rights reserved.
 //
 
-#define MAX_MNEUMONIC_LENGTH    5
-
-typedef struct _instruction_
-{
-    char     mnemonic[MAX_MNEUMONIC_LENGTH];    // Instruction mneumonic
-    ADDRMODE addrMode;                          // Instruction address mode
-    UINT8    preByte;                           // Pre-Byte value (optional)
-    UINT8    opCode;                            // Instruction op-code
-    UINT8    numBytes;                          // Number of encoding bytes for instruction
-    UINT8    numCycles;                         // Number of processor cycles for instruction
-} INSTRUCTION;
-
 INSTRUCTION instructions[] =
 {
     { "ABA",   INH,  0x00, 0x1B, 1, 2 },
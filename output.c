@@ -0,0 +1,319 @@
+//
+//  output.c
+//  MC68HC11 Assembler
+//
+//  Image output formats other than S-records: raw binary, Intel HEX, even/odd split and per-bank images.  Each is
+//  generated from the assembled memory image.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "utility.h"
+#include "mapfile.h"
+#include "bank.h"
+#include "output.h"
+
+int    g_outputFormats;                 // OUTPUT_FORMAT_xxx images to write (-f)
+UINT8  g_fillByte = 0xFF;               // Value of unwritten bytes in binary images (-F)
+bool   g_fImageWindow;                  // Binary window given on the command line (-w)
+UINT16 g_windowStart;
+UINT16 g_windowEnd;
+
+extern SWITCHBANK g_switchBanks[MAX_SWITCH_BANKS];
+extern UINT16 g_bankWindowStart;
+extern UINT16 g_bankWindowEnd;
+
+
+// Add an output format from its command line name.
+//
+int addOutputFormat(const char *pszFormat)
+{
+    if (!strcasecmp(pszFormat, "bin"))
+        g_outputFormats |= OUTPUT_FORMAT_BINARY;
+    else if (!strcasecmp(pszFormat, "hex"))
+        g_outputFormats |= OUTPUT_FORMAT_INTEL_HEX;
+    else if (!strcasecmp(pszFormat, "split"))
+        g_outputFormats |= OUTPUT_FORMAT_SPLIT;
+    else if (!strcasecmp(pszFormat, "banks"))
+        g_outputFormats |= OUTPUT_FORMAT_BANKS;
+    else
+    {
+        printf("ERROR: Unknown output format \'%s\' (expected bin, hex, split or banks)\r\n", pszFormat);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Set the fill byte for binary images.
+//
+int setFillByte(const char *pszFill)
+{
+    char   szFill[MAX_LINE_LENGTH];
+    UINT16 nFill;
+
+    strncpy(szFill, pszFill, MAX_LINE_LENGTH - 1);
+    szFill[MAX_LINE_LENGTH - 1] = '\0';
+
+    if (convertToNumber(szFill, &nFill) || nFill > 0xFF)
+    {
+        printf("ERROR: Invalid fill byte \'%s\'\r\n", pszFill);
+        return -1;
+    }
+    g_fillByte = (UINT8)nFill;
+
+    return 0;
+}
+
+
+// Set the binary image window from a "<start>,<end>" command line specification.
+//
+int setImageWindow(const char *pszSpec)
+{
+    char szSpec[MAX_LINE_LENGTH];
+    char *pszStart;
+    char *pszEnd;
+    char *pszContext;
+
+    strncpy(szSpec, pszSpec, MAX_LINE_LENGTH - 1);
+    szSpec[MAX_LINE_LENGTH - 1] = '\0';
+
+    if (NULL == (pszStart = strtok_r(szSpec, ",", &pszContext)) || NULL == (pszEnd = strtok_r(NULL, ",", &pszContext)) ||
+        convertToNumber(pszStart, &g_windowStart) || convertToNumber(pszEnd, &g_windowEnd) || g_windowEnd < g_windowStart)
+    {
+        printf("ERROR: Invalid image window \'%s\' (expected <start>,<end>)\r\n", pszSpec);
+        return -1;
+    }
+    g_fImageWindow = true;
+
+    return 0;
+}
+
+
+// Open an output file named after the source file with a new extension (and optional suffix ahead of it).
+//
+int openImageFile(const char *pszSourceName, const char *pszSuffix, const char *pszExtension)
+{
+    char szFileName[MAX_LINE_LENGTH];
+    int  fpImage;
+
+    makeOutputFileName(szFileName, sizeof(szFileName), pszSourceName, pszSuffix, pszExtension);
+
+    fpImage = open(szFileName, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (fpImage < 0)
+        printf("ERROR: Image file open failed (%s)\r\n", szFileName);
+
+    return fpImage;
+}
+
+
+// Write the bytes from nStart to nEnd (inclusive) whose address has the given parity (-1 == every byte), filling the
+// bytes that weren't assembled.
+//
+int writeBinaryImage(int fpImage, UINT8 *pImage, UINT8 *pWritten, UINT16 nStart, UINT16 nEnd, int nParity)
+{
+    UINT8  *pBuffer;
+    UINT32 nLength = 0;
+    int    nRetVal = 0;
+
+    if (NULL == (pBuffer = (UINT8 *)malloc((UINT32)nEnd - nStart + 1)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)((UINT32)nEnd - nStart + 1));
+        return -1;
+    }
+
+    for (UINT32 nAddr=nStart ; nAddr <= nEnd ; nAddr++)
+    {
+        if (nParity < 0 || (int)(nAddr & 1) == nParity)
+            pBuffer[nLength++] = (pWritten[nAddr] ? pImage[nAddr] : g_fillByte);
+    }
+
+    if (write(fpImage, pBuffer, nLength) != (ssize_t)nLength)
+    {
+        printf("ERROR: Image file write failed\r\n");
+        nRetVal = -1;
+    }
+    free(pBuffer);
+
+    return nRetVal;
+}
+
+
+// Intel HEX Line: :LLAAAATTdddddddCC  (LL == data byte count, AAAA == address, TT == record type, CC == checksum)
+//
+void appendIntelHexRecord(LISTBUFFER *pHex, UINT8 nType, UINT16 nAddr, UINT8 *pBytes, int nBytes)
+{
+    char  szLine[(MAX_SREC_COUNT * 2) + 16];
+    int   nChars;
+    UINT8 nChecksum = (UINT8)(nBytes + (nAddr >> 8) + (nAddr & 0xFF) + nType);
+
+    nChars = sprintf(szLine, ":%02X%04X%02X", nBytes, nAddr, nType);
+    for (int i=0 ; i<nBytes ; i++)
+    {
+        nChars    += sprintf(szLine + nChars, "%02X", pBytes[i]);
+        nChecksum += pBytes[i];
+    }
+    sprintf(szLine + nChars, "%02X\r\n", (UINT8)(0x100 - nChecksum));
+
+    appendToBuffer(pHex, szLine);
+}
+
+
+// Write the assembled bytes as Intel HEX data records (records break wherever the address isn't contiguous), the
+// start address as a start segment address record (CS == 0) and the end of file record.
+//
+int writeIntelHex(int fpHex, UINT8 *pImage, UINT8 *pWritten, UINT16 nStartAddr, int nRecordBytes)
+{
+    LISTBUFFER hex;
+    UINT8  startRecord[4];
+    UINT32 nAddr = 0;
+
+    memset(&hex, 0, sizeof(LISTBUFFER));
+
+    while (nAddr < MEM_IMAGE_SIZE)
+    {
+        int nBytes = 0;
+
+        if (!pWritten[nAddr])
+        {
+            nAddr++;
+            continue;
+        }
+
+        while (nBytes < nRecordBytes && nAddr + nBytes < MEM_IMAGE_SIZE && pWritten[nAddr + nBytes])
+            nBytes++;
+
+        appendIntelHexRecord(&hex, INTEL_HEX_DATA, (UINT16)nAddr, &pImage[nAddr], nBytes);
+        nAddr += nBytes;
+    }
+
+    startRecord[0] = 0;
+    startRecord[1] = 0;
+    startRecord[2] = (UINT8)(nStartAddr >> 8);
+    startRecord[3] = (UINT8)(nStartAddr & 0xFF);
+    appendIntelHexRecord(&hex, INTEL_HEX_START_SEGMENT, 0, startRecord, 4);
+    appendIntelHexRecord(&hex, INTEL_HEX_END_OF_FILE, 0, NULL, 0);
+
+    if (hex.length)
+        write(fpHex, hex.pBuffer, hex.length);
+    if (hex.pBuffer)
+        free(hex.pBuffer);
+
+    return 0;
+}
+
+
+// Write every image selected with -f.  Binary and split images cover the -w window, or the lowest to highest
+// assembled address when there isn't one; per-bank images cover each memory bank and each switched bank's window.
+//
+int writeImageFiles(const char *pszSourceName, UINT8 *pImage, UINT8 *pWritten, UINT16 nStartAddr, int nRecordBytes)
+{
+    int    nRetVal = 0;
+    int    fpImage;
+    UINT16 nStart = g_windowStart;
+    UINT16 nEnd   = g_windowEnd;
+
+    if (!g_outputFormats)
+        return 0;
+
+    if (!g_fImageWindow)
+    {
+        UINT32 nAddr;
+
+        for (nAddr=0 ; nAddr < MEM_IMAGE_SIZE && !pWritten[nAddr] ; nAddr++)
+            ;
+        if (nAddr == MEM_IMAGE_SIZE)
+            return 0;
+        nStart = (UINT16)nAddr;
+
+        for (nAddr=MEM_IMAGE_SIZE - 1 ; !pWritten[nAddr] ; nAddr--)
+            ;
+        nEnd = (UINT16)nAddr;
+    }
+
+    if (g_outputFormats & OUTPUT_FORMAT_BINARY)
+    {
+        if ((fpImage = openImageFile(pszSourceName, "", BIN_FILE_EXTENSION)) < 0)
+            return -1;
+        nRetVal = writeBinaryImage(fpImage, pImage, pWritten, nStart, nEnd, -1);
+        close(fpImage);
+        if (nRetVal)
+            return nRetVal;
+    }
+
+    if (g_outputFormats & OUTPUT_FORMAT_INTEL_HEX)
+    {
+        if ((fpImage = openImageFile(pszSourceName, "", HEX_FILE_EXTENSION)) < 0)
+            return -1;
+        nRetVal = writeIntelHex(fpImage, pImage, pWritten, nStartAddr, nRecordBytes);
+        close(fpImage);
+        if (nRetVal)
+            return nRetVal;
+    }
+
+    // Even/odd images for a pair of 8-bit EPROMs on a 16-bit bus - the window is widened to whole 16-bit words so
+    // both images cover the same words.
+    //
+    if (g_outputFormats & OUTPUT_FORMAT_SPLIT)
+    {
+        for (int nParity=0 ; nParity<2 ; nParity++)
+        {
+            if ((fpImage = openImageFile(pszSourceName, "", (nParity ? ODD_FILE_EXTENSION : EVEN_FILE_EXTENSION))) < 0)
+                return -1;
+            nRetVal = writeBinaryImage(fpImage, pImage, pWritten, (UINT16)(nStart & ~1), (UINT16)(nEnd | 1), nParity);
+            close(fpImage);
+            if (nRetVal)
+                return nRetVal;
+        }
+    }
+
+    if (g_outputFormats & OUTPUT_FORMAT_BANKS)
+    {
+        int nBanks;
+        MEMORYBANK *pBanks = getMemoryBanks(&nBanks);
+
+        for (int i=0 ; i<nBanks ; i++)
+        {
+            char szSuffix[MAX_SYMBOL_NAME_LENGTH + 1];
+
+            sprintf(szSuffix, "_%s", pBanks[i].name);
+            if ((fpImage = openImageFile(pszSourceName, szSuffix, BIN_FILE_EXTENSION)) < 0)
+                return -1;
+            nRetVal = writeBinaryImage(fpImage, pImage, pWritten, pBanks[i].start, pBanks[i].end, -1);
+            close(fpImage);
+            if (nRetVal)
+                return nRetVal;
+        }
+
+        // Each switched bank's window, from the bank's own image.
+        //
+        for (int i=0 ; i<MAX_SWITCH_BANKS ; i++)
+        {
+            char  szSuffix[MAX_SYMBOL_NAME_LENGTH + 1];
+            UINT8 *pBankImage;
+            UINT8 *pBankWritten;
+
+            if (!g_switchBanks[i].fUsed || NULL == g_switchBanks[i].pImage)
+                continue;
+
+            getBankImage(i, &pBankImage, &pBankWritten);
+            sprintf(szSuffix, "_bank%d", i);
+            if ((fpImage = openImageFile(pszSourceName, szSuffix, BIN_FILE_EXTENSION)) < 0)
+                return -1;
+            nRetVal = writeBinaryImage(fpImage, pBankImage, pBankWritten, g_bankWindowStart, g_bankWindowEnd, -1);
+            close(fpImage);
+            if (nRetVal)
+                return nRetVal;
+        }
+    }
+
+    return 0;
+}
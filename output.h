@@ -0,0 +1,11 @@
+//
+//  output.h
+//  MC68HC11 Assembler
+//
+//  Raw binary, Intel HEX, split and per-bank image output.
+//
+
+int addOutputFormat(const char *pszFormat);
+int setFillByte(const char *pszFill);
+int setImageWindow(const char *pszSpec);
+int writeImageFiles(const char *pszSourceName, UINT8 *pImage, UINT8 *pWritten, UINT16 nStartAddr, int nRecordBytes);
@@ -0,0 +1,191 @@
+//
+//  srecord.c
+//  MC68HC11 Assembler
+//
+//  Motorola S-record file reading.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "utility.h"
+#include "srecord.h"
+
+
+// Convert two hex characters to a byte value (-1 if either character isn't a hex digit).
+//
+int parseHexByte(const char *pszChars)
+{
+    int nValue = 0;
+
+    for (int i=0 ; i<2 ; i++)
+    {
+        char c = pszChars[i];
+
+        nValue <<= 4;
+        if (c >= '0' && c <= '9')
+            nValue |= (c - '0');
+        else if (c >= 'A' && c <= 'F')
+            nValue |= (c - 'A' + 0xA);
+        else if (c >= 'a' && c <= 'f')
+            nValue |= (c - 'a' + 0xA);
+        else
+            return -1;
+    }
+
+    return nValue;
+}
+
+
+// Parse one S-record line.  Data records (S1/S2/S3) are copied into the image and termination records (S7/S8/S9)
+// supply the start address.  Header and count records are ignored.
+//
+int parseSRecordLine(char *pszLine, int nLineNumber, UINT8 *pImage, UINT8 *pWritten, UINT16 *pStartAddr)
+{
+    int nType;
+    int nCount;
+    int nAddrBytes;
+    int nLength = (int)strlen(pszLine);
+    UINT32 nAddr = 0;
+    UINT8  nChecksum;
+    int    nByte;
+
+    if (pszLine[0] != 'S' || nLength < 4 || pszLine[1] < '0' || pszLine[1] > '9')
+    {
+        printf("ERROR: Invalid S-record on line %d\r\n", nLineNumber);
+        return -1;
+    }
+
+    nType = pszLine[1] - '0';
+    switch (nType)
+    {
+        case 1: case 9: nAddrBytes = 2; break;
+        case 2: case 8: nAddrBytes = 3; break;
+        case 3: case 7: nAddrBytes = 4; break;
+        case 0: case 5: case 6: nAddrBytes = 0; break;
+        default:
+            printf("ERROR: Unsupported S-record type S%d on line %d\r\n", nType, nLineNumber);
+            return -1;
+    }
+
+    // The count covers the address, data and checksum bytes - check it against the line length before reading any of them.
+    //
+    if ((nCount = parseHexByte(&pszLine[2])) < 0 || nLength < (4 + (nCount * 2)) || nCount < (nAddrBytes + 1))
+    {
+        printf("ERROR: Invalid S-record length on line %d\r\n", nLineNumber);
+        return -1;
+    }
+
+    nChecksum = (UINT8)nCount;
+    for (int i=0 ; i<nCount ; i++)
+    {
+        if ((nByte = parseHexByte(&pszLine[4 + (i * 2)])) < 0)
+        {
+            printf("ERROR: Invalid S-record character on line %d\r\n", nLineNumber);
+            return -1;
+        }
+        nChecksum += (UINT8)nByte;
+    }
+
+    if (nChecksum != 0xFF)
+    {
+        printf("ERROR: S-record checksum mismatch on line %d\r\n", nLineNumber);
+        return -1;
+    }
+
+    for (int i=0 ; i<nAddrBytes ; i++)
+    {
+        nAddr = (nAddr << 8) | (UINT32)parseHexByte(&pszLine[4 + (i * 2)]);
+    }
+
+    switch (nType)
+    {
+        case 1:
+        case 2:
+        case 3:
+        {
+            int nDataBytes = nCount - nAddrBytes - 1;
+
+            if (nAddr + nDataBytes > MEM_IMAGE_SIZE)
+            {
+                printf("ERROR: S-record on line %d is outside the 16-bit address space\r\n", nLineNumber);
+                return -1;
+            }
+
+            for (int i=0 ; i<nDataBytes ; i++)
+            {
+                pImage[nAddr + i]   = (UINT8)parseHexByte(&pszLine[4 + ((nAddrBytes + i) * 2)]);
+                pWritten[nAddr + i] = 1;
+            }
+            break;
+        }
+        case 7:
+        case 8:
+        case 9:
+            if (pStartAddr)
+                *pStartAddr = (UINT16)nAddr;
+            break;
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+
+// Load an S-record file into a 64K memory image.  Bytes that are loaded are flagged in pWritten.
+//
+int readSRecordFile(const char *pszFileName, UINT8 *pImage, UINT8 *pWritten, UINT16 *pStartAddr)
+{
+    int nRetVal = 0;
+    int fpSRecord;
+    int nFileSize;
+    char *pFile = NULL;
+    SOURCEFILE sourceFile;
+    char line[MAX_LINE_LENGTH];
+
+    // "-" reads the records from standard input.
+    //
+    if ((fpSRecord = (strcmp(pszFileName, "-") ? open(pszFileName, O_RDONLY) : STDIN_FILENO)) < 0)
+    {
+        printf("ERROR: S-Record file open failed (%s)\r\n", pszFileName);
+        return -1;
+    }
+
+    if (readFileContents(fpSRecord, &pFile, &nFileSize, MAX_SOURCE_SIZE) < 0)
+    {
+        printf("ERROR: S-Record file read failed (%s)\r\n", pszFileName);
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    memset(&sourceFile, 0, sizeof(SOURCEFILE));
+    sourceFile.pFile       = pFile;
+    sourceFile.fileSize    = nFileSize;
+    sourceFile.piterOffset = pFile;
+    sourceFile.fEOF        = (nFileSize == 0);
+
+    while (getNextFileLine(&sourceFile, line, MAX_LINE_LENGTH) == 0)
+    {
+        if (isBlankLine(line))
+            continue;
+
+        if (0 != (nRetVal = parseSRecordLine(line, sourceFile.lineStart + 1, pImage, pWritten, pStartAddr)))
+            break;
+    }
+
+Exit:
+
+    if (fpSRecord != STDIN_FILENO)
+        close(fpSRecord);
+    if (pFile)
+        free(pFile);
+
+    return nRetVal;
+}
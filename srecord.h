@@ -0,0 +1,10 @@
+//
+//  srecord.h
+//  MC68HC11 Assembler
+//
+//  Motorola S-record file reading.
+//
+
+int parseHexByte(const char *pszChars);
+int parseSRecordLine(char *pszLine, int nLineNumber, UINT8 *pImage, UINT8 *pWritten, UINT16 *pStartAddr);
+int readSRecordFile(const char *pszFileName, UINT8 *pImage, UINT8 *pWritten, UINT16 *pStartAddr);
@@ -0,0 +1,547 @@
+//
+//  stack.c
+//  MC68HC11 Assembler
+//
+//  Static stack depth analysis.  The assembled image is decoded with the disassembler tables and the call graph is
+//  followed from the start address and each interrupt vector, tracking the bytes pushed along every path.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utility.h"
+#include "disasm.h"
+#include "stack.h"
+
+extern SYMBOL symbols[];
+extern UINT16 symbolCount;
+
+
+// How each instruction moves the stack pointer or transfers control.
+//
+typedef enum _stackop_
+{
+    STACK_OP_NONE,          // Falls through to the next instruction
+    STACK_OP_ADJUST,        // Pushes (or pulls) a fixed number of bytes
+    STACK_OP_BRANCH,        // Conditional branch - the target and the next instruction
+    STACK_OP_JUMP,          // Unconditional branch or jump
+    STACK_OP_CALL,          // Subroutine call - pushes the return address while the subroutine runs
+    STACK_OP_RETURN,        // RTS/RTI
+    STACK_OP_SWI,           // Software interrupt - pushes an interrupt frame and runs the SWI handler
+    STACK_OP_LOAD_SP,       // LDS - the stack is (re)initialized, so depth is measured from here
+    STACK_OP_SET_SP         // TXS/TYS - the new stack pointer can't be determined statically
+} STACKOP;
+
+typedef struct _stackeffect_
+{
+    char    *pszMneumonic;
+    STACKOP op;
+    int     bytes;          // Bytes pushed (STACK_OP_ADJUST, negative for pulls)
+} STACKEFFECT;
+
+STACKEFFECT g_stackEffectTable[] =
+{
+    { "PSHA",  STACK_OP_ADJUST,  1 },
+    { "PSHB",  STACK_OP_ADJUST,  1 },
+    { "PSHX",  STACK_OP_ADJUST,  2 },
+    { "PSHY",  STACK_OP_ADJUST,  2 },
+    { "PULA",  STACK_OP_ADJUST, -1 },
+    { "PULB",  STACK_OP_ADJUST, -1 },
+    { "PULX",  STACK_OP_ADJUST, -2 },
+    { "PULY",  STACK_OP_ADJUST, -2 },
+    { "DES",   STACK_OP_ADJUST,  1 },
+    { "INS",   STACK_OP_ADJUST, -1 },
+    { "BCC",   STACK_OP_BRANCH,  0 },
+    { "BCS",   STACK_OP_BRANCH,  0 },
+    { "BEQ",   STACK_OP_BRANCH,  0 },
+    { "BGE",   STACK_OP_BRANCH,  0 },
+    { "BGT",   STACK_OP_BRANCH,  0 },
+    { "BHI",   STACK_OP_BRANCH,  0 },
+    { "BHS",   STACK_OP_BRANCH,  0 },
+    { "BLE",   STACK_OP_BRANCH,  0 },
+    { "BLO",   STACK_OP_BRANCH,  0 },
+    { "BLS",   STACK_OP_BRANCH,  0 },
+    { "BLT",   STACK_OP_BRANCH,  0 },
+    { "BMI",   STACK_OP_BRANCH,  0 },
+    { "BNE",   STACK_OP_BRANCH,  0 },
+    { "BPL",   STACK_OP_BRANCH,  0 },
+    { "BRCLR", STACK_OP_BRANCH,  0 },
+    { "BRN",   STACK_OP_BRANCH,  0 },
+    { "BRSET", STACK_OP_BRANCH,  0 },
+    { "BVC",   STACK_OP_BRANCH,  0 },
+    { "BVS",   STACK_OP_BRANCH,  0 },
+    { "BRA",   STACK_OP_JUMP,    0 },
+    { "JMP",   STACK_OP_JUMP,    0 },
+    { "BSR",   STACK_OP_CALL,    0 },
+    { "JSR",   STACK_OP_CALL,    0 },
+    { "RTS",   STACK_OP_RETURN,  0 },
+    { "RTI",   STACK_OP_RETURN,  0 },
+    { "SWI",   STACK_OP_SWI,     0 },
+    { "LDS",   STACK_OP_LOAD_SP, 0 },
+    { "TXS",   STACK_OP_SET_SP,  0 },
+    { "TYS",   STACK_OP_SET_SP,  0 },
+    { NULL,    STACK_OP_NONE,    0 }
+};
+
+// 68HC11 interrupt vectors, lowest address first.
+//
+typedef struct _stackvector_
+{
+    char   *pszName;
+    UINT16 addr;
+} STACKVECTOR;
+
+STACKVECTOR g_stackVectors[] =
+{
+    { "SCI",   0xFFD6 }, { "SPI",   0xFFD8 }, { "PAIE",  0xFFDA }, { "PAOV",  0xFFDC }, { "TOF",   0xFFDE },
+    { "TOC5",  0xFFE0 }, { "TOC4",  0xFFE2 }, { "TOC3",  0xFFE4 }, { "TOC2",  0xFFE6 }, { "TOC1",  0xFFE8 },
+    { "TIC3",  0xFFEA }, { "TIC2",  0xFFEC }, { "TIC1",  0xFFEE }, { "RTII",  0xFFF0 }, { "IRQ",   0xFFF2 },
+    { "XIRQ",  0xFFF4 }, { "SWI",   0xFFF6 }, { "ILLOP", 0xFFF8 }, { "COP",   0xFFFA }, { "CMF",   0xFFFC },
+    { "RESET", 0xFFFE }, { NULL,    0      }
+};
+
+#define SWI_VECTOR              0xFFF6
+#define RESET_VECTOR            0xFFFE
+#define UNVISITED               0x7FFF
+
+UINT8  *g_stackOps;                         // STACKEFFECT index + 1 for each instruction table entry (0 == STACK_OP_NONE)
+int    *g_funcDepth;                        // Maximum depth of the subroutine at each address
+UINT8  *g_funcFlags;                        // STACK_FLAG_xxx for the subroutine at each address
+UINT8  *g_funcState;                        // 0 == not analyzed, 1 == being analyzed, 2 == done
+short  *g_pathOffset;                       // Stack offset at each address during the current subroutine walk
+
+
+// Build the stack effect of each instruction table entry.
+//
+int buildStackTables(void)
+{
+    int nInstructions = 0;
+
+    if (g_stackOps)
+        return 0;
+
+    while (instructions[nInstructions].mnemonic[0] != '\0')
+        nInstructions++;
+
+    if (NULL == (g_stackOps = (UINT8 *)calloc(nInstructions, sizeof(UINT8))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", nInstructions);
+        return -1;
+    }
+
+    for (int i=0 ; i<nInstructions ; i++)
+    {
+        for (int j=0 ; g_stackEffectTable[j].pszMneumonic ; j++)
+        {
+            if (!strcmp(g_stackEffectTable[j].pszMneumonic, instructions[i].mnemonic))
+            {
+                g_stackOps[i] = (UINT8)(j + 1);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+// Returns the name of the first address symbol with the given value (or NULL).
+//
+char *findAddressName(UINT16 nAddr)
+{
+    for (int i=0 ; i<symbolCount ; i++)
+    {
+        if (symbols[i].symbolType == SYMBOL_TYPE_NUMBER_16BIT && symbols[i].u.nsymbolValue16 == nAddr)
+            return symbols[i].symbolName;
+    }
+
+    return NULL;
+}
+
+
+// Returns the target of a branch, jump or call, or -1 if it can't be determined (indexed addressing).
+//
+long getTargetAddress(UINT8 *pImage, UINT16 nAddr, INSTRUCTION *pInst)
+{
+    UINT32 nOperand = nAddr + (pInst->preByte ? 2 : 1);
+
+    // Relative branches (including BRSET/BRCLR) keep the offset in the last byte of the instruction.
+    //
+    if (pInst->addrMode == REL || !strcmp(pInst->mnemonic, "BRSET") || !strcmp(pInst->mnemonic, "BRCLR"))
+        return (UINT16)(nAddr + pInst->numBytes + (signed char)pImage[nAddr + pInst->numBytes - 1]);
+
+    if (pInst->addrMode == EXT)
+        return (UINT16)((pImage[nOperand] << 8) | pImage[(UINT16)(nOperand + 1)]);
+
+    if (pInst->addrMode == DIR)
+        return pImage[nOperand];
+
+    return -1;
+}
+
+
+int analyzeSubroutine(UINT8 *pImage, UINT8 *pWritten, UINT16 nEntry);
+
+
+// Account for a call made at the given stack offset: the return address (or interrupt frame) plus the callee's depth.
+//
+int callDepth(UINT8 *pImage, UINT8 *pWritten, long nTarget, int nOffset, int nFrameSize, UINT8 *pnFlags)
+{
+    if (nTarget < 0)
+    {
+        *pnFlags |= STACK_FLAG_INDIRECT;
+        return nOffset + nFrameSize;
+    }
+
+    if (analyzeSubroutine(pImage, pWritten, (UINT16)nTarget) < 0)
+        return -1;
+
+    *pnFlags |= g_funcFlags[nTarget];
+
+    return nOffset + nFrameSize + g_funcDepth[nTarget];
+}
+
+
+// Walk every path through the subroutine at nEntry, recording the deepest stack use (including the subroutines it
+// calls) in g_funcDepth.  Paths that reach the same instruction with a different stack offset are flagged as unbalanced.
+//
+int analyzeSubroutine(UINT8 *pImage, UINT8 *pWritten, UINT16 nEntry)
+{
+    UINT16 *pWork    = NULL;
+    short  *pOffsets = NULL;
+    UINT16 *pTouched = NULL;
+    int    nWork     = 0;
+    int    nTouched  = 0;
+    int    nDepth    = 0;
+    UINT8  nFlags    = 0;
+    int    nRetVal   = 0;
+
+    if (g_funcState[nEntry] == 2)
+        return 0;
+
+    // A subroutine that is still being analyzed has called itself (directly or indirectly).
+    //
+    if (g_funcState[nEntry] == 1)
+    {
+        g_funcFlags[nEntry] |= STACK_FLAG_RECURSIVE;
+        return 0;
+    }
+    g_funcState[nEntry] = 1;
+
+    // The walk visits each address once, so the work list and the touched list never exceed the address space.  The
+    // offsets are kept per walk since a nested call reuses g_pathOffset.
+    //
+    if (NULL == (pWork = (UINT16 *)malloc(sizeof(UINT16) * MEM_IMAGE_SIZE)) ||
+        NULL == (pOffsets = (short *)malloc(sizeof(short) * MEM_IMAGE_SIZE)) ||
+        NULL == (pTouched = (UINT16 *)malloc(sizeof(UINT16) * MEM_IMAGE_SIZE)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(UINT16) * MEM_IMAGE_SIZE));
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    g_pathOffset[nEntry]  = 0;
+    pTouched[nTouched++]  = nEntry;
+    pWork[nWork]          = nEntry;
+    pOffsets[nWork++]     = 0;
+
+    while (nWork)
+    {
+        UINT16      nAddr;
+        int         nOffset;
+        INSTRUCTION *pInst;
+        STACKEFFECT *pEffect;
+        long        nTarget;
+        int         nCallDepth;
+        int         nNext[2];
+        int         nNextCount = 0;
+
+        --nWork;
+        nAddr   = pWork[nWork];
+        nOffset = pOffsets[nWork];
+
+        if (NULL == (pInst = decodeOpcode(pImage, pWritten, nAddr)))
+        {
+            nFlags |= STACK_FLAG_UNDECODED;
+            continue;
+        }
+
+        pEffect = (g_stackOps[pInst - instructions] ? &g_stackEffectTable[g_stackOps[pInst - instructions] - 1] : NULL);
+        nTarget = getTargetAddress(pImage, nAddr, pInst);
+
+        switch (pEffect ? pEffect->op : STACK_OP_NONE)
+        {
+            case STACK_OP_ADJUST:
+                nOffset += pEffect->bytes;
+                nNext[nNextCount++] = (UINT16)(nAddr + pInst->numBytes);
+                break;
+            case STACK_OP_BRANCH:
+                nNext[nNextCount++] = (int)nTarget;
+                nNext[nNextCount++] = (UINT16)(nAddr + pInst->numBytes);
+                break;
+            case STACK_OP_JUMP:
+                if (nTarget < 0)
+                    nFlags |= STACK_FLAG_INDIRECT;
+                else
+                    nNext[nNextCount++] = (int)nTarget;
+                break;
+            case STACK_OP_CALL:
+                if ((nCallDepth = callDepth(pImage, pWritten, nTarget, nOffset, RETURN_ADDRESS_SIZE, &nFlags)) < 0)
+                {
+                    nRetVal = -1;
+                    goto Exit;
+                }
+                nDepth = (nCallDepth > nDepth ? nCallDepth : nDepth);
+                nNext[nNextCount++] = (UINT16)(nAddr + pInst->numBytes);
+                break;
+            case STACK_OP_SWI:
+                nTarget = (pWritten[SWI_VECTOR] && pWritten[SWI_VECTOR + 1] ? ((pImage[SWI_VECTOR] << 8) | pImage[SWI_VECTOR + 1]) : -1);
+                if ((nCallDepth = callDepth(pImage, pWritten, nTarget, nOffset, INTERRUPT_FRAME_SIZE, &nFlags)) < 0)
+                {
+                    nRetVal = -1;
+                    goto Exit;
+                }
+                nDepth = (nCallDepth > nDepth ? nCallDepth : nDepth);
+                nNext[nNextCount++] = (UINT16)(nAddr + pInst->numBytes);
+                break;
+            case STACK_OP_RETURN:
+                if (nOffset != 0)
+                    nFlags |= STACK_FLAG_UNBALANCED;
+                break;
+            case STACK_OP_LOAD_SP:
+                nOffset = 0;
+                nNext[nNextCount++] = (UINT16)(nAddr + pInst->numBytes);
+                break;
+            case STACK_OP_SET_SP:
+                nFlags |= STACK_FLAG_INDIRECT;
+                nNext[nNextCount++] = (UINT16)(nAddr + pInst->numBytes);
+                break;
+            case STACK_OP_NONE:
+            default:
+                nNext[nNextCount++] = (UINT16)(nAddr + pInst->numBytes);
+                break;
+        }
+
+        nDepth = (nOffset > nDepth ? nOffset : nDepth);
+
+        for (int i=0 ; i<nNextCount ; i++)
+        {
+            if (g_pathOffset[nNext[i]] != UNVISITED)
+            {
+                if (g_pathOffset[nNext[i]] != nOffset)
+                    nFlags |= STACK_FLAG_UNBALANCED;
+                continue;
+            }
+
+            g_pathOffset[nNext[i]] = (short)nOffset;
+            pTouched[nTouched++]   = (UINT16)nNext[i];
+            pWork[nWork]           = (UINT16)nNext[i];
+            pOffsets[nWork++]      = (short)nOffset;
+        }
+    }
+
+Exit:
+
+    // Clear this walk's offsets so the caller's walk (or the next subroutine) starts clean.
+    //
+    if (pTouched)
+    {
+        for (int i=0 ; i<nTouched ; i++)
+            g_pathOffset[pTouched[i]] = UNVISITED;
+    }
+
+    g_funcDepth[nEntry]  = nDepth;
+    g_funcFlags[nEntry] |= nFlags;
+    g_funcState[nEntry]  = 2;
+
+    if (pWork)
+        free(pWork);
+    if (pOffsets)
+        free(pOffsets);
+    if (pTouched)
+        free(pTouched);
+
+    return nRetVal;
+}
+
+
+// Format the flags for a report line.
+//
+void formatStackFlags(UINT8 nFlags, char *pszFlags)
+{
+    *pszFlags = '\0';
+    if (nFlags & STACK_FLAG_RECURSIVE)
+        strcat(pszFlags, "recursive ");
+    if (nFlags & STACK_FLAG_INDIRECT)
+        strcat(pszFlags, "indirect ");
+    if (nFlags & STACK_FLAG_UNBALANCED)
+        strcat(pszFlags, "unbalanced ");
+    if (nFlags & STACK_FLAG_UNDECODED)
+        strcat(pszFlags, "undecoded ");
+}
+
+
+// Append an entry to the listing report and the machine readable report.
+//
+void reportStackEntry(LISTBUFFER *pListing, LISTBUFFER *pReport, char *pszKind, char *pszName, UINT16 nAddr, int nDepth, UINT8 nFlags)
+{
+    char szLine[MAX_LINE_LENGTH];
+    char szFlags[64];
+    char *pszLabel = findAddressName(nAddr);
+
+    formatStackFlags(nFlags, szFlags);
+
+    sprintf(szLine, "%-10s %-8s %15s  $%04X  %5d  %s\r\n", pszKind, pszName, (pszLabel ? pszLabel : ""), nAddr, nDepth, szFlags);
+    appendToBuffer(pListing, szLine);
+
+    for (int i=(int)strlen(szFlags) - 1 ; i >= 0 && szFlags[i] == ' ' ; i--)
+        szFlags[i] = '\0';
+    sprintf(szLine, "%s,%s,%s,%04X,%d,%s\r\n", pszKind, pszName, (pszLabel ? pszLabel : ""), nAddr, nDepth, szFlags);
+    appendToBuffer(pReport, szLine);
+}
+
+
+// Analyze the stack depth of the assembled image from the start address and each interrupt vector.  The report is
+// appended to the listing (if there is one) and written to fpReport (if there is one).  The worst case is the deepest
+// main program path plus the deepest interrupt handler (including its frame), which is checked against nBudget.
+//
+int analyzeStackDepth(UINT8 *pImage, UINT8 *pWritten, UINT16 nStartAddr, int nBudget, int fpListing, int fpReport)
+{
+    int nRetVal = 0;
+    LISTBUFFER listing;
+    LISTBUFFER report;
+    char szLine[MAX_LINE_LENGTH];
+    char szFlags[64];
+    int  nMainDepth = 0;
+    int  nInterruptDepth = 0;
+    UINT8 nWorstFlags = 0;
+    int  nWorst;
+
+    memset(&listing, 0, sizeof(LISTBUFFER));
+    memset(&report, 0, sizeof(LISTBUFFER));
+
+    if (buildDecodeTables() < 0 || buildStackTables() < 0)
+        return -1;
+
+    g_funcDepth  = (int *)calloc(MEM_IMAGE_SIZE, sizeof(int));
+    g_funcFlags  = (UINT8 *)calloc(MEM_IMAGE_SIZE, sizeof(UINT8));
+    g_funcState  = (UINT8 *)calloc(MEM_IMAGE_SIZE, sizeof(UINT8));
+    g_pathOffset = (short *)malloc(MEM_IMAGE_SIZE * sizeof(short));
+    if (!g_funcDepth || !g_funcFlags || !g_funcState || !g_pathOffset)
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(MEM_IMAGE_SIZE * sizeof(int)));
+        nRetVal = -1;
+        goto Exit;
+    }
+    for (int i=0 ; i<MEM_IMAGE_SIZE ; i++)
+        g_pathOffset[i] = UNVISITED;
+
+    appendToBuffer(&listing, "\r\n  STACK DEPTH    ENTRY            LABEL  ADDR   DEPTH  NOTES\r\n");
+    appendToBuffer(&listing, "-----------------------------------------------\r\n");
+    appendToBuffer(&report, "kind,entry,label,address,depth,notes\r\n");
+
+    // The main program, from the start address.
+    //
+    if (0 != (nRetVal = analyzeSubroutine(pImage, pWritten, nStartAddr)))
+        goto Exit;
+    nMainDepth   = g_funcDepth[nStartAddr];
+    nWorstFlags |= g_funcFlags[nStartAddr];
+    reportStackEntry(&listing, &report, "entry", "START", nStartAddr, nMainDepth, g_funcFlags[nStartAddr]);
+
+    // Each interrupt vector that was assembled - handlers run with the 9-byte frame stacked on entry.  Reset starts
+    // with no frame and the software interrupt is already counted on the paths that execute SWI.
+    //
+    for (STACKVECTOR *pVector = g_stackVectors ; pVector->pszName ; pVector++)
+    {
+        UINT16 nHandler;
+        int    nDepth;
+
+        if (!pWritten[pVector->addr] || !pWritten[pVector->addr + 1])
+            continue;
+
+        nHandler = (UINT16)((pImage[pVector->addr] << 8) | pImage[pVector->addr + 1]);
+        if (0 != (nRetVal = analyzeSubroutine(pImage, pWritten, nHandler)))
+            goto Exit;
+
+        nDepth = g_funcDepth[nHandler] + (pVector->addr == RESET_VECTOR ? 0 : INTERRUPT_FRAME_SIZE);
+        reportStackEntry(&listing, &report, "vector", pVector->pszName, nHandler, nDepth, g_funcFlags[nHandler]);
+
+        if (pVector->addr == RESET_VECTOR)
+        {
+            nMainDepth   = (nDepth > nMainDepth ? nDepth : nMainDepth);
+            nWorstFlags |= g_funcFlags[nHandler];
+        }
+        else if (pVector->addr != SWI_VECTOR)
+        {
+            nInterruptDepth = (nDepth > nInterruptDepth ? nDepth : nInterruptDepth);
+            nWorstFlags    |= g_funcFlags[nHandler];
+        }
+    }
+
+    // Every subroutine reached along the way.
+    //
+    for (UINT32 nAddr=0 ; nAddr < MEM_IMAGE_SIZE ; nAddr++)
+    {
+        if (g_funcState[nAddr] && nAddr != nStartAddr)
+            reportStackEntry(&listing, &report, "subroutine", "", (UINT16)nAddr, g_funcDepth[nAddr], g_funcFlags[nAddr]);
+    }
+
+    nWorst = nMainDepth + nInterruptDepth;
+    formatStackFlags(nWorstFlags, szFlags);
+    sprintf(szLine, "%-10s %-8s %15s         %5d  %s\r\n", "worst", "", "", nWorst, szFlags);
+    appendToBuffer(&listing, szLine);
+    for (int i=(int)strlen(szFlags) - 1 ; i >= 0 && szFlags[i] == ' ' ; i--)
+        szFlags[i] = '\0';
+    sprintf(szLine, "worst,,,,%d,%s\r\n", nWorst, szFlags);
+    appendToBuffer(&report, szLine);
+    if (nBudget)
+    {
+        sprintf(szLine, "%-10s %-8s %15s         %5d  %s\r\n", "budget", "", "", nBudget, (nWorst > nBudget ? "EXCEEDED" : ""));
+        appendToBuffer(&listing, szLine);
+        sprintf(szLine, "budget,,,,%d,%s\r\n", nBudget, (nWorst > nBudget ? "exceeded" : ""));
+        appendToBuffer(&report, szLine);
+    }
+
+    printf("Stack depth: %d bytes worst case (main %d + interrupt %d)%s\r\n\n", nWorst, nMainDepth, nInterruptDepth,
+           (nWorstFlags ? " - not bounded, see report" : ""));
+
+    if (fpListing)
+        write(fpListing, listing.pBuffer, listing.length);
+    if (fpReport)
+        write(fpReport, report.pBuffer, report.length);
+
+    if (nBudget && nWorst > nBudget)
+    {
+        printf("ERROR: Worst case stack depth (%d bytes) exceeds the STACK budget (%d bytes)\r\n", nWorst, nBudget);
+        nRetVal = -1;
+    }
+    else if (nBudget && nWorstFlags)
+    {
+        printf("ERROR: Stack depth can't be bounded for the STACK budget (%s)\r\n", szFlags);
+        nRetVal = -1;
+    }
+
+Exit:
+
+    if (listing.pBuffer)
+        free(listing.pBuffer);
+    if (report.pBuffer)
+        free(report.pBuffer);
+    if (g_funcDepth)
+        free(g_funcDepth);
+    if (g_funcFlags)
+        free(g_funcFlags);
+    if (g_funcState)
+        free(g_funcState);
+    if (g_pathOffset)
+        free(g_pathOffset);
+    g_funcDepth  = NULL;
+    g_funcFlags  = NULL;
+    g_funcState  = NULL;
+    g_pathOffset = NULL;
+
+    return nRetVal;
+}
@@ -0,0 +1,8 @@
+//
+//  stack.h
+//  MC68HC11 Assembler
+//
+//  Static stack depth analysis.
+//
+
+int analyzeStackDepth(UINT8 *pImage, UINT8 *pWritten, UINT16 nStartAddr, int nBudget, int fpListing, int fpReport);
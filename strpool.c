@@ -0,0 +1,339 @@
+//
+//  strpool.c
+//  MC68HC11 Assembler
+//
+//  Pooled string sections (STRPOOL/ENDPOOL).  Only FCC strings and their labels may be placed between the directives,
+//  and each string in a section is stored once: a string that repeats another, or (for terminated strings) is the tail of a
+//  longer one, encodes nothing and its label is bound to the copy it shares.  STRPOOL Z terminates every string with a
+//  NUL and STRPOOL H sets the high bit of its last character; a plain STRPOOL only merges exact copies, since an
+//  unterminated string can't end partway through another.
+//
+//  The statement walk lays out a section when it reaches the STRPOOL statement.  The strings kept are placed in source
+//  order, so pass 2 still encodes them line by line at the addresses it steps through.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utility.h"
+#include "strpool.h"
+
+extern POOLSTRING *g_poolStrings;
+extern int g_poolStringCount;
+extern int g_poolStringsAllocated;
+extern void getStatementSpan(SOURCEFILE *pSourceFile, CHUNK *pChunk, STATEMENT *pStmt, char *pszSpan);
+
+int    g_poolSharedCount;       // Strings sharing another string's bytes
+int    g_poolBytesSaved;
+
+typedef struct _poolentry_
+{
+    UINT8     text[MAX_LINE_LENGTH + 1];    // String bytes, with the terminator applied
+    int       length;
+    int       host;             // Entry whose bytes the string is stored in (itself if it's kept)
+    UINT16    addr;             // Address of a kept string
+    STATEMENT *pStmt;
+} POOLENTRY;
+
+POOLENTRY *g_pPoolEntries;      // Section being laid out (for comparePoolEntries())
+
+
+// Order by the text read backwards, so a string comes just ahead of the strings it's the tail of.  Copies of a string
+// are in reverse source order, so the first copy is the one kept.
+//
+int comparePoolEntries(const void *pLeft, const void *pRight)
+{
+    int nLeft  = *(const int *)pLeft;
+    int nRight = *(const int *)pRight;
+    POOLENTRY *pLeftEntry  = &g_pPoolEntries[nLeft];
+    POOLENTRY *pRightEntry = &g_pPoolEntries[nRight];
+
+    for (int i=1 ; i <= pLeftEntry->length && i <= pRightEntry->length ; i++)
+    {
+        UINT8 nLeftChar  = pLeftEntry->text[pLeftEntry->length - i];
+        UINT8 nRightChar = pRightEntry->text[pRightEntry->length - i];
+
+        if (nLeftChar != nRightChar)
+            return (nLeftChar < nRightChar ? -1 : 1);
+    }
+
+    if (pLeftEntry->length != pRightEntry->length)
+        return (pLeftEntry->length < pRightEntry->length ? -1 : 1);
+
+    return (nLeft > nRight ? -1 : (nLeft < nRight ? 1 : 0));
+}
+
+
+// Returns true if a string can be stored in another one's bytes - as a copy, or as its tail if the section's strings are
+// terminated.
+//
+bool isSharedString(POOLENTRY *pEntry, POOLENTRY *pHost, UINT8 nTerminator)
+{
+    if (pEntry->length > pHost->length || (nTerminator == STRPOOL_PLAIN && pEntry->length != pHost->length))
+        return false;
+
+    return !memcmp(pEntry->text, (pHost->text + pHost->length - pEntry->length), pEntry->length);
+}
+
+
+// Append a string to the pool list.
+//
+int addPoolString(STATEMENT *pStmt, UINT8 nTerminator, bool fShared, UINT16 nAddr)
+{
+    if (g_poolStringCount == g_poolStringsAllocated)
+    {
+        int nNewCount = (g_poolStringsAllocated ? g_poolStringsAllocated * 2 : 64);
+        POOLSTRING *pTemp;
+
+        if (NULL == (pTemp = (POOLSTRING *)realloc(g_poolStrings, (sizeof(POOLSTRING) * nNewCount))))
+        {
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(POOLSTRING) * nNewCount));
+            return -1;
+        }
+        g_poolStrings          = pTemp;
+        g_poolStringsAllocated = nNewCount;
+    }
+
+    g_poolStrings[g_poolStringCount].lineOffset = pStmt->lineOffset;
+    g_poolStrings[g_poolStringCount].macroLine  = pStmt->macroLine;
+    g_poolStrings[g_poolStringCount].terminator = nTerminator;
+    g_poolStrings[g_poolStringCount].fShared    = fShared;
+    g_poolStrings[g_poolStringCount].addr       = nAddr;
+    g_poolStringCount++;
+
+    return 0;
+}
+
+
+// Lay out the pooled section starting at a STRPOOL statement, with its first string at nAddr, and add its strings to
+// the pool list.  The walk then takes each string's size and address from the list as it reaches it.
+//
+int layoutStringPool(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks, int nChunk, int nStmt, int nLineBase, UINT16 nAddr)
+{
+    UINT8     nTerminator = (UINT8)pChunks[nChunk].pStatements[nStmt].value;
+    int       nPoolLine   = nLineBase + pChunks[nChunk].pStatements[nStmt].lineNumber;
+    POOLENTRY *pEntries   = NULL;
+    int       *pOrder     = NULL;
+    int       nEntries    = 0;
+    int       nAllocated  = 0;
+    int       nRetVal     = 0;
+    bool      fEnd        = false;
+
+    // Collect the strings up to the ENDPOOL.  A parse error stops the section short - the walk reports it on the way.
+    //
+    while (!fEnd)
+    {
+        STATEMENT *pStmt;
+        STATEMENT *pNext;
+
+        while (++nStmt >= pChunks[nChunk].statementCount)
+        {
+            nLineBase += pChunks[nChunk].lineCount;
+            if (++nChunk >= nChunks)
+            {
+                printf("ERROR: STRPOOL on line %d has no ENDPOOL\r\n", nPoolLine);
+                nRetVal = -1;
+                goto Exit;
+            }
+            nStmt = -1;
+        }
+        pStmt = &pChunks[nChunk].pStatements[nStmt];
+        pNext = (nStmt + 1 < pChunks[nChunk].statementCount ? pStmt + 1 : NULL);
+
+        switch (pStmt->kind)
+        {
+            case STMT_ENDPOOL:
+            case STMT_ERROR:
+                fEnd = true;
+                break;
+
+            case STMT_EQU:
+            case STMT_EQU_STRING:
+                break;
+
+            case STMT_LABEL:
+                if (NULL == pNext || pNext->kind != STMT_STRING || pNext->lineOffset != pStmt->lineOffset || pNext->macroLine != pStmt->macroLine)
+                {
+                    printf("ERROR: Label on line %d doesn\'t name an FCC string in the string pool\r\n", nLineBase + pStmt->lineNumber);
+                    nRetVal = -1;
+                    goto Exit;
+                }
+                break;
+
+            case STMT_STRING:
+            {
+                POOLENTRY *pEntry;
+
+                if (nEntries == nAllocated)
+                {
+                    int       nNewCount = (nAllocated ? nAllocated * 2 : 64);
+                    POOLENTRY *pTemp;
+
+                    if (NULL == (pTemp = (POOLENTRY *)realloc(pEntries, (sizeof(POOLENTRY) * nNewCount))))
+                    {
+                        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(POOLENTRY) * nNewCount));
+                        nRetVal = -1;
+                        goto Exit;
+                    }
+                    pEntries   = pTemp;
+                    nAllocated = nNewCount;
+                }
+
+                pEntry = &pEntries[nEntries++];
+                getStatementSpan(pSourceFile, &pChunks[nChunk], pStmt, (char *)pEntry->text);
+                pEntry->length = pStmt->spanLength;
+                pEntry->host   = nEntries - 1;
+                pEntry->pStmt  = pStmt;
+
+                if (nTerminator == STRPOOL_NUL)
+                    pEntry->text[pEntry->length++] = '\0';
+                else if (nTerminator == STRPOOL_HIGH_BIT)
+                    pEntry->text[pEntry->length - 1] |= 0x80;
+                break;
+            }
+
+            default:
+                printf("ERROR: Only FCC strings and their labels can be placed in a string pool (line %d)\r\n", nLineBase + pStmt->lineNumber);
+                nRetVal = -1;
+                goto Exit;
+        }
+    }
+
+    if (0 == nEntries)
+        goto Exit;
+
+    if (NULL == (pOrder = (int *)malloc(sizeof(int) * nEntries)))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(int) * nEntries));
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    // The strings a string can be stored in come right after it in the sorted order, so the kept string each one ends up
+    // in is found with a single backwards pass.
+    //
+    for (int i=0 ; i<nEntries ; i++)
+        pOrder[i] = i;
+    g_pPoolEntries = pEntries;
+    qsort(pOrder, nEntries, sizeof(int), comparePoolEntries);
+
+    for (int i=nEntries-2 ; i >= 0 ; i--)
+    {
+        if (isSharedString(&pEntries[pOrder[i]], &pEntries[pOrder[i + 1]], nTerminator))
+            pEntries[pOrder[i]].host = pEntries[pOrder[i + 1]].host;
+    }
+
+    // The kept strings follow one another in source order, and a shared string is bound to the tail of the string it's
+    // stored in (which may come after it).
+    //
+    for (int i=0 ; i<nEntries ; i++)
+    {
+        if (pEntries[i].host == i)
+        {
+            pEntries[i].addr = nAddr;
+            nAddr += pEntries[i].length;
+        }
+    }
+
+    for (int i=0 ; i<nEntries && !nRetVal ; i++)
+    {
+        POOLENTRY *pHost  = &pEntries[pEntries[i].host];
+        bool      fShared = (pEntries[i].host != i);
+
+        nRetVal = addPoolString(pEntries[i].pStmt, nTerminator, fShared, (UINT16)(pHost->addr + pHost->length - pEntries[i].length));
+        if (fShared)
+        {
+            g_poolSharedCount++;
+            g_poolBytesSaved += pEntries[i].length;
+        }
+    }
+
+Exit:
+
+    if (pEntries)
+        free(pEntries);
+    if (pOrder)
+        free(pOrder);
+
+    return nRetVal;
+}
+
+
+// Returns the pool list entry for a line, or -1 if the line isn't a pooled string (binary search).
+//
+int findPoolString(POOLSTRING *pStrings, int nCount, int nLineOffset, int nMacroLine)
+{
+    int nLow  = 0;
+    int nHigh = nCount - 1;
+
+    while (nLow <= nHigh)
+    {
+        int nMid = (nLow + nHigh) / 2;
+
+        if (pStrings[nMid].lineOffset == nLineOffset && pStrings[nMid].macroLine == nMacroLine)
+            return nMid;
+
+        if (pStrings[nMid].lineOffset < nLineOffset || (pStrings[nMid].lineOffset == nLineOffset && pStrings[nMid].macroLine < nMacroLine))
+            nLow = nMid + 1;
+        else
+            nHigh = nMid - 1;
+    }
+
+    return -1;
+}
+
+
+// Returns true if a source line, or any line of the macro expansion it starts, is a pooled string.
+//
+bool isPooledLine(POOLSTRING *pStrings, int nCount, int nLineOffset)
+{
+    int nLow  = 0;
+    int nHigh = nCount - 1;
+
+    while (nLow <= nHigh)
+    {
+        int nMid = (nLow + nHigh) / 2;
+
+        if (pStrings[nMid].lineOffset == nLineOffset)
+            return true;
+
+        if (pStrings[nMid].lineOffset < nLineOffset)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid - 1;
+    }
+
+    return false;
+}
+
+
+// Forget the strings laid out by a statement walk, so the statements can be walked again.
+//
+void resetStringPools(void)
+{
+    g_poolStringCount = 0;
+    g_poolSharedCount = 0;
+    g_poolBytesSaved  = 0;
+}
+
+
+void freeStringPools(void)
+{
+    if (g_poolStrings)
+        free(g_poolStrings);
+    g_poolStrings          = NULL;
+    g_poolStringsAllocated = 0;
+
+    resetStringPools();
+}
+
+
+// Print the ROM bytes saved by sharing pooled strings.
+//
+void reportStringPools(void)
+{
+    printf("String pools: %d strings, %d shared, %d bytes saved\r\n\n", g_poolStringCount, g_poolSharedCount, g_poolBytesSaved);
+}
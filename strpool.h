@@ -0,0 +1,13 @@
+//
+//  strpool.h
+//  MC68HC11 Assembler
+//
+//  Pooled string sections (STRPOOL/ENDPOOL).
+//
+
+int layoutStringPool(SOURCEFILE *pSourceFile, CHUNK *pChunks, int nChunks, int nChunk, int nStmt, int nLineBase, UINT16 nAddr);
+int findPoolString(POOLSTRING *pStrings, int nCount, int nLineOffset, int nMacroLine);
+bool isPooledLine(POOLSTRING *pStrings, int nCount, int nLineOffset);
+void resetStringPools(void);
+void freeStringPools(void);
+void reportStringPools(void);
@@ -0,0 +1,302 @@
+//
+//  symfile.c
+//  MC68HC11 Assembler
+//
+//  Sorted symbol output: the text symbol file and the binary debug symbol file.  The debug file carries the symbols
+//  sorted by name plus an index of the address symbols sorted by value, so a debugger can mmap it and binary search
+//  either way without parsing anything.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utility.h"
+#include "symfile.h"
+
+extern SYMBOL symbols[];
+extern UINT16 symbolCount;
+
+
+// Symbol lookup ignores case, so that's the primary sort order - the case sensitive compare only breaks ties.
+//
+int compareSymbolNames(const void *pLeft, const void *pRight)
+{
+    const char *pszLeft  = symbols[*(const UINT16 *)pLeft].symbolName;
+    const char *pszRight = symbols[*(const UINT16 *)pRight].symbolName;
+    int nResult = strncasecmp(pszLeft, pszRight, MAX_SYMBOL_NAME_LENGTH);
+
+    return (nResult ? nResult : strncmp(pszLeft, pszRight, MAX_SYMBOL_NAME_LENGTH));
+}
+
+
+// Returns the symbol table indexes sorted by name (the caller frees the array).
+//
+UINT16 *sortSymbolsByName(void)
+{
+    UINT16 *pIndex;
+
+    if (NULL == (pIndex = (UINT16 *)malloc(sizeof(UINT16) * (symbolCount ? symbolCount : 1))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(UINT16) * symbolCount));
+        return NULL;
+    }
+
+    for (int i=0 ; i<symbolCount ; i++)
+        pIndex[i] = (UINT16)i;
+    qsort(pIndex, symbolCount, sizeof(UINT16), compareSymbolNames);
+
+    return pIndex;
+}
+
+
+// Write the text symbol file, sorted by name.
+//
+int writeSymbolFile(int fpSymbols)
+{
+    LISTBUFFER text;
+    char   szTempString[MAX_LINE_LENGTH * 2];
+    UINT16 *pIndex;
+    int    nRetVal = 0;
+
+    if (NULL == (pIndex = sortSymbolsByName()))
+        return -1;
+
+    memset(&text, 0, sizeof(LISTBUFFER));
+
+    sprintf(szTempString, "  SYMBOL NAME    VALUE            [Total=%d]\r\n", (symbolCount));
+    appendToBuffer(&text, szTempString);
+    sprintf(szTempString, "-----------------------------------------------\r\n");
+    appendToBuffer(&text, szTempString);
+
+    for (int i=0 ; i<symbolCount ; i++)
+    {
+        SYMBOL *pSymbol = &symbols[pIndex[i]];
+
+        switch(pSymbol->symbolType)
+        {
+            case SYMBOL_TYPE_STRING:
+                sprintf(szTempString, "%15s, %30s\r\n", pSymbol->symbolName, pSymbol->u.symbolValueStr);
+                break;
+            case SYMBOL_TYPE_NUMBER_8BIT:
+                sprintf(szTempString, "%15s, 0x%02x\r\n", pSymbol->symbolName, pSymbol->u.nsymbolValue8);
+                break;
+            case SYMBOL_TYPE_NUMBER_16BIT:
+                sprintf(szTempString, "%15s, 0x%04x\r\n", pSymbol->symbolName, pSymbol->u.nsymbolValue16);
+                break;
+            default:
+                continue;
+        }
+        appendToBuffer(&text, szTempString);
+    }
+
+    if (text.length && write(fpSymbols, text.pBuffer, text.length) != text.length)
+    {
+        printf("ERROR: Symbol file write failed\r\n");
+        nRetVal = -1;
+    }
+
+    if (text.pBuffer)
+        free(text.pBuffer);
+    free(pIndex);
+
+    return nRetVal;
+}
+
+
+// Value order for the address index, with the name order breaking ties (the records are already in name order).
+//
+SNAPSHOTSYMBOL *g_pSortRecords;
+
+int compareRecordValues(const void *pLeft, const void *pRight)
+{
+    UINT16 nLeft  = *(const UINT16 *)pLeft;
+    UINT16 nRight = *(const UINT16 *)pRight;
+
+    if (g_pSortRecords[nLeft].value != g_pSortRecords[nRight].value)
+        return (g_pSortRecords[nLeft].value < g_pSortRecords[nRight].value ? -1 : 1);
+
+    return (nLeft < nRight ? -1 : (nLeft > nRight ? 1 : 0));
+}
+
+
+// Write the binary debug symbol file:
+//
+//   DEBUGHEADER
+//   SNAPSHOTSYMBOL[symbolCount]    - sorted by name (case insensitive), string values are string pool offsets
+//   UINT16[addressCount]           - record numbers of the 16-bit (address) symbols, sorted by value
+//   string pool
+//
+int writeDebugSymbols(int fpDebug)
+{
+    DEBUGHEADER    header;
+    SNAPSHOTSYMBOL *pRecords = NULL;
+    UINT16         *pIndex   = NULL;
+    UINT16         *pAddress = NULL;
+    UINT16         nAddressCount = 0;
+    LISTBUFFER     pool;
+    int            nRetVal = 0;
+
+    memset(&pool, 0, sizeof(LISTBUFFER));
+
+    if (NULL == (pIndex = sortSymbolsByName()))
+        return -1;
+
+    if (NULL == (pRecords = (SNAPSHOTSYMBOL *)calloc((symbolCount ? symbolCount : 1), sizeof(SNAPSHOTSYMBOL))) ||
+        NULL == (pAddress = (UINT16 *)malloc(sizeof(UINT16) * (symbolCount ? symbolCount : 1))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(SNAPSHOTSYMBOL) * symbolCount));
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    for (int i=0 ; i<symbolCount ; i++)
+    {
+        SYMBOL *pSymbol = &symbols[pIndex[i]];
+
+        strncpy(pRecords[i].symbolName, pSymbol->symbolName, MAX_SYMBOL_NAME_LENGTH);
+        pRecords[i].symbolType = (UINT16)pSymbol->symbolType;
+
+        switch(pSymbol->symbolType)
+        {
+            case SYMBOL_TYPE_NUMBER_8BIT:
+                pRecords[i].value = pSymbol->u.nsymbolValue8;
+                break;
+            case SYMBOL_TYPE_NUMBER_16BIT:
+                pRecords[i].value = pSymbol->u.nsymbolValue16;
+                pAddress[nAddressCount++] = (UINT16)i;
+                break;
+            case SYMBOL_TYPE_STRING:
+                if (pool.length > 0xFFFF)
+                {
+                    printf("ERROR: Debug symbol string pool is too large (symbol \'%s\')\r\n", pSymbol->symbolName);
+                    nRetVal = -1;
+                    goto Exit;
+                }
+                pRecords[i].value = (UINT16)pool.length;
+
+                // Keep the terminator in the pool so each string can be used in place.
+                //
+                if (appendToBuffer(&pool, pSymbol->u.symbolValueStr) || appendToBuffer(&pool, " "))
+                {
+                    nRetVal = -1;
+                    goto Exit;
+                }
+                pool.pBuffer[pool.length - 1] = '\0';
+                break;
+            default:
+                break;
+        }
+    }
+
+    g_pSortRecords = pRecords;
+    qsort(pAddress, nAddressCount, sizeof(UINT16), compareRecordValues);
+
+    memset(&header, 0, sizeof(DEBUGHEADER));
+    strncpy(header.magic, DEBUG_MAGIC, sizeof(header.magic));
+    header.version            = DEBUG_VERSION;
+    header.byteOrder          = SNAPSHOT_BYTE_ORDER;
+    header.headerSize         = sizeof(DEBUGHEADER);
+    header.recordSize         = sizeof(SNAPSHOTSYMBOL);
+    header.symbolCount        = symbolCount;
+    header.addressCount       = nAddressCount;
+    header.recordOffset       = sizeof(DEBUGHEADER);
+    header.addressIndexOffset = header.recordOffset + (sizeof(SNAPSHOTSYMBOL) * symbolCount);
+    header.stringPoolOffset   = header.addressIndexOffset + (sizeof(UINT16) * nAddressCount);
+    header.stringPoolSize     = pool.length;
+
+    if (write(fpDebug, &header, sizeof(DEBUGHEADER)) != sizeof(DEBUGHEADER) ||
+        write(fpDebug, pRecords, (sizeof(SNAPSHOTSYMBOL) * symbolCount)) != (ssize_t)(sizeof(SNAPSHOTSYMBOL) * symbolCount) ||
+        write(fpDebug, pAddress, (sizeof(UINT16) * nAddressCount)) != (ssize_t)(sizeof(UINT16) * nAddressCount) ||
+        (pool.length && write(fpDebug, pool.pBuffer, pool.length) != pool.length))
+    {
+        printf("ERROR: Debug symbol file write failed\r\n");
+        nRetVal = -1;
+    }
+
+Exit:
+
+    if (pool.pBuffer)
+        free(pool.pBuffer);
+    if (pRecords)
+        free(pRecords);
+    if (pAddress)
+        free(pAddress);
+    free(pIndex);
+
+    return nRetVal;
+}
+
+
+// Check that a mapped debug symbol file was written by this version on a host with the same byte order, and that its
+// sections fit in the file.
+//
+bool isValidDebugFile(const void *pFile, UINT32 nFileSize)
+{
+    const DEBUGHEADER *pHeader = (const DEBUGHEADER *)pFile;
+
+    return (nFileSize >= sizeof(DEBUGHEADER) && !strncmp(pHeader->magic, DEBUG_MAGIC, sizeof(pHeader->magic)) &&
+            pHeader->version == DEBUG_VERSION && pHeader->byteOrder == SNAPSHOT_BYTE_ORDER &&
+            pHeader->headerSize == sizeof(DEBUGHEADER) && pHeader->recordSize == sizeof(SNAPSHOTSYMBOL) &&
+            pHeader->addressCount <= pHeader->symbolCount &&
+            pHeader->recordOffset + ((UINT32)sizeof(SNAPSHOTSYMBOL) * pHeader->symbolCount) <= pHeader->addressIndexOffset &&
+            pHeader->addressIndexOffset + ((UINT32)sizeof(UINT16) * pHeader->addressCount) <= pHeader->stringPoolOffset &&
+            pHeader->stringPoolOffset + pHeader->stringPoolSize <= nFileSize);
+}
+
+
+// Binary search the name-sorted records of a mapped debug symbol file (NULL if the name isn't there).
+//
+const SNAPSHOTSYMBOL *findDebugSymbolByName(const void *pFile, const char *pszName)
+{
+    const DEBUGHEADER    *pHeader  = (const DEBUGHEADER *)pFile;
+    const SNAPSHOTSYMBOL *pRecords = (const SNAPSHOTSYMBOL *)((const char *)pFile + pHeader->recordOffset);
+    int nLow  = 0;
+    int nHigh = pHeader->symbolCount - 1;
+
+    while (nLow <= nHigh)
+    {
+        int nMiddle = (nLow + nHigh) / 2;
+        int nResult = strncasecmp(pszName, pRecords[nMiddle].symbolName, MAX_SYMBOL_NAME_LENGTH);
+
+        if (0 == nResult)
+            return &pRecords[nMiddle];
+        if (nResult < 0)
+            nHigh = nMiddle - 1;
+        else
+            nLow = nMiddle + 1;
+    }
+
+    return NULL;
+}
+
+
+// Binary search the value index of a mapped debug symbol file for the symbol at, or closest below, an address (NULL
+// if every 16-bit symbol is above it).  A debugger shows code addresses as <symbol>+<offset> this way.
+//
+const SNAPSHOTSYMBOL *findDebugSymbolByAddress(const void *pFile, UINT16 nAddr)
+{
+    const DEBUGHEADER    *pHeader  = (const DEBUGHEADER *)pFile;
+    const SNAPSHOTSYMBOL *pRecords = (const SNAPSHOTSYMBOL *)((const char *)pFile + pHeader->recordOffset);
+    const UINT16         *pIndex   = (const UINT16 *)((const char *)pFile + pHeader->addressIndexOffset);
+    int nLow   = 0;
+    int nHigh  = pHeader->addressCount - 1;
+    int nFound = -1;
+
+    while (nLow <= nHigh)
+    {
+        int nMiddle = (nLow + nHigh) / 2;
+
+        if (pRecords[pIndex[nMiddle]].value <= nAddr)
+        {
+            nFound = nMiddle;
+            nLow   = nMiddle + 1;
+        }
+        else
+            nHigh = nMiddle - 1;
+    }
+
+    return (nFound >= 0 ? &pRecords[pIndex[nFound]] : NULL);
+}
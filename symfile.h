@@ -0,0 +1,13 @@
+//
+//  symfile.h
+//  MC68HC11 Assembler
+//
+//  Sorted text symbol file and binary debug symbol file.
+//
+
+UINT16 *sortSymbolsByName(void);
+int writeSymbolFile(int fpSymbols);
+int writeDebugSymbols(int fpDebug);
+bool isValidDebugFile(const void *pFile, UINT32 nFileSize);
+const SNAPSHOTSYMBOL *findDebugSymbolByName(const void *pFile, const char *pszName);
+const SNAPSHOTSYMBOL *findDebugSymbolByAddress(const void *pFile, UINT16 nAddr);
@@ -16,16 +16,43 @@
 #include <sys/types.h>
 
 #include "common.h"
+#include "cond.h"
+#include "macro.h"
 
 
 int getNextFileLine(SOURCEFILE *pSourceFile, char *pLine, int nMaxLineLength)
 {
+    int nRetVal;
+    
+    // The lines of a macro expansion come ahead of the next source line (even at the end of a chunk or region).
+    //
+    if (pSourceFile->pMacroState && pSourceFile->pMacroState->depth &&
+        (nRetVal = getNextMacroLine(pSourceFile, pLine, nMaxLineLength)) <= 0)
+        return nRetVal;
+    pSourceFile->macroLine = 0;
     
     // If we've already processed the file to the end, return EOF.
     //
     if (pSourceFile->fEOF)
         return EOF;
     
+    // Step over any lines disabled by conditional assembly - they may run to the end of what's left to read.
+    //
+    if (pSourceFile->condSpanCount)
+    {
+        skipDisabledLines(pSourceFile);
+        if (pSourceFile->byteOffset >= pSourceFile->fileSize)
+        {
+            pSourceFile->fEOF = true;
+            return EOF;
+        }
+    }
+    
+    // Remember where this line starts so callers can split the file at line boundaries.
+    //
+    pSourceFile->lineOffset = pSourceFile->byteOffset;
+    pSourceFile->lineStart  = pSourceFile->lineNumber;
+    
     // Loop through the file as long as there are bytes to read.
     //
     while ((pSourceFile->byteOffset < pSourceFile->fileSize) && (nMaxLineLength > 0))
@@ -84,6 +111,36 @@ int getFirstFileLine(SOURCEFILE *pSourceFile, char *pLine, int nMaxLineLength)
 }
 
 
+int appendToBuffer(LISTBUFFER *pBuffer, char *pszString)
+{
+    int nLength = (int)strlen(pszString);
+    
+    // Grow the buffer geometrically so appending a line is amortized constant time.
+    //
+    if (pBuffer->length + nLength + 1 > pBuffer->bufferSize)
+    {
+        int  nNewSize = (pBuffer->bufferSize ? pBuffer->bufferSize * 2 : 4096);
+        char *pTemp;
+        
+        while (nNewSize < pBuffer->length + nLength + 1)
+            nNewSize *= 2;
+        
+        if (NULL == (pTemp = (char *)realloc(pBuffer->pBuffer, nNewSize)))
+        {
+            printf("ERROR: Memory allocation failed (%d bytes)\r\n", nNewSize);
+            return -1;
+        }
+        pBuffer->pBuffer    = pTemp;
+        pBuffer->bufferSize = nNewSize;
+    }
+    
+    memcpy((pBuffer->pBuffer + pBuffer->length), pszString, nLength + 1);
+    pBuffer->length += nLength;
+    
+    return 0;
+}
+
+
 void trimTrailingWhitespace(char *pszString)
 {
     for (int i=0 ; pszString[i] != '\0' ; i++)
@@ -131,6 +188,36 @@ bool isValidSymbolName(char *pszToken)
 }
 
 
+// Copy a symbol name into a MAX_SYMBOL_NAME_LENGTH buffer, truncated to fit and always terminated (the source
+// needn't be - statement and snapshot names fill the whole field when they're at the limit).
+//
+void copySymbolName(char *pszDest, const char *pszName)
+{
+    size_t nLength = strnlen(pszName, MAX_SYMBOL_NAME_LENGTH - 1);
+    
+    memcpy(pszDest, pszName, nLength);
+    pszDest[nLength] = '\0';
+}
+
+
+// Number of values in a comma-separated list, or -1 if any of them is empty (a leading, trailing or doubled comma).
+//
+int countListValues(char *pszList)
+{
+    int nCount = 1;
+    
+    for (char *pTemp = pszList ; *pTemp != '\0' ; pTemp++)
+    {
+        if (*pTemp == ',')
+            nCount++;
+        if (*pTemp == ',' && (pTemp == pszList || *(pTemp + 1) == ',' || *(pTemp + 1) == '\0'))
+            return -1;
+    }
+    
+    return nCount;
+}
+
+
 bool isValidNumber(char *pszToken)
 {
     bool fisHexNumber = false;
@@ -262,3 +349,159 @@ int convertToNumber(char *pszToken, UINT16 *pnNumber)
     return 0;
 }
 
+
+// Parse a "<first>,<last>" address range operand (LOCALRAM, BANKWINDOW).
+//
+int parseAddressRange(char *pszOperand, UINT16 *pnStart, UINT16 *pnEnd)
+{
+    char szOperand[MAX_LINE_LENGTH];
+    char *pszEnd;
+
+    if (NULL == pszOperand)
+        return -1;
+
+    strncpy(szOperand, pszOperand, MAX_LINE_LENGTH - 1);
+    szOperand[MAX_LINE_LENGTH - 1] = '\0';
+    if (NULL == (pszEnd = strchr(szOperand, ',')))
+        return -1;
+    *pszEnd++ = '\0';
+
+    if (convertToNumber(szOperand, pnStart) || convertToNumber(pszEnd, pnEnd) || *pnEnd < *pnStart)
+        return -1;
+
+    return 0;
+}
+
+
+// Read everything from a file descriptor into an allocated buffer.  The buffer grows as data arrives, so this works for
+// pipes and terminals (where the size isn't known up front) as well as files, and stops at maxSize bytes.
+//
+int readFileContents(int fpFile, char **ppBuffer, int *pnSize, int nMaxSize)
+{
+    char    *pBuffer = NULL;
+    int     nAllocated = 0;
+    int     nSize = 0;
+    ssize_t nRead;
+
+    do
+    {
+        // One byte past the limit is allowed in, so an input of exactly maxSize bytes can be told from a larger one.
+        //
+        if (nSize == nAllocated)
+        {
+            int  nNewSize = (nAllocated ? nAllocated * 2 : SOURCE_READ_SIZE);
+            char *pTemp;
+
+            if (nNewSize > nMaxSize + 1)
+                nNewSize = nMaxSize + 1;
+
+            if (NULL == (pTemp = (char *)realloc(pBuffer, nNewSize + 1)))
+            {
+                printf("ERROR: Memory allocation failed (%d bytes)\r\n", nNewSize + 1);
+                free(pBuffer);
+                return -1;
+            }
+            pBuffer    = pTemp;
+            nAllocated = nNewSize;
+        }
+
+        if ((nRead = read(fpFile, pBuffer + nSize, nAllocated - nSize)) < 0)
+        {
+            printf("ERROR: Read failed\r\n");
+            free(pBuffer);
+            return -1;
+        }
+        nSize += (int)nRead;
+
+        if (nSize > nMaxSize)
+        {
+            printf("ERROR: Input is larger than %d bytes\r\n", nMaxSize);
+            free(pBuffer);
+            return -1;
+        }
+    } while (nRead > 0);
+
+    pBuffer[nSize] = '\0';
+    *ppBuffer = pBuffer;
+    *pnSize   = nSize;
+
+    return 0;
+}
+
+
+// Build an output file name from a base name: any extension on the base is replaced with the suffix and extension.
+//
+void makeOutputFileName(char *pszFileName, int nMaxLength, const char *pszBaseName, const char *pszSuffix, const char *pszExtension)
+{
+    const char *pszDot   = strrchr(pszBaseName, '.');
+    const char *pszSlash = strrchr(pszBaseName, '/');
+    int nBaseLength = (int)strlen(pszBaseName);
+
+    // Only a dot in the last path component (and not leading it, as in "./foo" or ".hidden") starts an extension.
+    //
+    if (pszDot && pszDot > pszBaseName && (NULL == pszSlash || pszDot > pszSlash + 1))
+        nBaseLength = (int)(pszDot - pszBaseName);
+
+    snprintf(pszFileName, nMaxLength, "%.*s%s.%s", nBaseLength, pszBaseName, pszSuffix, pszExtension);
+}
+
+
+// Open an output file: "-" is standard output, "fd:<n>" is a file descriptor inherited from the caller and anything
+// else is a path.  Once standard output carries a file, console messages are moved to standard error.
+//
+int openOutputFile(const char *pszPath, const char *pszDescription)
+{
+    static bool fStdoutUsed = false;
+    int fpOutput;
+
+    if (!strcmp(pszPath, "-"))
+    {
+        if (fStdoutUsed)
+        {
+            printf("ERROR: Only one output can be written to standard output (%s)\r\n", pszDescription);
+            return -1;
+        }
+        fStdoutUsed = true;
+
+        fflush(stdout);
+        if ((fpOutput = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        {
+            printf("ERROR: %s open failed (standard output)\r\n", pszDescription);
+            return -1;
+        }
+        return fpOutput;
+    }
+
+    if (!strncmp(pszPath, "fd:", 3))
+    {
+        char *pszEnd;
+        long nDescriptor = strtol(pszPath + 3, &pszEnd, 10);
+
+        if (pszPath[3] == '\0' || *pszEnd != '\0' || nDescriptor <= STDERR_FILENO || fcntl((int)nDescriptor, F_GETFD) < 0)
+        {
+            printf("ERROR: %s open failed (%s is not an open file descriptor)\r\n", pszDescription, pszPath);
+            return -1;
+        }
+        return (int)nDescriptor;
+    }
+
+    if ((fpOutput = open(pszPath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)) < 0)
+        printf("ERROR: %s open failed (%s)\r\n", pszDescription, pszPath);
+
+    return fpOutput;
+}
+
+
+// Open an output file at the path given on the command line, or named after the base name with a new extension.
+//
+int openDerivedFile(const char *pszPath, const char *pszBaseName, const char *pszExtension, const char *pszDescription)
+{
+    char szFileName[MAX_LINE_LENGTH];
+
+    if (pszPath)
+        return openOutputFile(pszPath, pszDescription);
+
+    makeOutputFileName(szFileName, sizeof(szFileName), pszBaseName, "", pszExtension);
+
+    return openOutputFile(szFileName, pszDescription);
+}
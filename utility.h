@@ -8,6 +8,7 @@
 
 int getNextFileLine(SOURCEFILE *pSourceFile, char *pLine, int nMaxLineLength);
 int getFirstFileLine(SOURCEFILE *pSourceFile, char *pLine, int nMaxLineLength);
+int appendToBuffer(LISTBUFFER *pBuffer, char *pszString);
 void trimTrailingWhitespace(char *pszString);
 
 bool isCommentLine(char *pszLine);
@@ -15,7 +16,14 @@ bool isBlankLine(char *pszLine);
 bool isSymbolLine(char *pszLine);
 
 bool isValidSymbolName(char *pszToken);
+void copySymbolName(char *pszDest, const char *pszName);
 bool isValidNumber(char *pszToken);
+int countListValues(char *pszList);
 bool isIndirectParams(char *pszParamString, char *pszValue, ADDRMODE *paddrMode);
 
-int convertToNumber(char *pszToken, UINT16 *pnNumber);
\ No newline at end of file
+int convertToNumber(char *pszToken, UINT16 *pnNumber);
+int parseAddressRange(char *pszOperand, UINT16 *pnStart, UINT16 *pnEnd);
+int readFileContents(int fpFile, char **ppBuffer, int *pnSize, int nMaxSize);
+void makeOutputFileName(char *pszFileName, int nMaxLength, const char *pszBaseName, const char *pszSuffix, const char *pszExtension);
+int openOutputFile(const char *pszPath, const char *pszDescription);
+int openDerivedFile(const char *pszPath, const char *pszBaseName, const char *pszExtension, const char *pszDescription);
@@ -0,0 +1,156 @@
+//
+//  watch.c
+//  MC68HC11 Assembler
+//
+//  Watch mode (--watch) - waits for the source file to change so it can be re-assembled.  On Linux the directory is
+//  watched with inotify (editors often save by writing a new file and renaming it over the old one); everywhere else
+//  the file's modification time and size are polled.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "common.h"
+#include "watch.h"
+
+char   g_szWatchFile[MAX_LINE_LENGTH];  // Source file being watched
+char   g_szWatchName[MAX_LINE_LENGTH];  // Source file name without the directory (inotify events)
+int    g_watchFd = -1;                  // inotify descriptor
+struct stat g_watchStat;                // Source file state when last seen (polling)
+
+
+// Start watching the source file.
+//
+int beginWatch(const char *pszFileName)
+{
+    char szDirectory[MAX_LINE_LENGTH];
+    char szName[MAX_LINE_LENGTH];
+
+    // basename() and dirname() may modify the string they're given, so each gets its own copy.
+    //
+    strncpy(g_szWatchFile, pszFileName, MAX_LINE_LENGTH - 1);
+    strcpy(szDirectory, g_szWatchFile);
+    strcpy(szName, g_szWatchFile);
+    strncpy(g_szWatchName, basename(szName), MAX_LINE_LENGTH - 1);
+
+    if (stat(g_szWatchFile, &g_watchStat) < 0)
+    {
+        printf("ERROR: Source file not found (%s)\r\n", g_szWatchFile);
+        return -1;
+    }
+
+#ifdef __linux__
+    if ((g_watchFd = inotify_init()) < 0 ||
+        inotify_add_watch(g_watchFd, dirname(szDirectory), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+    {
+        printf("ERROR: Can't watch the source file directory (%s)\r\n", g_szWatchFile);
+        return -1;
+    }
+#endif
+
+    printf("Watching %s for changes (Ctrl-C to stop) ...\r\n\n", g_szWatchFile);
+
+    return 0;
+}
+
+
+// Returns true if an inotify event (or the polled file state) says the source file changed.
+//
+bool hasSourceChanged(void)
+{
+#ifdef __linux__
+    char  events[sizeof(struct inotify_event) + MAX_LINE_LENGTH];
+    bool  fChanged = false;
+    ssize_t nLength;
+
+    if ((nLength = read(g_watchFd, events, sizeof(events))) <= 0)
+        return false;
+
+    for (char *pEvent = events ; pEvent < events + nLength ; )
+    {
+        struct inotify_event *pInfo = (struct inotify_event *)pEvent;
+
+        if (pInfo->len && !strcmp(pInfo->name, g_szWatchName))
+            fChanged = true;
+        pEvent += sizeof(struct inotify_event) + pInfo->len;
+    }
+
+    return fChanged;
+#else
+    struct stat fileStat;
+
+    if (stat(g_szWatchFile, &fileStat) < 0 ||
+        (fileStat.st_mtime == g_watchStat.st_mtime && fileStat.st_size == g_watchStat.st_size))
+        return false;
+
+    g_watchStat = fileStat;
+    return true;
+#endif
+}
+
+
+// Wait until the source file changes and stays unchanged for WATCH_SETTLE_MS (an editor may write it in pieces).
+//
+int waitForSourceChange(void)
+{
+    struct pollfd watchPoll;
+
+    watchPoll.fd     = g_watchFd;
+    watchPoll.events = POLLIN;
+
+    // Get the report of the last assembly out before blocking - stdout is fully buffered when it's redirected.
+    //
+    fflush(stdout);
+
+    for (;;)
+    {
+#ifdef __linux__
+        if (poll(&watchPoll, 1, -1) < 0)
+            return -1;
+#else
+        poll(NULL, 0, WATCH_POLL_MS);
+#endif
+        if (hasSourceChanged())
+            break;
+    }
+
+    // Let the writes settle, absorbing the events they raise.
+    //
+    for (;;)
+    {
+#ifdef __linux__
+        int nReady;
+
+        if ((nReady = poll(&watchPoll, 1, WATCH_SETTLE_MS)) < 0)
+            return -1;
+        if (0 == nReady)
+            break;
+        hasSourceChanged();
+#else
+        poll(NULL, 0, WATCH_SETTLE_MS);
+        if (!hasSourceChanged())
+            break;
+#endif
+    }
+
+    return 0;
+}
+
+
+// Empty an output file so it can be written again from the start.  Outputs that can't seek (standard output, pipes)
+// are simply appended to.
+//
+void rewindOutputFile(int fpOutput)
+{
+    if (fpOutput > 0 && lseek(fpOutput, 0, SEEK_SET) == 0)
+        ftruncate(fpOutput, 0);
+}
@@ -0,0 +1,10 @@
+//
+//  watch.h
+//  MC68HC11 Assembler
+//
+//  Watch mode source change notification.
+//
+
+int beginWatch(const char *pszFileName);
+int waitForSourceChange(void);
+void rewindOutputFile(int fpOutput);
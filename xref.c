@@ -0,0 +1,274 @@
+//
+//  xref.c
+//  MC68HC11 Assembler
+//
+//  Symbol cross-reference.  Pass 2 notes the symbol each line's operand refers to in its line record, and the records
+//  are gathered into a reference list per symbol once the image is assembled.  Unreferenced symbols are listed along
+//  with the bytes and cycles of the code that follows each unreferenced label, for dead code hunting.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utility.h"
+#include "symfile.h"
+#include "xref.h"
+
+extern SYMBOL symbols[];
+extern UINT16 symbolCount;
+
+char *g_pszRefModes[] = { "IMM", "INH", "DIR", "EXT", "REL", "INDX", "INDY", "DATA", "DROP" };
+
+
+// Value order for the code labels, with the symbol table order breaking ties.
+//
+int compareLabelValues(const void *pLeft, const void *pRight)
+{
+    UINT16 nLeft  = *(const UINT16 *)pLeft;
+    UINT16 nRight = *(const UINT16 *)pRight;
+
+    if (symbols[nLeft].u.nsymbolValue16 != symbols[nRight].u.nsymbolValue16)
+        return (symbols[nLeft].u.nsymbolValue16 < symbols[nRight].u.nsymbolValue16 ? -1 : 1);
+
+    return (nLeft < nRight ? -1 : (nLeft > nRight ? 1 : 0));
+}
+
+
+// Format a symbol's value for the tables.
+//
+void formatSymbolValue(SYMBOL *pSymbol, char *pszValue)
+{
+    switch(pSymbol->symbolType)
+    {
+        case SYMBOL_TYPE_NUMBER_8BIT:
+            sprintf(pszValue, "$%02X", pSymbol->u.nsymbolValue8);
+            break;
+        case SYMBOL_TYPE_NUMBER_16BIT:
+            sprintf(pszValue, "$%04X", pSymbol->u.nsymbolValue16);
+            break;
+        case SYMBOL_TYPE_STRING:
+        default:
+            strcpy(pszValue, "string");
+            break;
+    }
+}
+
+
+// Write the cross-reference table (every symbol in name order with the line, address and addressing mode of each
+// reference) followed by the unreferenced symbols.
+//
+// A code label is a 16-bit symbol at the address of an encoded line, and it owns the bytes up to the next code label.
+// The START symbol is the program entry point, so it's never reported as unreferenced.
+//
+int writeCrossReference(int fpXref, REGION *pRegions, int nRegions)
+{
+    LISTBUFFER  text;
+    char        szTempString[MAX_LINE_LENGTH];
+    char        szValue[16];
+    UINT16      *pNames    = NULL;
+    int         *pFirstRef = NULL;
+    LINERECORD  **pRefs    = NULL;
+    UINT8       *pLineStart = NULL;
+    UINT16      *pLabels   = NULL;
+    UINT32      *pBytes    = NULL;
+    UINT32      *pCycles   = NULL;
+    int         nRefs      = 0;
+    int         nLabels    = 0;
+    int         nUnreferenced = 0;
+    UINT32      nDeadBytes  = 0;
+    UINT32      nDeadCycles = 0;
+    int         nRetVal    = 0;
+
+    memset(&text, 0, sizeof(LISTBUFFER));
+
+    if (NULL == (pNames = sortSymbolsByName()))
+        return -1;
+
+    if (NULL == (pFirstRef = (int *)calloc(symbolCount + 1, sizeof(int))) ||
+        NULL == (pLineStart = (UINT8 *)calloc(MEM_IMAGE_SIZE, 1)) ||
+        NULL == (pLabels = (UINT16 *)malloc(sizeof(UINT16) * (symbolCount ? symbolCount : 1))) ||
+        NULL == (pBytes = (UINT32 *)calloc((symbolCount ? symbolCount : 1), sizeof(UINT32))) ||
+        NULL == (pCycles = (UINT32 *)calloc((symbolCount ? symbolCount : 1), sizeof(UINT32))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", MEM_IMAGE_SIZE);
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    // Count the references to each symbol, then turn the counts into the start of each symbol's run in a single
+    // reference array.  The lines are visited in source order, so each run comes out in source order too.
+    //
+    for (int i=0 ; i<nRegions ; i++)
+    {
+        for (int j=0 ; j<pRegions[i].lineCount ; j++)
+        {
+            LINERECORD *pLine = &pRegions[i].pLines[j];
+
+            if (pLine->refSymbol >= 0)
+            {
+                pFirstRef[pLine->refSymbol + 1]++;
+                nRefs++;
+            }
+            if (pLine->numBytes)
+                pLineStart[pLine->addr] = 1;
+        }
+    }
+
+    for (int i=0 ; i<symbolCount ; i++)
+        pFirstRef[i + 1] += pFirstRef[i];
+
+    if (NULL == (pRefs = (LINERECORD **)malloc(sizeof(LINERECORD *) * (nRefs ? nRefs : 1))))
+    {
+        printf("ERROR: Memory allocation failed (%d bytes)\r\n", (int)(sizeof(LINERECORD *) * nRefs));
+        nRetVal = -1;
+        goto Exit;
+    }
+
+    for (int i=0 ; i<nRegions ; i++)
+    {
+        for (int j=0 ; j<pRegions[i].lineCount ; j++)
+        {
+            LINERECORD *pLine = &pRegions[i].pLines[j];
+
+            if (pLine->refSymbol >= 0)
+                pRefs[pFirstRef[pLine->refSymbol]++] = pLine;
+        }
+    }
+
+    // The fill loop left each entry pointing at the end of its run, which is the start of the next symbol's run.
+    //
+    for (int i=symbolCount ; i>0 ; i--)
+        pFirstRef[i] = pFirstRef[i - 1];
+    pFirstRef[0] = 0;
+
+    // Attribute every encoded line to the closest code label at or below it.  Labels sharing an address share the code.
+    //
+    for (int i=0 ; i<symbolCount ; i++)
+    {
+        if (symbols[i].symbolType == SYMBOL_TYPE_NUMBER_16BIT && pLineStart[symbols[i].u.nsymbolValue16])
+            pLabels[nLabels++] = (UINT16)i;
+    }
+    qsort(pLabels, nLabels, sizeof(UINT16), compareLabelValues);
+
+    for (int i=0 ; i<nRegions && nLabels ; i++)
+    {
+        for (int j=0 ; j<pRegions[i].lineCount ; j++)
+        {
+            LINERECORD *pLine = &pRegions[i].pLines[j];
+            int nLow   = 0;
+            int nHigh  = nLabels - 1;
+            int nFound = -1;
+
+            if (0 == pLine->numBytes)
+                continue;
+
+            while (nLow <= nHigh)
+            {
+                int nMiddle = (nLow + nHigh) / 2;
+
+                if (symbols[pLabels[nMiddle]].u.nsymbolValue16 <= pLine->addr)
+                {
+                    nFound = nMiddle;
+                    nLow   = nMiddle + 1;
+                }
+                else
+                    nHigh = nMiddle - 1;
+            }
+
+            if (nFound < 0)
+                continue;
+
+            for (int k=nFound ; k >= 0 && symbols[pLabels[k]].u.nsymbolValue16 == symbols[pLabels[nFound]].u.nsymbolValue16 ; k--)
+            {
+                pBytes[pLabels[k]]  += pLine->numBytes;
+                pCycles[pLabels[k]] += pLine->cycles;
+            }
+        }
+    }
+
+    appendToBuffer(&text, "  SYMBOL NAME    VALUE   REFS   LINE   ADDR   MODE\r\n");
+    appendToBuffer(&text, "-----------------------------------------------------\r\n");
+
+    for (int i=0 ; i<symbolCount ; i++)
+    {
+        int nSymbol = pNames[i];
+        int nCount  = pFirstRef[nSymbol + 1] - pFirstRef[nSymbol];
+
+        formatSymbolValue(&symbols[nSymbol], szValue);
+        sprintf(szTempString, "%15s  %6s  %5d", symbols[nSymbol].symbolName, szValue, nCount);
+        appendToBuffer(&text, szTempString);
+
+        if (0 == nCount)
+            appendToBuffer(&text, "\r\n");
+
+        for (int j=0 ; j<nCount ; j++)
+        {
+            LINERECORD *pLine = pRefs[pFirstRef[nSymbol] + j];
+
+            sprintf(szTempString, "%*s  %5d  $%04X   %s\r\n", (j ? 30 : 0), "", pLine->lineNumber, pLine->addr,
+                    g_pszRefModes[pLine->refMode]);
+            appendToBuffer(&text, szTempString);
+        }
+    }
+
+    appendToBuffer(&text, "\r\n  UNREFERENCED   VALUE   BYTES  CYCLES\r\n");
+    appendToBuffer(&text, "-----------------------------------------------------\r\n");
+
+    for (int i=0 ; i<symbolCount ; i++)
+    {
+        int nSymbol = pNames[i];
+
+        if (pFirstRef[nSymbol + 1] != pFirstRef[nSymbol] || !strcasecmp(symbols[nSymbol].symbolName, START_SYMBOL_NAME))
+            continue;
+
+        formatSymbolValue(&symbols[nSymbol], szValue);
+        if (pBytes[nSymbol])
+        {
+            sprintf(szTempString, "%15s  %6s  %6lu  %6lu\r\n", symbols[nSymbol].symbolName, szValue, (unsigned long)pBytes[nSymbol],
+                    (unsigned long)pCycles[nSymbol]);
+            nDeadBytes  += pBytes[nSymbol];
+            nDeadCycles += pCycles[nSymbol];
+        }
+        else
+            sprintf(szTempString, "%15s  %6s       -       -\r\n", symbols[nSymbol].symbolName, szValue);
+        appendToBuffer(&text, szTempString);
+
+        nUnreferenced++;
+    }
+
+    sprintf(szTempString, "\r\n%15s  %d unreferenced symbols, %lu bytes and %lu cycles following unreferenced labels\r\n", "",
+            nUnreferenced, (unsigned long)nDeadBytes, (unsigned long)nDeadCycles);
+    appendToBuffer(&text, szTempString);
+
+    if (text.length && write(fpXref, text.pBuffer, text.length) != text.length)
+    {
+        printf("ERROR: Cross-reference file write failed\r\n");
+        nRetVal = -1;
+    }
+
+    printf("Cross-reference: %d references, %d unreferenced symbols (%lu bytes)\r\n\n", nRefs, nUnreferenced,
+           (unsigned long)nDeadBytes);
+
+Exit:
+
+    if (text.pBuffer)
+        free(text.pBuffer);
+    if (pRefs)
+        free(pRefs);
+    if (pFirstRef)
+        free(pFirstRef);
+    if (pLineStart)
+        free(pLineStart);
+    if (pLabels)
+        free(pLabels);
+    if (pBytes)
+        free(pBytes);
+    if (pCycles)
+        free(pCycles);
+    free(pNames);
+
+    return nRetVal;
+}
@@ -0,0 +1,8 @@
+//
+//  xref.h
+//  MC68HC11 Assembler
+//
+//  Symbol cross-reference and unreferenced symbol report.
+//
+
+int writeCrossReference(int fpXref, REGION *pRegions, int nRegions);